@@ -0,0 +1,13 @@
+// alloc_stats.hpp
+#ifndef ALLOC_STATS_HPP
+#define ALLOC_STATS_HPP
+
+#include <cstdint>
+
+// Heap allocations made through the global operator new since startup,
+// summed over all threads. alloc_stats.cpp replaces operator new to count
+// them; each thread increments its own cache line, so counting stays cheap
+// enough to leave on in production builds.
+std::uint64_t allocation_count();
+
+#endif  // ALLOC_STATS_HPP
@@ -0,0 +1,79 @@
+#include "asset_bundle.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::shared_ptr<const AssetBundle> AssetBundle::open(const std::string& file_path) {
+    int fd = ::open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open bundle " + file_path + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(BundleHeader))) {
+        ::close(fd);
+        throw std::runtime_error("Not a bundle: " + file_path);
+    }
+
+    // The mapping outlives the descriptor
+    std::size_t size = static_cast<std::size_t>(st.st_size);
+    void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Failed to map bundle " + file_path + ": " + std::strerror(errno));
+    }
+    std::shared_ptr<const AssetBundle> bundle(new AssetBundle(static_cast<const char*>(data), size));
+
+    // Only the fixed-size tables are checked here, so opening costs the
+    // same whatever the bundle holds; spans are checked as they are read
+    const BundleHeader& header = bundle->header();
+    if (std::memcmp(header.magic, kBundleMagic, sizeof(kBundleMagic)) != 0 || header.size != size ||
+        header.entries_offset % alignof(BundleEntry) != 0 ||
+        header.entries_offset > size ||
+        header.entry_count > (size - header.entries_offset) / sizeof(BundleEntry) ||
+        header.variants_offset % alignof(BundleVariant) != 0 ||
+        header.variants_offset > size ||
+        header.variant_count > (size - header.variants_offset) / sizeof(BundleVariant)) {
+        throw std::runtime_error("Not a bundle, or truncated: " + file_path);
+    }
+    return bundle;
+}
+
+AssetBundle::~AssetBundle() {
+    ::munmap(const_cast<char*>(data_), size_);
+}
+
+const BundleEntry* AssetBundle::find(std::string_view path) const {
+    const BundleEntry* begin = entries();
+    const BundleEntry* end = begin + header().entry_count;
+    const BundleEntry* it = std::lower_bound(
+        begin, end, path,
+        [this](const BundleEntry& entry, std::string_view key) { return text(entry.path) < key; });
+    if (it == end || text(it->path) != path) {
+        return nullptr;
+    }
+    // An entry whose variants run off the table is treated as absent
+    if (it->variant_count == 0 || it->first_variant > header().variant_count ||
+        it->variant_count > header().variant_count - it->first_variant) {
+        return nullptr;
+    }
+    return it;
+}
+
+const BundleVariant* AssetBundle::variants(const BundleEntry& entry) const {
+    return reinterpret_cast<const BundleVariant*>(data_ + header().variants_offset) +
+           entry.first_variant;
+}
+
+std::string_view AssetBundle::text(const BundleSpan& span) const {
+    if (span.offset > size_ || span.length > size_ - span.offset) {
+        return {};
+    }
+    return std::string_view(data_ + span.offset, span.length);
+}
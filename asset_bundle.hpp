@@ -0,0 +1,97 @@
+// asset_bundle.hpp
+#ifndef ASSET_BUNDLE_HPP
+#define ASSET_BUNDLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// A bundle is every servable file of a tree packed into one file by the
+// packer tool, with each representation already serialized as a response:
+// header bytes, body bytes and the 304 header sit next to each other, so
+// the server maps the bundle and answers requests with a gather write
+// straight out of the mapping. Nothing is read or indexed at startup, and
+// every process mapping the same bundle shares its page cache pages.
+//
+// Layout, in the byte order of the machine that packed it:
+//
+//   BundleHeader
+//   BundleEntry[entry_count]      sorted by path, for binary search
+//   BundleVariant[variant_count]  each entry's variants, identity first
+//   blobs                         strings and bodies the spans point at
+
+constexpr char kBundleMagic[8] = {'W', 'S', 'B', 'U', 'N', 'D', 'L', '1'};
+
+// Bytes [offset, offset + length) of the bundle
+struct BundleSpan {
+    std::uint64_t offset = 0;
+    std::uint64_t length = 0;
+};
+
+struct BundleHeader {
+    char magic[8];
+    std::uint32_t entry_count = 0;
+    std::uint32_t variant_count = 0;
+    std::uint64_t entries_offset = 0;
+    std::uint64_t variants_offset = 0;
+    std::uint64_t size = 0;  // of the whole bundle, to catch truncation
+};
+
+struct BundleEntry {
+    BundleSpan path;  // the route, e.g. "/css/site.css"
+    std::uint32_t first_variant = 0;
+    std::uint32_t variant_count = 0;  // at least 1
+    std::int64_t last_modified = 0;   // seconds since the epoch
+};
+
+struct BundleVariant {
+    BundleSpan encoding;       // empty for identity
+    BundleSpan etag;
+    BundleSpan last_modified;  // HTTP-date
+    BundleSpan content_type;
+    BundleSpan header;         // serialized 200 header
+    BundleSpan body;
+    BundleSpan not_modified;   // serialized 304 header
+};
+
+static_assert(sizeof(BundleHeader) == 40, "bundle layout must not depend on padding");
+static_assert(sizeof(BundleEntry) == 32, "bundle layout must not depend on padding");
+static_assert(sizeof(BundleVariant) == 112, "bundle layout must not depend on padding");
+
+// A read-only mapping of a bundle. Lookups work on the mapped index in
+// place; returned views stay valid for the bundle's lifetime.
+class AssetBundle {
+public:
+    // Throws std::runtime_error if the file cannot be mapped or is not a
+    // complete bundle
+    static std::shared_ptr<const AssetBundle> open(const std::string& file_path);
+    ~AssetBundle();
+
+    AssetBundle(const AssetBundle&) = delete;
+    AssetBundle& operator=(const AssetBundle&) = delete;
+
+    // The entry for a route, or nullptr
+    const BundleEntry* find(std::string_view path) const;
+    const BundleVariant* variants(const BundleEntry& entry) const;
+    // The bytes a span covers; empty if it points outside the bundle
+    std::string_view text(const BundleSpan& span) const;
+
+    std::size_t entryCount() const { return header().entry_count; }
+    std::size_t size() const { return size_; }
+
+private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+
+    AssetBundle(const char* data, std::size_t size) : data_(data), size_(size) {}
+
+    const BundleHeader& header() const { return *reinterpret_cast<const BundleHeader*>(data_); }
+    const BundleEntry* entries() const {
+        return reinterpret_cast<const BundleEntry*>(data_ + header().entries_offset);
+    }
+};
+
+#endif  // ASSET_BUNDLE_HPP
@@ -0,0 +1,217 @@
+#include "asset_cache.hpp"
+
+#include <sys/stat.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "globals.hpp"
+
+namespace {
+
+template <class Header>
+void apply_asset_headers(Header& header, const AssetHeaders& headers,
+                         const std::string& content_type) {
+    header.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    header.set(http::field::content_type, content_type);
+    header.set(http::field::cache_control, "public, max-age=2592000");
+    header.set(http::field::accept_ranges, "bytes");
+    if (!headers.content_encoding.empty()) {
+        header.set(http::field::content_encoding, headers.content_encoding);
+    }
+    if (headers.vary) {
+        header.set(http::field::vary, "Accept-Encoding");
+    }
+    if (!headers.etag.empty()) {
+        header.set(http::field::etag, headers.etag);
+    }
+    if (!headers.last_modified.empty()) {
+        header.set(http::field::last_modified, headers.last_modified);
+    }
+}
+
+}  // namespace
+
+void set_asset_headers(http::response_header<>& header, const AssetHeaders& headers) {
+    apply_asset_headers(header, headers, headers.content_type);
+}
+
+void set_asset_headers(header_writer& header, const AssetHeaders& headers) {
+    apply_asset_headers(header, headers, headers.content_type);
+}
+
+void set_asset_headers(header_writer& header, const AssetHeaders& headers,
+                       const std::string& content_type) {
+    apply_asset_headers(header, headers, content_type);
+}
+
+std::string make_asset_header(const AssetHeaders& headers, std::uint64_t content_length) {
+    http::response<http::empty_body> res{http::status::ok, 11};
+    set_asset_headers(res.base(), headers);
+    res.content_length(content_length);
+
+    std::ostringstream header;
+    header << res.base();
+    return header.str();
+}
+
+std::shared_ptr<const CachedAsset> make_cached_asset(std::string body,
+                                                     const AssetHeaders& headers) {
+    auto asset = std::make_shared<CachedAsset>();
+    asset->body = std::move(body);
+    asset->header = make_asset_header(headers, asset->body.size());
+    return asset;
+}
+
+std::shared_ptr<const CachedAsset> make_not_modified(const AssetHeaders& headers) {
+    auto asset = std::make_shared<CachedAsset>();
+    asset->status = 304;
+
+    // A 304 repeats the validators and caching headers but has no body or
+    // Content-Type (RFC 9110 section 15.4.5)
+    http::response<http::empty_body> res{http::status::not_modified, 11};
+    set_asset_headers(res.base(), headers);
+    res.erase(http::field::content_type);
+    res.erase(http::field::content_encoding);
+
+    std::ostringstream header;
+    header << res.base();
+    asset->header = header.str();
+    return asset;
+}
+
+AssetCache::AssetCache()
+    : capacity_(ASSET_CACHE_CAPACITY), max_entry_size_(ASSET_CACHE_MAX_ENTRY_SIZE) {}
+
+AssetCache& AssetCache::getInstance() {
+    static AssetCache instance;
+    return instance;
+}
+
+AssetCache::Shard& AssetCache::shard_for(const std::string& file_path) {
+    return shards_[std::hash<std::string>{}(file_path) % shards_.size()];
+}
+
+std::size_t AssetCache::shard_capacity() const {
+    return capacity_.load(std::memory_order_relaxed) / shards_.size();
+}
+
+std::shared_ptr<const CachedAsset> AssetCache::get(const std::string& file_path,
+                                                   const AssetHeaders& headers) {
+    Shard& shard = shard_for(file_path);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(file_path);
+        if (it != shard.entries.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_position);
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return it->second.asset;
+        }
+    }
+
+    misses_.fetch_add(1, std::memory_order_relaxed);
+
+    // Read the file outside the lock so other sessions keep hitting the cache
+    auto asset = load(file_path, headers);
+    if (!asset) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(file_path);
+    if (it != shard.entries.end()) {
+        // Another thread loaded it first; keep the published copy
+        return it->second.asset;
+    }
+
+    std::size_t budget = shard_capacity();
+    if (asset->footprint() > budget) {
+        return asset;
+    }
+
+    evict_until(shard, budget - asset->footprint());
+    shard.lru.push_front(file_path);
+    shard.entries.emplace(file_path, Entry{asset, shard.lru.begin()});
+    shard.size += asset->footprint();
+    return asset;
+}
+
+std::shared_ptr<const CachedAsset> AssetCache::load(const std::string& file_path,
+                                                    const AssetHeaders& headers) const {
+    // Every request for a file too large to cache misses and comes here, so
+    // the size check must not allocate: fs::file_size would build a path
+    struct stat st;
+    if (::stat(file_path.c_str(), &st) != 0 ||
+        static_cast<std::uint64_t>(st.st_size) > max_entry_size_.load(std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    std::size_t file_size = st.st_size;
+
+    std::ifstream file(file_path, std::ios::binary);
+    if (!file.is_open()) {
+        return nullptr;
+    }
+
+    std::string body(file_size, '\0');
+    file.read(body.data(), body.size());
+    body.resize(file.gcount());
+
+    return make_cached_asset(std::move(body), headers);
+}
+
+void AssetCache::evict_until(Shard& shard, std::size_t budget) {
+    while (shard.size > budget && !shard.lru.empty()) {
+        auto it = shard.entries.find(shard.lru.back());
+        shard.size -= it->second.asset->footprint();
+        shard.entries.erase(it);
+        shard.lru.pop_back();
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void AssetCache::invalidate(const std::string& file_path) {
+    Shard& shard = shard_for(file_path);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(file_path);
+    if (it == shard.entries.end()) {
+        return;
+    }
+    shard.size -= it->second.asset->footprint();
+    shard.lru.erase(it->second.lru_position);
+    shard.entries.erase(it);
+}
+
+void AssetCache::clear() {
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.entries.clear();
+        shard.lru.clear();
+        shard.size = 0;
+    }
+}
+
+void AssetCache::setCapacity(std::size_t bytes) {
+    capacity_.store(bytes, std::memory_order_relaxed);
+    std::size_t budget = shard_capacity();
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        evict_until(shard, budget);
+    }
+}
+
+void AssetCache::setMaxEntrySize(std::size_t bytes) {
+    max_entry_size_.store(bytes, std::memory_order_relaxed);
+}
+
+std::size_t AssetCache::capacity() const {
+    return capacity_.load(std::memory_order_relaxed);
+}
+
+std::size_t AssetCache::size() const {
+    std::size_t total = 0;
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        total += shard.size;
+    }
+    return total;
+}
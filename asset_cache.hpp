@@ -0,0 +1,120 @@
+// asset_cache.hpp
+#ifndef ASSET_CACHE_HPP
+#define ASSET_CACHE_HPP
+
+#include <boost/beast/http.hpp>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "header_writer.hpp"
+
+// A fully serialized response for a small static file. Both buffers are
+// immutable once the entry is published, so any number of sessions can
+// write them concurrently without copying.
+struct CachedAsset {
+    std::string header;  // status line + headers + blank line
+    std::string body;
+    unsigned status = 200;
+
+    std::size_t footprint() const { return header.size() + body.size(); }
+};
+
+// Headers describing one representation of a static file. Optional fields
+// are left out of the response when empty.
+struct AssetHeaders {
+    std::string content_type;
+    std::string content_encoding;
+    std::string etag;
+    std::string last_modified;  // HTTP-date
+    bool vary = false;          // other codings exist: send Vary: Accept-Encoding
+};
+
+// Sets the headers every static file response carries. Files with more than
+// one coding also get Vary: Accept-Encoding, whichever coding is being sent.
+void set_asset_headers(boost::beast::http::response_header<>& header,
+                       const AssetHeaders& headers);
+void set_asset_headers(header_writer& header, const AssetHeaders& headers);
+// Same, but with content_type in place of headers.content_type (multipart bodies)
+void set_asset_headers(header_writer& header, const AssetHeaders& headers,
+                       const std::string& content_type);
+
+// Serializes the 200 header for a representation of content_length bytes
+std::string make_asset_header(const AssetHeaders& headers, std::uint64_t content_length);
+
+// Builds the pre-serialized 200 response for a body held in memory
+std::shared_ptr<const CachedAsset> make_cached_asset(std::string body,
+                                                     const AssetHeaders& headers);
+
+// Builds the pre-serialized, header-only 304 response for a representation
+std::shared_ptr<const CachedAsset> make_not_modified(const AssetHeaders& headers);
+
+// Entries are spread over kShards shards by path hash, each with its own
+// lock, LRU list and an even share of the capacity, so sessions on
+// different threads hitting different files do not serialize on one mutex.
+// A file larger than a shard's share is never cached.
+class AssetCache {
+public:
+    static constexpr std::size_t kShards = 16;
+
+private:
+    struct Entry {
+        std::shared_ptr<const CachedAsset> asset;
+        std::list<std::string>::iterator lru_position;
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        std::list<std::string> lru;  // most recently used at the front
+        std::size_t size = 0;
+    };
+
+    std::array<Shard, kShards> shards_;
+    std::atomic<std::size_t> capacity_;
+    std::atomic<std::size_t> max_entry_size_;
+
+    std::atomic<std::uint64_t> hits_{0};
+    std::atomic<std::uint64_t> misses_{0};
+    std::atomic<std::uint64_t> evictions_{0};
+
+    AssetCache();
+
+    Shard& shard_for(const std::string& file_path);
+    std::size_t shard_capacity() const;
+    std::shared_ptr<const CachedAsset> load(const std::string& file_path,
+                                            const AssetHeaders& headers) const;
+    void evict_until(Shard& shard, std::size_t budget);
+
+public:
+    AssetCache(const AssetCache&) = delete;
+    AssetCache& operator=(const AssetCache&) = delete;
+
+    static AssetCache& getInstance();
+
+    // Returns the cached response for file_path, loading it on a miss.
+    // Returns nullptr if the file is missing or larger than the per-entry
+    // limit; callers should fall back to streaming it. Entries are keyed by
+    // path, so a path must always be requested with the same headers.
+    std::shared_ptr<const CachedAsset> get(const std::string& file_path,
+                                           const AssetHeaders& headers);
+
+    void invalidate(const std::string& file_path);
+    void clear();
+
+    void setCapacity(std::size_t bytes);
+    void setMaxEntrySize(std::size_t bytes);
+
+    std::size_t capacity() const;
+    std::size_t size() const;
+    std::uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    std::uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+    std::uint64_t evictions() const { return evictions_.load(std::memory_order_relaxed); }
+};
+
+#endif  // ASSET_CACHE_HPP
@@ -0,0 +1,23 @@
+#include "async_handler.hpp"
+
+async_request::async_request(const http_request& request, const RouteParams& params,
+                             boost::asio::any_io_executor executor)
+    : request_(request), executor_(std::move(executor)) {
+    // Parameter values point into the target; re-point them into the copy
+    std::string_view from(request.target().data(), request.target().size());
+    const char* to = request_.target().data();
+    for (std::size_t i = 0; i < params.size(); ++i) {
+        std::string_view value = params[i].second;
+        params_.push(params[i].first,
+                     std::string_view(to + (value.data() - from.data()), value.size()));
+    }
+    params_.copy_names(param_names_);
+}
+
+void async_request::cancel() {
+    cancelled_ = true;
+    if (auto fn = std::move(on_cancel_)) {
+        on_cancel_ = nullptr;
+        fn();
+    }
+}
@@ -0,0 +1,56 @@
+// async_handler.hpp
+#ifndef ASYNC_HANDLER_HPP
+#define ASYNC_HANDLER_HPP
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/beast/http.hpp>
+#include <functional>
+#include <string>
+
+#include "http_request.hpp"
+#include "route_params.hpp"
+
+// What a coroutine handler returns; the session adds the framing headers
+// (Content-Length, Connection) itself
+using AsyncResponse = boost::beast::http::response<boost::beast::http::string_body>;
+
+// The request as seen by a coroutine handler. The request and its route
+// parameters, names included, are copies owned by the coroutine, so they
+// stay valid across suspension points while the session goes on to read
+// and answer the requests pipelined behind it, and after the route table
+// they matched is replaced.
+class async_request {
+public:
+    async_request(const http_request& request, const RouteParams& params,
+                  boost::asio::any_io_executor executor);
+
+    const http_request& request() const { return request_; }
+    const RouteParams& params() const { return params_; }
+
+    // The connection's executor, for timers and other I/O objects
+    const boost::asio::any_io_executor& get_executor() const { return executor_; }
+
+    // Set once the connection has gone away; the response will be dropped
+    bool cancelled() const { return cancelled_; }
+
+    // Runs fn if the connection goes away while the handler is waiting, so
+    // it can cancel whatever it waits on. Replaces any earlier callback.
+    void on_cancel(std::function<void()> fn) { on_cancel_ = std::move(fn); }
+
+    // Called by the session
+    void cancel();
+    void finish() { on_cancel_ = nullptr; }
+
+private:
+    http_request request_;
+    RouteParams params_;
+    std::string param_names_;  // what params_'s names point at
+    boost::asio::any_io_executor executor_;
+    bool cancelled_ = false;
+    std::function<void()> on_cancel_;
+};
+
+using AsyncRequestHandler = std::function<AsyncResponse(async_request&, boost::asio::yield_context)>;
+
+#endif  // ASYNC_HANDLER_HPP
@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+# Runs the standard benchmark scenarios against a fresh webserver on
+# loopback and prints one JSON result per line. Pass a file name to also
+# append the results there, e.g. to compare commits.
+set -euo pipefail
+
+cd "$(dirname "$0")"
+repo=$(pwd)
+output=${1:-}
+label=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+duration=${BENCH_DURATION:-5}
+
+# The server serves its working directory, so give it a known set of files
+root=$(mktemp -d)
+cp index.html main.js favicon.ico "$root"
+head -c $((5 * 1024 * 1024)) /dev/urandom > "$root/large.png"
+# Too large for the asset cache, so every request reads the disk
+cold_urls=()
+for i in $(seq 48); do
+    head -c $((2 * 1024 * 1024)) /dev/urandom > "$root/cold-$i.png"
+    cold_urls+=(--url="/cold-$i.png")
+done
+sync
+# A throwaway self-signed certificate for the HTTPS scenarios
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 \
+    -subj /CN=localhost -keyout "$root/key.pem" -out "$root/cert.pem" 2> /dev/null
+
+# BENCH_SERVER_FLAGS passes extra options, e.g. --file-io-threads
+(cd "$root" && exec "$repo/webserver" --log-overflow=drop \
+    --tls-cert="$root/cert.pem" --tls-key="$root/key.pem" ${BENCH_SERVER_FLAGS:-} > /dev/null 2>&1) &
+server=$!
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null || true; rm -rf "$root"' EXIT
+
+for _ in $(seq 50); do
+    if (exec 3<>/dev/tcp/127.0.0.1/8080) 2>/dev/null; then
+        break
+    fi
+    sleep 0.1
+done
+
+run() {
+    local result
+    result=$(./loadgen --json --label="$label" --duration="$duration" "$@")
+    echo "$result"
+    if [ -n "$output" ]; then
+        echo "$result" >> "$output"
+    fi
+}
+
+run --name=small-file --connections=64 --url=/index.html
+run --name=small-file-pipelined --connections=64 --pipeline=8 --url=/index.html
+run --name=large-file --connections=16 --url=/large.png
+run --name=not-found --connections=64 --url=/missing
+run --name=mixed --connections=64 --url=/index.html@8 --url=/main.js@4 --url=/favicon.ico@2 --url=/missing@1
+run --name=no-keepalive --connections=16 --no-keepalive --url=/index.html
+run --name=idle-connections --connections=16 --idle=1000 --url=/index.html
+run --name=open-loop --connections=64 --rate=5000 --url=/index.html
+# HTTPS: one handshake per request, full and resumed, then throughput
+run --name=tls-handshake --port=8443 --tls --connections=16 --no-keepalive --url=/index.html
+run --name=tls-resume --port=8443 --tls-resume --connections=16 --no-keepalive --url=/index.html
+run --name=tls-small-file --port=8443 --tls --connections=64 --url=/index.html
+run --name=tls-large-file --port=8443 --tls --connections=16 --url=/large.png
+
+# Drop the files from the page cache first so reads block on the device;
+# only the first pass over them is cold
+for file in "$root"/cold-*.png; do
+    dd if="$file" iflag=nocache count=0 status=none
+done
+run --name=cold-files --connections=64 "${cold_urls[@]}"
@@ -0,0 +1,103 @@
+#include "byte_range.hpp"
+
+#include <cctype>
+
+namespace {
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+bool parse_position(std::string_view text, std::uint64_t& out) {
+    if (text.empty() || text.size() > 19) {
+        return false;
+    }
+    out = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        out = out * 10 + static_cast<std::uint64_t>(c - '0');
+    }
+    return true;
+}
+
+}  // namespace
+
+RangeParse parse_range(std::string_view header, std::uint64_t size,
+                       std::vector<ByteRange>& ranges) {
+    ranges.clear();
+
+    constexpr std::string_view unit = "bytes=";
+    if (header.size() <= unit.size()) {
+        return RangeParse::ignore;
+    }
+    for (std::size_t i = 0; i < unit.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(header[i])) != unit[i]) {
+            return RangeParse::ignore;
+        }
+    }
+    header.remove_prefix(unit.size());
+
+    std::size_t specs = 0;
+    while (!header.empty()) {
+        std::size_t comma = header.find(',');
+        std::string_view spec = trim(header.substr(0, comma));
+        header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+        if (spec.empty()) {
+            continue;
+        }
+        if (++specs > kMaxByteRanges) {
+            ranges.clear();
+            return RangeParse::ignore;
+        }
+
+        std::size_t dash = spec.find('-');
+        if (dash == std::string_view::npos) {
+            ranges.clear();
+            return RangeParse::ignore;
+        }
+
+        std::string_view first_text = spec.substr(0, dash);
+        std::string_view last_text = spec.substr(dash + 1);
+        std::uint64_t first = 0;
+        std::uint64_t last = 0;
+
+        if (first_text.empty()) {
+            // "-N": the final N bytes
+            if (!parse_position(last_text, last)) {
+                ranges.clear();
+                return RangeParse::ignore;
+            }
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            ranges.push_back({last >= size ? 0 : size - last, size - 1});
+            continue;
+        }
+
+        if (!parse_position(first_text, first) ||
+            (!last_text.empty() && (!parse_position(last_text, last) || last < first))) {
+            ranges.clear();
+            return RangeParse::ignore;
+        }
+        if (first >= size) {
+            continue;
+        }
+        if (last_text.empty() || last >= size) {
+            last = size - 1;
+        }
+        ranges.push_back({first, last});
+    }
+
+    if (specs == 0) {
+        return RangeParse::ignore;
+    }
+    return ranges.empty() ? RangeParse::unsatisfiable : RangeParse::satisfiable;
+}
@@ -0,0 +1,32 @@
+// byte_range.hpp
+#ifndef BYTE_RANGE_HPP
+#define BYTE_RANGE_HPP
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// An inclusive byte range, already clamped to the representation size
+struct ByteRange {
+    std::uint64_t first;
+    std::uint64_t last;
+
+    std::uint64_t length() const { return last - first + 1; }
+};
+
+enum class RangeParse {
+    ignore,         // no usable Range header; send the full representation
+    satisfiable,    // ranges holds at least one range
+    unsatisfiable,  // answer 416
+};
+
+// Upper bound on ranges honoured per request; more are treated as abuse and
+// the header is ignored
+constexpr std::size_t kMaxByteRanges = 16;
+
+// Parses a Range header (RFC 9110 section 14.2) against a representation of
+// the given size. Syntax errors and unknown units yield RangeParse::ignore.
+RangeParse parse_range(std::string_view header, std::uint64_t size,
+                       std::vector<ByteRange>& ranges);
+
+#endif  // BYTE_RANGE_HPP
@@ -0,0 +1,160 @@
+#include "compression.hpp"
+
+#include <brotli/encode.h>
+#include <zlib.h>
+
+#include <cctype>
+
+const std::vector<std::string> supported_encodings = {"br", "zstd", "gzip"};
+
+namespace {
+
+bool iequals(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    if (std::tolower(static_cast<unsigned char>(a[i])) !=
+        std::tolower(static_cast<unsigned char>(b[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+// Parses a qvalue ("0", "0.5", "1.000") into thousandths
+int parse_qvalue(std::string_view q) {
+  if (q.empty() || (q[0] != '0' && q[0] != '1')) {
+    return 1000;
+  }
+  int value = (q[0] - '0') * 1000;
+  int scale = 100;
+  for (std::size_t i = 2; i < q.size() && i < 5 && scale > 0; ++i, scale /= 10) {
+    if (!std::isdigit(static_cast<unsigned char>(q[i]))) {
+      break;
+    }
+    value += (q[i] - '0') * scale;
+  }
+  return value > 1000 ? 1000 : value;
+}
+
+bool gzip_compress(std::string_view data, std::string& out, int level) {
+  z_stream stream{};
+  if (deflateInit2(&stream, level == 0 ? Z_BEST_COMPRESSION : level, Z_DEFLATED,
+                   15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+
+  out.resize(deflateBound(&stream, data.size()));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = static_cast<uInt>(data.size());
+  stream.next_out = reinterpret_cast<Bytef*>(out.data());
+  stream.avail_out = static_cast<uInt>(out.size());
+
+  int result = deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return result == Z_STREAM_END;
+}
+
+bool brotli_compress(std::string_view data, std::string& out, int level) {
+  std::size_t size = BrotliEncoderMaxCompressedSize(data.size());
+  if (size == 0) {
+    return false;
+  }
+  out.resize(size);
+  if (!BrotliEncoderCompress(level == 0 ? BROTLI_MAX_QUALITY : level,
+                             BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(),
+                             reinterpret_cast<const uint8_t*>(data.data()), &size,
+                             reinterpret_cast<uint8_t*>(out.data()))) {
+    return false;
+  }
+  out.resize(size);
+  return true;
+}
+
+}  // namespace
+
+std::string encoding_suffix(const std::string& encoding) {
+  if (encoding == "gzip") {
+    return ".gz";
+  }
+  if (encoding == "zstd") {
+    return ".zst";
+  }
+  return "." + encoding;
+}
+
+bool is_compressible(std::string_view content_type) {
+  return content_type.compare(0, 5, "text/") == 0 ||
+         content_type == "application/json" ||
+         content_type == "application/javascript" ||
+         content_type == "image/svg+xml";
+}
+
+bool compress(const std::string& encoding, std::string_view data, std::string& out,
+              int level) {
+  if (encoding == "gzip") {
+    return gzip_compress(data, out, level);
+  }
+  if (encoding == "br") {
+    return brotli_compress(data, out, level);
+  }
+  // zstd is only served from precompressed .zst siblings
+  return false;
+}
+
+int encoding_quality(std::string_view accept_encoding, std::string_view encoding) {
+  int q = -1;
+  int wildcard_q = -1;
+
+  std::string_view rest = accept_encoding;
+  while (!rest.empty()) {
+    std::size_t comma = rest.find(',');
+    std::string_view item = rest.substr(0, comma);
+    rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+
+    std::size_t semi = item.find(';');
+    std::string_view coding = trim(item.substr(0, semi));
+    int item_q = 1000;
+    if (semi != std::string_view::npos) {
+      std::string_view param = trim(item.substr(semi + 1));
+      if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+        item_q = parse_qvalue(param.substr(2));
+      }
+    }
+
+    if (iequals(coding, encoding) ||
+        (encoding == "gzip" && iequals(coding, "x-gzip"))) {
+      q = item_q;
+    } else if (coding == "*") {
+      wildcard_q = item_q;
+    }
+  }
+
+  return q < 0 ? wildcard_q : q;
+}
+
+int negotiate_encoding(std::string_view accept_encoding,
+                       const std::vector<std::string>& available) {
+  int best = -1;
+  int best_q = 0;
+  for (std::size_t i = 0; i < available.size(); ++i) {
+    int q = encoding_quality(accept_encoding, available[i]);
+    if (q > best_q) {
+      best = static_cast<int>(i);
+      best_q = q;
+    }
+  }
+  return best;
+}
@@ -0,0 +1,34 @@
+// compression.hpp
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Content codings we can serve, in server preference order
+extern const std::vector<std::string> supported_encodings;
+
+// File suffix used for a precompressed sibling, e.g. ".br" for "br"
+std::string encoding_suffix(const std::string& encoding);
+
+// True for text-like MIME types that are worth compressing
+bool is_compressible(std::string_view content_type);
+
+// Compresses data with the given coding. Returns false if the coding is not
+// available in this build or compression failed. Level 0 selects the
+// coding's strongest setting, used for one-off compression at index time.
+bool compress(const std::string& encoding, std::string_view data, std::string& out,
+              int level = 0);
+
+// The q-value, 0 to 1000, an Accept-Encoding header gives one coding, or -1
+// if it names neither the coding nor "*"
+int encoding_quality(std::string_view accept_encoding, std::string_view encoding);
+
+// Picks the best of the available codings for an Accept-Encoding header,
+// honouring q-values; ties go to the earlier entry. Returns the index into
+// available, or -1 if identity should be used. Does not allocate.
+int negotiate_encoding(std::string_view accept_encoding,
+                       const std::vector<std::string>& available);
+
+#endif  // COMPRESSION_HPP
@@ -0,0 +1,122 @@
+#include "cpu_affinity.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Parses a sysfs cpulist such as "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    auto dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  return cpus;
+}
+
+// CPUs of each NUMA node, restricted to the allowed set
+std::vector<std::vector<int>> numa_nodes(const std::vector<int>& allowed) {
+  std::vector<std::vector<int>> nodes;
+  std::error_code ec;
+  const fs::path root = "/sys/devices/system/node";
+  for (int node = 0; fs::exists(root / ("node" + std::to_string(node)), ec); ++node) {
+    std::ifstream file(root / ("node" + std::to_string(node)) / "cpulist");
+    std::string list;
+    std::getline(file, list);
+
+    std::vector<int> cpus;
+    for (int cpu : parse_cpu_list(list)) {
+      if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+        cpus.push_back(cpu);
+      }
+    }
+    if (!cpus.empty()) {
+      nodes.push_back(std::move(cpus));
+    }
+  }
+  return nodes;
+}
+
+}  // namespace
+
+std::vector<int> plan_cpu_placement(std::size_t threads, bool numa_aware) {
+  std::vector<int> cpus = allowed_cpus();
+  if (cpus.empty()) {
+    return {};
+  }
+
+  if (numa_aware) {
+    auto nodes = numa_nodes(cpus);
+    if (nodes.size() > 1) {
+      // Interleave nodes: worker 0 on node 0, worker 1 on node 1, ...
+      cpus.clear();
+      for (std::size_t i = 0; cpus.size() < threads; ++i) {
+        bool any = false;
+        for (auto& node : nodes) {
+          if (i < node.size()) {
+            cpus.push_back(node[i]);
+            any = true;
+          }
+        }
+        if (!any) {
+          break;
+        }
+      }
+    }
+  }
+
+  std::vector<int> placement;
+  placement.reserve(threads);
+  for (std::size_t i = 0; i < threads; ++i) {
+    placement.push_back(cpus[i % cpus.size()]);
+  }
+  return placement;
+}
+
+bool pin_current_thread(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
@@ -0,0 +1,19 @@
+// cpu_affinity.hpp
+#ifndef CPU_AFFINITY_HPP
+#define CPU_AFFINITY_HPP
+
+#include <cstddef>
+#include <vector>
+
+// Returns one CPU id per worker thread, drawn from the CPUs this process is
+// allowed to run on. With numa_aware set, consecutive workers are spread
+// over NUMA nodes and each worker stays on a single node, so its io_context
+// and session memory are first-touched on local memory. Returns an empty
+// vector if the placement cannot be determined.
+std::vector<int> plan_cpu_placement(std::size_t threads, bool numa_aware);
+
+// Pins the calling thread to the given CPU. Returns false on failure or on
+// platforms without thread affinity support.
+bool pin_current_thread(int cpu);
+
+#endif  // CPU_AFFINITY_HPP
@@ -0,0 +1,183 @@
+#include "file_watcher.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <unordered_set>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "globals.hpp"
+#include "logger.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr std::uint32_t kWatchMask = IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE |
+                                     IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+// Keeps the last change of each path, in the order those last changes
+// happened; an overflow makes everything else moot
+std::vector<FileWatcher::Event> coalesce(std::vector<FileWatcher::Event>& events) {
+    for (const auto& event : events) {
+        if (event.change == FileWatcher::Change::rescan) {
+            return {event};
+        }
+    }
+    std::vector<FileWatcher::Event> batch;
+    std::unordered_set<std::string> seen;
+    for (auto it = events.rbegin(); it != events.rend(); ++it) {
+        if (seen.insert(it->path).second) {
+            batch.push_back(std::move(*it));
+        }
+    }
+    std::reverse(batch.begin(), batch.end());
+    return batch;
+}
+
+}  // namespace
+
+FileWatcher::FileWatcher(const std::string& root, Callback callback)
+    : root_(root), callback_(std::move(callback)) {
+    // Spell paths the way a directory walk from root does: "./a/b"
+    while (root_.size() > 1 && root_.back() == '/') {
+        root_.pop_back();
+    }
+
+    inotifyFd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd_ < 0) {
+        throw std::runtime_error("Failed to start inotify: " + std::string(std::strerror(errno)));
+    }
+    stopFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stopFd_ < 0) {
+        ::close(inotifyFd_);
+        throw std::runtime_error("Failed to create eventfd: " + std::string(std::strerror(errno)));
+    }
+
+    watchTree(root_, nullptr);
+    watchThread_ = std::thread(&FileWatcher::run, this);
+}
+
+FileWatcher::~FileWatcher() {
+    std::uint64_t one = 1;
+    if (::write(stopFd_, &one, sizeof(one)) < 0) {
+        getGlobalLogger().log("Failed to stop the file watcher");
+    }
+    if (watchThread_.joinable()) {
+        watchThread_.join();
+    }
+    ::close(stopFd_);
+    ::close(inotifyFd_);
+}
+
+void FileWatcher::watchTree(const std::string& directory, std::vector<Event>* created) {
+    int wd = ::inotify_add_watch(inotifyFd_, directory.c_str(), kWatchMask);
+    if (wd < 0) {
+        getGlobalLogger().log("Failed to watch " + directory + ": " + std::strerror(errno));
+        return;
+    }
+    directories_[wd] = directory;
+
+    // A directory that just appeared may have filled up before its watch
+    // existed, so what is already in it is reported as created
+    std::error_code ec;
+    for (fs::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+        std::string path = directory + "/" + it->path().filename().string();
+        std::error_code status_ec;
+        if (it->is_directory(status_ec) && !it->is_symlink(status_ec)) {
+            watchTree(path, created);
+        } else if (created && it->is_regular_file(status_ec)) {
+            created->push_back({path, Change::updated});
+        }
+    }
+}
+
+void FileWatcher::readEvents(std::vector<Event>& events) {
+    alignas(inotify_event) char buffer[64 * 1024];
+    while (true) {
+        ssize_t n = ::read(inotifyFd_, buffer, sizeof(buffer));
+        if (n <= 0) {
+            return;  // drained
+        }
+
+        for (char* p = buffer; p < buffer + n;) {
+            const auto* event = reinterpret_cast<const inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                events.push_back({root_, Change::rescan});
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                directories_.erase(event->wd);
+                continue;
+            }
+            auto directory = directories_.find(event->wd);
+            if (directory == directories_.end() || event->len == 0) {
+                continue;
+            }
+            std::string path = directory->second + "/" + event->name;
+
+            if (!(event->mask & IN_ISDIR)) {
+                if (event->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO)) {
+                    events.push_back({path, Change::updated});
+                } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    events.push_back({path, Change::removed});
+                }
+            } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                watchTree(path, &events);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                // Watches follow a moved directory, and would go on
+                // reporting it under its old name
+                std::string prefix = path + "/";
+                for (auto it = directories_.begin(); it != directories_.end();) {
+                    if (it->second == path || it->second.compare(0, prefix.size(), prefix) == 0) {
+                        ::inotify_rm_watch(inotifyFd_, it->first);
+                        it = directories_.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                events.push_back({path, Change::removed});
+            }
+        }
+    }
+}
+
+void FileWatcher::run() {
+    std::vector<Event> events;
+    pollfd fds[2] = {{inotifyFd_, POLLIN, 0}, {stopFd_, POLLIN, 0}};
+    while (true) {
+        // Sleep until something changes, then until the tree settles
+        int ready = ::poll(fds, 2, events.empty() ? -1 : WATCH_SETTLE_MS);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            getGlobalLogger().log("File watcher stopped: " + std::string(std::strerror(errno)));
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
+        if (ready > 0) {
+            readEvents(events);
+            continue;
+        }
+
+        std::vector<Event> batch = coalesce(events);
+        events.clear();
+        try {
+            callback_(batch);
+        } catch (const std::exception& e) {
+            getGlobalLogger().log("Error applying file changes: " + std::string(e.what()));
+        }
+    }
+}
@@ -0,0 +1,51 @@
+// file_watcher.hpp
+#ifndef FILE_WATCHER_HPP
+#define FILE_WATCHER_HPP
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Watches a directory tree with inotify(7) on a thread of its own and
+// reports the files that appear, change or disappear under it. Events are
+// gathered until the tree has been quiet for WATCH_SETTLE_MS, so an editor
+// saving through a temporary file, or a deploy copying a whole directory,
+// arrives as one batch with one entry per path.
+class FileWatcher {
+public:
+    enum class Change {
+        updated,  // created, written or moved in; index it again
+        removed,  // deleted or moved out; for a directory, everything below it
+        rescan,   // the kernel queue overflowed; compare the whole tree
+    };
+
+    struct Event {
+        std::string path;  // root-relative, spelled as "<root>/<name>" like a directory walk
+        Change change;
+    };
+
+    using Callback = std::function<void(const std::vector<Event>& events)>;
+
+    // Throws std::runtime_error if inotify is unavailable
+    FileWatcher(const std::string& root, Callback callback);
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+private:
+    std::string root_;
+    Callback callback_;
+    int inotifyFd_ = -1;
+    int stopFd_ = -1;  // eventfd that wakes the thread to exit
+    std::unordered_map<int, std::string> directories_;  // watch descriptor -> path
+    std::thread watchThread_;
+
+    void run();
+    void watchTree(const std::string& directory, std::vector<Event>* created);
+    void readEvents(std::vector<Event>& events);
+};
+
+#endif  // FILE_WATCHER_HPP
@@ -1,6 +1,14 @@
 #include "globals.hpp"
 
+#include <time.h>
+
 Logger& getGlobalLogger() {
     static Logger& instance = Logger::getInstance();
     return instance;
-}
\ No newline at end of file
+}
+
+std::uint64_t coarse_now() {
+    timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
@@ -1,32 +1,67 @@
-#ifndef GLOBALS_HPP
-#define GLOBALS_HPP
-
-#include <boost/asio/ip/tcp.hpp>
-#include <boost/asio/spawn.hpp>
-#include <boost/beast/core.hpp>
-#include <boost/beast/http.hpp>
-#include <mutex>
-#include <unordered_map>
-#include "http_session.hpp"
-#include "http_server.hpp"
-#include "logger.hpp"
-
-#define isDevMode 1
-#define MAX_THREADS std::thread::hardware_concurrency()
-#define SERVER_PORT 8080
-#define BOOST_BEAST_VERSION_STRING "my_server/1.0"
-
-namespace beast = boost::beast;
-namespace http = beast::http;
-namespace net = boost::asio;
-using tcp = net::ip::tcp;
-
-using RequestHandler = std::function<void(
-    http_session&, const http::request<http::dynamic_body>&)>;
-using RouteHandlers = std::map<std::string, RequestHandler>;
-
-void handle_root(http_session& session, const http::request<http::dynamic_body>& req);
-
-Logger& getGlobalLogger();
-
-#endif  // GLOBALS_HPP
+#ifndef GLOBALS_HPP
+#define GLOBALS_HPP
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include "http_session.hpp"
+#include "http_server.hpp"
+#include "logger.hpp"
+
+#define isDevMode 1
+#define MAX_THREADS std::thread::hardware_concurrency()
+#define SERVER_PORT 8080
+#define BOOST_BEAST_VERSION_STRING "my_server/1.0"
+#define ASSET_CACHE_CAPACITY (64 * 1024 * 1024)
+#define ASSET_CACHE_MAX_ENTRY_SIZE (1024 * 1024)
+#define SENDFILE_MIN_SIZE (64 * 1024)
+#define SENDFILE_MAX_PER_TURN (1024 * 1024)
+#define FILE_IO_THREADS 4             // --file-io-threads with no count
+#define DYNAMIC_COMPRESSION_LEVEL 1  // favour latency for per-request gzip
+#define MAX_PIPELINED_REQUESTS 16     // responses queued per connection before reading pauses
+#define REAP_INTERVAL_MS 250          // how often sessions are checked against their deadlines
+#define RATE_LIMIT_CLIENTS 65536      // clients RateLimiter tracks before forgetting the coldest
+#define RATE_LIMIT_EXPIRY_MS 60000    // idle time after which a client's entry is dropped
+#define REQUEST_HEADER_LIMIT 8192     // bytes of request line and fields
+#define REQUEST_BODY_LIMIT (1024 * 1024)  // routes without BodyOptions
+#define UPLOAD_SPOOL_DIR "/tmp"       // spool_to_file's temporary files
+#define DEBUG_UPLOAD_LIMIT (1024ULL * 1024 * 1024)  // POST /debug/upload
+#define PROXY_BODY_LIMIT (1024ULL * 1024 * 1024)    // request bodies on --proxy routes
+#define PROXY_HEADER_LIMIT (64 * 1024)  // bytes of a backend's response header
+#define PROXY_BUFFER_SIZE (16 * 1024)   // response body relayed per read from a backend
+#define HTTP2_MAX_STREAMS 100         // concurrent streams a client may open on one connection
+#define HTTP2_WINDOW (1024 * 1024)    // flow control window offered per stream and per connection
+#define HTTP2_CONTROL_LIMIT (64 * 1024)       // queued control frames past which reading pauses
+#define HTTP2_CONTROL_HARD_LIMIT (256 * 1024) // past which the client gets GOAWAY(ENHANCE_YOUR_CALM)
+#define HTTP2_BUFFERED_BODY_LIMIT (4 * REQUEST_BODY_LIMIT)  // unfinished request bodies held per connection
+#define WATCH_SETTLE_MS 50            // quiet time before file changes are applied
+#define TRACE_DUMP_PATH "/tmp/webserver-trace.json"  // written on SIGUSR1
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+// Beast's string_view is boost::string_view; the rest of the tree uses std
+inline std::string_view to_string_view(beast::string_view sv) {
+    return {sv.data(), sv.size()};
+}
+
+using RequestHandler = std::function<void(
+    http_session&, const http_request&)>;
+using RouteHandlers = std::map<std::string, RequestHandler>;
+
+void handle_root(http_session& session, const http_request& req);
+
+Logger& getGlobalLogger();
+
+// Milliseconds on the coarse monotonic clock that session deadlines, backend
+// health and rate limit buckets are kept in. Reading it is a plain memory
+// read, and all of them work on scales far above its few-ms resolution.
+std::uint64_t coarse_now();
+
+#endif  // GLOBALS_HPP
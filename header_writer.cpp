@@ -0,0 +1,59 @@
+#include "header_writer.hpp"
+
+#include <charconv>
+
+namespace http = boost::beast::http;
+
+header_writer::header_writer(std::string& out, http::status status, unsigned version)
+    : out_(out), version_(version) {
+    out_ += "HTTP/";
+    out_ += static_cast<char>('0' + version / 10);
+    out_ += '.';
+    out_ += static_cast<char>('0' + version % 10);
+    out_ += ' ';
+    append_number(static_cast<unsigned>(status));
+    out_ += ' ';
+    auto reason = http::obsolete_reason(status);
+    out_.append(reason.data(), reason.size());
+    out_ += "\r\n";
+}
+
+void header_writer::set(http::field name, std::string_view value) {
+    auto text = http::to_string(name);
+    set(std::string_view(text.data(), text.size()), value);
+}
+
+void header_writer::set(std::string_view name, std::string_view value) {
+    out_.append(name.data(), name.size());
+    out_ += ": ";
+    out_.append(value.data(), value.size());
+    out_ += "\r\n";
+}
+
+void header_writer::content_length(std::uint64_t length) {
+    out_ += "Content-Length: ";
+    append_number(length);
+    out_ += "\r\n";
+}
+
+void header_writer::chunked() {
+    out_ += "Transfer-Encoding: chunked\r\n";
+}
+
+void header_writer::keep_alive(bool keep_alive) {
+    if (version_ < 11 && keep_alive) {
+        out_ += "Connection: keep-alive\r\n";
+    } else if (version_ >= 11 && !keep_alive) {
+        out_ += "Connection: close\r\n";
+    }
+}
+
+void header_writer::finish() {
+    out_ += "\r\n";
+}
+
+void header_writer::append_number(std::uint64_t value) {
+    char digits[20];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out_.append(digits, result.ptr - digits);
+}
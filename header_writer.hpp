@@ -0,0 +1,36 @@
+// header_writer.hpp
+#ifndef HEADER_WRITER_HPP
+#define HEADER_WRITER_HPP
+
+#include <boost/beast/http/field.hpp>
+#include <boost/beast/http/status.hpp>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Serializes a response header straight into a caller-owned string. Beast's
+// fields container allocates a node per field, so responses built on the
+// request path are written with this instead; reusing the string keeps the
+// whole header free of heap allocation.
+class header_writer {
+public:
+    // Appends the status line; version is Beast's encoding (11 = HTTP/1.1)
+    header_writer(std::string& out, boost::beast::http::status status, unsigned version);
+
+    void set(boost::beast::http::field name, std::string_view value);
+    void set(std::string_view name, std::string_view value);
+    void content_length(std::uint64_t length);
+    void chunked();
+    // Same Connection header rules as Beast's message::keep_alive
+    void keep_alive(bool keep_alive);
+    // Appends the blank line that ends the header
+    void finish();
+
+private:
+    std::string& out_;
+    unsigned version_;
+
+    void append_number(std::uint64_t value);
+};
+
+#endif  // HEADER_WRITER_HPP
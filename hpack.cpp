@@ -0,0 +1,454 @@
+#include "hpack.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+
+namespace {
+
+struct static_entry {
+    std::string_view name;
+    std::string_view value;
+};
+
+// RFC 7541 Appendix A; index 1 is the first entry
+constexpr std::array<static_entry, 61> static_table = {{
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""},
+    {"accept", ""}, {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""}, {"content-disposition", ""},
+    {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""},
+    {"max-forwards", ""}, {"proxy-authenticate", ""}, {"proxy-authorization", ""},
+    {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+}};
+
+struct huffman_code {
+    std::uint32_t bits;
+    std::uint8_t length;
+};
+
+// RFC 7541 Appendix B, by symbol; 256 is EOS
+constexpr std::array<huffman_code, 257> huffman_codes = {{
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28},
+    {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24},
+    {0x3ffffffc, 30}, {0xfffffe9, 28}, {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28},
+    {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28}, {0xffffff4, 28},
+    {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8},
+    {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7},
+    {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7},
+    {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7},
+    {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6}, {0x7ffd, 15},
+    {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6}, {0x27, 6},
+    {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6},
+    {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7}, {0x79, 7},
+    {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13},
+    {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22},
+    {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23},
+    {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22},
+    {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22},
+    {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23},
+    {0x1fffde, 21}, {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21},
+    {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22},
+    {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22},
+    {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22},
+    {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26},
+    {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24},
+    {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21},
+    {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20},
+    {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24},
+    {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26}, {0x7ffffe6, 27},
+    {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27},
+    {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30}
+}};
+
+constexpr std::uint16_t EOS = 256;
+
+// The code as a binary tree, walked a bit at a time. next[bit] is a node
+// index, or ~symbol for a leaf.
+struct huffman_node {
+    std::int16_t next[2] = {0, 0};
+};
+
+const std::vector<huffman_node>& huffman_tree() {
+    static const std::vector<huffman_node> tree = [] {
+        std::vector<huffman_node> nodes(1);
+        for (std::uint16_t symbol = 0; symbol < huffman_codes.size(); ++symbol) {
+            const huffman_code& code = huffman_codes[symbol];
+            std::size_t node = 0;
+            for (int i = code.length - 1; i > 0; --i) {
+                int bit = (code.bits >> i) & 1;
+                if (nodes[node].next[bit] == 0) {
+                    nodes[node].next[bit] = static_cast<std::int16_t>(nodes.size());
+                    nodes.emplace_back();
+                }
+                node = nodes[node].next[bit];
+            }
+            nodes[node].next[code.bits & 1] = static_cast<std::int16_t>(~symbol);
+        }
+        return nodes;
+    }();
+    return tree;
+}
+
+// Padding is the most significant bits of EOS, all ones, and shorter than
+// a byte; anything else, or EOS itself, is an error (RFC 7541 5.2)
+bool huffman_decode(const std::uint8_t* in, std::size_t size, std::string& out) {
+    const std::vector<huffman_node>& tree = huffman_tree();
+    out.clear();
+    std::size_t node = 0;
+    int pending_bits = 0;
+    bool all_ones = true;
+    for (std::size_t i = 0; i < size; ++i) {
+        for (int shift = 7; shift >= 0; --shift) {
+            int bit = (in[i] >> shift) & 1;
+            std::int16_t next = tree[node].next[bit];
+            ++pending_bits;
+            all_ones = all_ones && bit;
+            if (next >= 0) {
+                node = next;
+                continue;
+            }
+            std::uint16_t symbol = static_cast<std::uint16_t>(~next);
+            if (symbol == EOS) {
+                return false;
+            }
+            out += static_cast<char>(symbol);
+            node = 0;
+            pending_bits = 0;
+            all_ones = true;
+        }
+    }
+    return pending_bits < 8 && all_ones;
+}
+
+std::size_t entry_size(std::string_view name, std::string_view value) {
+    return 32 + name.size() + value.size();
+}
+
+// Fields whose values change from one response to the next; adding them to
+// the table would only push out the ones that repeat
+bool worth_indexing(std::string_view name) {
+    static constexpr std::string_view varying[] = {
+        "content-length", "content-range", "date", "etag", "last-modified",
+        "expires", "age", "location", "set-cookie",
+    };
+    return std::find(std::begin(varying), std::end(varying), name) == std::end(varying);
+}
+
+}  // namespace
+
+hpack_table::hpack_table(std::size_t max_size) : max_size_(0) { resize(max_size); }
+
+void hpack_table::resize(std::size_t max_size) {
+    evict(max_size > size_ ? 0 : size_ - max_size);
+    max_size_ = max_size;
+    std::size_t slots = max_size / 32 + 1;
+    if (slots == ring_.size()) {
+        return;
+    }
+    // Entries keep their order, newest last, in the new ring
+    std::vector<entry> ring(slots);
+    for (std::size_t i = 0; i < count_; ++i) {
+        std::size_t from = (newest_ + ring_.size() - i) % ring_.size();
+        ring[count_ - 1 - i] = std::move(ring_[from]);
+    }
+    ring_ = std::move(ring);
+    newest_ = count_ ? count_ - 1 : 0;
+}
+
+void hpack_table::evict(std::size_t needed) {
+    // The oldest entries go first. Their strings stay in place until the
+    // slot is reused, so a field just read from one is still valid.
+    std::size_t freed = 0;
+    while (freed < needed && count_ > 0) {
+        const entry& oldest = slot(count_ - 1);
+        std::size_t size = entry_size(oldest.name, oldest.value);
+        freed += size;
+        size_ -= size;
+        --count_;
+    }
+}
+
+void hpack_table::insert(std::string_view name, std::string_view value) {
+    std::size_t size = entry_size(name, value);
+    if (size > max_size_) {
+        evict(size_);
+        return;
+    }
+    if (size_ + size > max_size_) {
+        evict(size_ + size - max_size_);
+    }
+    // At most max_size / 32 entries fit, so the slot after the newest is
+    // never a live one
+    newest_ = (newest_ + 1) % ring_.size();
+    entry& slot = ring_[newest_];
+    slot.name.assign(name.data(), name.size());
+    slot.value.assign(value.data(), value.size());
+    size_ += size;
+    ++count_;
+}
+
+void hpack_table::clear() {
+    evict(size_);
+}
+
+hpack_decoder::hpack_decoder(std::size_t max_size)
+    : table_(max_size), settings_max_size_(max_size) {}
+
+void hpack_decoder::reset() {
+    table_.clear();
+    table_.resize(settings_max_size_);
+}
+
+bool hpack_decoder::field(std::size_t index, std::string_view& name,
+                          std::string_view& value) const {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= static_table.size()) {
+        name = static_table[index - 1].name;
+        value = static_table[index - 1].value;
+        return true;
+    }
+    index -= static_table.size() + 1;
+    if (index >= table_.count()) {
+        return false;
+    }
+    name = table_.name(index);
+    value = table_.value(index);
+    return true;
+}
+
+bool hpack_decoder::read_integer(const std::uint8_t*& in, const std::uint8_t* end,
+                                 int prefix_bits, std::uint64_t& value) {
+    if (in == end) {
+        return false;
+    }
+    std::uint64_t mask = (1u << prefix_bits) - 1;
+    value = *in++ & mask;
+    if (value < mask) {
+        return true;
+    }
+    // Nothing in a block legitimately needs more than 32 bits. Zero-valued
+    // continuation bytes never trip the value check, so the shift is bounded
+    // on its own before it can run past 64.
+    for (int shift = 0; in != end; shift += 7) {
+        if (shift > 28) {
+            return false;
+        }
+        std::uint8_t byte = *in++;
+        value += static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if (value > 0xffffffffu) {
+            return false;
+        }
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool hpack_decoder::read_string(const std::uint8_t*& in, const std::uint8_t* end,
+                                std::string& scratch, std::string_view& out) {
+    if (in == end) {
+        return false;
+    }
+    bool huffman = *in & 0x80;
+    std::uint64_t length;
+    if (!read_integer(in, end, 7, length) || length > static_cast<std::uint64_t>(end - in)) {
+        return false;
+    }
+    if (huffman) {
+        if (!huffman_decode(in, length, scratch)) {
+            return false;
+        }
+        out = scratch;
+    } else {
+        out = std::string_view(reinterpret_cast<const char*>(in), length);
+    }
+    in += length;
+    return true;
+}
+
+bool hpack_decoder::decode(std::string_view block, const field_handler& on_field) {
+    const auto* in = reinterpret_cast<const std::uint8_t*>(block.data());
+    const auto* end = in + block.size();
+    bool fields = false;
+    while (in != end) {
+        std::uint8_t first = *in;
+        std::uint64_t index;
+        std::string_view name;
+        std::string_view value;
+
+        if (first & 0x80) {
+            // Indexed field
+            if (!read_integer(in, end, 7, index) || !field(index, name, value)) {
+                return false;
+            }
+            on_field(name, value);
+            fields = true;
+            continue;
+        }
+        if ((first & 0xe0) == 0x20) {
+            // Table size update; only before the block's first field
+            if (fields || !read_integer(in, end, 5, index) || index > settings_max_size_) {
+                return false;
+            }
+            table_.resize(index);
+            continue;
+        }
+
+        // Literal, with incremental indexing (01), without indexing (0000)
+        // or never indexed (0001)
+        bool indexing = (first & 0xc0) == 0x40;
+        if (!read_integer(in, end, indexing ? 6 : 4, index)) {
+            return false;
+        }
+        if (index == 0) {
+            if (!read_string(in, end, name_, name)) {
+                return false;
+            }
+        } else if (!field(index, name, value)) {
+            return false;
+        }
+        if (!read_string(in, end, value_, value)) {
+            return false;
+        }
+        if (indexing) {
+            table_.insert(name, value);
+        }
+        on_field(name, value);
+        fields = true;
+    }
+    return true;
+}
+
+void hpack_encoder::set_max_size(std::size_t max_size) {
+    max_size = std::min(max_size, HPACK_DEFAULT_TABLE_SIZE);
+    if (max_size == table_.max_size()) {
+        return;
+    }
+    // Shrinking evicts now; the decoder does the same once it reads the
+    // update, before anything that refers to the table
+    if (!size_update_ || max_size < smallest_size_) {
+        smallest_size_ = max_size;
+    }
+    table_.resize(max_size);
+    size_update_ = true;
+}
+
+void hpack_encoder::begin_block(std::string& out) {
+    if (!size_update_) {
+        return;
+    }
+    // The smallest limit since the last block first, so the decoder evicts
+    // what this end did (RFC 7541 4.2)
+    if (smallest_size_ < table_.max_size()) {
+        write_integer(out, 0x20, 5, smallest_size_);
+    }
+    write_integer(out, 0x20, 5, table_.max_size());
+    size_update_ = false;
+}
+
+void hpack_encoder::encode_status(std::string& out, unsigned status) {
+    char digits[4];
+    auto result = std::to_chars(digits, digits + sizeof(digits), status);
+    encode(out, ":status", std::string_view(digits, result.ptr - digits));
+}
+
+void hpack_encoder::encode(std::string& out, std::string_view name, std::string_view value) {
+    std::size_t name_index = 0;
+    for (std::size_t i = 0; i < static_table.size(); ++i) {
+        if (static_table[i].name != name) {
+            continue;
+        }
+        if (static_table[i].value == value) {
+            write_integer(out, 0x80, 7, i + 1);
+            return;
+        }
+        if (!name_index) {
+            name_index = i + 1;
+        }
+    }
+    for (std::size_t i = 0; i < table_.count(); ++i) {
+        if (table_.name(i) != name) {
+            continue;
+        }
+        if (table_.value(i) == value) {
+            write_integer(out, 0x80, 7, static_table.size() + 1 + i);
+            return;
+        }
+        if (!name_index) {
+            name_index = static_table.size() + 1 + i;
+        }
+    }
+
+    bool indexing = worth_indexing(name) && entry_size(name, value) <= table_.max_size();
+    if (indexing) {
+        write_integer(out, 0x40, 6, name_index);
+    } else if (name == "set-cookie") {
+        // Never indexed, by this end or any intermediary (RFC 7541 7.1.3)
+        write_integer(out, 0x10, 4, name_index);
+    } else {
+        write_integer(out, 0x00, 4, name_index);
+    }
+    if (!name_index) {
+        write_string(out, name);
+    }
+    write_string(out, value);
+    if (indexing) {
+        table_.insert(name, value);
+    }
+}
+
+void hpack_encoder::reset() {
+    table_.clear();
+    table_.resize(HPACK_DEFAULT_TABLE_SIZE);
+    size_update_ = false;
+    smallest_size_ = 0;
+}
+
+void hpack_encoder::write_integer(std::string& out, std::uint8_t first, int prefix_bits,
+                                  std::uint64_t value) {
+    std::uint64_t mask = (1u << prefix_bits) - 1;
+    if (value < mask) {
+        out += static_cast<char>(first | value);
+        return;
+    }
+    out += static_cast<char>(first | mask);
+    value -= mask;
+    while (value >= 0x80) {
+        out += static_cast<char>(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+void hpack_encoder::write_string(std::string& out, std::string_view text) {
+    write_integer(out, 0x00, 7, text.size());
+    out.append(text.data(), text.size());
+}
@@ -0,0 +1,113 @@
+// hpack.hpp
+#ifndef HPACK_HPP
+#define HPACK_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// HPACK (RFC 7541), the header compression of HTTP/2. Each direction of a
+// connection keeps a table of fields it has recently sent, which the
+// encoder on one end and the decoder on the other keep in step; a field
+// already in it goes over the wire as a single index.
+
+// Size of the table both ends start with (SETTINGS_HEADER_TABLE_SIZE)
+constexpr std::size_t HPACK_DEFAULT_TABLE_SIZE = 4096;
+
+// The dynamic table, newest entry first. Entries sit in a ring of slots that
+// keep their strings' capacity, so a warm table stops allocating.
+class hpack_table {
+public:
+    explicit hpack_table(std::size_t max_size = HPACK_DEFAULT_TABLE_SIZE);
+
+    // Evicts down to the new limit
+    void resize(std::size_t max_size);
+    // Evicts what it must to make room; an entry larger than the whole
+    // table empties it and is not added
+    void insert(std::string_view name, std::string_view value);
+    void clear();
+
+    std::size_t count() const { return count_; }
+    std::size_t max_size() const { return max_size_; }
+    // i = 0 is the newest entry
+    std::string_view name(std::size_t i) const { return slot(i).name; }
+    std::string_view value(std::size_t i) const { return slot(i).value; }
+
+private:
+    struct entry {
+        std::string name;
+        std::string value;
+    };
+
+    std::vector<entry> ring_;  // max_size / 32 + 1 slots: entries cost at least 32
+    std::size_t newest_ = 0;
+    std::size_t count_ = 0;
+    std::size_t size_ = 0;     // as RFC 7541 4.1 counts it: 32 + name + value each
+    std::size_t max_size_;
+
+    const entry& slot(std::size_t i) const {
+        return ring_[(newest_ + ring_.size() - i) % ring_.size()];
+    }
+    void evict(std::size_t needed);
+};
+
+// Decodes the header blocks of one direction of a connection. A block
+// that fails to decode leaves the table out of step with the peer's, so
+// the connection cannot go on (COMPRESSION_ERROR).
+class hpack_decoder {
+public:
+    // Fields in order; name and value are only valid during the call
+    using field_handler = std::function<void(std::string_view name, std::string_view value)>;
+
+    // max_size is the SETTINGS_HEADER_TABLE_SIZE this end has advertised,
+    // the most the peer may resize the table to
+    explicit hpack_decoder(std::size_t max_size = HPACK_DEFAULT_TABLE_SIZE);
+
+    bool decode(std::string_view block, const field_handler& on_field);
+    void reset();
+
+private:
+    hpack_table table_;
+    std::size_t settings_max_size_;
+    std::string name_;   // Huffman-decoded strings
+    std::string value_;
+
+    bool field(std::size_t index, std::string_view& name, std::string_view& value) const;
+    static bool read_integer(const std::uint8_t*& in, const std::uint8_t* end, int prefix_bits,
+                             std::uint64_t& value);
+    static bool read_string(const std::uint8_t*& in, const std::uint8_t* end,
+                            std::string& scratch, std::string_view& out);
+};
+
+// Encodes the header blocks of one direction of a connection. Values that
+// repeat across responses (server, content types, cache policy) are added
+// to the table and cost a byte from then on; ones that differ each time
+// (lengths, dates, validators) are sent as literals and left out of it.
+// Strings go out without Huffman coding, which would cost a pass over each.
+class hpack_encoder {
+public:
+    // The peer's SETTINGS_HEADER_TABLE_SIZE. Only HPACK_DEFAULT_TABLE_SIZE
+    // of it is used; a change is announced at the start of the next block.
+    void set_max_size(std::size_t max_size);
+
+    // Starts a block in out; every block must begin with it
+    void begin_block(std::string& out);
+    void encode_status(std::string& out, unsigned status);
+    // name in lowercase, as HTTP/2 requires
+    void encode(std::string& out, std::string_view name, std::string_view value);
+    void reset();
+
+private:
+    hpack_table table_;
+    bool size_update_ = false;  // the table's limit has changed since the last block
+    std::size_t smallest_size_ = 0;  // the lowest it has been meanwhile
+
+    static void write_integer(std::string& out, std::uint8_t first, int prefix_bits,
+                              std::uint64_t value);
+    static void write_string(std::string& out, std::string_view text);
+};
+
+#endif  // HPACK_HPP
@@ -0,0 +1,1672 @@
+#include "http2.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#include "globals.hpp"
+#include "metrics.hpp"
+#include "rate_limiter.hpp"
+#include "tracer.hpp"
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+namespace {
+
+// A read takes a full frame or so at a time
+constexpr std::size_t READ_SIZE = H2_DEFAULT_FRAME_SIZE + H2_FRAME_HEADER_SIZE;
+// Frames gathered into one write: a round of full DATA frames for a
+// handful of busy streams
+constexpr std::size_t WRITE_BATCH = 128 * 1024;
+// File body read per trip, inline or through the file I/O pool
+constexpr std::size_t FILE_READ_SIZE = 64 * 1024;
+// A header block, with its CONTINUATION frames, before it is decoded
+constexpr std::size_t HEADER_BLOCK_LIMIT = 4 * REQUEST_HEADER_LIMIT;
+// Finished streams a connection keeps for reuse
+constexpr std::size_t FREE_STREAMS = 8;
+
+std::uint32_t read_u16(const char* in) {
+    auto* bytes = reinterpret_cast<const std::uint8_t*>(in);
+    return (std::uint32_t(bytes[0]) << 8) | bytes[1];
+}
+
+std::uint32_t read_u32(const char* in) {
+    auto* bytes = reinterpret_cast<const std::uint8_t*>(in);
+    return (std::uint32_t(bytes[0]) << 24) | (std::uint32_t(bytes[1]) << 16) |
+           (std::uint32_t(bytes[2]) << 8) | bytes[3];
+}
+
+void append_u16(std::string& out, std::uint32_t value) {
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+void append_u32(std::string& out, std::uint32_t value) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+// Fields about one HTTP/1.1 connection, which HTTP/2 has no use for
+// (RFC 9113 8.2.2): a request carrying one is malformed, and a response's
+// are dropped
+bool is_connection_specific(std::string_view name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+           name == "transfer-encoding" || name == "upgrade";
+}
+
+// HTTP2-Settings is a SETTINGS payload in unpadded base64url
+bool decode_base64url(std::string_view in, std::string& out) {
+    out.clear();
+    std::uint32_t bits = 0;
+    int count = 0;
+    for (char c : in) {
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '-') {
+            value = 62;
+        } else if (c == '_') {
+            value = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            return false;
+        }
+        bits = (bits << 6) | value;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out += static_cast<char>(bits >> count);
+        }
+    }
+    return true;
+}
+
+std::string_view trim(std::string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+beast::string_view to_beast(std::string_view text) {
+    return {text.data(), text.size()};
+}
+
+}  // namespace
+
+h2_frame_header parse_frame_header(const std::uint8_t* in) {
+    h2_frame_header header;
+    header.length = (std::uint32_t(in[0]) << 16) | (std::uint32_t(in[1]) << 8) | in[2];
+    header.type = static_cast<h2_frame>(in[3]);
+    header.flags = in[4];
+    header.stream_id = read_u32(reinterpret_cast<const char*>(in + 5)) & 0x7fffffff;
+    return header;
+}
+
+void append_frame_header(std::string& out, std::size_t length, h2_frame type,
+                         std::uint8_t flags, std::uint32_t stream_id) {
+    out += static_cast<char>(length >> 16);
+    out += static_cast<char>(length >> 8);
+    out += static_cast<char>(length);
+    out += static_cast<char>(type);
+    out += static_cast<char>(flags);
+    append_u32(out, stream_id & 0x7fffffff);
+}
+
+void h2_stream::clear() {
+    id = 0;
+    request.reset();
+    params.clear();
+    route_id = 0;
+    started = trace_id = read_started = 0;
+    header_bytes = 0;
+    response.reset();
+    upload.reset();
+    proxy.reset();
+    content_length.reset();
+    body_limit = body_received = 0;
+    buffered = 0;
+    receive_window = 0;
+    receive_credit = 0;
+    async = nullptr;
+    send_window = 0;
+    next_buffer = 0;
+    data = nullptr;
+    data_size = 0;
+    until_eof = trailer_sent = false;
+    counted = remote_closed = routed = headers_sent = false;
+    local_closed = reset = discard = reading = false;
+}
+
+h2_connection::h2_connection(http_session& session) : session_(session) {}
+
+bool h2_connection::wants_upgrade(const http_request& request) {
+    bool h2c = false;
+    for (auto token : http::token_list(request[http::field::upgrade])) {
+        h2c = h2c || beast::iequals(token, "h2c");
+    }
+    if (!h2c) {
+        return false;
+    }
+    auto settings = request.find("HTTP2-Settings");
+    std::string payload;
+    return settings != request.end() &&
+           decode_base64url(to_string_view(settings->value()), payload) &&
+           payload.size() % 6 == 0;
+}
+
+void h2_connection::start(http_request* upgraded, std::size_t header_bytes) {
+    http_session& session = session_;
+    preface_ = true;
+    settings_ = true;
+    if (upgraded) {
+        control_ +=
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Connection: Upgrade\r\n"
+            "Upgrade: h2c\r\n\r\n";
+    }
+    // The server's preface is its SETTINGS; the connection window is
+    // opened to match the streams'
+    append_frame_header(control_, 18, h2_frame::settings, 0, 0);
+    append_u16(control_, static_cast<std::uint16_t>(h2_setting::max_concurrent_streams));
+    append_u32(control_, HTTP2_MAX_STREAMS);
+    append_u16(control_, static_cast<std::uint16_t>(h2_setting::initial_window_size));
+    append_u32(control_, HTTP2_WINDOW);
+    append_u16(control_, static_cast<std::uint16_t>(h2_setting::max_header_list_size));
+    append_u32(control_, REQUEST_HEADER_LIMIT);
+    queue_window_update(0, HTTP2_WINDOW - H2_DEFAULT_WINDOW);
+    receive_window_ = HTTP2_WINDOW;
+
+    // The preface and the client's SETTINGS are due under the header timeout
+    session.read_phase_ = http_session::read_phase::header;
+    session.read_deadline_ = session.deadline(session.options_.timeouts.header);
+
+    processing_ = true;
+    if (upgraded) {
+        // The 101 stands in for acknowledging the client's HTTP2-Settings
+        std::string payload;
+        decode_base64url(to_string_view(upgraded->find("HTTP2-Settings")->value()), payload);
+        apply_settings(payload);
+
+        auto stream = new_stream(1);
+        stream->request.emplace(std::move(*upgraded));
+        stream->request->erase(http::field::upgrade);
+        stream->request->erase(http::field::connection);
+        stream->request->erase("HTTP2-Settings");
+        stream->header_bytes = header_bytes;
+        stream->remote_closed = true;
+        stream->read_started = session.read_started_;
+        last_stream_id_ = 1;
+        streams_.push_back(std::move(stream));
+        if (!stopped_) {
+            dispatch(*streams_.back());
+        }
+    }
+    process();
+    processing_ = false;
+    if (!stopped_) {
+        do_read();
+    }
+    do_write();
+}
+
+void h2_connection::reset() {
+    for (auto& stream : streams_) {
+        stream->clear();
+        if (free_.size() < FREE_STREAMS) {
+            free_.push_back(std::move(stream));
+        }
+    }
+    streams_.clear();
+    decoder_.reset();
+    encoder_.reset();
+    last_stream_id_ = 0;
+    preface_ = settings_ = processing_ = stopped_ = goaway_ = shut_down_ = false;
+    read_paused_ = false;
+    buffered_body_ = 0;
+    continuation_ = 0;
+    continuation_end_stream_ = false;
+    header_block_.clear();
+    initial_window_ = send_window_ = receive_window_ = H2_DEFAULT_WINDOW;
+    receive_credit_ = 0;
+    control_.clear();
+    frames_.clear();
+    frames_flushed_ = 0;
+    pieces_.clear();
+    buffers_.clear();
+    finished_.clear();
+    next_turn_ = 0;
+    stalled_ = false;
+}
+
+void h2_connection::do_read() {
+    http_session& session = session_;
+    session.reading_ = true;
+    session.park_pending_ = false;
+    auto self = session.shared_from_this();
+    session.stream_.async_read_some(
+        session.buffer_.prepare(READ_SIZE),
+        bind_pool(session.pool_, [self, this](beast::error_code ec, std::size_t bytes) {
+            on_read(ec, bytes);
+        }));
+}
+
+void h2_connection::on_read(beast::error_code ec, std::size_t bytes) {
+    http_session& session = session_;
+    if (ec == net::error::operation_aborted && session.parked_ && !session.closing_) {
+        // Cancelled by park()
+        wait_readable();
+        return;
+    }
+    session.reading_ = false;
+    session.parked_ = false;
+    if (shut_down_) {
+        // GOAWAY is out; whatever else comes is dropped until the client
+        // closes its side too
+        if (!ec) {
+            do_read();
+        }
+        return;
+    }
+    if (ec) {
+        if (ec != net::error::operation_aborted) {
+            getGlobalLogger().logError("Error: ", ec);
+        }
+        stopped_ = true;
+        session.closing_ = true;
+        abandon_all();
+        do_write();
+        return;
+    }
+
+    session.buffer_.commit(bytes);
+    processing_ = true;
+    process();
+    processing_ = false;
+    // A client that sends PINGs, SETTINGS or refused streams without
+    // reading the answers would grow control_ without end; past the limit
+    // nothing more is read until it has taken what is queued
+    read_paused_ = !stopped_;
+    do_write();
+    resume_reading();
+}
+
+void h2_connection::resume_reading() {
+    if (read_paused_ && (stopped_ || shut_down_)) {
+        read_paused_ = false;
+    } else if (read_paused_ && control_.size() <= HTTP2_CONTROL_LIMIT) {
+        read_paused_ = false;
+        do_read();
+    }
+}
+
+void h2_connection::wait_readable() {
+    // As the session's own: while parked, only a zero-byte wait is pending
+    // and the connection holds no buffers but its HPACK tables
+    http_session& session = session_;
+    session.buffer_.shrink_to_fit();
+    free_.clear();
+    std::string().swap(control_);
+    std::string().swap(frames_);
+    std::string().swap(header_block_);
+    std::string().swap(block_);
+    std::vector<piece>().swap(pieces_);
+    std::vector<net::const_buffer>().swap(buffers_);
+    session.pool_.trim();
+
+    auto self = session.shared_from_this();
+    if (session.stream_.pending()) {
+        session.parked_ = false;
+        net::post(session.stream_.get_executor(),
+                  bind_pool(session.pool_, [self, this] { do_read(); }));
+        return;
+    }
+    session.socket_->async_wait(tcp::socket::wait_read,
+                                bind_pool(session.pool_, [self, this](beast::error_code ec) {
+                                    session_.parked_ = false;
+                                    if (ec) {
+                                        on_read(ec, 0);
+                                        return;
+                                    }
+                                    do_read();
+                                }));
+}
+
+void h2_connection::process() {
+    auto& buffer = session_.buffer_;
+    if (preface_) {
+        auto data = buffer.data();
+        std::string_view buffered(static_cast<const char*>(data.data()), data.size());
+        std::size_t size = std::min(buffered.size(), H2_PREFACE.size());
+        if (buffered.substr(0, size) != H2_PREFACE.substr(0, size)) {
+            // Not an HTTP/2 client after all; there is nothing to tell it
+            getGlobalLogger().log("HTTP/2: bad connection preface");
+            stopped_ = true;
+            session_.closing_ = true;
+            return;
+        }
+        if (size < H2_PREFACE.size()) {
+            return;
+        }
+        buffer.consume(size);
+        preface_ = false;
+    }
+
+    while (!stopped_) {
+        auto data = buffer.data();
+        if (data.size() < H2_FRAME_HEADER_SIZE) {
+            break;
+        }
+        auto* in = static_cast<const std::uint8_t*>(data.data());
+        h2_frame_header header = parse_frame_header(in);
+        if (header.length > H2_DEFAULT_FRAME_SIZE) {
+            connection_error(h2_error::frame_size_error, "frame too large");
+            break;
+        }
+        if (data.size() < H2_FRAME_HEADER_SIZE + header.length) {
+            break;
+        }
+        std::string_view payload(reinterpret_cast<const char*>(in) + H2_FRAME_HEADER_SIZE,
+                                 header.length);
+        bool ok = handle_frame(header, payload);
+        buffer.consume(H2_FRAME_HEADER_SIZE + header.length);
+        if (!ok) {
+            break;
+        }
+        if (control_.size() > HTTP2_CONTROL_HARD_LIMIT) {
+            connection_error(h2_error::enhance_your_calm, "control frames not being read");
+            break;
+        }
+    }
+    update_read_deadline();
+}
+
+bool h2_connection::handle_frame(const h2_frame_header& header, std::string_view payload) {
+    if (settings_ && header.type != h2_frame::settings) {
+        connection_error(h2_error::protocol_error, "expected SETTINGS");
+        return false;
+    }
+    if (continuation_ && header.type != h2_frame::continuation) {
+        connection_error(h2_error::protocol_error, "expected CONTINUATION");
+        return false;
+    }
+
+    switch (header.type) {
+        case h2_frame::data:
+            return on_data(header, payload);
+        case h2_frame::headers:
+            return on_headers(header, payload);
+        case h2_frame::continuation: {
+            if (!continuation_ || header.stream_id != continuation_) {
+                connection_error(h2_error::protocol_error, "unexpected CONTINUATION");
+                return false;
+            }
+            if (header_block_.size() + payload.size() > HEADER_BLOCK_LIMIT) {
+                connection_error(h2_error::enhance_your_calm, "header block too large");
+                return false;
+            }
+            header_block_.append(payload.data(), payload.size());
+            if (!(header.flags & H2_END_HEADERS)) {
+                return true;
+            }
+            std::uint32_t id = continuation_;
+            continuation_ = 0;
+            return on_header_block(id, continuation_end_stream_);
+        }
+        case h2_frame::priority:
+            // Streams share the connection evenly; a client's weights and
+            // dependencies are not followed
+            if (header.stream_id == 0) {
+                connection_error(h2_error::protocol_error, "PRIORITY on stream 0");
+                return false;
+            }
+            return true;
+        case h2_frame::rst_stream:
+            if (header.stream_id == 0 || payload.size() != 4) {
+                connection_error(header.stream_id ? h2_error::frame_size_error
+                                                  : h2_error::protocol_error,
+                                 "bad RST_STREAM");
+                return false;
+            }
+            on_rst_stream(header, payload);
+            return true;
+        case h2_frame::settings:
+            return on_settings(header, payload);
+        case h2_frame::push_promise:
+            connection_error(h2_error::protocol_error, "PUSH_PROMISE from a client");
+            return false;
+        case h2_frame::ping:
+            if (header.stream_id != 0 || payload.size() != 8) {
+                connection_error(header.stream_id ? h2_error::protocol_error
+                                                  : h2_error::frame_size_error,
+                                 "bad PING");
+                return false;
+            }
+            if (!(header.flags & H2_ACK)) {
+                append_frame_header(control_, 8, h2_frame::ping, H2_ACK, 0);
+                control_.append(payload.data(), payload.size());
+            }
+            return true;
+        case h2_frame::goaway:
+            // The client opens no more streams; those it has are finished
+            session_.closing_ = true;
+            return true;
+        case h2_frame::window_update:
+            return on_window_update(header, payload);
+    }
+    // Unknown frame types are ignored (RFC 9113 5.5)
+    return true;
+}
+
+bool h2_connection::on_data(const h2_frame_header& header, std::string_view payload) {
+    if (header.stream_id == 0) {
+        connection_error(h2_error::protocol_error, "DATA on stream 0");
+        return false;
+    }
+    // Flow control counts the whole payload, padding and all
+    receive_window_ -= header.length;
+    if (receive_window_ < 0) {
+        connection_error(h2_error::flow_control_error, "connection window exceeded");
+        return false;
+    }
+    if (header.flags & H2_PADDED) {
+        std::size_t padding = payload.empty() ? 0 : static_cast<std::uint8_t>(payload[0]);
+        if (payload.empty() || padding >= payload.size()) {
+            connection_error(h2_error::protocol_error, "bad padding");
+            return false;
+        }
+        payload = payload.substr(1, payload.size() - 1 - padding);
+    }
+
+    h2_stream* stream = find(header.stream_id);
+    if (!stream) {
+        if (header.stream_id > last_stream_id_) {
+            connection_error(h2_error::protocol_error, "DATA on an idle stream");
+            return false;
+        }
+        // A stream already reset; the client had sent this before it knew
+        credit(nullptr, header.length);
+        return true;
+    }
+    if (stream->remote_closed) {
+        credit(nullptr, header.length);
+        reset_stream(*stream, h2_error::stream_closed);
+        return true;
+    }
+    stream->receive_window -= header.length;
+    if (stream->receive_window < 0) {
+        credit(nullptr, header.length);
+        reset_stream(*stream, h2_error::flow_control_error);
+        return true;
+    }
+    take_data(*stream, payload);
+    if (header.flags & H2_END_STREAM) {
+        stream->remote_closed = true;
+        end_request(*stream);
+    }
+    credit(stream, header.length);
+    return true;
+}
+
+bool h2_connection::on_headers(const h2_frame_header& header, std::string_view payload) {
+    if (header.stream_id == 0) {
+        connection_error(h2_error::protocol_error, "HEADERS on stream 0");
+        return false;
+    }
+    std::size_t padding = 0;
+    if (header.flags & H2_PADDED) {
+        if (payload.empty()) {
+            connection_error(h2_error::protocol_error, "bad padding");
+            return false;
+        }
+        padding = static_cast<std::uint8_t>(payload[0]);
+        payload.remove_prefix(1);
+    }
+    if (header.flags & H2_PRIORITY) {
+        if (payload.size() < 5) {
+            connection_error(h2_error::protocol_error, "bad HEADERS priority");
+            return false;
+        }
+        payload.remove_prefix(5);
+    }
+    if (padding > payload.size()) {
+        connection_error(h2_error::protocol_error, "bad padding");
+        return false;
+    }
+    payload.remove_suffix(padding);
+
+    header_block_.assign(payload.data(), payload.size());
+    bool end_stream = header.flags & H2_END_STREAM;
+    if (!(header.flags & H2_END_HEADERS)) {
+        continuation_ = header.stream_id;
+        continuation_end_stream_ = end_stream;
+        return true;
+    }
+    return on_header_block(header.stream_id, end_stream);
+}
+
+bool h2_connection::on_header_block(std::uint32_t id, bool end_stream) {
+    h2_stream* existing = find(id);
+    if (existing || id <= last_stream_id_) {
+        // Trailers, or a block for a stream already gone. Either way it is
+        // decoded, to keep the table in step with the client's, and its
+        // fields are dropped.
+        if (!decoder_.decode(header_block_, [](std::string_view, std::string_view) {})) {
+            connection_error(h2_error::compression_error, "HPACK decoding failed");
+            return false;
+        }
+        if (!existing) {
+            return true;
+        }
+        if (existing->remote_closed) {
+            reset_stream(*existing, h2_error::stream_closed);
+        } else if (!end_stream) {
+            reset_stream(*existing, h2_error::protocol_error);
+        } else {
+            existing->remote_closed = true;
+            end_request(*existing);
+        }
+        return true;
+    }
+    if (id % 2 == 0) {
+        connection_error(h2_error::protocol_error, "even stream id from a client");
+        return false;
+    }
+    last_stream_id_ = id;
+
+    auto stream = new_stream(id);
+    stream->request.emplace(std::piecewise_construct, std::make_tuple(),
+                            std::make_tuple(pool_allocator<char>(session_.pool_)));
+    http_request& request = *stream->request;
+    method_.clear();
+    path_.clear();
+    authority_.clear();
+    cookie_.clear();
+    unsigned pseudo = 0;  // one bit per pseudo-header seen
+    bool regular = false;
+    bool malformed = false;
+    std::size_t list_size = 0;
+    bool decoded = decoder_.decode(header_block_, [&](std::string_view name,
+                                                      std::string_view value) {
+        // As SETTINGS_MAX_HEADER_LIST_SIZE counts it
+        list_size += name.size() + value.size() + 32;
+        if (malformed || list_size > REQUEST_HEADER_LIMIT) {
+            return;
+        }
+        if (!name.empty() && name.front() == ':') {
+            static constexpr std::string_view pseudo_headers[] = {":method", ":scheme", ":path",
+                                                                  ":authority"};
+            std::string* targets[] = {&method_, nullptr, &path_, &authority_};
+            auto it = std::find(std::begin(pseudo_headers), std::end(pseudo_headers), name);
+            unsigned bit = 1u << (it - std::begin(pseudo_headers));
+            if (regular || it == std::end(pseudo_headers) || (pseudo & bit)) {
+                malformed = true;
+                return;
+            }
+            pseudo |= bit;
+            if (std::string* target = targets[it - std::begin(pseudo_headers)]) {
+                target->assign(value.data(), value.size());
+            }
+            return;
+        }
+        regular = true;
+        bool lowercase = std::none_of(name.begin(), name.end(),
+                                      [](char c) { return c >= 'A' && c <= 'Z'; });
+        if (!lowercase || is_connection_specific(name) ||
+            (name == "te" && value != "trailers")) {
+            malformed = true;
+            return;
+        }
+        if (name == "cookie") {
+            // Sent as separate fields so each can be indexed; rejoined for
+            // HTTP/1.1 handlers (RFC 9113 8.2.3)
+            if (!cookie_.empty()) {
+                cookie_ += "; ";
+            }
+            cookie_.append(value.data(), value.size());
+            return;
+        }
+        request.insert(to_beast(name), to_beast(value));
+    });
+    if (!decoded) {
+        connection_error(h2_error::compression_error, "HPACK decoding failed");
+        return false;
+    }
+    // :method, :scheme and :path are required; CONNECT is not served
+    if (malformed || (pseudo & 0x7) != 0x7 || path_.empty()) {
+        queue_rst_stream(id, h2_error::protocol_error);
+        return true;
+    }
+    if (session_.closing_ || streams_.size() >= HTTP2_MAX_STREAMS) {
+        queue_rst_stream(id, h2_error::refused_stream);
+        return true;
+    }
+
+    request.method_string(to_beast(method_));
+    request.target(to_beast(path_));
+    request.version(11);
+    if (!authority_.empty() && request.find(http::field::host) == request.end()) {
+        request.set(http::field::host, to_beast(authority_));
+    }
+    if (!cookie_.empty()) {
+        request.set(http::field::cookie, to_beast(cookie_));
+    }
+    stream->header_bytes = header_block_.size();
+    stream->remote_closed = end_stream;
+    stream->read_started = Tracer::getInstance().enabled() ? Tracer::now() : 0;
+    streams_.push_back(std::move(stream));
+    h2_stream& opened = *streams_.back();
+
+    if (list_size > REQUEST_HEADER_LIMIT) {
+        refuse(opened, http::status::request_header_fields_too_large,
+               "Request header too large");
+    } else if (end_stream) {
+        dispatch(opened);
+    } else {
+        begin_body(opened);
+    }
+    return true;
+}
+
+bool h2_connection::on_settings(const h2_frame_header& header, std::string_view payload) {
+    if (header.stream_id != 0) {
+        connection_error(h2_error::protocol_error, "SETTINGS on a stream");
+        return false;
+    }
+    if (header.flags & H2_ACK) {
+        if (!payload.empty() || settings_) {
+            connection_error(h2_error::frame_size_error, "bad SETTINGS acknowledgement");
+            return false;
+        }
+        return true;
+    }
+    if (payload.size() % 6 != 0) {
+        connection_error(h2_error::frame_size_error, "bad SETTINGS");
+        return false;
+    }
+    settings_ = false;
+    if (!apply_settings(payload)) {
+        return false;
+    }
+    append_frame_header(control_, 0, h2_frame::settings, H2_ACK, 0);
+    return true;
+}
+
+bool h2_connection::apply_settings(std::string_view payload) {
+    for (std::size_t i = 0; i + 6 <= payload.size(); i += 6) {
+        std::uint32_t value = read_u32(payload.data() + i + 2);
+        switch (static_cast<h2_setting>(read_u16(payload.data() + i))) {
+            case h2_setting::header_table_size:
+                encoder_.set_max_size(value);
+                break;
+            case h2_setting::enable_push:
+                if (value > 1) {
+                    connection_error(h2_error::protocol_error, "bad SETTINGS_ENABLE_PUSH");
+                    return false;
+                }
+                break;
+            case h2_setting::initial_window_size: {
+                if (value > H2_MAX_WINDOW) {
+                    connection_error(h2_error::flow_control_error, "window too large");
+                    return false;
+                }
+                // Applies to the streams already open as well
+                std::int64_t change = std::int64_t(value) - initial_window_;
+                initial_window_ = value;
+                for (auto& stream : streams_) {
+                    stream->send_window += change;
+                    if (stream->send_window > H2_MAX_WINDOW) {
+                        connection_error(h2_error::flow_control_error, "window too large");
+                        return false;
+                    }
+                }
+                break;
+            }
+            case h2_setting::max_frame_size:
+                if (value < H2_DEFAULT_FRAME_SIZE || value > 0xffffff) {
+                    connection_error(h2_error::protocol_error, "bad SETTINGS_MAX_FRAME_SIZE");
+                    return false;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+bool h2_connection::on_window_update(const h2_frame_header& header, std::string_view payload) {
+    if (payload.size() != 4) {
+        connection_error(h2_error::frame_size_error, "bad WINDOW_UPDATE");
+        return false;
+    }
+    std::uint32_t increment = read_u32(payload.data()) & 0x7fffffff;
+    if (header.stream_id == 0) {
+        send_window_ += increment;
+        if (increment == 0 || send_window_ > H2_MAX_WINDOW) {
+            connection_error(increment ? h2_error::flow_control_error : h2_error::protocol_error,
+                             "bad WINDOW_UPDATE");
+            return false;
+        }
+        return true;
+    }
+    h2_stream* stream = find(header.stream_id);
+    if (!stream) {
+        return true;
+    }
+    stream->send_window += increment;
+    if (increment == 0 || stream->send_window > H2_MAX_WINDOW) {
+        reset_stream(*stream, increment ? h2_error::flow_control_error : h2_error::protocol_error);
+    }
+    return true;
+}
+
+void h2_connection::on_rst_stream(const h2_frame_header& header, std::string_view) {
+    h2_stream* stream = find(header.stream_id);
+    if (!stream) {
+        return;
+    }
+    // Nothing more goes either way, not even a RST_STREAM back
+    stream->remote_closed = true;
+    abandon(*stream);
+}
+
+h2_stream* h2_connection::find(std::uint32_t id) {
+    for (auto& stream : streams_) {
+        if (stream->id == id) {
+            return stream.get();
+        }
+    }
+    return nullptr;
+}
+
+std::unique_ptr<h2_stream> h2_connection::new_stream(std::uint32_t id) {
+    std::unique_ptr<h2_stream> stream;
+    if (free_.empty()) {
+        stream = std::make_unique<h2_stream>();
+    } else {
+        stream = std::move(free_.back());
+        free_.pop_back();
+    }
+    stream->id = id;
+    stream->send_window = initial_window_;
+    stream->receive_window = HTTP2_WINDOW;
+    return stream;
+}
+
+void h2_connection::unbuffer(h2_stream& stream) {
+    // The body is the handler's now, or no longer wanted
+    buffered_body_ -= stream.buffered;
+    stream.buffered = 0;
+}
+
+void h2_connection::release(std::size_t index) {
+    std::unique_ptr<h2_stream> stream = std::move(streams_[index]);
+    streams_.erase(streams_.begin() + index);
+    unbuffer(*stream);
+    stream->clear();
+    if (free_.size() < FREE_STREAMS) {
+        free_.push_back(std::move(stream));
+    }
+}
+
+void h2_connection::sweep() {
+    // Only between writes, which may point into any stream's response
+    bool released = false;
+    for (std::size_t i = 0; i < streams_.size();) {
+        h2_stream& stream = *streams_[i];
+        if (stream.local_closed && (stream.remote_closed || stream.reset) && !busy(stream)) {
+            release(i);
+            released = true;
+        } else {
+            ++i;
+        }
+    }
+    if (released && streams_.empty()) {
+        update_read_deadline();
+    }
+}
+
+void h2_connection::update_read_deadline() {
+    // While bodies are arriving the body timeout runs from each read; with
+    // no stream open the connection is idle, and otherwise it is waiting on
+    // this end
+    http_session& session = session_;
+    bool receiving = std::any_of(streams_.begin(), streams_.end(), [](const auto& stream) {
+        return !stream->remote_closed && !stream->reset;
+    });
+    if (receiving) {
+        session.read_phase_ = http_session::read_phase::body;
+        session.read_deadline_ = session.deadline(session.options_.timeouts.body);
+    } else if (streams_.empty() && !preface_ && !settings_) {
+        if (session.read_phase_ != http_session::read_phase::idle) {
+            session.read_phase_ = http_session::read_phase::idle;
+            session.read_deadline_ = session.deadline(session.options_.timeouts.idle);
+        }
+    } else if (!streams_.empty()) {
+        session.read_phase_ = http_session::read_phase::header;
+        session.read_deadline_ = 0;
+    }
+}
+
+void h2_connection::enter(h2_stream& stream) {
+    // The session routes and answers one request at a time; this one is it
+    http_session& session = session_;
+    session.h2_stream_ = &stream;
+    session.request_ = &*stream.request;
+    session.route_params_ = stream.params;
+    session.route_id_ = stream.route_id;
+    session.request_started_ = stream.started;
+    session.trace_id_ = stream.trace_id;
+    session.read_started_ = stream.read_started;
+}
+
+void h2_connection::leave() {
+    session_.h2_stream_ = nullptr;
+    session_.request_ = nullptr;
+}
+
+void h2_connection::count(h2_stream& stream, std::size_t bytes) {
+    // Entered: begin_request logs and counts the current request
+    session_.begin_request(bytes);
+    stream.counted = true;
+    stream.started = session_.request_started_;
+    stream.trace_id = session_.trace_id_;
+}
+
+void h2_connection::begin_body(h2_stream& stream) {
+    // As the session's on_header: the route decides how much body to take
+    // and where it goes, before any of it is read
+    enter(stream);
+    http_session& session = session_;
+    http_request& request = *stream.request;
+    auto body_route = Router::getInstance().bodyRoute(session, request);
+    stream.params = session.route_params_;
+    stream.route_id = session.route_id_;
+    BodyOptions options = body_route ? body_route->options : BodyOptions{};
+    stream.body_limit = options.body_limit ? options.body_limit : REQUEST_BODY_LIMIT;
+    if (body_route && body_route->proxy) {
+        // The body is buffered and forwarded with the header once it is
+        // complete, so it is held to the buffered limit; a length over it
+        // is refused before any of the body is sent
+        stream.body_limit = std::min<std::uint64_t>(stream.body_limit, REQUEST_BODY_LIMIT);
+    }
+
+    auto length = request.find(http::field::content_length);
+    if (length != request.end()) {
+        std::string_view text = to_string_view(length->value());
+        std::uint64_t value = 0;
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+            leave();
+            reset_stream(stream, h2_error::protocol_error);
+            return;
+        }
+        stream.content_length = value;
+    }
+    if (options.header_limit && stream.header_bytes > options.header_limit) {
+        leave();
+        refuse(stream, http::status::request_header_fields_too_large,
+               "Request header too large");
+        return;
+    }
+    if (stream.content_length && *stream.content_length > stream.body_limit) {
+        leave();
+        refuse(stream, http::status::payload_too_large, "Request body too large");
+        return;
+    }
+    if (beast::iequals(request[http::field::expect], "100-continue")) {
+        if (!options.expect_continue) {
+            leave();
+            refuse(stream, http::status::expectation_failed, "Expectation failed");
+            return;
+        }
+        send_continue(stream);
+    }
+
+    if (body_route && (body_route->upload || body_route->proxy)) {
+        // Checked now, as for HTTP/1.1, before any of the body is taken
+        count(stream, stream.header_bytes);
+        auto& limiter = RateLimiter::getInstance();
+        std::uint32_t retry_after = limiter.admitRequest(session.client_);
+        if (!retry_after) {
+            retry_after = limiter.admitRoute(session.client_, stream.route_id);
+        }
+        if (retry_after) {
+            session.routing_ = true;
+            session.send_too_many_requests(retry_after);
+            session.routing_ = false;
+            stream.discard = true;
+        } else if (body_route->proxy) {
+            stream.proxy = body_route->proxy;
+        } else {
+            // Its sink's on_complete may outlive the route table
+            stream.params.copy_names(stream.param_names);
+            session.route_params_ = stream.params;
+            session.routing_ = true;
+            stream.upload = body_route->upload(session, request);
+            session.routing_ = false;
+            stream.discard = !stream.upload;
+        }
+    }
+    leave();
+}
+
+void h2_connection::take_data(h2_stream& stream, std::string_view data) {
+    if (stream.discard || stream.reset || data.empty()) {
+        return;
+    }
+    stream.body_received += data.size();
+    if (stream.content_length && stream.body_received > *stream.content_length) {
+        // More than it said it would send (RFC 9113 8.1.1)
+        reset_stream(stream, h2_error::protocol_error);
+        return;
+    }
+    if (stream.body_received > stream.body_limit) {
+        if (stream.upload) {
+            stream.upload->on_error(http::error::body_limit);
+            stream.upload.reset();
+        }
+        refuse(stream, http::status::payload_too_large, "Request body too large");
+        return;
+    }
+    if (stream.upload) {
+        if (!stream.upload->on_data(data)) {
+            // The sink has had enough; answer now and drop the rest
+            finish_upload(stream);
+            stream.discard = true;
+        }
+        return;
+    }
+    // Window is handed back as soon as a body is buffered, so what all the
+    // streams may hold at once is bounded here
+    if (buffered_body_ + data.size() > HTTP2_BUFFERED_BODY_LIMIT) {
+        reset_stream(stream, h2_error::refused_stream);
+        return;
+    }
+    auto& body = stream.request->body();
+    body.commit(net::buffer_copy(body.prepare(data.size()), net::buffer(data.data(), data.size())));
+    stream.buffered += data.size();
+    buffered_body_ += data.size();
+}
+
+void h2_connection::end_request(h2_stream& stream) {
+    if (stream.discard || stream.reset) {
+        return;
+    }
+    if (stream.content_length && *stream.content_length != stream.body_received) {
+        reset_stream(stream, h2_error::protocol_error);
+        return;
+    }
+    if (stream.upload) {
+        finish_upload(stream);
+        return;
+    }
+    dispatch(stream);
+}
+
+void h2_connection::dispatch(h2_stream& stream) {
+    unbuffer(stream);
+    enter(stream);
+    http_session& session = session_;
+    if (!stream.counted) {
+        count(stream, stream.header_bytes + stream.body_received);
+    }
+    if (stream.proxy) {
+        session.routing_ = true;
+        session.proxy_request(stream.proxy);
+        session.routing_ = false;
+    } else {
+        session.route_request();
+    }
+    if (stream.trace_id) {
+        Tracer::getInstance().span("route", stream.trace_id, stream.started, Tracer::now());
+    }
+    leave();
+}
+
+void h2_connection::finish_upload(h2_stream& stream) {
+    enter(stream);
+    auto sink = std::move(stream.upload);
+    session_.routing_ = true;
+    sink->on_complete(session_, *stream.request);
+    session_.routing_ = false;
+    leave();
+}
+
+void h2_connection::refuse(h2_stream& stream, http::status status, const std::string& message) {
+    // The rest of the body is dropped; once the answer is out the stream is
+    // reset so the client stops sending it
+    enter(stream);
+    if (!stream.counted) {
+        count(stream, stream.header_bytes + stream.body_received);
+    }
+    session_.routing_ = true;
+    session_.send_error(status, message);
+    session_.routing_ = false;
+    stream.discard = true;
+    leave();
+}
+
+void h2_connection::send_continue(h2_stream& stream) {
+    block_.clear();
+    encoder_.begin_block(block_);
+    encoder_.encode_status(block_, 100);
+    append_frame_header(control_, block_.size(), h2_frame::headers, H2_END_HEADERS, stream.id);
+    control_ += block_;
+}
+
+void h2_connection::credit(h2_stream* stream, std::size_t bytes) {
+    // What the client sent has been taken; it may send as much again.
+    // Windows are topped up once half is used, not frame by frame.
+    receive_credit_ += bytes;
+    if (receive_credit_ >= HTTP2_WINDOW / 2) {
+        queue_window_update(0, receive_credit_);
+        receive_window_ += receive_credit_;
+        receive_credit_ = 0;
+    }
+    if (stream && !stream->remote_closed && !stream->reset) {
+        stream->receive_credit += bytes;
+        if (stream->receive_credit >= HTTP2_WINDOW / 2) {
+            queue_window_update(stream->id, stream->receive_credit);
+            stream->receive_window += stream->receive_credit;
+            stream->receive_credit = 0;
+        }
+    }
+}
+
+void h2_connection::connection_error(h2_error code, const char* reason) {
+    getGlobalLogger().log(std::string("HTTP/2 connection error: ") + reason);
+    goaway(code);
+    stopped_ = true;
+    abandon_all();
+}
+
+void h2_connection::goaway(h2_error code) {
+    if (goaway_) {
+        return;
+    }
+    goaway_ = true;
+    session_.closing_ = true;
+    append_frame_header(control_, 8, h2_frame::goaway, 0, 0);
+    append_u32(control_, last_stream_id_);
+    append_u32(control_, static_cast<std::uint32_t>(code));
+}
+
+void h2_connection::reset_stream(h2_stream& stream, h2_error code) {
+    if (!stream.reset) {
+        queue_rst_stream(stream.id, code);
+    }
+    abandon(stream);
+}
+
+void h2_connection::abandon(h2_stream& stream) {
+    // Stops whatever is working on the stream; it is released once nothing
+    // refers to it any more
+    stream.reset = true;
+    stream.local_closed = true;
+    stream.discard = true;
+    unbuffer(stream);
+    if (stream.upload) {
+        stream.upload->on_error(net::error::operation_aborted);
+        stream.upload.reset();
+    }
+    OutboundResponse& response = stream.response;
+    if (response.type == OutboundResponse::kind::pending && stream.async) {
+        stream.async->cancel();
+    }
+    if (response.type == OutboundResponse::kind::proxied && response.proxy.connection) {
+        // Closing it fails whatever step the backend is in
+        response.proxy.cancelled = true;
+        beast::error_code ec;
+        response.proxy.connection->socket.close(ec);
+    }
+}
+
+void h2_connection::abandon_all() {
+    // A cancelled handler may finish inline; its write waits until the
+    // streams have all been gone through
+    bool processing = processing_;
+    processing_ = true;
+    for (auto& stream : streams_) {
+        if (!stream->reset) {
+            abandon(*stream);
+        }
+    }
+    processing_ = processing;
+}
+
+bool h2_connection::busy(const h2_stream& stream) const {
+    const OutboundResponse& response = stream.response;
+    return stream.reading || response.type == OutboundResponse::kind::pending ||
+           (response.type == OutboundResponse::kind::proxied && !response.proxy.ready);
+}
+
+void h2_connection::queue_window_update(std::uint32_t id, std::uint32_t increment) {
+    append_frame_header(control_, 4, h2_frame::window_update, 0, id);
+    append_u32(control_, increment);
+}
+
+void h2_connection::queue_rst_stream(std::uint32_t id, h2_error code) {
+    append_frame_header(control_, 4, h2_frame::rst_stream, 0, id);
+    append_u32(control_, static_cast<std::uint32_t>(code));
+}
+
+void h2_connection::queue_response(h2_stream& stream) {
+    stream.routed = true;
+}
+
+void h2_connection::drop_response(OutboundResponse& response) {
+    response.type = OutboundResponse::kind::buffered;
+    for (auto& stream : streams_) {
+        if (&stream->response == &response) {
+            if (!stream->reset) {
+                reset_stream(*stream, h2_error::internal_error);
+            }
+            break;
+        }
+    }
+    do_write();
+}
+
+void h2_connection::check_timeouts(std::uint64_t now) {
+    http_session& session = session_;
+    if (shut_down_) {
+        // Waiting for the client to close after GOAWAY
+        if (session.reading_ && session.read_deadline_ && now >= session.read_deadline_) {
+            session.on_timeout("idle");
+        }
+        return;
+    }
+    if (stopped_ && !session.writing_) {
+        return;
+    }
+    // A write that is not progressing, or data held back by windows the
+    // client does not open
+    if (session.write_deadline_ && now >= session.write_deadline_) {
+        session.on_timeout("write");
+        return;
+    }
+    if (session.reading_ && session.read_deadline_ && now >= session.read_deadline_) {
+        session.read_deadline_ = 0;
+        Metrics::getInstance().countTimeout();
+        if (session.read_phase_ == http_session::read_phase::idle) {
+            getGlobalLogger().log("Closing connection: idle timeout");
+            goaway(h2_error::no_error);
+            do_write();
+            return;
+        }
+        if (session.read_phase_ == http_session::read_phase::header) {
+            getGlobalLogger().log("Closing connection: header timeout");
+            connection_error(h2_error::settings_timeout, "no SETTINGS from the client");
+            do_write();
+            return;
+        }
+        // Only the streams waiting on their bodies are given up on
+        getGlobalLogger().log("Resetting HTTP/2 streams: body timeout");
+        processing_ = true;
+        for (auto& stream : streams_) {
+            if (!stream->remote_closed && !stream->reset) {
+                reset_stream(*stream, h2_error::cancel);
+            }
+        }
+        processing_ = false;
+        do_write();
+        return;
+    }
+
+    // A connection idle for a whole pass gives its buffers back
+    bool idle = session.reading_ && streams_.empty() && !session.writing_ && control_.empty() &&
+                session.buffer_.size() == 0 && !session.parked_ && !session.closing_;
+    if (idle && session.park_pending_) {
+        session.park();
+    }
+    session.park_pending_ = idle;
+}
+
+bool h2_connection::startable(const h2_stream& stream) const {
+    if (!stream.routed || stream.headers_sent || stream.local_closed) {
+        return false;
+    }
+    switch (stream.response.type) {
+        case OutboundResponse::kind::pending:
+            return false;
+        case OutboundResponse::kind::proxied:
+            return stream.response.proxy.ready;
+        default:
+            return true;
+    }
+}
+
+bool h2_connection::sending(const h2_stream& stream) const {
+    return stream.headers_sent && !stream.local_closed;
+}
+
+void h2_connection::write_headers(h2_stream& stream) {
+    // The session serialized the header as HTTP/1.1; it is re-encoded here
+    OutboundResponse& response = stream.response;
+    std::string_view header;
+    if (response.type == OutboundResponse::kind::buffered) {
+        // Every buffered response starts with its whole header in its
+        // first buffer, often followed by the body
+        std::string_view first;
+        if (!response.buffers.empty()) {
+            first = std::string_view(static_cast<const char*>(response.buffers[0].data()),
+                                     response.buffers[0].size());
+        }
+        std::size_t end = first.find("\r\n\r\n");
+        end = end == std::string_view::npos ? first.size() : end + 4;
+        header = first.substr(0, end);
+        stream.data = first.data() + end;
+        stream.data_size = first.size() - end;
+        stream.next_buffer = 1;
+    } else {
+        header = std::string_view(response.storage)
+                     .substr(response.header_begin, response.header_end - response.header_begin);
+        if (response.type == OutboundResponse::kind::chunked_file && !response.head) {
+            // Read to the end; DATA frames need no chunk framing
+            response.file.segments.assign(1, {0, 0, 0, std::numeric_limits<std::uint64_t>::max()});
+            stream.until_eof = true;
+        }
+    }
+    if (response.trace_id) {
+        session_.trace_write_start(response);
+    }
+
+    unsigned status = 0;
+    if (header.size() > 12) {
+        std::from_chars(header.data() + 9, header.data() + 12, status);
+    }
+    block_.clear();
+    encoder_.begin_block(block_);
+    encoder_.encode_status(block_, status);
+    std::size_t pos = header.find("\r\n");
+    while (pos != std::string_view::npos) {
+        pos += 2;
+        std::size_t end = header.find("\r\n", pos);
+        if (end == std::string_view::npos || end == pos) {
+            break;
+        }
+        std::string_view line = header.substr(pos, end - pos);
+        pos = end;
+        std::size_t colon = line.find(':');
+        if (colon == std::string_view::npos) {
+            continue;
+        }
+        name_.assign(line.data(), colon);
+        std::transform(name_.begin(), name_.end(), name_.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        if (is_connection_specific(name_)) {
+            continue;
+        }
+        encoder_.encode(block_, name_, trim(line.substr(colon + 1)));
+    }
+    stream.headers_sent = true;
+    bool end_stream = fill(stream) == source::finished;
+
+    // HEADERS, then CONTINUATION for whatever does not fit in a frame
+    std::size_t offset = 0;
+    h2_frame type = h2_frame::headers;
+    do {
+        std::size_t size = std::min(block_.size() - offset, H2_DEFAULT_FRAME_SIZE);
+        std::uint8_t flags = offset + size == block_.size() ? H2_END_HEADERS : 0;
+        if (type == h2_frame::headers && end_stream) {
+            flags |= H2_END_STREAM;
+        }
+        append_frame_header(frames_, size, type, flags, stream.id);
+        frames_.append(block_, offset, size);
+        offset += size;
+        type = h2_frame::continuation;
+    } while (offset < block_.size());
+    if (end_stream) {
+        stream.local_closed = true;
+        finished_.push_back(&stream);
+    }
+}
+
+h2_connection::source h2_connection::fill(h2_stream& stream) {
+    // Points data at the next piece of the body that is already in memory
+    if (stream.data_size > 0) {
+        return source::ready;
+    }
+    OutboundResponse& response = stream.response;
+    switch (response.type) {
+        case OutboundResponse::kind::buffered:
+            while (stream.next_buffer < response.buffers.size()) {
+                net::const_buffer buffer = response.buffers[stream.next_buffer++];
+                if (buffer.size() > 0) {
+                    stream.data = static_cast<const char*>(buffer.data());
+                    stream.data_size = buffer.size();
+                    return source::ready;
+                }
+            }
+            return source::finished;
+        case OutboundResponse::kind::proxied:
+            return response.proxy.parser->is_done() ? source::finished : source::read;
+        default:
+            break;
+    }
+
+    // Files: each segment's multipart framing, then its bytes, then the
+    // closing delimiter
+    FileTransfer& file = response.file;
+    for (;;) {
+        if (file.remaining > 0) {
+            return source::read;
+        }
+        if (file.next_segment == file.segments.size()) {
+            break;
+        }
+        const FileSegment& segment = file.segments[file.next_segment++];
+        file.offset = segment.offset;
+        file.remaining = segment.length;
+        if (file.fd < 0 && file.remaining > 0) {
+            file.file_stream.clear();
+            file.file_stream.seekg(file.offset);
+        }
+        if (segment.prefix_begin != segment.prefix_end) {
+            stream.data = response.storage.data() + segment.prefix_begin;
+            stream.data_size = segment.prefix_end - segment.prefix_begin;
+            return source::ready;
+        }
+    }
+    if (!stream.trailer_sent && response.trailer_begin != response.trailer_end) {
+        stream.trailer_sent = true;
+        stream.data = response.storage.data() + response.trailer_begin;
+        stream.data_size = response.trailer_end - response.trailer_begin;
+        return source::ready;
+    }
+    return source::finished;
+}
+
+void h2_connection::start_reads() {
+    for (auto& stream : streams_) {
+        if (!sending(*stream) || stream->reading || fill(*stream) != source::read) {
+            continue;
+        }
+        if (stream->response.type == OutboundResponse::kind::proxied) {
+            read_upstream(*stream);
+        } else {
+            read_file(*stream);
+        }
+    }
+}
+
+void h2_connection::read_file(h2_stream& stream) {
+    // Never sendfile: the body has to be cut into frames in user space
+    FileTransfer& file = stream.response.file;
+    file.buffer.resize(FILE_READ_SIZE);
+    std::size_t size =
+        static_cast<std::size_t>(std::min<std::uint64_t>(file.buffer.size(), file.remaining));
+    stream.reading = true;
+    h2_stream* reader = &stream;
+    std::uint64_t trace_id = stream.response.trace_id;
+    session_.run_file_io(
+        [&file, size, trace_id] {
+            TraceScope trace("file-read", trace_id);
+#ifdef __linux__
+            if (file.fd >= 0) {
+                ssize_t n = ::pread(file.fd, file.buffer.data(), size, file.offset);
+                return std::make_pair(static_cast<std::int64_t>(n), n < 0 ? errno : 0);
+            }
+#endif
+            file.file_stream.read(file.buffer.data(), size);
+            return std::make_pair(static_cast<std::int64_t>(file.file_stream.gcount()), 0);
+        },
+        [this, reader](std::pair<std::int64_t, int> result) {
+            on_file_read(*reader, result.first, result.second);
+        });
+}
+
+void h2_connection::on_file_read(h2_stream& stream, std::int64_t bytes, int error) {
+    stream.reading = false;
+    FileTransfer& file = stream.response.file;
+    if (!stream.reset) {
+        if (bytes > 0) {
+            file.offset += bytes;
+            file.remaining -= bytes;
+            stream.data = file.buffer.data();
+            stream.data_size = bytes;
+            if (stream.until_eof && file.file_stream.eof()) {
+                file.remaining = 0;
+            }
+        } else if (bytes == 0 && stream.until_eof) {
+            file.remaining = 0;
+        } else {
+            // The body cannot be finished
+            getGlobalLogger().log(std::string("Error reading file: ") +
+                                  (error ? std::strerror(error) : "unexpected end of file"));
+            reset_stream(stream, h2_error::internal_error);
+        }
+    }
+    do_write();
+}
+
+void h2_connection::read_upstream(h2_stream& stream) {
+    ProxyTransfer& proxy = stream.response.proxy;
+    proxy.buffer.resize(PROXY_BUFFER_SIZE);
+    auto& body = proxy.parser->get().body();
+    body.data = proxy.buffer.data();
+    body.size = proxy.buffer.size();
+    proxy.deadline = session_.deadline(proxy.upstream->options().response_timeout);
+    stream.reading = true;
+    auto self = session_.shared_from_this();
+    h2_stream* reader = &stream;
+    http::async_read_some(proxy.connection->socket, proxy.connection->buffer, *proxy.parser,
+                          session_.upstream_handler(
+                              [self, this, reader](beast::error_code ec, std::size_t) {
+                                  on_upstream_read(*reader, ec);
+                              }));
+}
+
+void h2_connection::on_upstream_read(h2_stream& stream, beast::error_code ec) {
+    stream.reading = false;
+    ProxyTransfer& proxy = stream.response.proxy;
+    proxy.deadline = 0;
+    if (ec == http::error::need_buffer) {
+        ec = {};  // the buffer is full
+    }
+    if (ec) {
+        if (!proxy.cancelled) {
+            proxy.upstream->failed(*proxy.backend, coarse_now());
+            getGlobalLogger().logError("Backend " + proxy.backend->address + ": ", ec);
+        }
+        proxy.connection.reset();
+        if (!stream.reset) {
+            reset_stream(stream, h2_error::internal_error);
+        }
+        do_write();
+        return;
+    }
+    if (stream.reset) {
+        proxy.connection.reset();
+        do_write();
+        return;
+    }
+
+    stream.data = proxy.buffer.data();
+    stream.data_size = proxy.buffer.size() - proxy.parser->get().body().size;
+    if (proxy.parser->is_done() && proxy.parser->keep_alive()) {
+        // As finish_proxy: the connection can take the next request for its
+        // backend
+        session_.upstreams_.release(std::move(proxy.connection));
+    }
+    do_write();
+}
+
+void h2_connection::write_data(h2_stream& stream, const char* data, std::size_t size,
+                               bool last) {
+    append_frame_header(frames_, size, h2_frame::data, last ? H2_END_STREAM : 0, stream.id);
+    if (size > 0) {
+        flush_frames();
+        pieces_.push_back({data, 0, size});
+    }
+    if (last) {
+        stream.local_closed = true;
+        finished_.push_back(&stream);
+    }
+}
+
+void h2_connection::flush_frames() {
+    if (frames_.size() > frames_flushed_) {
+        pieces_.push_back({nullptr, frames_flushed_, frames_.size() - frames_flushed_});
+        frames_flushed_ = frames_.size();
+    }
+}
+
+void h2_connection::do_write() {
+    http_session& session = session_;
+    if (session.writing_ || processing_ || shut_down_) {
+        return;
+    }
+    processing_ = true;
+    sweep();
+
+    // Control frames first, then the headers of responses that are ready,
+    // in the order their streams were opened
+    frames_.clear();
+    frames_.swap(control_);
+    frames_flushed_ = 0;
+    pieces_.clear();
+    for (auto& stream : streams_) {
+        if (startable(*stream)) {
+            write_headers(*stream);
+        }
+    }
+    start_reads();
+
+    // Then DATA, a frame per stream per round, so every stream with a body
+    // to send moves at the same pace
+    std::size_t batch = frames_.size();
+    std::size_t count = streams_.size();
+    stalled_ = false;
+    bool progress = true;
+    while (progress && batch < WRITE_BATCH) {
+        progress = false;
+        for (std::size_t i = 0; i < count && batch < WRITE_BATCH; ++i) {
+            h2_stream& stream = *streams_[(next_turn_ + i) % count];
+            if (!sending(stream)) {
+                continue;
+            }
+            source state = fill(stream);
+            if (state == source::read) {
+                continue;
+            }
+            if (state == source::finished) {
+                write_data(stream, nullptr, 0, true);
+                batch += H2_FRAME_HEADER_SIZE;
+                progress = true;
+                continue;
+            }
+            std::int64_t window = std::min(send_window_, stream.send_window);
+            if (window <= 0) {
+                stalled_ = true;
+                continue;
+            }
+            std::size_t size = std::min({stream.data_size, H2_DEFAULT_FRAME_SIZE,
+                                         static_cast<std::size_t>(window)});
+            const char* data = stream.data;
+            stream.data += size;
+            stream.data_size -= size;
+            send_window_ -= size;
+            stream.send_window -= size;
+            bool last = stream.data_size == 0 && fill(stream) == source::finished;
+            write_data(stream, data, size, last);
+            batch += H2_FRAME_HEADER_SIZE + size;
+            progress = true;
+        }
+    }
+    if (count > 0) {
+        next_turn_ = (next_turn_ + 1) % count;
+    }
+    flush_frames();
+    processing_ = false;
+
+    if (pieces_.empty()) {
+        // Only waiting on the client's windows counts against the write
+        // timeout
+        if (!stalled_) {
+            session.write_deadline_ = 0;
+        } else if (!session.write_deadline_) {
+            session.arm_write_deadline();
+        }
+        maybe_close();
+        return;
+    }
+
+    buffers_.clear();
+    for (const piece& p : pieces_) {
+        buffers_.emplace_back(p.data ? p.data : frames_.data() + p.offset, p.size);
+    }
+    session.writing_ = true;
+    session.arm_write_deadline();
+    auto self = session.shared_from_this();
+    net::async_write(
+        session.stream_, beast::span<const net::const_buffer>(buffers_.data(), buffers_.size()),
+        bind_pool(session.pool_, [self, this](beast::error_code ec, std::size_t bytes) {
+            Metrics::getInstance().countBytesOut(bytes);
+            on_write(ec, bytes);
+        }));
+}
+
+void h2_connection::on_write(beast::error_code ec, std::size_t) {
+    http_session& session = session_;
+    session.writing_ = false;
+    if (ec) {
+        // Frames may be half written; nothing more can be sent
+        getGlobalLogger().logError("Error: ", ec);
+        session.closing_ = true;
+        stopped_ = true;
+        shut_down_ = true;
+        finished_.clear();
+        abandon_all();
+        session.socket_->close(ec);
+        return;
+    }
+
+    for (h2_stream* stream : finished_) {
+        if (stream->response.trace_id) {
+            Tracer::getInstance().span("write", stream->response.trace_id,
+                                       stream->response.trace_mark, Tracer::now());
+        }
+        if (!stream->remote_closed && !stream->reset) {
+            // Answered before its body was in; the rest is not wanted
+            reset_stream(*stream, h2_error::no_error);
+        }
+    }
+    finished_.clear();
+    do_write();
+    resume_reading();
+}
+
+void h2_connection::maybe_close() {
+    // Once the client has gone quiet or been sent GOAWAY, and everything
+    // owed to it is out
+    http_session& session = session_;
+    if (shut_down_ || !session.closing_ || !streams_.empty() || session.writing_ ||
+        !control_.empty()) {
+        return;
+    }
+    shut_down_ = true;
+    session.stream_.shutdown();
+    beast::error_code ec;
+    session.socket_->shutdown(tcp::socket::shutdown_send, ec);
+    session.read_phase_ = http_session::read_phase::idle;
+    session.read_deadline_ = session.deadline(session.options_.timeouts.idle);
+}
@@ -0,0 +1,292 @@
+// http2.hpp
+#ifndef HTTP2_HPP
+#define HTTP2_HPP
+
+#include <boost/asio/buffer.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hpack.hpp"
+#include "http_session.hpp"
+
+// HTTP/2 (RFC 9113) framing. A frame is a 9-byte header and a payload of
+// at most the receiver's SETTINGS_MAX_FRAME_SIZE.
+
+enum class h2_frame : std::uint8_t {
+    data = 0x0,
+    headers = 0x1,
+    priority = 0x2,
+    rst_stream = 0x3,
+    settings = 0x4,
+    push_promise = 0x5,
+    ping = 0x6,
+    goaway = 0x7,
+    window_update = 0x8,
+    continuation = 0x9,
+};
+
+enum class h2_error : std::uint32_t {
+    no_error = 0x0,
+    protocol_error = 0x1,
+    internal_error = 0x2,
+    flow_control_error = 0x3,
+    settings_timeout = 0x4,
+    stream_closed = 0x5,
+    frame_size_error = 0x6,
+    refused_stream = 0x7,
+    cancel = 0x8,
+    compression_error = 0x9,
+    enhance_your_calm = 0xb,
+};
+
+enum class h2_setting : std::uint16_t {
+    header_table_size = 0x1,
+    enable_push = 0x2,
+    max_concurrent_streams = 0x3,
+    initial_window_size = 0x4,
+    max_frame_size = 0x5,
+    max_header_list_size = 0x6,
+};
+
+// Frame flags
+constexpr std::uint8_t H2_END_STREAM = 0x1;
+constexpr std::uint8_t H2_ACK = 0x1;
+constexpr std::uint8_t H2_END_HEADERS = 0x4;
+constexpr std::uint8_t H2_PADDED = 0x8;
+constexpr std::uint8_t H2_PRIORITY = 0x20;
+
+constexpr std::size_t H2_FRAME_HEADER_SIZE = 9;
+// SETTINGS_MAX_FRAME_SIZE until changed, and the most this end accepts
+constexpr std::size_t H2_DEFAULT_FRAME_SIZE = 16384;
+constexpr std::int64_t H2_DEFAULT_WINDOW = 65535;
+constexpr std::int64_t H2_MAX_WINDOW = 0x7fffffff;
+
+// What a client sends first, before its SETTINGS
+constexpr std::string_view H2_PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+struct h2_frame_header {
+    std::uint32_t length = 0;
+    h2_frame type = h2_frame::data;
+    std::uint8_t flags = 0;
+    std::uint32_t stream_id = 0;
+};
+
+h2_frame_header parse_frame_header(const std::uint8_t* in);
+void append_frame_header(std::string& out, std::size_t length, h2_frame type,
+                         std::uint8_t flags, std::uint32_t stream_id);
+
+// One request and its response on an HTTP/2 connection. The response is
+// built by the session into the stream's own OutboundResponse, as an
+// HTTP/1.1 one would be into a ring slot. Streams are kept for reuse by
+// their connection, so their storage stays warm.
+struct h2_stream {
+    std::uint32_t id = 0;
+    std::optional<http_request> request;
+    RouteParams params;             // the route's, for an upload sink's on_complete
+    std::string param_names;        // params's names, copied for an upload
+    std::uint32_t route_id = 0;
+    std::uint64_t started = 0;      // Metrics::now() once the request was counted
+    std::uint64_t trace_id = 0;
+    std::uint64_t read_started = 0; // Tracer::now() at its HEADERS, if tracing is on
+    std::size_t header_bytes = 0;   // its header block, as it came over the wire
+    OutboundResponse response;
+
+    // The request body
+    std::unique_ptr<UploadSink> upload;
+    std::shared_ptr<Upstream> proxy;  // forwarded once the body is in
+    std::optional<std::uint64_t> content_length;
+    std::uint64_t body_limit = 0;
+    std::uint64_t body_received = 0;
+    std::size_t buffered = 0;         // of it, held here until the request is dispatched
+    std::int64_t receive_window = 0;  // what the client may still send
+    std::uint32_t receive_credit = 0; // consumed, not yet handed back
+    // The coroutine handler answering it; valid while response is pending
+    async_request* async = nullptr;
+
+    // The response body: DATA frames are cut from data, which points into
+    // the response's buffers, its storage or its file or backend buffer
+    std::int64_t send_window = 0;
+    std::size_t next_buffer = 0;    // buffered responses: the next of buffers
+    const char* data = nullptr;
+    std::size_t data_size = 0;
+    bool until_eof = false;         // a whole file of unknown length
+    bool trailer_sent = false;      // multipart closing delimiter
+
+    bool counted = false;           // begin_request has seen it
+    bool remote_closed = false;     // END_STREAM received
+    bool routed = false;            // a response is queued or pending
+    bool headers_sent = false;
+    bool local_closed = false;      // END_STREAM or RST_STREAM sent, or abandoned
+    bool reset = false;             // abandoned; dropped once nothing refers to it
+    bool discard = false;           // answered early; the rest of the body is dropped
+    bool reading = false;           // a file or backend read into the response is out
+
+    void clear();
+};
+
+// Runs an http_session's connection once it has switched to HTTP/2, from
+// the client preface (prior knowledge, or ALPN "h2" over TLS) or an
+// "Upgrade: h2c" request.
+//
+// Requests are routed through the session exactly as HTTP/1.1 ones are, so
+// every handler works unchanged; the session builds each response into
+// its stream's slot, and here its serialized header is re-encoded as a
+// HEADERS block and its body cut into DATA frames. Every stream with data
+// ready gets a frame in turn, within the flow control windows, so a large
+// file does not hold up the small responses beside it. Frames from many
+// streams go out in one gather write.
+//
+// Owned by its session and pooled with it; runs on the session's executor.
+class h2_connection {
+public:
+    explicit h2_connection(http_session& session);
+    h2_connection(const h2_connection&) = delete;
+    h2_connection& operator=(const h2_connection&) = delete;
+
+    // An "Upgrade: h2c" request this end can take up
+    static bool wants_upgrade(const http_request& request);
+
+    // Takes the connection over, with whatever the session has buffered.
+    // upgraded is the request that asked for h2c, answered as stream 1;
+    // null when the client opened with the preface.
+    void start(http_request* upgraded, std::size_t header_bytes);
+    // Forgets the connection, keeping storage for the next one
+    void reset();
+
+    // The session has queued or reserved the stream's response
+    void queue_response(h2_stream& stream);
+    // The work behind a response has been given up on; drops its stream
+    void drop_response(OutboundResponse& response);
+    void do_write();
+    void check_timeouts(std::uint64_t now);
+
+    template <class Fn>
+    void for_each_response(Fn fn) {
+        for (auto& stream : streams_) {
+            fn(stream->response);
+        }
+    }
+
+private:
+    enum class source { ready, read, finished };
+
+    http_session& session_;
+    hpack_decoder decoder_;
+    hpack_encoder encoder_;
+    std::vector<std::unique_ptr<h2_stream>> streams_;  // open ones, oldest first
+    std::vector<std::unique_ptr<h2_stream>> free_;
+    std::uint32_t last_stream_id_ = 0;  // highest the client has opened
+    bool preface_ = false;              // the client's preface is still to come
+    bool settings_ = false;             // and its first frame, SETTINGS
+    bool processing_ = false;           // frames or a write are being worked through
+    bool stopped_ = false;              // nothing more is read from the client
+    bool goaway_ = false;               // sent; the client opens no more streams
+    bool shut_down_ = false;            // the sending side is closed
+    bool read_paused_ = false;          // control_ is over HTTP2_CONTROL_LIMIT
+    std::size_t buffered_body_ = 0;     // streams' buffered, summed
+
+    // A header block split across HEADERS and CONTINUATION frames
+    std::uint32_t continuation_ = 0;
+    bool continuation_end_stream_ = false;
+    std::string header_block_;
+
+    // What the client lets this end send. Frames stay at the default size
+    // whatever it allows, so streams interleave finely.
+    std::int64_t initial_window_ = H2_DEFAULT_WINDOW;
+    std::int64_t send_window_ = H2_DEFAULT_WINDOW;
+    // What the client may send on the connection
+    std::int64_t receive_window_ = H2_DEFAULT_WINDOW;
+    std::uint32_t receive_credit_ = 0;
+
+    // Output. Frames queued between writes go in control_ and out first in
+    // the next write; frames_ holds the frame headers and header blocks of
+    // the write being built or in progress, and pieces_ lays it out with
+    // the DATA payloads, which stay where they are.
+    struct piece {
+        const char* data;   // null: [offset, offset + size) of frames_
+        std::size_t offset;
+        std::size_t size;
+    };
+    std::string control_;
+    std::string frames_;
+    std::size_t frames_flushed_ = 0;
+    std::vector<piece> pieces_;
+    std::vector<boost::asio::const_buffer> buffers_;
+    std::vector<h2_stream*> finished_;  // their last frame is in the write
+    std::size_t next_turn_ = 0;         // stream that goes first in the next round
+    bool stalled_ = false;              // data waits on the client's windows
+
+    // Scratch, kept for its capacity
+    std::string block_;
+    std::string name_;
+    std::string method_;
+    std::string path_;
+    std::string authority_;
+    std::string cookie_;
+
+    void do_read();
+    void resume_reading();
+    void on_read(boost::beast::error_code ec, std::size_t bytes);
+    void wait_readable();
+    void process();
+    bool handle_frame(const h2_frame_header& header, std::string_view payload);
+    bool on_data(const h2_frame_header& header, std::string_view payload);
+    bool on_headers(const h2_frame_header& header, std::string_view payload);
+    bool on_header_block(std::uint32_t id, bool end_stream);
+    bool on_settings(const h2_frame_header& header, std::string_view payload);
+    bool apply_settings(std::string_view payload);
+    bool on_window_update(const h2_frame_header& header, std::string_view payload);
+    void on_rst_stream(const h2_frame_header& header, std::string_view payload);
+
+    h2_stream* find(std::uint32_t id);
+    std::unique_ptr<h2_stream> new_stream(std::uint32_t id);
+    void release(std::size_t index);
+    void unbuffer(h2_stream& stream);
+    void sweep();
+    void update_read_deadline();
+
+    // Requests
+    void enter(h2_stream& stream);
+    void leave();
+    void count(h2_stream& stream, std::size_t bytes);
+    void begin_body(h2_stream& stream);
+    void take_data(h2_stream& stream, std::string_view data);
+    void end_request(h2_stream& stream);
+    void dispatch(h2_stream& stream);
+    void finish_upload(h2_stream& stream);
+    void refuse(h2_stream& stream, http::status status, const std::string& message);
+    void send_continue(h2_stream& stream);
+
+    // Flow control and errors
+    void credit(h2_stream* stream, std::size_t bytes);
+    void connection_error(h2_error code, const char* reason);
+    void goaway(h2_error code);
+    void reset_stream(h2_stream& stream, h2_error code);
+    void abandon(h2_stream& stream);
+    void abandon_all();
+    bool busy(const h2_stream& stream) const;
+    void queue_window_update(std::uint32_t id, std::uint32_t increment);
+    void queue_rst_stream(std::uint32_t id, h2_error code);
+
+    // Responses
+    bool startable(const h2_stream& stream) const;
+    bool sending(const h2_stream& stream) const;
+    void write_headers(h2_stream& stream);
+    source fill(h2_stream& stream);
+    void start_reads();
+    void read_file(h2_stream& stream);
+    void on_file_read(h2_stream& stream, std::int64_t bytes, int error);
+    void read_upstream(h2_stream& stream);
+    void on_upstream_read(h2_stream& stream, boost::beast::error_code ec);
+    void write_data(h2_stream& stream, const char* data, std::size_t size, bool last);
+    void flush_frames();
+    void on_write(boost::beast::error_code ec, std::size_t bytes);
+    void maybe_close();
+};
+
+#endif  // HTTP2_HPP
@@ -0,0 +1,16 @@
+// http_request.hpp
+#ifndef HTTP_REQUEST_HPP
+#define HTTP_REQUEST_HPP
+
+#include <boost/beast/http.hpp>
+
+#include "memory_pool.hpp"
+
+// The request type handed to route handlers. Its header fields are
+// allocated from the owning session's memory_pool, so parsing one request
+// after another on a connection reuses the same memory.
+using http_request = boost::beast::http::request<
+    boost::beast::http::dynamic_body,
+    boost::beast::http::basic_fields<pool_allocator<char>>>;
+
+#endif  // HTTP_REQUEST_HPP
@@ -1,74 +1,305 @@
-#include "http_server.hpp"
-
-#include <iostream>
-
-#include "globals.hpp"
-#include "http_session.hpp"
-
-#define isDevMode 1
-
-http_server::http_server(
-    std::vector<std::reference_wrapper<net::io_context>>& io_contexts,
-    tcp::endpoint endpoint)
-    : io_contexts_(io_contexts),
-      acceptor_(net::make_strand(io_contexts.front().get())),
-      next_io_context_(0) {
-  beast::error_code ec;
-
-  // Open the acceptor
-  acceptor_.open(endpoint.protocol(), ec);
-  if (ec) {
-    throw std::runtime_error("Failed to open acceptor: " + ec.message());
-  }
-
-#if isDevMode
-  acceptor_.set_option(net::socket_base::reuse_address(true), ec);
-  if (ec) {
-    throw std::runtime_error("Failed to set SO_REUSEADDR: " + ec.message());
-  }
-#endif
-
-  // Bind to the server address
-  acceptor_.bind(endpoint, ec);
-  if (ec) {
-    throw std::runtime_error("Failed to bind: " + ec.message());
-  }
-
-  // Start listening for connections
-  acceptor_.listen(net::socket_base::max_listen_connections, ec);
-  if (ec) {
-    throw std::runtime_error("Failed to listen: " + ec.message());
-  }
-}
-
-// Start accepting incoming connections
-void http_server::run() { do_accept(); }
-
-void http_server::stop() {
-  // Close the acceptor
-  beast::error_code ec;
-  acceptor_.close(ec);
-  if (ec) {
-    // Log the error
-    getGlobalLogger().log("Failed to close acceptor: " + ec.message());
-  }
-
-  // Stop the io_context
-  for (auto& ctx : io_contexts_) {
-    ctx.get().stop();
-  }
-}
-
-void http_server::do_accept() {
-  // load balancing here
-  acceptor_.async_accept(
-      net::make_strand(io_contexts_[next_io_context_].get()),
-      [this](beast::error_code ec, tcp::socket socket) {
-        if (!ec) {
-          std::make_shared<http_session>(std::move(socket))->start();
-        }
-        do_accept();
-      });
-
-  next_io_context_ = (next_io_context_ + 1) % io_contexts_.size();
-}
\ No newline at end of file
+#include "http_server.hpp"
+
+#include <unistd.h>
+
+#include <iostream>
+
+#include "globals.hpp"
+#include "http_session.hpp"
+#include "metrics.hpp"
+#include "rate_limiter.hpp"
+#include "tracer.hpp"
+
+#define isDevMode 1
+
+#ifdef SO_REUSEPORT
+using reuse_port = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+http_server::http_server(
+    std::vector<std::reference_wrapper<net::io_context>>& io_contexts,
+    tcp::endpoint endpoint, server_options options)
+    : io_contexts_(io_contexts),
+      io_context_stats_(io_contexts.size()),
+      options_(options),
+      next_io_context_(0) {
+  // One session pool per io_context, only touched from that context's thread.
+  // In strand mode the sessions bring their own strands, so sockets are
+  // accepted onto the plain executor either way.
+  options_.session.strand = options_.execution == execution_mode::strand;
+  if (options_.file_io_threads > 0) {
+    file_io_ = std::make_unique<net::thread_pool>(options_.file_io_threads);
+    options_.session.file_io = file_io_.get();
+  }
+  for (size_t i = 0; i < io_contexts_.size(); ++i) {
+    session_pools_.push_back(std::make_unique<session_pool>(
+        io_contexts_[i].get(), io_context_stats_[i].load,
+        io_context_stats_[i].requests, io_context_stats_[i].overloaded, options_.session));
+  }
+
+  acceptors_.reserve(options_.tls ? 2 * io_contexts_.size() : io_contexts_.size());
+  open_acceptors(endpoint);
+  tls_acceptors_begin_ = acceptors_.size();
+  if (options_.tls) {
+    open_acceptors(options_.tls_endpoint);
+  }
+}
+
+void http_server::open_acceptors(const tcp::endpoint& endpoint) {
+  if (options_.accept == accept_mode::reuseport) {
+#ifndef SO_REUSEPORT
+    throw std::runtime_error("SO_REUSEPORT is not supported on this platform");
+#endif
+    // Every io_context listens on the same port; the kernel spreads accepts
+    for (auto& ctx : io_contexts_) {
+      acceptors_.emplace_back(net::make_strand(ctx.get()));
+      open_acceptor(acceptors_.back(), endpoint);
+    }
+  } else {
+    acceptors_.emplace_back(net::make_strand(io_contexts_.front().get()));
+    open_acceptor(acceptors_.back(), endpoint);
+  }
+}
+
+void http_server::open_acceptor(tcp::acceptor& acceptor,
+                                const tcp::endpoint& endpoint) {
+  beast::error_code ec;
+
+  // Open the acceptor
+  acceptor.open(endpoint.protocol(), ec);
+  if (ec) {
+    throw std::runtime_error("Failed to open acceptor: " + ec.message());
+  }
+
+#if isDevMode
+  acceptor.set_option(net::socket_base::reuse_address(true), ec);
+  if (ec) {
+    throw std::runtime_error("Failed to set SO_REUSEADDR: " + ec.message());
+  }
+#endif
+
+#ifdef SO_REUSEPORT
+  if (options_.accept == accept_mode::reuseport) {
+    acceptor.set_option(reuse_port(true), ec);
+    if (ec) {
+      throw std::runtime_error("Failed to set SO_REUSEPORT: " + ec.message());
+    }
+  }
+#endif
+
+  // Bind to the server address
+  acceptor.bind(endpoint, ec);
+  if (ec) {
+    throw std::runtime_error("Failed to bind: " + ec.message());
+  }
+
+  // Start listening for connections
+  acceptor.listen(net::socket_base::max_listen_connections, ec);
+  if (ec) {
+    throw std::runtime_error("Failed to listen: " + ec.message());
+  }
+}
+
+// Start accepting incoming connections
+void http_server::run() {
+  for (auto& pool : session_pools_) {
+    pool->start_reaper(options_.overload_lag_ms);
+  }
+  for (size_t i = 0; i < acceptors_.size(); ++i) {
+    do_accept(i);
+  }
+}
+
+void http_server::stop() {
+  // Close the acceptors
+  for (auto& acceptor : acceptors_) {
+    beast::error_code ec;
+    acceptor.close(ec);
+    if (ec) {
+      // Log the error
+      getGlobalLogger().logError("Failed to close acceptor: ", ec);
+    }
+  }
+
+  // Stop the io_context
+  for (auto& ctx : io_contexts_) {
+    ctx.get().stop();
+  }
+  if (file_io_) {
+    file_io_->stop();
+  }
+}
+
+size_t http_server::pick_io_context() {
+  size_t count = io_contexts_.size();
+  size_t start = next_io_context_;
+  next_io_context_ = (next_io_context_ + 1) % count;
+
+  if (options_.dispatch == dispatch_policy::round_robin) {
+    return start;
+  }
+
+  // Scan from the round-robin position so ties still rotate
+  size_t best = start;
+  int best_load = io_context_stats_[start].load.load(std::memory_order_relaxed);
+  for (size_t i = 1; i < count && best_load > 0; ++i) {
+    size_t candidate = (start + i) % count;
+    int load = io_context_stats_[candidate].load.load(std::memory_order_relaxed);
+    if (load < best_load) {
+      best = candidate;
+      best_load = load;
+    }
+  }
+  return best;
+}
+
+void http_server::do_accept(size_t acceptor_index) {
+  // With SO_REUSEPORT each acceptor keeps its sockets on its own io_context.
+  // The single acceptor accepts onto its own io_context and picks the target
+  // once the connection exists, so the choice sees the load at that moment
+  // rather than when the accept was armed.
+  bool single = options_.accept == accept_mode::single;
+  size_t home = single ? 0 : acceptor_index % io_contexts_.size();
+  TlsContext* tls = acceptor_index >= tls_acceptors_begin_ ? options_.tls.get() : nullptr;
+  auto on_accept = [this, acceptor_index, single, home, tls](beast::error_code ec,
+                                                             tcp::socket socket) {
+    if (!ec) {
+      Metrics::getInstance().countAccept();
+      admit(std::move(socket), single ? pick_io_context() : home, tls);
+    } else if (ec == net::error::operation_aborted) {
+      return;
+    }
+    do_accept(acceptor_index);
+  };
+
+  acceptors_[acceptor_index].async_accept(
+      io_contexts_[home].get().get_executor(), std::move(on_accept));
+}
+
+bool http_server::should_shed(size_t target) const {
+  const io_context_stats& stats = io_context_stats_[target];
+  if (stats.overloaded.load(std::memory_order_relaxed)) {
+    return true;
+  }
+  std::size_t load = stats.load.load(std::memory_order_relaxed);
+  if (options_.max_connections_per_context && load >= options_.max_connections_per_context) {
+    return true;
+  }
+  if (options_.max_connections) {
+    std::size_t total = 0;
+    for (const auto& context : io_context_stats_) {
+      total += context.load.load(std::memory_order_relaxed);
+    }
+    return total >= options_.max_connections;
+  }
+  return false;
+}
+
+void http_server::admit(tcp::socket socket, size_t target, TlsContext* tls) {
+  if (should_shed(target)) {
+    Metrics::getInstance().countShed();
+    refuse_connection(std::move(socket), http::status::service_unavailable, tls);
+    return;
+  }
+
+  // The peer address is only looked up when some client limit is set
+  auto& limiter = RateLimiter::getInstance();
+  RateLimiter::ClientKey client{};
+  if (limiter.enabled()) {
+    beast::error_code ec;
+    auto endpoint = socket.remote_endpoint(ec);
+    if (ec) {
+      return;  // already gone
+    }
+    client = RateLimiter::keyFor(endpoint.address());
+  }
+  if (!limiter.admitConnection(client)) {
+    refuse_connection(std::move(socket), http::status::too_many_requests, tls);
+    return;
+  }
+  start_session(std::move(socket), target, client, tls);
+}
+
+void http_server::refuse_connection(tcp::socket socket, http::status status, TlsContext* tls) {
+  // Answered on the accepting thread without a session: one non-blocking
+  // send of a fixed response. If the socket buffer cannot take it the
+  // client just sees the close. An HTTPS client only sees the close;
+  // answering would take a handshake, the very work being shed.
+  if (tls) {
+    return;
+  }
+  std::string_view response = http_session::refusal_response(status);
+  ::send(socket.native_handle(), response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  beast::error_code ec;
+  socket.shutdown(tcp::socket::shutdown_send, ec);
+}
+
+void http_server::start_session(tcp::socket socket, size_t target,
+                                const RateLimiter::ClientKey& client, TlsContext* tls) {
+  // Counted now rather than once the session starts, so the next accept's
+  // least-loaded choice already sees this connection
+  io_context_stats_[target].load.fetch_add(1, std::memory_order_relaxed);
+
+  // The single acceptor accepted onto the first io_context; hand the
+  // descriptor over to the target's reactor
+  if (options_.accept == accept_mode::single && target != 0) {
+    beast::error_code ec;
+    auto protocol = socket.local_endpoint(ec).protocol();
+    auto fd = ec ? -1 : socket.release(ec);
+    tcp::socket moved(io_contexts_[target].get());
+    if (!ec) {
+      moved.assign(protocol, fd, ec);
+      if (ec) {
+        ::close(fd);
+      }
+    }
+    if (ec) {
+      io_context_stats_[target].load.fetch_sub(1, std::memory_order_relaxed);
+      getGlobalLogger().logError("Error: ", ec);
+      return;
+    }
+    socket = std::move(moved);
+  }
+
+  // Take a pooled session on the socket's own io_context, not the
+  // acceptor's, since the pool belongs to that io_context's thread
+  auto executor = socket.get_executor();
+  std::uint64_t trace_id = Tracer::getInstance().sample();
+  std::uint64_t accepted = trace_id ? Tracer::now() : 0;
+  net::dispatch(executor, [this, target, trace_id, accepted, client, tls,
+                           socket = std::move(socket)]() mutable {
+    if (trace_id) {
+      Tracer::getInstance().span("accept-handoff", trace_id, accepted, Tracer::now());
+    }
+    session_pools_[target]->acquire(std::move(socket), client, tls)->start(trace_id);
+  });
+}
+
+std::uint64_t http_server::requests_served() const {
+  std::uint64_t total = 0;
+  for (const auto& stats : io_context_stats_) {
+    total += stats.requests.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+void http_server::collect_metrics(std::string& out) const {
+  out += "# HELP webserver_active_sessions Open sessions by io_context.\n"
+         "# TYPE webserver_active_sessions gauge\n";
+  for (size_t i = 0; i < io_context_stats_.size(); ++i) {
+    out += "webserver_active_sessions{io_context=\"" + std::to_string(i) + "\"} " +
+           std::to_string(io_context_stats_[i].load.load(std::memory_order_relaxed)) + "\n";
+  }
+  out += "# HELP webserver_io_context_overloaded 1 while the io_context is shedding load.\n"
+         "# TYPE webserver_io_context_overloaded gauge\n";
+  for (size_t i = 0; i < io_context_stats_.size(); ++i) {
+    out += "webserver_io_context_overloaded{io_context=\"" + std::to_string(i) + "\"} " +
+           (io_context_stats_[i].overloaded.load(std::memory_order_relaxed) ? "1\n" : "0\n");
+  }
+  out += "# HELP webserver_io_context_requests_total Requests read by io_context.\n"
+         "# TYPE webserver_io_context_requests_total counter\n";
+  for (size_t i = 0; i < io_context_stats_.size(); ++i) {
+    out += "webserver_io_context_requests_total{io_context=\"" + std::to_string(i) + "\"} " +
+           std::to_string(io_context_stats_[i].requests.load(std::memory_order_relaxed)) + "\n";
+  }
+}
@@ -1,27 +1,98 @@
-// http_server.hpp
-#ifndef HTTP_SERVER_HPP
-#define HTTP_SERVER_HPP
-
-#include <boost/asio.hpp>
-#include <memory>
-
-namespace net = boost::asio;  // from <boost/asio.hpp>
-using tcp = net::ip::tcp;     // from <boost/asio/ip/tcp.hpp>
-
-class http_server {
- public:
-  http_server(std::vector<std::reference_wrapper<net::io_context>>& io_contexts,
-              tcp::endpoint endpoint);
-  void run();
-  void stop();
-
- private:
-  std::vector<std::reference_wrapper<net::io_context>>& io_contexts_;
-  std::vector<std::atomic<int>> io_context_loads_;
-  tcp::acceptor acceptor_;
-  size_t next_io_context_;
-
-  void do_accept();
-};
-
-#endif  // HTTP_SERVER_HPP
+// http_server.hpp
+#ifndef HTTP_SERVER_HPP
+#define HTTP_SERVER_HPP
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "http_session.hpp"
+#include "session_pool.hpp"
+
+namespace net = boost::asio;  // from <boost/asio.hpp>
+using tcp = net::ip::tcp;     // from <boost/asio/ip/tcp.hpp>
+
+// How listening sockets are laid out across the io_contexts
+enum class accept_mode {
+  single,     // one acceptor on the first io_context hands sockets out
+  reuseport,  // one SO_REUSEPORT acceptor per io_context, kernel balances
+};
+
+// How the single acceptor picks an io_context for a new session
+enum class dispatch_policy {
+  round_robin,
+  least_loaded,  // fewest open sessions, see io_context_stats_
+};
+
+// How sessions are serialised on their io_context
+enum class execution_mode {
+  strand,    // every socket wrapped in a strand
+  per_core,  // one pinned thread per io_context, plain executor, no strands
+};
+
+struct server_options {
+  accept_mode accept = accept_mode::single;
+  dispatch_policy dispatch = dispatch_policy::round_robin;
+  execution_mode execution = execution_mode::strand;
+  bool numa_aware = false;  // per_core only: spread threads over NUMA nodes
+  std::size_t file_io_threads = 0;  // blocking file reads run here; 0 keeps them inline
+  // Load shedding: past a cap, or while its io_context is overloaded, a new
+  // connection is answered 503 and closed. 0 turns a cap off.
+  std::size_t max_connections = 0;
+  std::size_t max_connections_per_context = 0;
+  std::uint32_t overload_lag_ms = 250;  // see session_pool::start_reaper
+  // HTTPS: set to also listen on tls_endpoint, laid out as accept says
+  std::shared_ptr<TlsContext> tls;
+  tcp::endpoint tls_endpoint;
+  session_options session;
+};
+
+class http_server {
+ public:
+  http_server(std::vector<std::reference_wrapper<net::io_context>>& io_contexts,
+              tcp::endpoint endpoint, server_options options = {});
+  void run();
+  void stop();
+
+  // Requests read so far, summed over every io_context
+  std::uint64_t requests_served() const;
+
+  // Appends per-io_context gauges in Prometheus text format; registered
+  // with Metrics as a collector
+  void collect_metrics(std::string& out) const;
+
+ private:
+  std::vector<std::reference_wrapper<net::io_context>>& io_contexts_;
+  // Per io_context counters, each on its own cache line
+  struct alignas(64) io_context_stats {
+    std::atomic<int> load{0};  // open sessions
+    std::atomic<std::uint64_t> requests{0};
+    std::atomic<bool> overloaded{false};  // set by its session_pool's reaper
+  };
+
+  std::vector<io_context_stats> io_context_stats_;
+  std::vector<std::unique_ptr<session_pool>> session_pools_;
+  // Declared after the session pools so its threads are joined, and any
+  // session they still hold released, before the pools go away
+  std::unique_ptr<net::thread_pool> file_io_;
+  std::vector<tcp::acceptor> acceptors_;  // plaintext first, then HTTPS
+  std::size_t tls_acceptors_begin_ = 0;
+  server_options options_;
+  size_t next_io_context_;
+
+  void open_acceptors(const tcp::endpoint& endpoint);
+  void open_acceptor(tcp::acceptor& acceptor, const tcp::endpoint& endpoint);
+  void do_accept(size_t acceptor_index);
+  size_t pick_io_context();
+  // Starts a session for the socket, or refuses it if the server is
+  // shedding load or the client is over its connection limit
+  void admit(tcp::socket socket, size_t target, TlsContext* tls);
+  bool should_shed(size_t target) const;
+  void refuse_connection(tcp::socket socket, http::status status, TlsContext* tls);
+  void start_session(tcp::socket socket, size_t target, const RateLimiter::ClientKey& client,
+                     TlsContext* tls);
+};
+
+#endif  // HTTP_SERVER_HPP
@@ -1,206 +1,2427 @@
-#include "http_session.hpp"
-
-#include <filesystem>
-#include <fstream>
-#include <iostream>
-
-#include "globals.hpp"
-
-http_session::http_session(tcp::socket socket): socket_(std::move(socket)) {}
-
-void http_session::start() { do_read(); }
-
-void http_session::send_response(const std::string& message,
-                                 const std::string& content_type) {
-  auto res = std::make_shared<http::response<http::string_body>>(
-      http::status::ok, req_.version());
-  res->set(http::field::server, BOOST_BEAST_VERSION_STRING);
-  res->set(http::field::content_type, content_type);
-  res->set(http::field::cache_control, "public, max-age=2592000");
-  res->body() = message;
-  res->prepare_payload();
-
-  getGlobalLogger().log(std::to_string(res->result_int()) + " " +
-                                   res->reason().to_string() + " " +
-                                   std::to_string(res->body().size()) +
-                                   " outgoing bytes");
-
-  auto self = shared_from_this();
-  http::async_write(
-      socket_, *res, [self, res](beast::error_code ec, std::size_t) {
-        if (ec) {;
-          getGlobalLogger().log("\x1b[31m" + std::string("Error: " + ec.message()) + "\x1b[0m");
-          return;
-        }
-
-        self->on_write(ec, res->need_eof());
-      });
-}
-
-void http_session::send_bad_request(const std::string& message) {
-  auto res = std::make_shared<http::response<http::string_body>>(
-      http::status::bad_request, req_.version());
-  res->set(http::field::server, BOOST_BEAST_VERSION_STRING);
-  res->set(http::field::content_type, "text/plain");
-  res->set(http::field::cache_control, "public, max-age=2592000");
-  res->body() = message;
-  res->prepare_payload();
-
-  auto self = shared_from_this();
-  http::async_write(
-      socket_, *res, [self, res](beast::error_code ec, std::size_t) {
-        if (ec) {
-          getGlobalLogger().log("\x1b[31m" + std::string("Error: " + ec.message()) + "\x1b[0m");
-          return;
-        }
-        self->on_write(ec, res->need_eof());
-      });
-}
-
-void http_session::do_read() {
-  auto self = shared_from_this();
-  http::async_read(socket_, buffer_, req_,
-                   [self](beast::error_code ec, std::size_t bytes_transferred) {
-                     self->on_read(ec, bytes_transferred);
-                   });
-}
-
-void http_session::on_read(beast::error_code ec,
-                           std::size_t bytes_transferred) {
-  if (ec) {
-    getGlobalLogger().log("\x1b[31m" + std::string("Error: " + ec.message()) + "\x1b[0m");
-    return;
-  }
-
-  // Log the request type ( with color), path, and bytes transfered
-
-  getGlobalLogger().log("\x1b[32m" + std::string(req_.method_string()) + " " +
-                                   req_.target().to_string() + "\x1b[0m" + " " +
-                                   std::to_string(bytes_transferred) +
-                                   " incoming bytes");
-
-  if (!Router::getInstance().routeRequest(*this, req_)) {
-      // If route not found
-      handle_fallback();
-  }
-}
-
-void http_session::handle_fallback() {
-  // Send the response
-  std::string notFoundMessage =
-      "<html><body><h1>404 Not Found</h1><p>The requested resource was not "
-      "found on this server.</p></body></html>";
-  send_response(notFoundMessage, "text/html");
-}
-
-void http_session::on_write(beast::error_code ec, bool close) {
-  if (ec) {
-    getGlobalLogger().log("\x1b[31m" + std::string("Error: " + ec.message()) + "\x1b[0m");
-    if (ec == net::error::broken_pipe || ec == net::error::connection_reset) {
-      // Gracefully close the socket
-      socket_.close();
-    }
-    return;
-  }
-
-  if (close) {
-    // Close the socket
-    socket_.shutdown(tcp::socket::shutdown_send, ec);
-    return;
-  }
-
-  // Clear the buffer
-  buffer_.consume(buffer_.size());
-
-  // Read another request
-  do_read();
-}
-
-void http_session::stream_file(const std::string& file_path,
-                               const std::string& content_type) {
-  int transfer_id = next_transfer_id++;
-  FileTransfer& transfer = file_transfers[transfer_id];
-
-  transfer.file_stream.open(file_path, std::ios::binary);
-  if (!transfer.file_stream.is_open()) {
-    getGlobalLogger().log("File not found: " + file_path);
-    send_bad_request("File not found");
-    file_transfers.erase(transfer_id);
-    return;
-  }
-
-  // Prepare the response header
-  auto response = std::make_shared<http::response<http::empty_body>>(
-      http::status::ok, req_.version());
-  response->set(http::field::server, BOOST_BEAST_VERSION_STRING);
-  response->set(http::field::content_type, content_type);
-  response->set(http::field::cache_control, "public, max-age=2592000");
-  response->keep_alive(req_.keep_alive());
-  response->chunked(true);
-
-  // Serialize and send the header
-  auto sr =
-      std::make_shared<http::response_serializer<http::empty_body>>(*response);
-  auto self = shared_from_this();  // Keep the session alive
-  http::async_write_header(
-      socket_, *sr,
-      [self, transfer_id, response, sr](beast::error_code ec, std::size_t) {
-        if (!ec) {
-          self->do_file_read(transfer_id);
-        } else {
-          getGlobalLogger().log("Error writing header: " + ec.message());
-          self->file_transfers.erase(transfer_id);
-        }
-      });
-}
-
-void http_session::do_file_read(int transfer_id) {
-  auto self = shared_from_this();
-  FileTransfer& transfer = file_transfers[transfer_id];
-  if (!transfer.file_stream.good()) {
-    getGlobalLogger().log("Error: File stream is not good");
-    file_transfers.erase(transfer_id);
-    return;
-  }
-
-  transfer.file_stream.read(transfer.buffer.data(), transfer.buffer.size());
-  auto bytes_read = transfer.file_stream.gcount();
-
-  if (bytes_read <= 0) {
-    // Send the last chunk
-    boost::asio::async_write(
-        socket_, http::make_chunk_last(),
-        [self, transfer_id](beast::error_code ec, std::size_t) {
-          if (ec) {
-            getGlobalLogger().log("\x1b[31m" + std::string("Error sending last chunk: " + ec.message()) + "\x1b[0m");
-          }
-          self->file_transfers.erase(transfer_id);
-        });
-    return;
-  }
-
-  // Send a chunk
-  boost::asio::const_buffer chunk_body(transfer.buffer.data(), bytes_read);
-  boost::asio::async_write(
-      socket_, http::make_chunk(chunk_body),
-      [self, transfer_id](beast::error_code ec, std::size_t) {
-        if (!ec) {
-          if (!self->file_transfers[transfer_id].file_stream.eof()) {
-            self->do_file_read(transfer_id);
-          } else {
-            // Send the last chunk
-            boost::asio::async_write(
-                self->socket_, http::make_chunk_last(),
-                [self, transfer_id](beast::error_code ec, std::size_t) {
-                  if (ec) {
-                    getGlobalLogger().log("\x1b[31m" + std::string("Error sending last chunk: " + ec.message()) + "\x1b[0m");
-                  }
-                  self->file_transfers.erase(transfer_id);
-                });
-          }
-        } else {
-          getGlobalLogger().log("\x1b[31m" + std::string("Error sending chunk: " + ec.message()) + "\x1b[0m");
-          self->file_transfers.erase(transfer_id);
-        }
-      });
-}
\ No newline at end of file
+#include "http_session.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+
+#include "compression.hpp"
+#include "globals.hpp"
+#include "header_writer.hpp"
+#include "http2.hpp"
+#include "metrics.hpp"
+#include "tracer.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Delimiter for multipart/byteranges bodies. It is random per process so a
+// served file cannot contain it by accident.
+const std::string& byteranges_boundary() {
+  static const std::string boundary = [] {
+    std::random_device rd;
+    char out[33];
+    std::snprintf(out, sizeof(out), "%08x%08x%08x%08x", rd(), rd(), rd(), rd());
+    return std::string(out);
+  }();
+  return boundary;
+}
+
+const std::string& byteranges_content_type() {
+  static const std::string content_type =
+      "multipart/byteranges; boundary=" + byteranges_boundary();
+  return content_type;
+}
+
+std::string_view content_range(char (&out)[64], const ByteRange& range,
+                               std::uint64_t size) {
+  int n = std::snprintf(out, sizeof(out), "bytes %llu-%llu/%llu",
+                        static_cast<unsigned long long>(range.first),
+                        static_cast<unsigned long long>(range.last),
+                        static_cast<unsigned long long>(size));
+  return {out, static_cast<std::size_t>(n)};
+}
+
+net::const_buffer slice(const std::string& storage, std::size_t begin,
+                        std::size_t end) {
+  return net::buffer(storage.data() + begin, end - begin);
+}
+
+// Fields about one connection rather than the message, which a proxy does
+// not pass on (RFC 9110 7.6.1): the fixed set, and any that Connection
+// names. The framing fields are set afresh on each side.
+bool is_hop_by_hop(http::field name, beast::string_view name_string,
+                   beast::string_view connection) {
+  switch (name) {
+    case http::field::connection:
+    case http::field::keep_alive:
+    case http::field::proxy_connection:
+    case http::field::te:
+    case http::field::trailer:
+    case http::field::transfer_encoding:
+    case http::field::upgrade:
+    case http::field::content_length:
+    case http::field::expect:
+      return true;
+    default:
+      break;
+  }
+  for (auto token : http::token_list(connection)) {
+    if (beast::iequals(token, name_string)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Methods a request may be repeated with (RFC 9110 9.2.2), so one can be
+// sent again after a backend drops it
+bool is_idempotent(http::verb method) {
+  switch (method) {
+    case http::verb::get:
+    case http::verb::head:
+    case http::verb::options:
+    case http::verb::trace:
+    case http::verb::put:
+    case http::verb::delete_:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void append_number(std::string& out, std::uint64_t value) {
+  char digits[20];
+  auto result = std::to_chars(digits, digits + sizeof(digits), value);
+  out.append(digits, result.ptr - digits);
+}
+
+}  // namespace
+
+void FileTransfer::reset() {
+  if (file_stream.is_open()) {
+    file_stream.close();
+  }
+  file_stream.clear();
+#ifdef __linux__
+  if (fd >= 0) {
+    ::close(fd);
+  }
+#endif
+  fd = -1;
+  segments.clear();
+  next_segment = 0;
+  offset = 0;
+  remaining = 0;
+  copy = false;
+}
+
+FileTransfer::~FileTransfer() { reset(); }
+
+void ProxyTransfer::reset() {
+  if (backend) {
+    upstream->finished(*backend);
+  }
+  backend = nullptr;
+  connection.reset();
+  parser.reset();
+  upstream.reset();
+  request.clear();
+  buffers.clear();
+  deadline = 0;
+  attempts = 0;
+  chunked_request = sent = body_sent = ready = chunked = false;
+  timed_out = cancelled = false;
+}
+
+ProxyTransfer::~ProxyTransfer() { reset(); }
+
+void OutboundResponse::reset() {
+  type = kind::buffered;
+  close = false;
+  head = false;
+  buffers.clear();
+  owner.reset();
+  storage.clear();
+  header_begin = header_end = 0;
+  trailer_begin = trailer_end = 0;
+  file.reset();
+  proxy.reset();
+  trace_id = 0;
+  trace_mark = 0;
+}
+
+void OutboundResponse::release() {
+  reset();
+  std::string().swap(storage);
+  std::vector<char>().swap(file.buffer);
+  std::vector<FileSegment>().swap(file.segments);
+  std::string().swap(proxy.request);
+  std::vector<char>().swap(proxy.buffer);
+}
+
+http_session::http_session(net::io_context& ioc, std::atomic<int>& load,
+                           std::atomic<std::uint64_t>& requests,
+                           std::atomic<bool>& overloaded, upstream_pool& upstreams,
+                           const session_options& options)
+    : load_(load), requests_(requests), overloaded_(overloaded), upstreams_(upstreams),
+      options_(options) {
+  if (options_.strand) {
+    strand_.emplace(net::make_strand(ioc));
+  }
+
+  // The ring never holds more than MAX_PIPELINED_REQUESTS + 1 slots, so
+  // growing it never reallocates
+  outbound_.reserve(MAX_PIPELINED_REQUESTS + 1);
+  outbound_.push_back(std::make_unique<OutboundResponse>());
+  outbound_.push_back(std::make_unique<OutboundResponse>());
+}
+
+http_session::~http_session() = default;
+
+template <class Fn>
+void http_session::for_each_response(Fn fn) {
+  for (std::size_t i = 0; i < outbound_size_; ++i) {
+    fn(*outbound_[(outbound_head_ + i) % outbound_.size()]);
+  }
+  if (http2_) {
+    h2_->for_each_response(fn);
+  }
+}
+
+void http_session::reset(tcp::socket socket, const RateLimiter::ClientKey& client,
+                         TlsContext* tls) {
+  // load_ was already raised by the server when it picked this io_context;
+  // recycle() lowers it again
+  client_ = client;
+  if (strand_) {
+    // Move the connection onto this session's strand, referenced through a
+    // strand_ref so the socket's executor is copied without allocating
+    beast::error_code ec;
+    auto protocol = socket.local_endpoint(ec).protocol();
+    auto fd = ec ? -1 : socket.release(ec);
+    if (!ec) {
+      socket_.emplace(strand_ref(*strand_));
+      socket_->assign(protocol, fd, ec);
+      if (!ec) {
+        stream_.bind(*socket_, tls);
+        return;
+      }
+      ::close(fd);
+    }
+    getGlobalLogger().logError("Error: ", ec);
+  }
+  socket_.emplace(std::move(socket));
+  stream_.bind(*socket_, tls);
+}
+
+void http_session::recycle() {
+  // Drop the connection but keep every buffer's capacity for the next one;
+  // an unusually large read buffer is given back
+  stream_.reset();
+  socket_.reset();
+  parser_.reset();
+  buffer_.consume(buffer_.size());
+  if (buffer_.capacity() > 64 * 1024) {
+    buffer_.shrink_to_fit();
+  }
+  route_params_.clear();
+  body_route_.reset();
+  upload_.reset();
+  proxying_ = nullptr;
+  async_requests_.clear();
+  for (auto& response : outbound_) {
+    response->reset();
+  }
+  if (h2_) {
+    h2_->reset();
+  }
+  http2_ = false;
+  h2_stream_ = nullptr;
+  request_ = nullptr;
+  outbound_head_ = 0;
+  outbound_size_ = 0;
+  reading_ = writing_ = routing_ = closing_ = false;
+  kept_alive_ = park_pending_ = parked_ = false;
+  RateLimiter::getInstance().releaseConnection(client_);
+  load_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void http_session::start(std::uint64_t trace_id) {
+  accept_trace_id_ = trace_id;
+  if (!stream_.secure()) {
+    do_read();
+    return;
+  }
+  // The handshake is read under the header timeout, as if it were the
+  // start of the first request
+  reading_ = true;
+  read_phase_ = read_phase::header;
+  read_deadline_ = deadline(options_.timeouts.header);
+  auto self = shared_from_this();
+  stream_.async_handshake(bind_pool(pool_, [self](beast::error_code ec, std::size_t) {
+    self->on_handshake(ec);
+  }));
+}
+
+void http_session::on_handshake(beast::error_code ec) {
+  reading_ = false;
+  if (ec) {
+    // Scanners and clients that distrust the certificate end here; the
+    // count is in the TLS metrics, so only the unusual ones are logged
+    if (ec != net::error::eof && ec != net::error::operation_aborted &&
+        ec.category() != net::error::get_ssl_category()) {
+      getGlobalLogger().logError("TLS handshake failed: ", ec);
+    }
+    closing_ = true;
+    return;
+  }
+  if (stream_.protocol() == "h2") {
+    start_http2(false, 0);
+    return;
+  }
+  do_read();
+}
+
+std::string_view http_session::refusal_response(http::status status) {
+  static const std::string_view overloaded =
+      "HTTP/1.1 503 Service Unavailable\r\n"
+      "Server: " BOOST_BEAST_VERSION_STRING "\r\n"
+      "Retry-After: 1\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n\r\n";
+  static const std::string_view too_many =
+      "HTTP/1.1 429 Too Many Requests\r\n"
+      "Server: " BOOST_BEAST_VERSION_STRING "\r\n"
+      "Retry-After: 1\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n\r\n";
+  return status == http::status::too_many_requests ? too_many : overloaded;
+}
+
+std::uint64_t http_session::deadline(std::uint32_t timeout) const {
+  return timeout ? coarse_now() + timeout : 0;
+}
+
+void http_session::arm_write_deadline() {
+  write_deadline_ = deadline(options_.timeouts.write);
+}
+
+void http_session::check_timeouts(std::uint64_t now) {
+  // A backend's deadline runs whatever the client side is doing. Closing
+  // its connection fails the step it is stuck on.
+  for_each_response([now](OutboundResponse& response) {
+    ProxyTransfer& proxy = response.proxy;
+    if (proxy.deadline && now >= proxy.deadline && proxy.connection) {
+      getGlobalLogger().log("Backend " + proxy.backend->address + " timed out");
+      Metrics::getInstance().countTimeout();
+      proxy.timed_out = true;
+      proxy.deadline = 0;
+      beast::error_code ec;
+      proxy.connection->socket.close(ec);
+    }
+  });
+  if (http2_) {
+    h2_->check_timeouts(now);
+    return;
+  }
+
+  if (closing_ && !reading_ && !writing_) {
+    return;
+  }
+  if (reading_ && read_phase_ == read_phase::idle && buffer_.size() > 0) {
+    // The next request has started arriving; its header gets the header
+    // timeout from here
+    read_phase_ = read_phase::header;
+    read_deadline_ = deadline(options_.timeouts.header);
+    park_pending_ = false;
+  }
+  if (writing_ && write_deadline_ && now >= write_deadline_) {
+    on_timeout("write");
+    return;
+  }
+  // Nor is a connection idle while responses are still owed on it
+  bool owed = read_phase_ == read_phase::idle && outbound_size_ > 0;
+  if (reading_ && read_deadline_ && now >= read_deadline_ && !owed) {
+    on_timeout(read_phase_ == read_phase::idle     ? "idle"
+               : read_phase_ == read_phase::header ? "header"
+                                                   : "body");
+    return;
+  }
+
+  // A connection idle for a whole pass gives its buffers back
+  bool idle = reading_ && read_phase_ == read_phase::idle && !writing_ &&
+              outbound_size_ == 0 && async_requests_.empty() && !parked_;
+  if (idle && park_pending_) {
+    park();
+  }
+  park_pending_ = idle;
+}
+
+void http_session::on_timeout(const char* phase) {
+  getGlobalLogger().log(std::string("Closing connection: ") + phase + " timeout");
+  Metrics::getInstance().countTimeout();
+  // Shut down rather than close: a file I/O thread may be in sendfile on
+  // the descriptor. Every pending operation then fails and the session
+  // winds down through its usual error paths.
+  closing_ = true;
+  cancel_async();
+  cancel_proxies();
+  beast::error_code ec;
+  socket_->shutdown(tcp::socket::shutdown_both, ec);
+  socket_->cancel(ec);
+}
+
+void http_session::park() {
+  // Cancelling the idle read lets on_header release what the read held;
+  // nothing is lost, since nothing had arrived. parked_ stays set until
+  // the connection is readable again.
+  parked_ = true;
+  beast::error_code ec;
+  socket_->cancel(ec);
+}
+
+void http_session::wait_readable() {
+  // While parked only a zero-byte wait is pending, so the connection holds
+  // no read buffer, parser or response storage
+  parser_.reset();
+  buffer_.shrink_to_fit();
+  for (auto& response : outbound_) {
+    response->release();
+  }
+  std::vector<net::const_buffer>().swap(write_buffers_);
+  std::vector<ByteRange>().swap(ranges_);
+  pool_.trim();
+
+  auto self = shared_from_this();
+  if (stream_.pending()) {
+    // TLS already holds the start of the next request
+    parked_ = false;
+    net::post(stream_.get_executor(), bind_pool(pool_, [self] { self->do_read(); }));
+    return;
+  }
+  socket_->async_wait(tcp::socket::wait_read,
+                      bind_pool(pool_, [self](beast::error_code ec) {
+                        self->parked_ = false;
+                        if (ec) {
+                          self->on_read(ec, 0);
+                          return;
+                        }
+                        self->do_read();
+                      }));
+}
+
+void http_session::shed_request() {
+  OutboundResponse& response = prepare_response();
+  std::string_view overloaded = refusal_response(http::status::service_unavailable);
+  response.buffers.push_back(net::buffer(overloaded.data(), overloaded.size()));
+  log_response(503, "Service Unavailable", 0, "overloaded");
+  queue_response(true);
+}
+
+void http_session::send_too_many_requests(std::uint32_t retry_after) {
+  OutboundResponse& response = prepare_response();
+  header_writer header(response.storage, http::status::too_many_requests, req().version());
+  header.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  char seconds[12];
+  int n = std::snprintf(seconds, sizeof(seconds), "%u", retry_after);
+  header.set(http::field::retry_after, std::string_view(seconds, n));
+  header.keep_alive(req().keep_alive());
+  header.content_length(0);
+  header.finish();
+  response.buffers.push_back(net::buffer(response.storage));
+  log_response(429, "Too Many Requests", 0, "rate limited");
+  queue_response(!req().keep_alive());
+}
+
+bool http_session::admit_route(std::uint32_t route_id) {
+  if (std::uint32_t retry_after = RateLimiter::getInstance().admitRoute(client_, route_id)) {
+    send_too_many_requests(retry_after);
+    return false;
+  }
+  return true;
+}
+
+void http_session::send_response(const std::string& message,
+                                 const std::string& content_type) {
+  send_text(http::status::ok, message, content_type, true);
+}
+
+void http_session::send_bad_request(const std::string& message) {
+  send_error(http::status::bad_request, message);
+}
+
+void http_session::send_error(http::status status, const std::string& message) {
+  send_text(status, message, "text/plain", false);
+}
+
+void http_session::send_text(http::status status, std::string_view body,
+                             std::string_view content_type,
+                             bool allow_compression) {
+  std::string_view payload = body;
+  bool vary = false;
+  bool gzip = false;
+
+  // Large dynamic bodies are compressed on the fly when enabled
+  std::string compressed;
+  if (allow_compression && options_.compress_dynamic &&
+      body.size() >= options_.compress_min_size && is_compressible(content_type)) {
+    static const std::vector<std::string> dynamic_encodings = {"gzip"};
+    vary = true;
+    if (negotiate_encoding(to_string_view(req()[http::field::accept_encoding]),
+                           dynamic_encodings) == 0 &&
+        compress("gzip", body, compressed, DYNAMIC_COMPRESSION_LEVEL) &&
+        compressed.size() < body.size()) {
+      payload = compressed;
+      gzip = true;
+    }
+  }
+
+  // Header and body are serialized into the slot's reused storage
+  OutboundResponse& response = prepare_response();
+  header_writer header(response.storage, status, req().version());
+  header.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  header.set(http::field::content_type, content_type);
+  header.set(http::field::cache_control, "public, max-age=2592000");
+  if (gzip) {
+    header.set(http::field::content_encoding, "gzip");
+  }
+  if (vary) {
+    header.set(http::field::vary, "Accept-Encoding");
+  }
+  header.keep_alive(req().keep_alive());
+  header.content_length(payload.size());
+  header.finish();
+  if (req().method() != http::verb::head) {
+    response.storage.append(payload.data(), payload.size());
+  }
+  response.buffers.push_back(net::buffer(response.storage));
+
+  log_response(static_cast<unsigned>(status), to_string_view(http::obsolete_reason(status)),
+               payload.size());
+  queue_response(!req().keep_alive());
+}
+
+void http_session::do_read() {
+  reading_ = true;
+  if (kept_alive_ && buffer_.size() == 0) {
+    read_phase_ = read_phase::idle;
+    read_deadline_ = deadline(options_.timeouts.idle);
+  } else {
+    read_phase_ = read_phase::header;
+    read_deadline_ = deadline(options_.timeouts.header);
+  }
+  park_pending_ = false;
+  read_started_ = Tracer::getInstance().enabled() ? Tracer::now() : 0;
+
+  // A fresh parser per request. Its fields come from pool_, which the
+  // previous request's fields have just been returned to.
+  parser_.emplace(std::piecewise_construct, std::make_tuple(),
+                  std::make_tuple(pool_allocator<char>(pool_)));
+  request_ = &parser_->get();
+
+  // Only the header is read here; how much body to take is up to the route
+  // it goes to, so the body limit is set once that is known
+  parser_->header_limit(REQUEST_HEADER_LIMIT);
+  parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+
+  auto self = shared_from_this();
+  http::async_read_header(stream_, buffer_, *parser_,
+                          bind_pool(pool_, [self](beast::error_code ec,
+                                                  std::size_t bytes_transferred) {
+                            self->on_header(ec, bytes_transferred);
+                          }));
+}
+
+void http_session::maybe_read() {
+  // Backpressure: stop parsing pipelined requests once enough responses
+  // are waiting to be written
+  if (reading_ || closing_ || http2_ || outbound_size_ >= MAX_PIPELINED_REQUESTS) {
+    return;
+  }
+  do_read();
+}
+
+void http_session::on_header(beast::error_code ec,
+                             std::size_t bytes_transferred) {
+  if (parked_ && ec == net::error::operation_aborted && !closing_) {
+    // Cancelled by park(). A request that began arriving meanwhile is read
+    // as usual.
+    if (buffer_.size() > 0) {
+      parked_ = false;
+      do_read();
+    } else {
+      wait_readable();
+    }
+    return;
+  }
+  parked_ = false;
+  if (ec == http::error::bad_version && !kept_alive_ && options_.http2) {
+    // An HTTP/2 client that knows this server speaks it opens with the
+    // preface, whose request line Beast stops at without consuming
+    auto data = buffer_.data();
+    std::string_view buffered(static_cast<const char*>(data.data()), data.size());
+    if (buffered.compare(0, H2_PREFACE.find('\r'), H2_PREFACE, 0, H2_PREFACE.find('\r')) == 0) {
+      reading_ = false;
+      start_http2(false, 0);
+      return;
+    }
+  }
+  if (ec == http::error::header_limit) {
+    reading_ = false;
+    begin_request(bytes_transferred);
+    refuse_request(http::status::request_header_fields_too_large,
+                   "Request header too large");
+    return;
+  }
+  if (ec || parser_->is_done()) {
+    // No body; requests without one never look at body options
+    on_read(ec, bytes_transferred);
+    return;
+  }
+
+  body_route_ = Router::getInstance().bodyRoute(*this, req());
+  BodyOptions options = body_route_ ? body_route_->options : BodyOptions{};
+  std::uint64_t limit = options.body_limit ? options.body_limit : REQUEST_BODY_LIMIT;
+  auto content_length = parser_->content_length();
+  if (options.header_limit && bytes_transferred > options.header_limit) {
+    reading_ = false;
+    begin_request(bytes_transferred);
+    refuse_request(http::status::request_header_fields_too_large,
+                   "Request header too large");
+    return;
+  }
+  if (content_length && *content_length > limit) {
+    reading_ = false;
+    begin_request(bytes_transferred);
+    refuse_request(http::status::payload_too_large, "Request body too large");
+    return;
+  }
+  if (req().version() >= 11 &&
+      beast::iequals(req()[http::field::expect], "100-continue")) {
+    if (!options.expect_continue) {
+      reading_ = false;
+      begin_request(bytes_transferred);
+      refuse_request(http::status::expectation_failed, "Expectation failed");
+      return;
+    }
+    send_continue();
+  }
+  // Counts down as a chunked body arrives
+  parser_->body_limit(limit);
+  read_phase_ = read_phase::body;
+  read_deadline_ = deadline(options_.timeouts.body);
+
+  if (body_route_ && (body_route_->upload || body_route_->proxy)) {
+    // Uploads and proxied requests skip on_read and the router, so their
+    // limits are checked here, before any of the body is read
+    begin_request(bytes_transferred);
+    auto& limiter = RateLimiter::getInstance();
+    std::uint32_t retry_after = limiter.admitRequest(client_);
+    if (!retry_after) {
+      retry_after = limiter.admitRoute(client_, route_id_);
+    }
+    if (retry_after) {
+      reading_ = false;
+      body_route_.reset();
+      req().keep_alive(false);
+      routing_ = true;
+      send_too_many_requests(retry_after);
+      routing_ = false;
+      finish_request();
+      return;
+    }
+    if (auto upstream = body_route_->proxy) {
+      body_route_.reset();
+      proxy_request(upstream);
+      return;
+    }
+    start_upload();
+    return;
+  }
+  body_route_.reset();
+  auto self = shared_from_this();
+  http::async_read(stream_, buffer_, *parser_,
+                   bind_pool(pool_, [self, header = bytes_transferred](
+                                        beast::error_code ec,
+                                        std::size_t bytes_transferred) {
+                     self->on_read(ec, header + bytes_transferred);
+                   }));
+}
+
+void http_session::on_read(beast::error_code ec,
+                           std::size_t bytes_transferred) {
+  reading_ = false;
+  if (ec == http::error::body_limit) {
+    // A chunked body ran past the limit
+    begin_request(bytes_transferred);
+    refuse_request(http::status::payload_too_large, "Request body too large");
+    return;
+  }
+  if (ec) {
+    // Finish writing whatever is already queued, then let the session go
+    getGlobalLogger().logError("Error: ", ec);
+    closing_ = true;
+    cancel_async();
+    do_write();
+    return;
+  }
+  if (options_.http2 && !stream_.secure() && outbound_size_ == 0 && !writing_ &&
+      h2_connection::wants_upgrade(req())) {
+    // Answered as stream 1 once the connection has switched
+    start_http2(true, bytes_transferred);
+    return;
+  }
+  begin_request(bytes_transferred);
+  route_request();
+  finish_request();
+}
+
+void http_session::route_request() {
+  if (overloaded_.load(std::memory_order_relaxed)) {
+    shed_request();
+    return;
+  }
+  routing_ = true;
+  if (std::uint32_t retry_after = RateLimiter::getInstance().admitRequest(client_)) {
+    send_too_many_requests(retry_after);
+  } else {
+    switch (Router::getInstance().routeRequest(*this, req())) {
+      case RouteResult::handled:
+        break;
+      case RouteResult::not_found:
+        handle_fallback();
+        break;
+      case RouteResult::method_not_allowed:
+        send_error(http::status::method_not_allowed, "Method not allowed");
+        break;
+    }
+  }
+  routing_ = false;
+}
+
+void http_session::start_http2(bool upgrade, std::size_t bytes_transferred) {
+  if (!h2_) {
+    h2_ = std::make_unique<h2_connection>(*this);
+  }
+  http2_ = true;
+  read_deadline_ = 0;
+  // Writes follow the client's windows as they open, often less than a
+  // segment at a time; Nagle would hold each one for the client's ACK
+  beast::error_code ec;
+  socket_->set_option(tcp::no_delay(true), ec);
+  h2_->start(upgrade ? &req() : nullptr, bytes_transferred);
+  // The upgraded request now belongs to stream 1
+  parser_.reset();
+}
+
+void http_session::begin_request(std::size_t bytes_transferred) {
+  kept_alive_ = true;
+  requests_.fetch_add(1, std::memory_order_relaxed);
+  request_started_ = Metrics::now();
+  Metrics::getInstance().countRequest(bytes_transferred);
+  // The read span includes waiting for the client, which on a keep-alive
+  // connection is idle time. The connection's first request keeps the id
+  // sampled at accept, so its spans follow the accept-handoff one.
+  trace_id_ = 0;
+  if (read_started_) {
+    trace_id_ = accept_trace_id_ ? accept_trace_id_ : Tracer::getInstance().sample();
+  }
+  accept_trace_id_ = 0;
+  if (trace_id_) {
+    Tracer::getInstance().span("read", trace_id_, read_started_, request_started_);
+  }
+
+  // Log the request type ( with color), path, and bytes transfered
+
+  getGlobalLogger().logRequest(to_string_view(req().method_string()),
+                               to_string_view(req().target()),
+                               bytes_transferred);
+}
+
+void http_session::finish_request() {
+  if (trace_id_) {
+    Tracer::getInstance().span("route", trace_id_, request_started_, Tracer::now());
+  }
+
+  maybe_read();
+
+  // If the next pipelined request is already buffered, hold the write back
+  // so its response can share the same gather write
+  auto pending = buffer_.data();
+  std::string_view buffered(static_cast<const char*>(pending.data()), pending.size());
+  if (!reading_ || buffered.find("\r\n\r\n") == std::string_view::npos) {
+    do_write();
+  }
+}
+
+void http_session::refuse_request(http::status status, const std::string& message) {
+  // The rest of the request is never read, so the connection cannot carry
+  // another one
+  req().keep_alive(false);
+  routing_ = true;
+  send_error(status, message);
+  routing_ = false;
+  finish_request();
+}
+
+void http_session::send_continue() {
+  // An interim response, queued behind any earlier pipelined responses so
+  // it cannot overtake them
+  static const std::string_view continue_header = "HTTP/1.1 100 Continue\r\n\r\n";
+  OutboundResponse& response = prepare_response();
+  response.trace_id = 0;
+  response.buffers.push_back(net::buffer(continue_header.data(), continue_header.size()));
+  queue_response(false);
+}
+
+void http_session::start_upload() {
+  // The handler sees the header before any of the body. If it refuses the
+  // body, its response goes out now and the body is read and dropped.
+  // The sink's on_complete may look at the parameters once the route
+  // table has been replaced.
+  route_params_.copy_names(route_param_names_);
+  routing_ = true;
+  upload_ = body_route_->upload(*this, req());
+  routing_ = false;
+  if (!upload_) {
+    do_write();
+  }
+  read_upload();
+}
+
+void http_session::read_upload() {
+  read_deadline_ = deadline(options_.timeouts.body);
+  auto self = shared_from_this();
+  http::async_read_some(stream_, buffer_, *parser_,
+                        bind_pool(pool_, [self](beast::error_code ec, std::size_t) {
+                          self->on_upload_read(ec);
+                        }));
+}
+
+void http_session::on_upload_read(beast::error_code ec) {
+  // Hand over what this read parsed and drop it, so the body never holds
+  // more than one read's worth
+  auto& body = req().body();
+  bool stopped = false;
+  if (upload_) {
+    for (auto buffer : beast::buffers_range(body.data())) {
+      if (!upload_->on_data(std::string_view(static_cast<const char*>(buffer.data()),
+                                             buffer.size()))) {
+        stopped = true;
+        break;
+      }
+    }
+  }
+  body.consume(body.size());
+
+  if (ec) {
+    if (upload_) {
+      upload_->on_error(ec);
+      upload_.reset();
+    }
+    body_route_.reset();
+    reading_ = false;
+    if (ec == http::error::body_limit) {
+      refuse_request(http::status::payload_too_large, "Request body too large");
+      return;
+    }
+    getGlobalLogger().logError("Error: ", ec);
+    closing_ = true;
+    cancel_async();
+    do_write();
+    return;
+  }
+  if (stopped) {
+    // The sink has had enough; answer now and close rather than read the rest
+    req().keep_alive(false);
+    finish_upload();
+    return;
+  }
+  if (!parser_->is_done()) {
+    read_upload();
+    return;
+  }
+  finish_upload();
+}
+
+void http_session::finish_upload() {
+  reading_ = false;
+  auto sink = std::move(upload_);
+  body_route_.reset();
+  if (sink) {
+    routing_ = true;
+    sink->on_complete(*this, req());
+    routing_ = false;
+  }
+  finish_request();
+}
+
+void http_session::handle_fallback() {
+  // Send the response
+  static const std::string notFoundMessage =
+      "<html><body><h1>404 Not Found</h1><p>The requested resource was not "
+      "found on this server.</p></body></html>";
+  send_response(notFoundMessage, "text/html");
+}
+
+OutboundResponse& http_session::prepare_response() {
+  if (h2_stream_) {
+    OutboundResponse& response = h2_stream_->response;
+    response.reset();
+    response.trace_id = trace_id_;
+    return response;
+  }
+  if (outbound_size_ == outbound_.size()) {
+    // Every slot is queued: unroll the ring so the head is first and add a
+    // slot at the end. Slots are kept for the session's lifetime, so a warm
+    // session does not get here.
+    std::rotate(outbound_.begin(), outbound_.begin() + outbound_head_,
+                outbound_.end());
+    outbound_head_ = 0;
+    outbound_.push_back(std::make_unique<OutboundResponse>());
+  }
+
+  // The slot is filled in place and only joins the queue in queue_response
+  OutboundResponse& response =
+      *outbound_[(outbound_head_ + outbound_size_) % outbound_.size()];
+  response.reset();
+  response.trace_id = trace_id_;
+  return response;
+}
+
+OutboundResponse& http_session::next_response() {
+  if (h2_stream_) {
+    return h2_stream_->response;
+  }
+  return *outbound_[(outbound_head_ + outbound_size_) % outbound_.size()];
+}
+
+void http_session::queue_response(bool close) {
+  if (h2_stream_) {
+    // Streams end on their own; closing the connection is the client's call
+    OutboundResponse& response = h2_stream_->response;
+    if (response.trace_id) {
+      response.trace_mark = Tracer::now();
+    }
+    h2_->queue_response(*h2_stream_);
+    if (!routing_) {
+      do_write();
+    }
+    return;
+  }
+  OutboundResponse& response = next_response();
+  response.close = close;
+  closing_ = closing_ || close;
+  ++outbound_size_;
+  if (response.trace_id) {
+    response.trace_mark = Tracer::now();
+  }
+
+  // Responses produced while routing are flushed by on_read, which knows
+  // whether more pipelined requests are about to join them
+  if (!routing_) {
+    do_write();
+  }
+}
+
+void http_session::do_write() {
+  if (http2_) {
+    h2_->do_write();
+    return;
+  }
+  if (writing_ || outbound_size_ == 0) {
+    return;
+  }
+  writing_ = true;
+
+  // A streamed response owns the socket until it calls on_write; a pending
+  // one is written once its coroutine has filled it in
+  switch (front_response().type) {
+    case OutboundResponse::kind::buffered:
+      break;
+    case OutboundResponse::kind::pending:
+      writing_ = false;
+      return;
+    case OutboundResponse::kind::proxied:
+      if (!front_response().proxy.ready) {
+        writing_ = false;
+        return;
+      }
+      start_proxy_stream();
+      return;
+    case OutboundResponse::kind::chunked_file:
+    case OutboundResponse::kind::file:
+      start_stream();
+      return;
+  }
+
+  // Coalesce every buffered response up to the next stream or close
+  write_buffers_.clear();
+  std::size_t count = 0;
+  while (count < outbound_size_) {
+    OutboundResponse& response =
+        *outbound_[(outbound_head_ + count) % outbound_.size()];
+    if (response.type != OutboundResponse::kind::buffered) {
+      break;
+    }
+    write_buffers_.insert(write_buffers_.end(), response.buffers.begin(),
+                          response.buffers.end());
+    if (response.trace_id) {
+      trace_write_start(response);
+    }
+    ++count;
+    if (response.close) {
+      break;
+    }
+  }
+
+  arm_write_deadline();
+  auto self = shared_from_this();
+  net::async_write(
+      stream_,
+      beast::span<const net::const_buffer>(write_buffers_.data(), write_buffers_.size()),
+      bind_pool(pool_, [self, count](beast::error_code ec, std::size_t bytes) {
+        Metrics::getInstance().countBytesOut(bytes);
+        self->on_write(ec, count);
+      }));
+}
+
+void http_session::on_write(beast::error_code ec, std::size_t responses) {
+  writing_ = false;
+  if (ec) {
+    // A response may be half written; nothing more can be sent on this
+    // connection
+    getGlobalLogger().logError("Error: ", ec);
+    closing_ = true;
+    cancel_async();
+    cancel_proxies();
+    socket_->close(ec);
+    return;
+  }
+
+  bool close = false;
+  for (; responses > 0 && outbound_size_ > 0; --responses) {
+    // Release the asset or file now rather than when the slot is reused
+    OutboundResponse& response = front_response();
+    close = close || response.close;
+    if (response.trace_id) {
+      Tracer::getInstance().span("write", response.trace_id, response.trace_mark,
+                                 Tracer::now());
+    }
+    response.reset();
+    outbound_head_ = (outbound_head_ + 1) % outbound_.size();
+    --outbound_size_;
+  }
+
+  if (close || (closing_ && outbound_size_ == 0 && !reading_)) {
+    // Close the socket
+    stream_.shutdown();
+    socket_->shutdown(tcp::socket::shutdown_send, ec);
+    return;
+  }
+
+  if (outbound_size_ == 0 && reading_ && read_phase_ == read_phase::idle) {
+    // The keep-alive wait starts once the last response is out
+    read_deadline_ = deadline(options_.timeouts.idle);
+  }
+  maybe_read();
+  do_write();
+}
+
+void http_session::spawn_handler(std::shared_ptr<const AsyncRequestHandler> handler) {
+  // Reserve the response's place in the queue now; the requests pipelined
+  // behind this one are read and answered while the coroutine runs
+  OutboundResponse& response = prepare_response();
+  response.type = OutboundResponse::kind::pending;
+  OutboundResponse* slot = &response;
+  auto request = std::make_shared<async_request>(req(), route_params_,
+                                                 socket_->get_executor());
+  async_requests_.push_back(request.get());
+  if (h2_stream_) {
+    h2_stream_->async = request.get();
+  }
+  queue_response(!req().keep_alive());
+
+  // The coroutine runs on the connection's executor, so it never runs
+  // concurrently with the session's own handlers
+  auto self = shared_from_this();
+  net::spawn(socket_->get_executor(),
+             [self, handler, request, slot, route_id = route_id_,
+              started = request_started_](net::yield_context yield) {
+               std::optional<AsyncResponse> result;
+               try {
+                 result.emplace((*handler)(*request, yield));
+               } catch (const std::exception& e) {
+                 if (!request->cancelled()) {
+                   getGlobalLogger().log(std::string("Error in async handler: ") + e.what());
+                 }
+               }
+               self->finish_async(*request, *slot, result ? &*result : nullptr,
+                                  route_id, started);
+             });
+}
+
+void http_session::finish_async(async_request& request, OutboundResponse& response,
+                                const AsyncResponse* result, std::uint32_t route_id,
+                                std::uint64_t started) {
+  request.finish();
+  async_requests_.erase(
+      std::find(async_requests_.begin(), async_requests_.end(), &request));
+  response.type = OutboundResponse::kind::buffered;
+  if (response.trace_id) {
+    std::uint64_t now = Tracer::now();
+    Tracer::getInstance().span("handler", response.trace_id, response.trace_mark, now);
+    response.trace_mark = now;
+  }
+
+  if (request.cancelled()) {
+    // The connection is gone; the empty slot just closes it
+    if (http2_) {
+      h2_->drop_response(response);
+      return;
+    }
+    response.close = true;
+    closing_ = true;
+    do_write();
+    return;
+  }
+
+  AsyncResponse error{http::status::internal_server_error, request.request().version()};
+  if (!result) {
+    error.set(http::field::content_type, "text/plain");
+    error.body() = "Internal server error";
+    result = &error;
+  }
+
+  // The handler's fields are copied as they are; the framing is the
+  // session's, as for every other response
+  const http_request& req = request.request();
+  header_writer header(response.storage, result->result(), req.version());
+  if (result->find(http::field::server) == result->end()) {
+    header.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  }
+  for (const auto& field : *result) {
+    if (field.name() == http::field::connection ||
+        field.name() == http::field::content_length ||
+        field.name() == http::field::transfer_encoding) {
+      continue;
+    }
+    header.set(to_string_view(field.name_string()), to_string_view(field.value()));
+  }
+  header.keep_alive(req.keep_alive());
+  bool bodyless = result->result_int() / 100 == 1 ||
+                  result->result() == http::status::no_content ||
+                  result->result() == http::status::not_modified;
+  if (!bodyless) {
+    header.content_length(result->body().size());
+  }
+  header.finish();
+  if (!bodyless && req.method() != http::verb::head) {
+    response.storage += result->body();
+  }
+  response.buffers.push_back(net::buffer(response.storage));
+
+  getGlobalLogger().logResponse(result->result_int(),
+                                to_string_view(result->reason()),
+                                result->body().size());
+  Metrics::getInstance().recordResponse(route_id, result->result_int(),
+                                        Metrics::now() - started);
+  do_write();
+}
+
+void http_session::cancel_async() {
+  // Copy first: a cancel callback may complete an operation inline
+  auto requests = async_requests_;
+  for (async_request* request : requests) {
+    request->cancel();
+  }
+}
+
+void http_session::proxy_request(const std::shared_ptr<Upstream>& upstream) {
+  // The response keeps its place in the queue while the backend works; the
+  // requests pipelined behind a bodiless one are read and answered meanwhile
+  OutboundResponse& response = prepare_response();
+  response.type = OutboundResponse::kind::proxied;
+  ProxyTransfer& proxy = response.proxy;
+  proxy.upstream = upstream;
+  proxy.started = request_started_;
+  proxy.route_id = route_id_;
+  proxy.version = req().version();
+  proxy.keep_alive = req().keep_alive();
+  proxy.head = req().method() == http::verb::head;
+  proxy.idempotent = is_idempotent(req().method());
+  write_upstream_request(proxy);
+  if (!http2_ && !parser_->is_done()) {
+    // The body is read as the backend takes it; until it is connected, its
+    // deadline stands in for the body timeout
+    proxying_ = &response;
+    read_deadline_ = 0;
+  }
+  queue_response(!proxy.keep_alive);
+  connect_upstream(response);
+}
+
+void http_session::write_upstream_request(ProxyTransfer& proxy) {
+  const http_request& request = req();
+  std::string& out = proxy.request;
+  out.clear();
+  out.append(request.method_string().data(), request.method_string().size());
+  out += ' ';
+  out.append(request.target().data(), request.target().size());
+  out += " HTTP/1.1\r\n";
+
+  beast::string_view connection = request[http::field::connection];
+  beast::string_view forwarded_for;
+  for (const auto& field : request) {
+    if (is_hop_by_hop(field.name(), field.name_string(), connection)) {
+      continue;
+    }
+    if (beast::iequals(field.name_string(), "X-Forwarded-For")) {
+      forwarded_for = field.value();
+      continue;
+    }
+    out.append(field.name_string().data(), field.name_string().size());
+    out += ": ";
+    out.append(field.value().data(), field.value().size());
+    out += "\r\n";
+  }
+
+  // The backend sees the client's address, after any proxies before this one
+  beast::error_code ec;
+  auto peer = socket_->remote_endpoint(ec);
+  out += "X-Forwarded-For: ";
+  if (!forwarded_for.empty()) {
+    out.append(forwarded_for.data(), forwarded_for.size());
+    out += ", ";
+  }
+  out += ec ? "unknown" : peer.address().to_string();
+  out += "\r\n";
+
+  // A length the client gave is passed on; a chunked body is re-chunked
+  // as it is read. An HTTP/2 request's body has all arrived by now, and
+  // goes with the header.
+  if (http2_) {
+    std::size_t length = request.body().size();
+    if (length > 0 || request.method() == http::verb::post ||
+        request.method() == http::verb::put) {
+      out += "Content-Length: ";
+      append_number(out, length);
+      out += "\r\n";
+    }
+    out += "\r\n";
+    for (auto buffer : beast::buffers_range(request.body().data())) {
+      out.append(static_cast<const char*>(buffer.data()), buffer.size());
+    }
+    return;
+  }
+  if (auto length = parser_->content_length()) {
+    out += "Content-Length: ";
+    append_number(out, *length);
+    out += "\r\n";
+  } else if (!parser_->is_done()) {
+    out += "Transfer-Encoding: chunked\r\n";
+    proxy.chunked_request = true;
+  }
+  out += "\r\n";
+}
+
+void http_session::connect_upstream(OutboundResponse& response) {
+  ProxyTransfer& proxy = response.proxy;
+  std::uint64_t now = coarse_now();
+  ++proxy.attempts;
+  proxy.backend = proxy.upstream->pick(now);
+  if (!proxy.backend) {
+    fail_proxy(response, http::status::bad_gateway, "No backend available");
+    return;
+  }
+  proxy.connection = upstreams_.acquire(proxy.upstream, *proxy.backend);
+  if (proxy.connection->connected) {
+    send_upstream_request(response);
+    return;
+  }
+
+  std::uint32_t timeout = proxy.upstream->options().connect_timeout;
+  proxy.deadline = timeout ? now + timeout : 0;
+  auto self = shared_from_this();
+  OutboundResponse* slot = &response;
+  proxy.connection->socket.async_connect(
+      proxy.backend->endpoint, upstream_handler([self, slot](beast::error_code ec) {
+        if (ec) {
+          self->on_upstream_error(*slot, ec);
+          return;
+        }
+        upstream_connection& connection = *slot->proxy.connection;
+        connection.connected = true;
+        connection.socket.set_option(tcp::no_delay(true), ec);
+        self->send_upstream_request(*slot);
+      }));
+}
+
+void http_session::send_upstream_request(OutboundResponse& response) {
+  ProxyTransfer& proxy = response.proxy;
+  std::uint32_t timeout = proxy.upstream->options().response_timeout;
+  proxy.deadline = deadline(timeout);
+  auto self = shared_from_this();
+  OutboundResponse* slot = &response;
+  net::async_write(proxy.connection->socket, net::buffer(proxy.request),
+                   upstream_handler([self, slot](beast::error_code ec, std::size_t) {
+                     if (ec) {
+                       self->on_upstream_error(*slot, ec);
+                       return;
+                     }
+                     slot->proxy.sent = true;
+                     if (self->proxying_ == slot) {
+                       self->read_proxy_body();
+                     } else {
+                       self->read_upstream_header(*slot);
+                     }
+                   }));
+}
+
+void http_session::read_proxy_body() {
+  proxying_->proxy.deadline = 0;
+  read_phase_ = read_phase::body;
+  read_deadline_ = deadline(options_.timeouts.body);
+  auto self = shared_from_this();
+  http::async_read_some(stream_, buffer_, *parser_,
+                        bind_pool(pool_, [self](beast::error_code ec, std::size_t) {
+                          self->on_proxy_body_read(ec);
+                        }));
+}
+
+void http_session::on_proxy_body_read(beast::error_code ec) {
+  read_deadline_ = 0;
+  OutboundResponse& response = *proxying_;
+  ProxyTransfer& proxy = response.proxy;
+  if (ec) {
+    // The backend has part of a request it will never see the end of; that
+    // is the client's doing, not the backend's
+    proxy.connection.reset();
+    if (ec == http::error::body_limit) {
+      fail_proxy(response, http::status::payload_too_large, "Request body too large");
+      return;
+    }
+    getGlobalLogger().logError("Error: ", ec);
+    drop_proxy(response);
+    return;
+  }
+
+  // Whatever this read parsed goes to the backend before the next read, so
+  // the client can send no faster than the backend takes it
+  auto& body = req().body();
+  bool done = parser_->is_done();
+  if (body.size() == 0 && !done) {
+    read_proxy_body();
+    return;
+  }
+  static const char last_chunk[] = "0\r\n\r\n";
+  proxy.buffers.clear();
+  if (proxy.chunked_request && body.size() > 0) {
+    int header_size = std::snprintf(proxy.chunk_header, sizeof(proxy.chunk_header), "%lx\r\n",
+                                    static_cast<unsigned long>(body.size()));
+    proxy.buffers.push_back(net::buffer(proxy.chunk_header, header_size));
+  }
+  for (auto buffer : beast::buffers_range(body.data())) {
+    proxy.buffers.push_back(buffer);
+  }
+  if (proxy.chunked_request && body.size() > 0) {
+    proxy.buffers.push_back(net::buffer("\r\n", 2));
+  }
+  if (proxy.chunked_request && done) {
+    proxy.buffers.push_back(net::buffer(last_chunk, sizeof(last_chunk) - 1));
+  }
+  proxy.body_sent = proxy.body_sent || body.size() > 0;
+
+  proxy.deadline = deadline(proxy.upstream->options().response_timeout);
+  auto self = shared_from_this();
+  OutboundResponse* slot = &response;
+  net::async_write(proxy.connection->socket, proxy.buffers,
+                   upstream_handler([self, slot, done](beast::error_code ec, std::size_t) {
+                     self->req().body().consume(self->req().body().size());
+                     if (ec) {
+                       self->on_upstream_error(*slot, ec);
+                     } else if (done) {
+                       self->finish_proxy_body();
+                     } else {
+                       self->read_proxy_body();
+                     }
+                   }));
+}
+
+void http_session::finish_proxy_body() {
+  OutboundResponse& response = *proxying_;
+  proxying_ = nullptr;
+  reading_ = false;
+  read_upstream_header(response);
+  finish_request();
+}
+
+void http_session::read_upstream_header(OutboundResponse& response) {
+  ProxyTransfer& proxy = response.proxy;
+  proxy.parser.emplace(std::piecewise_construct, std::make_tuple(),
+                       std::make_tuple(pool_allocator<char>(pool_)));
+  proxy.parser->header_limit(PROXY_HEADER_LIMIT);
+  proxy.parser->body_limit(std::numeric_limits<std::uint64_t>::max());
+  // A response to HEAD has no body, whatever its Content-Length says
+  proxy.parser->skip(proxy.head);
+  proxy.deadline = deadline(proxy.upstream->options().response_timeout);
+  auto self = shared_from_this();
+  OutboundResponse* slot = &response;
+  http::async_read_header(proxy.connection->socket, proxy.connection->buffer, *proxy.parser,
+                          upstream_handler([self, slot](beast::error_code ec, std::size_t) {
+                            self->on_upstream_header(*slot, ec);
+                          }));
+}
+
+void http_session::on_upstream_header(OutboundResponse& response, beast::error_code ec) {
+  ProxyTransfer& proxy = response.proxy;
+  proxy.deadline = 0;
+  if (ec) {
+    on_upstream_error(response, ec);
+    return;
+  }
+  const auto& upstream_response = proxy.parser->get();
+  unsigned status = upstream_response.result_int();
+  if (status / 100 == 1) {
+    // Interim responses are between this server and the backend (the
+    // client's 100-continue was answered here). Switching protocols is not
+    // supported, and Upgrade is never passed on, so 101 is a broken backend.
+    if (status != 101) {
+      read_upstream_header(response);
+      return;
+    }
+    proxy.connection.reset();
+    fail_proxy(response, http::status::bad_gateway, "Bad gateway");
+    return;
+  }
+  proxy.upstream->succeeded(*proxy.backend);
+
+  // The backend's fields go out as they are; the framing is this server's,
+  // as for every other response. A body of unknown length is chunked for
+  // an HTTP/1.1 client and ends with the connection for an older one.
+  header_writer header(response.storage, static_cast<http::status>(status), proxy.version);
+  beast::string_view connection = upstream_response[http::field::connection];
+  for (const auto& field : upstream_response) {
+    if (!is_hop_by_hop(field.name(), field.name_string(), connection)) {
+      header.set(to_string_view(field.name_string()), to_string_view(field.value()));
+    }
+  }
+  bool bodyless = proxy.head || status == 204 || status == 304;
+  bool close = !proxy.keep_alive;
+  auto length = proxy.parser->content_length();
+  if (length && status != 204) {
+    header.content_length(*length);
+  } else if (!bodyless && proxy.version >= 11) {
+    header.chunked();
+    proxy.chunked = true;
+  } else if (!bodyless) {
+    close = true;
+  }
+  header.keep_alive(!close);
+  header.finish();
+  response.header_begin = 0;
+  response.header_end = response.storage.size();
+  if (close) {
+    response.close = true;
+    closing_ = true;
+  }
+  proxy.ready = true;
+
+  getGlobalLogger().logResponse(status, to_string_view(upstream_response.reason()),
+                                length ? *length : 0, proxy.backend->address);
+  Metrics::getInstance().recordResponse(proxy.route_id, status, Metrics::now() - proxy.started);
+  do_write();
+}
+
+void http_session::on_upstream_error(OutboundResponse& response, beast::error_code ec) {
+  ProxyTransfer& proxy = response.proxy;
+  bool reused = proxy.connection && proxy.connection->reused;
+  proxy.connection.reset();
+  proxy.deadline = 0;
+  if (proxy.cancelled) {
+    drop_proxy(response);
+    return;
+  }
+
+  // A pooled connection the backend closed as it was picked up says
+  // nothing about the backend; anything else counts against it
+  bool stale = reused && !proxy.timed_out;
+  if (!stale) {
+    proxy.upstream->failed(*proxy.backend, coarse_now());
+  }
+  getGlobalLogger().logError("Backend " + proxy.backend->address + ": ", ec);
+  proxy.upstream->finished(*proxy.backend);
+  proxy.backend = nullptr;
+
+  // Another try, on whichever backend comes next, if the request can be
+  // sent again: none of its body is gone, and if the backend may have
+  // acted on it, it is idempotent
+  bool retry = !proxy.timed_out && !proxy.body_sent && (!proxy.sent || proxy.idempotent) &&
+               proxy.attempts < proxy.upstream->size() + (stale ? 1 : 0);
+  if (retry) {
+    proxy.sent = false;
+    connect_upstream(response);
+    return;
+  }
+  if (proxy.timed_out) {
+    fail_proxy(response, http::status::gateway_timeout, "Gateway timeout");
+  } else {
+    fail_proxy(response, http::status::bad_gateway, "Bad gateway");
+  }
+}
+
+void http_session::fail_proxy(OutboundResponse& response, http::status status,
+                              std::string_view message) {
+  ProxyTransfer& proxy = response.proxy;
+  unsigned version = proxy.version;
+  bool keep_alive = proxy.keep_alive;
+  bool head = proxy.head;
+  std::uint32_t route_id = proxy.route_id;
+  std::uint64_t started = proxy.started;
+  bool reading_body = proxying_ == &response;
+  if (reading_body) {
+    // The rest of the body is never read, so the connection cannot carry
+    // another request
+    proxying_ = nullptr;
+    reading_ = false;
+    keep_alive = false;
+  }
+  proxy.reset();
+
+  response.type = OutboundResponse::kind::buffered;
+  response.storage.clear();
+  header_writer header(response.storage, status, version);
+  header.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  header.set(http::field::content_type, "text/plain");
+  header.keep_alive(keep_alive);
+  header.content_length(message.size());
+  header.finish();
+  if (!head) {
+    response.storage.append(message.data(), message.size());
+  }
+  response.buffers.push_back(net::buffer(response.storage));
+  if (!keep_alive) {
+    response.close = true;
+    closing_ = true;
+  }
+
+  getGlobalLogger().logResponse(static_cast<unsigned>(status),
+                                to_string_view(http::obsolete_reason(status)), message.size());
+  Metrics::getInstance().recordResponse(route_id, static_cast<unsigned>(status),
+                                        Metrics::now() - started);
+  if (reading_body) {
+    finish_request();
+  } else {
+    do_write();
+  }
+}
+
+void http_session::drop_proxy(OutboundResponse& response) {
+  // The client is gone, or its request is broken; the empty slot just
+  // closes the connection once the responses ahead of it are out
+  if (http2_) {
+    response.proxy.reset();
+    h2_->drop_response(response);
+    return;
+  }
+  if (proxying_ == &response) {
+    proxying_ = nullptr;
+    reading_ = false;
+  }
+  response.proxy.reset();
+  response.type = OutboundResponse::kind::buffered;
+  response.close = true;
+  closing_ = true;
+  do_write();
+}
+
+void http_session::cancel_proxies() {
+  // Closing each backend connection fails whatever step it is in
+  for_each_response([](OutboundResponse& response) {
+    ProxyTransfer& proxy = response.proxy;
+    if (proxy.connection) {
+      proxy.cancelled = true;
+      beast::error_code ec;
+      proxy.connection->socket.close(ec);
+    }
+  });
+}
+
+void http_session::start_proxy_stream() {
+  OutboundResponse& response = front_response();
+  if (response.trace_id) {
+    trace_write_start(response);
+  }
+  if (!response.proxy.parser->is_done()) {
+    // The header goes out with the first piece of the body; written apart,
+    // the body would wait on the client's delayed ACK of the header
+    read_upstream_body();
+    return;
+  }
+  arm_write_deadline();
+  auto self = shared_from_this();
+  net::async_write(
+      stream_, slice(response.storage, response.header_begin, response.header_end),
+      bind_pool(pool_, [self](beast::error_code ec, std::size_t bytes) {
+        Metrics::getInstance().countBytesOut(bytes);
+        if (ec) {
+          self->on_write(ec, 1);
+          return;
+        }
+        self->finish_proxy();
+      }));
+}
+
+void http_session::read_upstream_body() {
+  // Waiting on the backend is not the client's write stalling
+  write_deadline_ = 0;
+  ProxyTransfer& proxy = front_response().proxy;
+  proxy.buffer.resize(PROXY_BUFFER_SIZE);
+  auto& body = proxy.parser->get().body();
+  body.data = proxy.buffer.data();
+  body.size = proxy.buffer.size();
+  proxy.deadline = deadline(proxy.upstream->options().response_timeout);
+  auto self = shared_from_this();
+  http::async_read_some(proxy.connection->socket, proxy.connection->buffer, *proxy.parser,
+                        upstream_handler([self](beast::error_code ec, std::size_t) {
+                          self->relay_upstream_body(ec);
+                        }));
+}
+
+void http_session::relay_upstream_body(beast::error_code ec) {
+  OutboundResponse& response = front_response();
+  ProxyTransfer& proxy = response.proxy;
+  proxy.deadline = 0;
+  if (ec == http::error::need_buffer) {
+    ec = {};  // the buffer is full
+  }
+  if (ec) {
+    // Part of the response is out, so the client can only be told by the
+    // connection closing
+    if (!proxy.cancelled) {
+      proxy.upstream->failed(*proxy.backend, coarse_now());
+    }
+    proxy.connection.reset();
+    on_write(ec, 1);
+    return;
+  }
+
+  std::size_t bytes = proxy.buffer.size() - proxy.parser->get().body().size;
+  bool done = proxy.parser->is_done();
+  if (bytes == 0 && !done) {
+    read_upstream_body();
+    return;
+  }
+  static const char last_chunk[] = "0\r\n\r\n";
+  proxy.buffers.clear();
+  if (response.header_begin < response.header_end) {
+    proxy.buffers.push_back(slice(response.storage, response.header_begin, response.header_end));
+    response.header_begin = response.header_end;
+  }
+  if (proxy.chunked && bytes > 0) {
+    int header_size = std::snprintf(proxy.chunk_header, sizeof(proxy.chunk_header), "%lx\r\n",
+                                    static_cast<unsigned long>(bytes));
+    proxy.buffers.push_back(net::buffer(proxy.chunk_header, header_size));
+  }
+  if (bytes > 0) {
+    proxy.buffers.push_back(net::buffer(proxy.buffer.data(), bytes));
+  }
+  if (proxy.chunked && bytes > 0) {
+    proxy.buffers.push_back(net::buffer("\r\n", 2));
+  }
+  if (proxy.chunked && done) {
+    proxy.buffers.push_back(net::buffer(last_chunk, sizeof(last_chunk) - 1));
+  }
+  if (proxy.buffers.empty()) {
+    finish_proxy();
+    return;
+  }
+
+  arm_write_deadline();
+  auto self = shared_from_this();
+  net::async_write(stream_, proxy.buffers,
+                   bind_pool(pool_, [self, done](beast::error_code ec, std::size_t bytes) {
+                     Metrics::getInstance().countBytesOut(bytes);
+                     if (ec) {
+                       self->on_write(ec, 1);
+                     } else if (done) {
+                       self->finish_proxy();
+                     } else {
+                       self->read_upstream_body();
+                     }
+                   }));
+}
+
+void http_session::finish_proxy() {
+  // A connection whose response was read to its end can take the next
+  // request for its backend, from any session on this io_context
+  ProxyTransfer& proxy = front_response().proxy;
+  if (proxy.connection && proxy.parser->is_done() && proxy.parser->keep_alive()) {
+    upstreams_.release(std::move(proxy.connection));
+  }
+  on_write({}, 1);
+}
+
+void http_session::log_response(unsigned status, std::string_view reason,
+                                std::size_t bytes, std::string_view note) {
+  getGlobalLogger().logResponse(status, reason, bytes, note);
+  Metrics::getInstance().recordResponse(route_id_, status,
+                                        Metrics::now() - request_started_);
+}
+
+void http_session::trace_write_start(OutboundResponse& response) {
+  // Ends the wait behind earlier responses; the write span starts here
+  std::uint64_t now = Tracer::now();
+  Tracer::getInstance().span("queued", response.trace_id, response.trace_mark, now);
+  response.trace_mark = now;
+}
+
+void http_session::send_cached(std::shared_ptr<const CachedAsset> asset) {
+  log_response(
+      asset->status,
+      to_string_view(http::obsolete_reason(http::int_to_status(asset->status))),
+      asset->body.size());
+
+  // Header and body are shared immutable buffers, written without copying
+  OutboundResponse& response = prepare_response();
+  response.buffers.push_back(net::buffer(asset->header));
+  if (req().method() != http::verb::head && !asset->body.empty()) {
+    response.buffers.push_back(net::buffer(asset->body));
+  }
+  response.owner = std::move(asset);
+  queue_response(!req().keep_alive());
+}
+
+void http_session::serve_asset(const std::shared_ptr<const StaticAsset>& asset) {
+  // Pick the best precompressed variant the client accepts. Byte ranges
+  // address the identity bytes, so range requests skip negotiation.
+  bool ranged = req().method() == http::verb::get &&
+                req().find(http::field::range) != req().end();
+  int choice = asset->variants.empty() || ranged
+                   ? -1
+                   : negotiate_encoding(
+                         to_string_view(req()[http::field::accept_encoding]),
+                         asset->encodings);
+  const AssetVariant& variant =
+      choice < 0 ? asset->identity : asset->variants[choice];
+
+  // Revalidation is answered from the pre-built 304 without touching the file
+  if (is_not_modified(variant.headers.etag, variant.headers.last_modified)) {
+    send_cached(variant.not_modified);
+    return;
+  }
+
+  if (variant.response) {
+    send_cached(variant.response);
+  } else {
+    send_file(variant.file_path, variant.headers);
+  }
+}
+
+void http_session::serve_bundled(const std::shared_ptr<const AssetBundle>& bundle,
+                                 std::string_view path) {
+  const BundleEntry* entry = bundle->find(path);
+  if (!entry) {
+    handle_fallback();
+    return;
+  }
+
+  // Same choice as serve_asset, made on the mapped index
+  const BundleVariant* variants = bundle->variants(*entry);
+  bool ranged = req().method() == http::verb::get &&
+                req().find(http::field::range) != req().end();
+  std::size_t choice = 0;
+  if (!ranged && entry->variant_count > 1) {
+    std::string_view accept_encoding = to_string_view(req()[http::field::accept_encoding]);
+    int best_q = 0;
+    for (std::size_t i = 1; i < entry->variant_count; ++i) {
+      int q = encoding_quality(accept_encoding, bundle->text(variants[i].encoding));
+      if (q > best_q) {
+        choice = i;
+        best_q = q;
+      }
+    }
+  }
+  const BundleVariant& variant = variants[choice];
+
+  if (is_not_modified(bundle->text(variant.etag), bundle->text(variant.last_modified))) {
+    send_bundled(bundle, 304, bundle->text(variant.not_modified), {});
+    return;
+  }
+
+  std::string_view body = bundle->text(variant.body);
+  if (ranged) {
+    AssetHeaders headers;
+    headers.content_type = bundle->text(variant.content_type);
+    headers.etag = bundle->text(variant.etag);
+    headers.last_modified = bundle->text(variant.last_modified);
+    headers.vary = entry->variant_count > 1;
+    switch (requested_ranges(body.size(), headers)) {
+      case RangeParse::ignore:
+        break;
+      case RangeParse::unsatisfiable:
+        send_range_not_satisfiable(body.size());
+        return;
+      case RangeParse::satisfiable:
+        send_memory_ranges(body, headers, bundle);
+        return;
+    }
+  }
+  send_bundled(bundle, 200, bundle->text(variant.header), body);
+}
+
+void http_session::send_bundled(const std::shared_ptr<const AssetBundle>& bundle,
+                                unsigned status, std::string_view header,
+                                std::string_view body) {
+  log_response(status, to_string_view(http::obsolete_reason(http::int_to_status(status))),
+               body.size());
+
+  // Both point into the mapping, which the response keeps alive
+  OutboundResponse& response = prepare_response();
+  response.buffers.push_back(net::buffer(header.data(), header.size()));
+  if (req().method() != http::verb::head && !body.empty()) {
+    response.buffers.push_back(net::buffer(body.data(), body.size()));
+  }
+  response.owner = bundle;
+  queue_response(!req().keep_alive());
+}
+
+bool http_session::is_not_modified(std::string_view etag,
+                                   std::string_view last_modified) const {
+  const http_request& request = req();
+  if (request.method() != http::verb::get && request.method() != http::verb::head) {
+    return false;
+  }
+
+  // If-None-Match takes precedence over If-Modified-Since (RFC 9110 13.2.2)
+  auto if_none_match = request.find(http::field::if_none_match);
+  if (if_none_match != request.end()) {
+    return !etag.empty() &&
+           etag_matches(to_string_view(if_none_match->value()), etag);
+  }
+
+  // Each representation carries its own Last-Modified; precompressed
+  // siblings are files of their own with their own times
+  auto if_modified_since = request.find(http::field::if_modified_since);
+  std::time_t since, modified;
+  return if_modified_since != request.end() &&
+         parse_http_date(last_modified, modified) &&
+         parse_http_date(to_string_view(if_modified_since->value()), since) &&
+         modified <= since;
+}
+
+RangeParse http_session::requested_ranges(std::uint64_t size,
+                                          const AssetHeaders& headers) {
+  const http_request& request = req();
+  if (request.method() != http::verb::get || !headers.content_encoding.empty()) {
+    return RangeParse::ignore;
+  }
+  auto range = request.find(http::field::range);
+  if (range == request.end()) {
+    return RangeParse::ignore;
+  }
+
+  // If-Range: send the ranges only if the client's copy is still current,
+  // otherwise the whole representation. Entity tags use the strong
+  // comparison and dates must match exactly (RFC 9110 section 13.1.5).
+  auto if_range = request.find(http::field::if_range);
+  if (if_range != request.end()) {
+    std::string_view validator = to_string_view(if_range->value());
+    const std::string& current = !validator.empty() && validator.front() == '"'
+                                     ? headers.etag
+                                     : headers.last_modified;
+    if (current.empty() || validator != current) {
+      return RangeParse::ignore;
+    }
+  }
+
+  return parse_range(to_string_view(range->value()), size, ranges_);
+}
+
+void http_session::send_range_not_satisfiable(std::uint64_t size) {
+  char range_text[64];
+  int n = std::snprintf(range_text, sizeof(range_text), "bytes */%llu",
+                        static_cast<unsigned long long>(size));
+
+  OutboundResponse& response = prepare_response();
+  header_writer header(response.storage, http::status::range_not_satisfiable,
+                       req().version());
+  header.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  header.set(http::field::content_range,
+             std::string_view(range_text, static_cast<std::size_t>(n)));
+  header.keep_alive(req().keep_alive());
+  header.content_length(0);
+  header.finish();
+  response.buffers.push_back(net::buffer(response.storage));
+
+  log_response(416, "Range Not Satisfiable", 0);
+  queue_response(!req().keep_alive());
+}
+
+std::uint64_t http_session::write_partial_header(OutboundResponse& response,
+                                                 const AssetHeaders& headers,
+                                                 std::uint64_t size) {
+  // Builds the 206 for ranges_ into the slot's storage. Multipart framing
+  // goes in first, so the Content-Length is known by the time the header is
+  // written after it; each piece is then sent as a slice of storage.
+  std::string& out = response.storage;
+  std::vector<FileSegment>& segments = response.file.segments;
+  char range_text[64];
+  std::uint64_t length = 0;
+
+  if (ranges_.size() > 1) {
+    const std::string& boundary = byteranges_boundary();
+    for (const ByteRange& range : ranges_) {
+      std::size_t begin = out.size();
+      out += segments.empty() ? "--" : "\r\n--";
+      out += boundary;
+      out += "\r\nContent-Type: ";
+      out += headers.content_type;
+      out += "\r\nContent-Range: ";
+      out += content_range(range_text, range, size);
+      out += "\r\n\r\n";
+      segments.push_back({begin, out.size(), range.first, range.length()});
+      length += out.size() - begin + range.length();
+    }
+    response.trailer_begin = out.size();
+    out += "\r\n--";
+    out += boundary;
+    out += "--\r\n";
+    response.trailer_end = out.size();
+    length += response.trailer_end - response.trailer_begin;
+  } else {
+    const ByteRange& range = ranges_.front();
+    segments.push_back({0, 0, range.first, range.length()});
+    length = range.length();
+  }
+
+  response.header_begin = out.size();
+  header_writer header(out, http::status::partial_content, req().version());
+  if (ranges_.size() > 1) {
+    set_asset_headers(header, headers, byteranges_content_type());
+  } else {
+    set_asset_headers(header, headers);
+    header.set(http::field::content_range,
+               content_range(range_text, ranges_.front(), size));
+  }
+  header.keep_alive(req().keep_alive());
+  header.content_length(length);
+  header.finish();
+  response.header_end = out.size();
+  return length;
+}
+
+void http_session::send_cached_file(std::shared_ptr<const CachedAsset> asset,
+                                    const AssetHeaders& headers) {
+  switch (requested_ranges(asset->body.size(), headers)) {
+    case RangeParse::ignore:
+      send_cached(std::move(asset));
+      return;
+    case RangeParse::unsatisfiable:
+      send_range_not_satisfiable(asset->body.size());
+      return;
+    case RangeParse::satisfiable:
+      break;
+  }
+
+  const std::string& body = asset->body;
+  send_memory_ranges(body, headers, std::move(asset));
+}
+
+void http_session::send_memory_ranges(std::string_view body, const AssetHeaders& headers,
+                                      std::shared_ptr<const void> owner) {
+  // The ranges are slices of the body; only the framing is built per
+  // request
+  OutboundResponse& response = prepare_response();
+  std::uint64_t length = write_partial_header(response, headers, body.size());
+  const std::string& storage = response.storage;
+  response.buffers.push_back(slice(storage, response.header_begin, response.header_end));
+  for (const FileSegment& segment : response.file.segments) {
+    if (segment.prefix_begin != segment.prefix_end) {
+      response.buffers.push_back(slice(storage, segment.prefix_begin, segment.prefix_end));
+    }
+    response.buffers.push_back(
+        net::buffer(body.data() + segment.offset, segment.length));
+  }
+  if (response.trailer_begin != response.trailer_end) {
+    response.buffers.push_back(
+        slice(storage, response.trailer_begin, response.trailer_end));
+  }
+  response.file.segments.clear();
+  response.owner = std::move(owner);
+
+  log_response(206, "Partial Content", length);
+  queue_response(!req().keep_alive());
+}
+
+void http_session::stream_file(const std::string& file_path,
+                               const std::string& content_type) {
+  AssetHeaders headers;
+  headers.content_type = content_type;
+  send_file(file_path, headers);
+}
+
+void http_session::send_file(const std::string& file_path,
+                             const AssetHeaders& headers) {
+  // Small files are answered straight from memory
+  if (auto asset = AssetCache::getInstance().get(file_path, headers)) {
+    send_cached_file(std::move(asset), headers);
+    return;
+  }
+
+  // Large files go straight from the page cache to the socket
+  if (try_sendfile(file_path, headers)) {
+    return;
+  }
+
+  OutboundResponse& response = prepare_response();
+  FileTransfer& transfer = response.file;
+
+  // Giving the filebuf a buffer of our own keeps open() from allocating one;
+  // reads of a whole transfer buffer bypass it anyway
+  transfer.file_stream.rdbuf()->pubsetbuf(transfer.stream_buffer,
+                                          sizeof(transfer.stream_buffer));
+  transfer.file_stream.open(file_path, std::ios::binary);
+  if (!transfer.file_stream.is_open()) {
+    getGlobalLogger().log("File not found: " + file_path);
+    transfer.reset();
+    send_bad_request("File not found");
+    return;
+  }
+
+  transfer.file_stream.seekg(0, std::ios::end);
+  std::uint64_t size = transfer.file_stream.tellg();
+  transfer.file_stream.seekg(0);
+
+  switch (requested_ranges(size, headers)) {
+    case RangeParse::ignore:
+      break;
+    case RangeParse::unsatisfiable:
+      transfer.reset();
+      send_range_not_satisfiable(size);
+      return;
+    case RangeParse::satisfiable: {
+      // Seek to each range and send exactly its bytes under a Content-Length
+      std::uint64_t length = write_partial_header(response, headers, size);
+      response.type = OutboundResponse::kind::file;
+      log_response(206, "Partial Content", length);
+      queue_response(!req().keep_alive());
+      return;
+    }
+  }
+
+  // Send the header once the earlier responses are out, then the chunks
+  header_writer header(response.storage, http::status::ok, req().version());
+  set_asset_headers(header, headers);
+  header.keep_alive(req().keep_alive());
+  header.chunked();
+  header.finish();
+  response.header_end = response.storage.size();
+  response.type = OutboundResponse::kind::chunked_file;
+  response.head = req().method() == http::verb::head;
+  log_response(200, "OK", size, "chunked");
+  queue_response(!req().keep_alive());
+}
+
+bool http_session::try_sendfile(const std::string& file_path,
+                                const AssetHeaders& headers) {
+#ifdef __linux__
+  int fd = ::open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < SENDFILE_MIN_SIZE) {
+    ::close(fd);
+    return false;
+  }
+
+  std::uint64_t size = st.st_size;
+  switch (requested_ranges(size, headers)) {
+    case RangeParse::unsatisfiable:
+      ::close(fd);
+      send_range_not_satisfiable(size);
+      return true;
+    case RangeParse::satisfiable: {
+      // sendfile starts at each range's offset, so only the requested
+      // bytes are read
+      OutboundResponse& response = prepare_response();
+      std::uint64_t length = write_partial_header(response, headers, size);
+      log_response(206, "Partial Content", length, "sendfile");
+      break;
+    }
+    case RangeParse::ignore: {
+      OutboundResponse& response = prepare_response();
+      header_writer header(response.storage, http::status::ok, req().version());
+      set_asset_headers(header, headers);
+      header.keep_alive(req().keep_alive());
+      header.content_length(size);
+      header.finish();
+      response.header_end = response.storage.size();
+      if (req().method() != http::verb::head) {
+        response.file.segments.push_back({0, 0, 0, size});
+      }
+      log_response(200, "OK", size, "sendfile");
+      break;
+    }
+  }
+
+  // prepare_response() has not queued the slot yet, so it is still the one
+  // just filled
+  OutboundResponse& response = next_response();
+  response.file.fd = fd;
+  // Through TLS the file is encrypted in user space, unless the kernel
+  // does it for us
+  response.file.copy = !stream_.zero_copy();
+  response.type = OutboundResponse::kind::file;
+  queue_response(!req().keep_alive());
+  return true;
+#else
+  return false;
+#endif
+}
+
+void http_session::start_stream() {
+  arm_write_deadline();
+  OutboundResponse& response = front_response();
+  if (response.trace_id) {
+    trace_write_start(response);
+  }
+  auto self = shared_from_this();
+  net::async_write(
+      stream_, slice(response.storage, response.header_begin, response.header_end),
+      bind_pool(pool_, [self](beast::error_code ec, std::size_t bytes) {
+        Metrics::getInstance().countBytesOut(bytes);
+        OutboundResponse& response = self->front_response();
+        if (ec || (response.type == OutboundResponse::kind::chunked_file &&
+                   response.head)) {
+          self->on_write(ec, 1);
+        } else if (response.type == OutboundResponse::kind::chunked_file) {
+          self->do_file_read();
+        } else {
+          self->next_file_segment();
+        }
+      }));
+}
+
+std::size_t http_session::file_read_size() const {
+  // A trip through the file I/O pool costs two thread hand-offs, so read
+  // more per trip
+  return options_.file_io ? 64 * 1024 : 4096;
+}
+
+void http_session::do_file_read() {
+  arm_write_deadline();
+  FileTransfer& transfer = front_response().file;
+  if (!transfer.file_stream.good()) {
+    // The chunked body cannot be finished
+    getGlobalLogger().log("Error: File stream is not good");
+    beast::error_code ec;
+    socket_->close(ec);
+    return;
+  }
+
+  transfer.buffer.resize(file_read_size());
+  std::uint64_t trace_id = front_response().trace_id;
+  run_file_io(
+      [&transfer, trace_id] {
+        TraceScope trace("file-read", trace_id);
+        transfer.file_stream.read(transfer.buffer.data(), transfer.buffer.size());
+        return transfer.file_stream.gcount();
+      },
+      [this](std::streamsize bytes_read) { write_file_chunk(bytes_read); });
+}
+
+void http_session::write_file_chunk(std::streamsize bytes_read) {
+  auto self = shared_from_this();
+  FileTransfer& transfer = front_response().file;
+
+  // The final chunk is a constant; the others are framed by hand into
+  // chunk_header rather than through Beast's chunk objects, which allocate
+  static const char last_chunk[] = "0\r\n\r\n";
+  if (bytes_read <= 0) {
+    net::async_write(stream_, net::buffer(last_chunk, sizeof(last_chunk) - 1),
+                     bind_pool(pool_, [self](beast::error_code ec, std::size_t bytes) {
+                       Metrics::getInstance().countBytesOut(bytes);
+                       self->on_write(ec, 1);
+                     }));
+    return;
+  }
+
+  // Send a chunk, followed by the last chunk if this was the end of the file
+  int header_size = std::snprintf(transfer.chunk_header, sizeof(transfer.chunk_header),
+                                  "%lx\r\n", static_cast<unsigned long>(bytes_read));
+  bool last = transfer.file_stream.eof();
+  std::array<net::const_buffer, 4> chunk = {
+      net::buffer(transfer.chunk_header, header_size),
+      net::buffer(transfer.buffer.data(), bytes_read), net::buffer("\r\n", 2),
+      net::buffer(last_chunk, last ? sizeof(last_chunk) - 1 : 0)};
+  net::async_write(stream_, chunk,
+                   bind_pool(pool_, [self, last](beast::error_code ec, std::size_t bytes) {
+                     Metrics::getInstance().countBytesOut(bytes);
+                     if (ec || last) {
+                       self->on_write(ec, 1);
+                       return;
+                     }
+                     self->do_file_read();
+                   }));
+}
+
+void http_session::next_file_segment() {
+  OutboundResponse& response = front_response();
+  FileTransfer& transfer = response.file;
+  auto self = shared_from_this();
+
+  if (transfer.next_segment == transfer.segments.size()) {
+    // Every range is out; close the multipart body if there is one
+    if (response.trailer_begin == response.trailer_end) {
+      on_write({}, 1);
+      return;
+    }
+    net::async_write(stream_,
+                     slice(response.storage, response.trailer_begin, response.trailer_end),
+                     bind_pool(pool_, [self](beast::error_code ec, std::size_t bytes) {
+                       Metrics::getInstance().countBytesOut(bytes);
+                       self->on_write(ec, 1);
+                     }));
+    return;
+  }
+
+  const FileSegment& segment = transfer.segments[transfer.next_segment++];
+  transfer.offset = segment.offset;
+  transfer.remaining = segment.length;
+  if (segment.prefix_begin == segment.prefix_end) {
+    continue_file_segment();
+    return;
+  }
+  net::async_write(stream_,
+                   slice(response.storage, segment.prefix_begin, segment.prefix_end),
+                   bind_pool(pool_, [self](beast::error_code ec, std::size_t bytes) {
+                     Metrics::getInstance().countBytesOut(bytes);
+                     if (ec) {
+                       self->on_write(ec, 1);
+                       return;
+                     }
+                     self->continue_file_segment();
+                   }));
+}
+
+void http_session::continue_file_segment() {
+  FileTransfer& transfer = front_response().file;
+  if (transfer.fd < 0) {
+    transfer.file_stream.seekg(transfer.offset);
+    do_file_range();
+  } else if (transfer.copy) {
+    do_sendfile_copy();
+  } else {
+    do_sendfile();
+  }
+}
+
+void http_session::do_file_range() {
+  arm_write_deadline();
+  FileTransfer& transfer = front_response().file;
+  if (transfer.remaining == 0) {
+    next_file_segment();
+    return;
+  }
+
+  transfer.buffer.resize(file_read_size());
+  std::size_t size = std::min<std::uint64_t>(transfer.buffer.size(), transfer.remaining);
+  std::uint64_t trace_id = front_response().trace_id;
+  run_file_io(
+      [&transfer, size, trace_id] {
+        TraceScope trace("file-read", trace_id);
+        transfer.file_stream.read(transfer.buffer.data(), size);
+        return transfer.file_stream.gcount();
+      },
+      [this](std::streamsize bytes_read) { write_file_range(bytes_read); });
+}
+
+void http_session::write_file_range(std::streamsize bytes_read) {
+  auto self = shared_from_this();
+  FileTransfer& transfer = front_response().file;
+  if (bytes_read <= 0) {
+    // The file shrank underneath us; the Content-Length cannot be honoured
+    getGlobalLogger().log("Error: File stream is not good");
+    beast::error_code ec;
+    socket_->close(ec);
+    return;
+  }
+  transfer.remaining -= bytes_read;
+
+  net::async_write(stream_, net::buffer(transfer.buffer.data(), bytes_read),
+                   bind_pool(pool_, [self](beast::error_code ec, std::size_t bytes) {
+                     Metrics::getInstance().countBytesOut(bytes);
+                     if (ec) {
+                       self->on_write(ec, 1);
+                       return;
+                     }
+                     self->do_file_range();
+                   }));
+}
+
+http_session::sendfile_status http_session::sendfile_turn(int socket,
+                                                         FileTransfer& transfer,
+                                                         std::uint64_t trace_id,
+                                                         int& error) {
+#ifdef __linux__
+  TraceScope trace("sendfile", trace_id);
+
+  // Bound the work done per wakeup so one fast reader cannot starve the
+  // other sessions on this io_context
+  std::size_t budget = SENDFILE_MAX_PER_TURN;
+  while (transfer.remaining > 0 && budget > 0) {
+    off_t offset = static_cast<off_t>(transfer.offset);
+    ssize_t n = ::sendfile(socket, transfer.fd, &offset,
+                           std::min<std::uint64_t>(transfer.remaining, budget));
+    if (n > 0) {
+      Metrics::getInstance().countBytesOut(n);
+      transfer.offset += n;
+      transfer.remaining -= n;
+      budget -= std::min<std::size_t>(n, budget);
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return sendfile_status::would_block;
+    }
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+      return sendfile_status::unsupported;
+    }
+    error = n < 0 ? errno : 0;
+    return sendfile_status::failed;
+  }
+  return transfer.remaining > 0 ? sendfile_status::more : sendfile_status::done;
+#else
+  return sendfile_status::unsupported;
+#endif
+}
+
+void http_session::do_sendfile() {
+  arm_write_deadline();
+  FileTransfer& transfer = front_response().file;
+  beast::error_code ec;
+  socket_->native_non_blocking(true, ec);
+
+  // On the file I/O pool the socket is only written by the pool thread
+  // while the session waits, so sharing the descriptor is safe
+  int socket = socket_->native_handle();
+  std::uint64_t trace_id = front_response().trace_id;
+  run_file_io(
+      [socket, &transfer, trace_id] {
+        int error = 0;
+        sendfile_status status = sendfile_turn(socket, transfer, trace_id, error);
+        return std::make_pair(status, error);
+      },
+      [this](std::pair<sendfile_status, int> result) {
+        on_sendfile_turn(result.first, result.second);
+      });
+}
+
+void http_session::on_sendfile_turn(sendfile_status status, int error) {
+  auto self = shared_from_this();
+  FileTransfer& transfer = front_response().file;
+  beast::error_code ec;
+  switch (status) {
+    case sendfile_status::done:
+      next_file_segment();
+      return;
+    case sendfile_status::more:
+      net::post(socket_->get_executor(),
+                bind_pool(pool_, [self] { self->do_sendfile(); }));
+      return;
+    case sendfile_status::would_block:
+      // Socket buffer is full; resume once the kernel drains it
+      socket_->async_wait(tcp::socket::wait_write,
+                          bind_pool(pool_, [self](beast::error_code ec) {
+                            if (ec) {
+                              self->on_write(ec, 1);
+                              return;
+                            }
+                            self->do_sendfile();
+                          }));
+      return;
+    case sendfile_status::unsupported:
+      // The file system cannot splice this file; copy it through user space
+      // from where sendfile stopped
+      transfer.copy = true;
+      do_sendfile_copy();
+      return;
+    case sendfile_status::failed:
+      // Hard error, or the file shrank underneath us; the declared
+      // Content-Length can no longer be honoured
+      getGlobalLogger().logError("Error in sendfile: ",
+                                 error ? beast::error_code(error, beast::system_category())
+                                       : beast::error_code(net::error::eof));
+      socket_->close(ec);
+      return;
+  }
+}
+
+void http_session::do_sendfile_copy() {
+#ifdef __linux__
+  arm_write_deadline();
+  FileTransfer& transfer = front_response().file;
+  if (transfer.remaining == 0) {
+    next_file_segment();
+    return;
+  }
+
+  transfer.buffer.resize(64 * 1024);
+  std::size_t size = std::min<std::uint64_t>(transfer.remaining, transfer.buffer.size());
+  std::uint64_t trace_id = front_response().trace_id;
+  run_file_io(
+      [&transfer, size, trace_id] {
+        TraceScope trace("file-read", trace_id);
+        ssize_t n = ::pread(transfer.fd, transfer.buffer.data(), size,
+                            static_cast<off_t>(transfer.offset));
+        return std::make_pair(static_cast<std::int64_t>(n), n < 0 ? errno : 0);
+      },
+      [this](std::pair<std::int64_t, int> result) {
+        write_copied_range(result.first, result.second);
+      });
+#endif
+}
+
+void http_session::write_copied_range(std::int64_t n, int error) {
+  FileTransfer& transfer = front_response().file;
+  if (n <= 0) {
+    getGlobalLogger().logError("Error reading file: ",
+                               n < 0 ? beast::error_code(error, beast::system_category())
+                                     : beast::error_code(net::error::eof));
+    beast::error_code ec;
+    socket_->close(ec);
+    return;
+  }
+
+  transfer.offset += n;
+  transfer.remaining -= n;
+
+  auto self = shared_from_this();
+  net::async_write(stream_, net::buffer(transfer.buffer.data(), n),
+                   bind_pool(pool_, [self](beast::error_code ec, std::size_t bytes) {
+                     Metrics::getInstance().countBytesOut(bytes);
+                     if (ec) {
+                       self->on_write(ec, 1);
+                       return;
+                     }
+                     self->do_sendfile_copy();
+                   }));
+}
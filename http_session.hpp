@@ -1,57 +1,403 @@
-// http_session.hpp
-#ifndef HTTP_SESSION_HPP
-#define HTTP_SESSION_HPP
-
-#include <boost/beast/core.hpp>
-#include <boost/beast/http.hpp>
-#include <boost/asio/write.hpp>
-#include <boost/asio/ip/tcp.hpp>
-#include <boost/asio/spawn.hpp>
-#include <functional>
-#include <memory>
-#include <string>
-#include <map>
-#include <fstream>
-#include <vector>
-
-class http_session;
-#include "router.hpp"
-
-namespace beast = boost::beast;  // from <boost/beast.hpp>
-namespace http = beast::http;    // from <boost/beast/http.hpp>
-namespace net = boost::asio;     // from <boost/asio.hpp>
-using tcp = net::ip::tcp;        // from <boost/asio/ip/tcp.hpp>
-
-struct FileTransfer {
-    std::ifstream file_stream;
-    std::vector<char> buffer;
-    std::shared_ptr<http::response<http::buffer_body>> response;
-
-    FileTransfer() : buffer(4096) { /* ... */ }
-};
-
-class http_session : public std::enable_shared_from_this<http_session> {
-public:
-    explicit http_session(tcp::socket socket);
-    void start();
-
-    void send_response(const std::string& message, const std::string &content_type);
-    void send_bad_request(const std::string& message);
-    void stream_file(const std::string& file_path, const std::string &content_type);
-
-private:
-    tcp::socket socket_;
-    beast::flat_buffer buffer_;
-    http::request<http::dynamic_body> req_;
-    std::unordered_map<int, FileTransfer> file_transfers;
-    int next_transfer_id = 0;
-
-    void do_read();
-    void on_read(beast::error_code ec, std::size_t bytes_transferred);
-    void on_write(beast::error_code ec, bool close);
-    void handle_fallback();
-
-    void do_file_read(int transfer_id);
-};
-
-#endif  // HTTP_SESSION_HPP
+// http_session.hpp
+#ifndef HTTP_SESSION_HPP
+#define HTTP_SESSION_HPP
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/container/small_vector.hpp>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <map>
+#include <fstream>
+#include <vector>
+
+class http_session;
+class h2_connection;
+struct h2_stream;
+#include "async_handler.hpp"
+#include "http_request.hpp"
+#include "memory_pool.hpp"
+#include "route_params.hpp"
+#include "router.hpp"
+#include "asset_bundle.hpp"
+#include "asset_cache.hpp"
+#include "static_asset.hpp"
+#include "byte_range.hpp"
+#include "strand_ref.hpp"
+#include "proxy.hpp"
+#include "rate_limiter.hpp"
+#include "tls.hpp"
+#include "upload.hpp"
+
+namespace beast = boost::beast;  // from <boost/beast.hpp>
+namespace http = beast::http;    // from <boost/beast/http.hpp>
+namespace net = boost::asio;     // from <boost/asio.hpp>
+using tcp = net::ip::tcp;        // from <boost/asio/ip/tcp.hpp>
+
+// One stretch of a response body taken from a file or cached buffer. The
+// framing sent before it (multipart delimiter and part headers) is the
+// [prefix_begin, prefix_end) slice of the response's storage.
+struct FileSegment {
+    std::size_t prefix_begin = 0;
+    std::size_t prefix_end = 0;
+    std::uint64_t offset = 0;
+    std::uint64_t length = 0;
+};
+
+// A file body being streamed to the socket. Large files are moved with
+// sendfile(2) so the body never passes through user space; the ifstream is
+// the fallback where that is unavailable.
+struct FileTransfer {
+    std::ifstream file_stream;
+    int fd = -1;
+    std::vector<FileSegment> segments;  // one per range; the whole file for a 200
+    std::size_t next_segment = 0;
+    std::uint64_t offset = 0;
+    std::uint64_t remaining = 0;        // left in the current segment
+    bool copy = false;                  // sendfile refused; copying through user space
+    std::vector<char> buffer;
+    char stream_buffer[64];             // given to the filebuf so opening it does not allocate
+    char chunk_header[20];              // "<hex size>\r\n" for the chunk being written
+
+    void reset();
+    ~FileTransfer();
+};
+
+// A request forwarded to a backend and the response relayed back. The
+// backend's header is read as soon as it comes, but its body only once the
+// response is at the front of the queue, one buffer at a time, so neither
+// body is held whole.
+struct ProxyTransfer {
+    using response_parser = http::response_parser<http::buffer_body, pool_allocator<char>>;
+
+    std::shared_ptr<Upstream> upstream;
+    Upstream::Backend* backend = nullptr;  // counted as in flight while set
+    std::unique_ptr<upstream_connection> connection;
+    std::string request;                   // the header as sent to the backend
+    std::optional<response_parser> parser;
+    std::vector<char> buffer;              // one read of the response body
+    std::vector<net::const_buffer> buffers;  // the body write in progress, either way
+    char chunk_header[20];
+    std::uint64_t deadline = 0;            // coarse_now() ms for the backend's current step
+    std::uint64_t started = 0;             // Metrics::now() when the request was read
+    std::uint32_t route_id = 0;
+    unsigned version = 11;                 // the client's
+    unsigned attempts = 0;
+    bool keep_alive = true;                // the client's
+    bool head = false;
+    bool idempotent = false;
+    bool chunked_request = false;          // body sent to the backend as chunks
+    bool sent = false;                     // the header reached the backend
+    bool body_sent = false;                // and some of the body, which cannot be replayed
+    bool ready = false;                    // the response header is in the slot's storage
+    bool chunked = false;                  // response body re-framed as chunks
+    bool timed_out = false;
+    bool cancelled = false;                // the client connection is gone
+
+    // Closes the connection, if any, and stops counting the request
+    void reset();
+    ~ProxyTransfer();
+};
+
+// A response waiting its turn on the socket. Buffered responses are fully
+// serialized and may be coalesced with their neighbours into one gather
+// write; streamed ones (files) take the socket over and report back through
+// on_write once their last byte is out. A pending slot holds the place of a
+// coroutine handler's response and blocks the queue until it is filled; a
+// proxied one blocks it until the backend's header is in, then streams like
+// a file. Slots are recycled in a ring, so storage and the transfers' vectors
+// keep their capacity across requests.
+struct OutboundResponse {
+    enum class kind { buffered, chunked_file, file, pending, proxied };
+
+    kind type = kind::buffered;
+    bool close = false;
+    bool head = false;                  // chunked_file: send the header only
+    boost::container::small_vector<net::const_buffer, 4> buffers;
+    std::shared_ptr<const void> owner;  // keeps what buffers point at alive
+    std::string storage;                // header and framing built for this response
+    std::size_t header_begin = 0;       // file kinds: where the header sits in storage
+    std::size_t header_end = 0;
+    std::size_t trailer_begin = 0;      // closing multipart delimiter, if any
+    std::size_t trailer_end = 0;
+    FileTransfer file;
+    ProxyTransfer proxy;
+    std::uint64_t trace_id = 0;         // Tracer id of the request, 0 if not sampled
+    std::uint64_t trace_mark = 0;       // start of the phase it is in
+
+    void reset();
+    // reset(), and give back the capacity it keeps
+    void release();
+};
+
+// Deadlines for each phase of a connection, in milliseconds; 0 turns one
+// off. They are checked by the session_pool's reaper, so one may be overrun
+// by up to its interval.
+struct session_timeouts {
+    std::uint32_t header = 10000;  // from connecting, or a request's first byte, to the end of its header
+    std::uint32_t body = 30000;    // for each read of a request body
+    std::uint32_t write = 30000;   // for each write of a response to make progress
+    std::uint32_t idle = 15000;    // keep-alive wait for the next request
+};
+
+// Per-session behaviour chosen at startup; owned by http_server
+struct session_options {
+    bool compress_dynamic = false;  // gzip large send_response bodies
+    std::size_t compress_min_size = 1024;
+    bool strand = false;            // run each session's handlers on its own strand
+    net::thread_pool* file_io = nullptr;  // where blocking file reads run; null for inline
+    bool http2 = true;              // h2c by upgrade or prior knowledge; TLS offers it by ALPN
+    session_timeouts timeouts;
+};
+
+// Sessions are recycled by their io_context's session_pool: reset() binds a
+// pooled session to a new connection and recycle() returns it, keeping its
+// buffers, response slots and memory pool warm for the next one.
+class http_session : public std::enable_shared_from_this<http_session> {
+public:
+    http_session(net::io_context& ioc, std::atomic<int>& load,
+                 std::atomic<std::uint64_t>& requests, std::atomic<bool>& overloaded,
+                 upstream_pool& upstreams, const session_options& options);
+    ~http_session();
+    // tls set: the connection is HTTPS, and start() begins with the handshake
+    void reset(tcp::socket socket, const RateLimiter::ClientKey& client, TlsContext* tls);
+    void recycle();
+    // trace_id: sampled at accept, so the first request's spans join the
+    // accept-handoff span; 0 if not sampled
+    void start(std::uint64_t trace_id = 0);
+
+    // The whole of a response refusing a connection: 503 for shedding
+    // load, 429 for a client over its connection limit. Fixed, so refusing
+    // work costs next to nothing.
+    static std::string_view refusal_response(http::status status);
+    // Run by the session_pool's reaper: closes the connection if its current
+    // phase is past its deadline, and releases the buffers of one that has
+    // been waiting for its next request since the last check
+    void check_timeouts(std::uint64_t now);
+    bool active() const { return socket_.has_value(); }
+
+    void send_response(const std::string& message, const std::string &content_type);
+    void send_bad_request(const std::string& message);
+    void send_error(http::status status, const std::string& message);
+    void stream_file(const std::string& file_path, const std::string &content_type);
+    void serve_asset(const std::shared_ptr<const StaticAsset>& asset);
+    // Serves path from a mapped bundle, or the fallback page if it has none
+    void serve_bundled(const std::shared_ptr<const AssetBundle>& bundle, std::string_view path);
+    // Runs a coroutine handler for the current request; see Router::addAsyncRoute
+    void spawn_handler(std::shared_ptr<const AsyncRequestHandler> handler);
+    // Forwards the current request, and its body as it arrives, to one of
+    // upstream's backends; see Router::addProxyRoute
+    void proxy_request(const std::shared_ptr<Upstream>& upstream);
+
+    // Parameters matched by the router for the request being handled
+    RouteParams& route_params() { return route_params_; }
+    const RouteParams& route_params() const { return route_params_; }
+    // Metrics id of the matched route, set by the router
+    void set_route_id(std::uint32_t id) { route_id_ = id; }
+    // Checks the route's rate limit for this client; if it is over, answers
+    // 429 and returns false
+    bool admit_route(std::uint32_t route_id);
+
+private:
+    friend class h2_connection;
+
+    std::optional<strand_ref::strand_type> strand_;  // strand mode only
+    std::optional<tcp::socket> socket_;
+    session_stream stream_;  // what requests are read from and responses written to
+    std::atomic<int>& load_;  // open sessions on this socket's io_context
+    std::atomic<std::uint64_t>& requests_;  // requests read on this io_context
+    std::atomic<bool>& overloaded_;  // this io_context is shedding requests
+    upstream_pool& upstreams_;  // this io_context's backend connections
+    RateLimiter::ClientKey client_{};  // peer address, if RateLimiter is enabled
+    const session_options& options_;
+    memory_pool pool_;  // request fields and handler state
+    beast::flat_buffer buffer_;
+    std::optional<http::request_parser<http::dynamic_body, pool_allocator<char>>> parser_;
+    RouteParams route_params_;
+    std::string route_param_names_;  // route_params_'s names, while an upload outlives routing
+    std::uint32_t route_id_ = 0;
+    std::uint64_t request_started_ = 0;  // Metrics::now() when the request was read
+    std::uint64_t read_started_ = 0;     // when the read was issued, if tracing is on
+    std::uint64_t trace_id_ = 0;         // current request's Tracer id, 0 if not sampled
+    std::uint64_t accept_trace_id_ = 0;  // sampled at accept; taken by the first request
+    std::vector<ByteRange> ranges_;
+    std::shared_ptr<const BodyRoute> body_route_;  // of the request being read
+    std::unique_ptr<UploadSink> upload_;  // where its body goes; null to discard it
+    OutboundResponse* proxying_ = nullptr;  // its slot, while its body goes to a backend
+
+    // Responses in request order, as a ring of reusable slots; at most
+    // MAX_PIPELINED_REQUESTS before reading pauses
+    std::vector<std::unique_ptr<OutboundResponse>> outbound_;
+    std::size_t outbound_head_ = 0;
+    std::size_t outbound_size_ = 0;
+    std::vector<net::const_buffer> write_buffers_;
+    bool reading_ = false;
+    bool writing_ = false;
+    bool routing_ = false;
+    bool closing_ = false;  // no further requests will be read
+
+    // Timeouts. A read is either waiting for the next request (idle), or
+    // for the rest of one (header, body).
+    enum class read_phase { idle, header, body };
+    read_phase read_phase_ = read_phase::header;
+    std::uint64_t read_deadline_ = 0;   // coarse_now() ms, 0 for none
+    std::uint64_t write_deadline_ = 0;
+    bool kept_alive_ = false;    // a request has been read on this connection
+    bool park_pending_ = false;  // the reaper found it idle on its last pass
+    bool parked_ = false;        // idle read cancelled to release the buffers
+    std::vector<async_request*> async_requests_;  // coroutine handlers still running
+
+    // HTTP/2. Once the connection switches, h2_ reads and writes it, and
+    // each stream's request is routed here like an HTTP/1.1 one, with its
+    // response going to the stream's slot rather than the ring.
+    std::unique_ptr<h2_connection> h2_;  // kept across connections once made
+    bool http2_ = false;
+    h2_stream* h2_stream_ = nullptr;     // the stream being routed
+    http_request* request_ = nullptr;    // the parser's, or h2_stream_'s
+
+    http_request& req() { return *request_; }
+    const http_request& req() const { return *request_; }
+
+    void on_handshake(beast::error_code ec);
+    void do_read();
+    void maybe_read();
+    std::uint64_t deadline(std::uint32_t timeout) const;
+    void arm_write_deadline();
+    void park();
+    void wait_readable();
+    void on_timeout(const char* phase);
+    void shed_request();
+    void send_too_many_requests(std::uint32_t retry_after);
+    void on_header(beast::error_code ec, std::size_t bytes_transferred);
+    void on_read(beast::error_code ec, std::size_t bytes_transferred);
+    void route_request();
+    void start_http2(bool upgrade, std::size_t bytes_transferred);
+    void begin_request(std::size_t bytes_transferred);
+    void finish_request();
+    void refuse_request(http::status status, const std::string& message);
+    void send_continue();
+    void start_upload();
+    void read_upload();
+    void on_upload_read(beast::error_code ec);
+    void finish_upload();
+    OutboundResponse& prepare_response();
+    void queue_response(bool close);
+    OutboundResponse& front_response() { return *outbound_[outbound_head_]; }
+    // The slot prepare_response() filled, not yet queued
+    OutboundResponse& next_response();
+    // Every response owed on the connection: the ring, or the HTTP/2 streams
+    template <class Fn>
+    void for_each_response(Fn fn);
+    void do_write();
+    void on_write(beast::error_code ec, std::size_t responses);
+    void handle_fallback();
+    void finish_async(async_request& request, OutboundResponse& response,
+                      const AsyncResponse* result, std::uint32_t route_id,
+                      std::uint64_t started);
+    void cancel_async();
+
+    // Proxying. Backend I/O completes on this session's executor.
+    template <class Handler>
+    auto upstream_handler(Handler&& handler);
+    void write_upstream_request(ProxyTransfer& proxy);
+    void connect_upstream(OutboundResponse& response);
+    void send_upstream_request(OutboundResponse& response);
+    void read_proxy_body();
+    void on_proxy_body_read(beast::error_code ec);
+    void finish_proxy_body();
+    void read_upstream_header(OutboundResponse& response);
+    void on_upstream_header(OutboundResponse& response, beast::error_code ec);
+    void on_upstream_error(OutboundResponse& response, beast::error_code ec);
+    // Answers in the proxied slot's place, or just closes if that is all
+    // that is left to do
+    void fail_proxy(OutboundResponse& response, http::status status, std::string_view message);
+    void drop_proxy(OutboundResponse& response);
+    void cancel_proxies();
+    void start_proxy_stream();
+    void read_upstream_body();
+    void relay_upstream_body(beast::error_code ec);
+    void finish_proxy();
+    // Logs the current request's response and records it in Metrics
+    void log_response(unsigned status, std::string_view reason, std::size_t bytes,
+                      std::string_view note = {});
+    void trace_write_start(OutboundResponse& response);
+    void send_text(http::status status, std::string_view body,
+                   std::string_view content_type, bool allow_compression);
+    void send_cached(std::shared_ptr<const CachedAsset> asset);
+    void send_cached_file(std::shared_ptr<const CachedAsset> asset,
+                          const AssetHeaders& headers);
+    void send_memory_ranges(std::string_view body, const AssetHeaders& headers,
+                            std::shared_ptr<const void> owner);
+    void send_bundled(const std::shared_ptr<const AssetBundle>& bundle, unsigned status,
+                      std::string_view header, std::string_view body);
+    void send_range_not_satisfiable(std::uint64_t size);
+    std::uint64_t write_partial_header(OutboundResponse& response,
+                                       const AssetHeaders& headers,
+                                       std::uint64_t size);
+
+    void send_file(const std::string& file_path, const AssetHeaders& headers);
+    bool is_not_modified(std::string_view etag, std::string_view last_modified) const;
+    RangeParse requested_ranges(std::uint64_t size, const AssetHeaders& headers);
+    bool try_sendfile(const std::string& file_path, const AssetHeaders& headers);
+
+    // Streaming, always on the front response
+    enum class sendfile_status { done, more, would_block, unsupported, failed };
+
+    // Runs work() where options_.file_io says and hands its result to done()
+    // on this session's executor
+    template <class Work, class Done>
+    void run_file_io(Work work, Done done);
+    std::size_t file_read_size() const;
+    void start_stream();
+    void do_file_read();
+    void write_file_chunk(std::streamsize bytes_read);
+    void next_file_segment();
+    void continue_file_segment();
+    void do_file_range();
+    void write_file_range(std::streamsize bytes_read);
+    static sendfile_status sendfile_turn(int socket, FileTransfer& transfer,
+                                         std::uint64_t trace_id, int& error);
+    void do_sendfile();
+    void on_sendfile_turn(sendfile_status status, int error);
+    void do_sendfile_copy();
+    void write_copied_range(std::int64_t n, int error);
+};
+
+template <class Handler>
+auto http_session::upstream_handler(Handler&& handler) {
+  // A backend connection outlives the session it serves, so it is bound to
+  // the plain io_context; its completions are brought onto this session's
+  // executor (its strand, if it has one)
+  return net::bind_executor(socket_->get_executor(),
+                            bind_pool(pool_, std::forward<Handler>(handler)));
+}
+
+template <class Work, class Done>
+void http_session::run_file_io(Work work, Done done) {
+  if (!options_.file_io) {
+    done(work());
+    return;
+  }
+
+  // The continuation takes over the pool thread's reference, so the last
+  // one is always dropped (and the session recycled) on its own thread
+  auto self = shared_from_this();
+  auto executor = socket_->get_executor();
+  net::post(*options_.file_io, [self = std::move(self), executor,
+                                work = std::move(work), done = std::move(done)]() mutable {
+    auto result = work();
+    net::post(executor, [self = std::move(self), done = std::move(done), result]() mutable {
+      done(result);
+    });
+  });
+}
+
+#endif  // HTTP_SESSION_HPP
@@ -0,0 +1,688 @@
+// loadgen: HTTP/1.1 load generator for benchmarking webserver.
+//
+// Closed loop (default): each connection keeps --pipeline requests in flight
+// and sends the next as soon as a response arrives. Open loop (--rate): the
+// requests are scheduled at a fixed total rate whether or not the server
+// keeps up, and latency is measured from the scheduled time, so a stalled
+// server shows up in the percentiles instead of quietly lowering the load.
+//
+// --tls speaks HTTPS without checking the certificate, so a self-signed
+// one will do. With --no-keepalive every request pays for a handshake,
+// which makes requests per second a handshake rate; --tls-resume makes
+// those resumptions.
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+using steady = std::chrono::steady_clock;
+
+namespace {
+
+struct options {
+  std::string host = "127.0.0.1";
+  std::string port = "8080";
+  std::vector<std::pair<std::string, unsigned>> urls;  // path, weight
+  std::size_t connections = 16;
+  std::size_t idle = 0;      // extra connections that never send
+  std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  std::size_t pipeline = 1;  // requests in flight per connection
+  double rate = 0;           // total requests per second; 0 = closed loop
+  double duration = 10;
+  double warmup = 1;
+  bool keep_alive = true;
+  bool tls = false;
+  bool tls_resume = false;  // offer the last connection's session on the next
+  bool json = false;
+  std::string name = "load";
+  std::string label;
+};
+
+// Latency histogram with HdrHistogram-style log-linear buckets: values are
+// grouped by their highest set bit and each power of two is split into
+// 2^kSubBits linear steps, so every bucket is within ~3% of its values.
+class latency_histogram {
+ public:
+  void record(std::uint64_t ns) {
+    ++counts_[index(ns)];
+    ++total_;
+    max_ = std::max(max_, ns);
+  }
+
+  void merge(const latency_histogram& other) {
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    total_ += other.total_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  std::uint64_t total() const { return total_; }
+  std::uint64_t max() const { return max_; }
+
+  // Smallest recorded bucket covering fraction q of the samples, reported
+  // as the bucket's upper bound
+  std::uint64_t percentile(double q) const {
+    if (total_ == 0) {
+      return 0;
+    }
+    auto target = static_cast<std::uint64_t>(std::ceil(q * total_));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= std::max<std::uint64_t>(target, 1)) {
+        return std::min(max_, lower_bound(i + 1) - 1);
+      }
+    }
+    return max_;
+  }
+
+ private:
+  static constexpr unsigned kSubBits = 5;
+  static constexpr std::uint64_t kSubCount = 1u << kSubBits;
+
+  std::array<std::uint64_t, 64 * kSubCount> counts_{};
+  std::uint64_t total_ = 0;
+  std::uint64_t max_ = 0;
+
+  static std::size_t index(std::uint64_t v) {
+    if (v < kSubCount) {
+      return v;
+    }
+    unsigned shift = 63 - __builtin_clzll(v) - kSubBits;
+    return ((shift + 1) << kSubBits) + ((v >> shift) & (kSubCount - 1));
+  }
+
+  static std::uint64_t lower_bound(std::size_t i) {
+    std::size_t bucket = i >> kSubBits;
+    std::uint64_t sub = i & (kSubCount - 1);
+    if (bucket == 0) {
+      return sub;
+    }
+    return (kSubCount + sub) << (bucket - 1);
+  }
+};
+
+// Per-thread results; only touched by the thread running its io_context
+struct worker_stats {
+  latency_histogram latency;
+  std::uint64_t responses = 0;
+  std::uint64_t non_2xx = 0;
+  std::uint64_t errors = 0;   // connect, handshake, read and write failures
+  std::uint64_t bytes = 0;
+  std::uint64_t handshakes = 0;
+  std::uint64_t resumed = 0;  // of those, resumed sessions
+};
+
+// Parses and throws away response bodies; only the framing matters here
+struct discard_body {
+  struct value_type {};
+
+  struct reader {
+    template <bool isRequest, class Fields>
+    reader(http::header<isRequest, Fields>&, value_type&) {}
+
+    void init(const boost::optional<std::uint64_t>&, beast::error_code& ec) { ec = {}; }
+
+    template <class ConstBufferSequence>
+    std::size_t put(const ConstBufferSequence& buffers, beast::error_code& ec) {
+      ec = {};
+      return net::buffer_size(buffers);
+    }
+
+    void finish(beast::error_code& ec) { ec = {}; }
+  };
+};
+
+std::atomic<bool> measuring{false};
+std::atomic<bool> stopping{false};
+
+class connection : public std::enable_shared_from_this<connection> {
+ public:
+  connection(net::io_context& ioc, net::ssl::context& tls_context, const options& opts,
+             const tcp::resolver::results_type& endpoints,
+             const std::vector<std::string>& requests,
+             std::discrete_distribution<std::size_t>& pick, std::mt19937& rng,
+             worker_stats& stats, double interval, bool idle)
+      : socket_(ioc),
+        tls_context_(tls_context),
+        timer_(ioc),
+        opts_(opts),
+        endpoints_(endpoints),
+        requests_(requests),
+        pick_(pick),
+        rng_(rng),
+        stats_(stats),
+        interval_(interval),
+        idle_(idle) {}
+
+  ~connection() {
+    if (session_) {
+      SSL_SESSION_free(session_);
+    }
+  }
+
+  void start() { do_connect(); }
+
+ private:
+  tcp::socket socket_;
+  net::ssl::context& tls_context_;
+  std::optional<net::ssl::stream<tcp::socket&>> tls_;  // made anew per connection
+  SSL_SESSION* session_ = nullptr;  // --tls-resume: offered on the next handshake
+  net::steady_timer timer_;
+  const options& opts_;
+  const tcp::resolver::results_type& endpoints_;
+  const std::vector<std::string>& requests_;
+  std::discrete_distribution<std::size_t>& pick_;
+  std::mt19937& rng_;
+  worker_stats& stats_;
+  double interval_;  // open loop: seconds between this connection's requests
+  bool idle_;
+
+  beast::flat_buffer buffer_;
+  std::optional<http::response_parser<discard_body>> parser_;
+  std::deque<steady::time_point> backlog_;    // due but not yet sent
+  std::deque<steady::time_point> in_flight_;  // sent, awaiting a response
+  std::string writing_buffer_;
+  std::string queued_buffer_;
+  bool writing_ = false;
+  bool connected_ = false;
+  unsigned generation_ = 0;  // bumped per connection; older completions are stale
+  steady::time_point next_send_;
+
+  std::size_t depth() const { return opts_.keep_alive ? opts_.pipeline : 1; }
+
+  // Requests and responses go over TLS if there is any, else the socket
+  template <class F>
+  void with_stream(F&& f) {
+    if (tls_) {
+      f(*tls_);
+    } else {
+      f(socket_);
+    }
+  }
+
+  void do_connect() {
+    if (stopping) {
+      return;
+    }
+    ++generation_;
+    writing_ = false;
+    auto self = shared_from_this();
+    net::async_connect(socket_, endpoints_,
+                       [self, gen = generation_](beast::error_code ec, const tcp::endpoint&) {
+                         if (gen == self->generation_) {
+                           self->on_connect(ec);
+                         }
+                       });
+  }
+
+  void on_connect(beast::error_code ec) {
+    if (ec) {
+      ++stats_.errors;
+      retry_later();
+      return;
+    }
+    socket_.set_option(tcp::no_delay(true), ec);
+    if (!opts_.tls) {
+      on_ready();
+      return;
+    }
+    tls_.emplace(socket_, tls_context_);
+    if (session_) {
+      SSL_set_session(tls_->native_handle(), session_);
+    }
+    auto self = shared_from_this();
+    tls_->async_handshake(net::ssl::stream_base::client,
+                          [self, gen = generation_](beast::error_code ec) {
+                            if (gen == self->generation_) {
+                              self->on_handshake(ec);
+                            }
+                          });
+  }
+
+  void on_handshake(beast::error_code ec) {
+    if (ec) {
+      ++stats_.errors;
+      retry_later();
+      return;
+    }
+    if (measuring) {
+      ++stats_.handshakes;
+      if (SSL_session_reused(tls_->native_handle())) {
+        ++stats_.resumed;
+      }
+    }
+    on_ready();
+  }
+
+  void on_ready() {
+    connected_ = true;
+    if (idle_) {
+      // Hold the connection open; the read only finishes when it closes
+      do_read();
+      return;
+    }
+
+    if (interval_ > 0) {
+      if (next_send_ == steady::time_point{}) {
+        // Spread the connections' first requests over one interval
+        std::uniform_real_distribution<double> phase(0, interval_);
+        next_send_ = steady::now() + to_duration(phase(rng_));
+        schedule();
+      }
+    } else {
+      while (backlog_.size() + in_flight_.size() < depth()) {
+        backlog_.push_back(steady::now());
+      }
+    }
+    flush();
+    do_read();
+  }
+
+  // Keeps the session for --tls-resume and drops the TLS state. No
+  // close_notify is sent, as most clients never send one; marking the
+  // connection shut down anyway stops OpenSSL from spoiling the session.
+  void drop_tls() {
+    if (!tls_) {
+      return;
+    }
+    SSL* ssl = tls_->native_handle();
+    if (opts_.tls_resume && SSL_is_init_finished(ssl)) {
+      if (session_) {
+        SSL_SESSION_free(session_);
+      }
+      session_ = SSL_get1_session(ssl);
+      SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+    tls_.reset();
+  }
+
+  void retry_later() {
+    connected_ = false;
+    ++generation_;
+    drop_tls();
+    beast::error_code ignored;
+    socket_.close(ignored);
+    buffer_.consume(buffer_.size());
+    queued_buffer_.clear();
+    if (stopping) {
+      return;
+    }
+    auto self = shared_from_this();
+    timer_.expires_after(std::chrono::milliseconds(100));
+    timer_.async_wait([self](beast::error_code ec) {
+      if (!ec) {
+        self->do_connect();
+      }
+    });
+  }
+
+  static steady::duration to_duration(double seconds) {
+    return std::chrono::duration_cast<steady::duration>(
+        std::chrono::duration<double>(seconds));
+  }
+
+  // Open loop: queue every request that has come due, then sleep until the
+  // next one
+  void schedule() {
+    auto now = steady::now();
+    while (next_send_ <= now) {
+      backlog_.push_back(next_send_);
+      next_send_ += to_duration(interval_);
+    }
+    flush();
+    if (stopping) {
+      return;
+    }
+    auto self = shared_from_this();
+    timer_.expires_at(next_send_);
+    timer_.async_wait([self](beast::error_code ec) {
+      if (!ec) {
+        self->schedule();
+      }
+    });
+  }
+
+  void flush() {
+    if (!connected_ || stopping) {
+      return;
+    }
+    while (!backlog_.empty() && in_flight_.size() < depth()) {
+      in_flight_.push_back(backlog_.front());
+      backlog_.pop_front();
+      queued_buffer_ += requests_[pick_(rng_)];
+    }
+    do_write();
+  }
+
+  void do_write() {
+    if (writing_ || queued_buffer_.empty()) {
+      return;
+    }
+    writing_ = true;
+    std::swap(writing_buffer_, queued_buffer_);
+    queued_buffer_.clear();
+    auto self = shared_from_this();
+    with_stream([&](auto& stream) {
+      net::async_write(stream, net::buffer(writing_buffer_),
+                       [self, gen = generation_](beast::error_code ec, std::size_t) {
+                         if (gen != self->generation_) {
+                           return;
+                         }
+                         self->writing_ = false;
+                         if (ec) {
+                           self->on_error();
+                           return;
+                         }
+                         self->do_write();
+                       });
+    });
+  }
+
+  void do_read() {
+    parser_.emplace();
+    // Not boost::none: 1.74 compares the length against the optional and
+    // treats an unset limit as zero
+    parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+    auto self = shared_from_this();
+    with_stream([&](auto& stream) {
+      http::async_read(stream, buffer_, *parser_,
+                       [self, gen = generation_](beast::error_code ec, std::size_t bytes) {
+                         if (gen == self->generation_) {
+                           self->on_read(ec, bytes);
+                         }
+                       });
+    });
+  }
+
+  void on_read(beast::error_code ec, std::size_t bytes) {
+    if (ec || in_flight_.empty()) {
+      if (!stopping && !idle_) {
+        on_error();
+      }
+      return;
+    }
+
+    auto sent = in_flight_.front();
+    in_flight_.pop_front();
+    if (measuring) {
+      auto elapsed = steady::now() - sent;
+      stats_.latency.record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+      ++stats_.responses;
+      stats_.bytes += bytes;
+      unsigned status = parser_->get().result_int();
+      if (status < 200 || status >= 300) {
+        ++stats_.non_2xx;
+      }
+    }
+
+    if (!opts_.keep_alive || !parser_->get().keep_alive()) {
+      // The connection is closing (cached responses do not repeat the
+      // client's Connection: close); anything still in flight is sent again
+      // on the next connection
+      for (auto it = in_flight_.rbegin(); it != in_flight_.rend(); ++it) {
+        backlog_.push_front(*it);
+      }
+      in_flight_.clear();
+      reconnect();
+      return;
+    }
+
+    if (interval_ == 0) {
+      backlog_.push_back(steady::now());
+    }
+    flush();
+    do_read();
+  }
+
+  void on_error() {
+    ++stats_.errors;
+    for (auto it = in_flight_.rbegin(); it != in_flight_.rend(); ++it) {
+      backlog_.push_front(*it);
+    }
+    in_flight_.clear();
+    retry_later();
+  }
+
+  void reconnect() {
+    connected_ = false;
+    drop_tls();
+    beast::error_code ignored;
+    socket_.close(ignored);
+    buffer_.consume(buffer_.size());
+    queued_buffer_.clear();
+    if (interval_ == 0 && backlog_.empty()) {
+      backlog_.push_back(steady::now());
+    }
+    do_connect();
+  }
+};
+
+void print_usage(const char* program) {
+  std::cerr << "Usage: " << program << " [options]\n"
+            << "  --host=HOST --port=PORT       server address (127.0.0.1:8080)\n"
+            << "  --url=PATH[@WEIGHT]           request path; repeat for a weighted mix\n"
+            << "  --connections=N               active connections (16)\n"
+            << "  --idle=N                      extra connections that stay silent (0)\n"
+            << "  --threads=N                   client threads (one per core)\n"
+            << "  --pipeline=N                  requests in flight per connection (1)\n"
+            << "  --rate=REQ_PER_SEC            open loop at this total rate (closed loop)\n"
+            << "  --duration=SECONDS            measured time (10)\n"
+            << "  --warmup=SECONDS              unmeasured time before it (1)\n"
+            << "  --no-keepalive                one request per connection\n"
+            << "  --tls                         HTTPS; the certificate is not checked\n"
+            << "  --tls-resume                  resume the previous connection's TLS session\n"
+            << "  --name=NAME --label=TEXT      tags for the report\n"
+            << "  --json                        print one JSON object instead of text\n";
+}
+
+bool parse_arguments(int argc, char* argv[], options& opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    std::string name = arg.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+    try {
+      if (name == "--host" && !value.empty()) {
+        opts.host = value;
+      } else if (name == "--port" && !value.empty()) {
+        opts.port = value;
+      } else if (name == "--url" && !value.empty() && value[0] == '/') {
+        auto at = value.rfind('@');
+        unsigned weight = 1;
+        if (at != std::string::npos) {
+          weight = std::stoul(value.substr(at + 1));
+          value.erase(at);
+        }
+        opts.urls.emplace_back(value, weight);
+      } else if (name == "--connections") {
+        opts.connections = std::stoul(value);
+      } else if (name == "--idle") {
+        opts.idle = std::stoul(value);
+      } else if (name == "--threads") {
+        opts.threads = std::max(1ul, std::stoul(value));
+      } else if (name == "--pipeline") {
+        opts.pipeline = std::max(1ul, std::stoul(value));
+      } else if (name == "--rate") {
+        opts.rate = std::stod(value);
+      } else if (name == "--duration") {
+        opts.duration = std::stod(value);
+      } else if (name == "--warmup") {
+        opts.warmup = std::stod(value);
+      } else if (arg == "--no-keepalive") {
+        opts.keep_alive = false;
+      } else if (arg == "--tls") {
+        opts.tls = true;
+      } else if (arg == "--tls-resume") {
+        opts.tls = opts.tls_resume = true;
+      } else if (name == "--name" && !value.empty()) {
+        opts.name = value;
+      } else if (name == "--label") {
+        opts.label = value;
+      } else if (arg == "--json") {
+        opts.json = true;
+      } else {
+        std::cerr << "Unknown option: " << arg << "\n";
+        return false;
+      }
+    } catch (const std::exception&) {
+      std::cerr << "Bad value: " << arg << "\n";
+      return false;
+    }
+  }
+  if (opts.urls.empty()) {
+    opts.urls.emplace_back("/", 1);
+  }
+  return opts.connections > 0;
+}
+
+void report(const options& opts, const worker_stats& total, double seconds) {
+  auto us = [](std::uint64_t ns) { return ns / 1000.0; };
+  double rps = total.responses / seconds;
+  double bps = total.bytes / seconds;
+  const latency_histogram& h = total.latency;
+
+  char line[1024];
+  if (opts.json) {
+    std::snprintf(line, sizeof(line),
+                  "{\"name\":\"%s\",\"label\":\"%s\",\"connections\":%zu,\"idle\":%zu,"
+                  "\"pipeline\":%zu,\"keep_alive\":%s,\"rate\":%.1f,\"duration\":%.3f,"
+                  "\"requests\":%llu,\"non_2xx\":%llu,\"errors\":%llu,"
+                  "\"requests_per_sec\":%.1f,\"bytes_per_sec\":%.1f,"
+                  "\"tls\":%s,\"handshakes_per_sec\":%.1f,\"resumed_per_sec\":%.1f,"
+                  "\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p99_9\":%.1f,\"max\":%.1f}}",
+                  opts.name.c_str(), opts.label.c_str(), opts.connections, opts.idle,
+                  opts.pipeline, opts.keep_alive ? "true" : "false", opts.rate, seconds,
+                  static_cast<unsigned long long>(total.responses),
+                  static_cast<unsigned long long>(total.non_2xx),
+                  static_cast<unsigned long long>(total.errors), rps, bps,
+                  opts.tls ? "true" : "false", total.handshakes / seconds,
+                  total.resumed / seconds, us(h.percentile(0.50)), us(h.percentile(0.99)),
+                  us(h.percentile(0.999)), us(h.max()));
+    std::cout << line << std::endl;
+    return;
+  }
+
+  std::snprintf(line, sizeof(line),
+                "%s: %zu connections (+%zu idle), pipeline %zu, %s, %.1f s\n"
+                "  requests %llu  non-2xx %llu  errors %llu\n"
+                "  throughput %.1f req/s  %.2f MB/s\n"
+                "  latency p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+                opts.name.c_str(), opts.connections, opts.idle, opts.pipeline,
+                opts.rate > 0 ? "open loop" : "closed loop", seconds,
+                static_cast<unsigned long long>(total.responses),
+                static_cast<unsigned long long>(total.non_2xx),
+                static_cast<unsigned long long>(total.errors), rps, bps / 1e6,
+                us(h.percentile(0.50)), us(h.percentile(0.99)), us(h.percentile(0.999)),
+                us(h.max()));
+  std::cout << line;
+  if (opts.tls) {
+    std::printf("  tls handshakes %.1f/s  resumed %.1f/s\n", total.handshakes / seconds,
+                total.resumed / seconds);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  options opts;
+  if (!parse_arguments(argc, argv, opts)) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Requests are serialized once and reused for every send
+  std::vector<std::string> requests;
+  std::vector<unsigned> weights;
+  for (const auto& [path, weight] : opts.urls) {
+    requests.push_back("GET " + path + " HTTP/1.1\r\nHost: " + opts.host +
+                       (opts.keep_alive ? "" : "\r\nConnection: close") + "\r\n\r\n");
+    weights.push_back(weight);
+  }
+
+  std::deque<net::io_context> contexts;
+  std::vector<worker_stats> stats(opts.threads);
+  std::vector<std::mt19937> rngs;
+  std::vector<std::discrete_distribution<std::size_t>> picks;
+  for (std::size_t i = 0; i < opts.threads; ++i) {
+    contexts.emplace_back(1);
+    rngs.emplace_back(static_cast<std::mt19937::result_type>(i + 1));
+    picks.emplace_back(weights.begin(), weights.end());
+  }
+
+  tcp::resolver::results_type endpoints;
+  try {
+    endpoints = tcp::resolver(contexts.front()).resolve(opts.host, opts.port);
+  } catch (const std::exception& e) {
+    std::cerr << "Cannot resolve " << opts.host << ":" << opts.port << ": " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  // Shared by every connection; OpenSSL locks what it has to
+  net::ssl::context tls_context(net::ssl::context::tls_client);
+  tls_context.set_verify_mode(net::ssl::verify_none);
+
+  double interval = opts.rate > 0 ? opts.connections / opts.rate : 0;
+  for (std::size_t i = 0; i < opts.connections + opts.idle; ++i) {
+    std::size_t t = i % opts.threads;
+    std::make_shared<connection>(contexts[t], tls_context, opts, endpoints, requests, picks[t],
+                                 rngs[t], stats[t], interval, i >= opts.connections)
+        ->start();
+  }
+
+  std::vector<std::thread> threads;
+  for (auto& ioc : contexts) {
+    threads.emplace_back([&ioc] { ioc.run(); });
+  }
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(opts.warmup));
+  measuring = true;
+  auto begin = steady::now();
+  std::this_thread::sleep_for(std::chrono::duration<double>(opts.duration));
+  measuring = false;
+  double seconds = std::chrono::duration<double>(steady::now() - begin).count();
+
+  stopping = true;
+  for (auto& ioc : contexts) {
+    ioc.stop();
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  worker_stats total;
+  for (const auto& s : stats) {
+    total.latency.merge(s.latency);
+    total.responses += s.responses;
+    total.non_2xx += s.non_2xx;
+    total.errors += s.errors;
+    total.bytes += s.bytes;
+    total.handshakes += s.handshakes;
+    total.resumed += s.resumed;
+  }
+  report(opts, total, seconds);
+  return total.responses > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
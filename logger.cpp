@@ -1,8 +1,155 @@
 #include "logger.hpp"
-#include "thread_safe_queue.hpp"
-#include <iostream>
 
-std::mutex Logger::coutMutex_;
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+std::uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+#ifdef IOV_MAX
+constexpr std::size_t kMaxIov = IOV_MAX;
+#else
+constexpr std::size_t kMaxIov = 1024;
+#endif
+
+}  // namespace
+
+// Gives a thread exclusive use of a ring until the thread exits
+struct Logger::RingLease {
+    Ring* ring = nullptr;
+
+    ~RingLease() {
+        if (ring) {
+            ring->owned.store(false, std::memory_order_release);
+        }
+    }
+};
+
+// Output assembled by the logging thread. Record text is referenced in place
+// in the rings; numbers and error strings are rendered into scratch.
+struct Logger::Batch {
+    std::vector<iovec> iov;
+    std::vector<char> scratch;
+    std::size_t scratch_used = 0;
+    std::vector<std::uint64_t> cursor;
+    std::vector<std::uint64_t> end;
+
+    Batch() : scratch(64 * 1024), cursor(kMaxRings), end(kMaxRings) {
+        iov.reserve(kMaxIov);
+    }
+
+    bool full() const {
+        return iov.size() + 16 > kMaxIov || scratch_used + 512 > scratch.size();
+    }
+
+    void add(const char* data, std::size_t size) {
+        if (size > 0) {
+            iov.push_back({const_cast<char*>(data), size});
+        }
+    }
+
+    void add(const char* literal) { add(literal, std::strlen(literal)); }
+
+    void addCopy(const std::string& text) {
+        std::size_t size = std::min<std::size_t>(text.size(), 256);
+        std::memcpy(scratch.data() + scratch_used, text.data(), size);
+        add(scratch.data() + scratch_used, size);
+        scratch_used += size;
+    }
+
+    void addNumber(std::uint64_t value) {
+        char digits[20];
+        std::size_t n = 0;
+        do {
+            digits[n++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+        char* out = scratch.data() + scratch_used;
+        std::reverse_copy(digits, digits + n, out);
+        add(out, n);
+        scratch_used += n;
+    }
+
+    void format(const Record& record) {
+        switch (record.kind) {
+            case Kind::text_part:
+                add(record.text, record.length);
+                break;
+            case Kind::text:
+                add(record.text, record.length);
+                add("\n");
+                break;
+            case Kind::request:
+                add("\x1b[32m");
+                add(record.text, record.split);
+                add(" ");
+                add(record.text + record.split, record.length - record.split);
+                add("\x1b[0m ");
+                addNumber(record.values[0]);
+                add(" incoming bytes\n");
+                break;
+            case Kind::response:
+                addNumber(record.values[0]);
+                add(" ");
+                add(record.text, record.split);
+                add(" ");
+                addNumber(record.values[1]);
+                add(" outgoing bytes");
+                if (record.length > record.split) {
+                    add(" (");
+                    add(record.text + record.split, record.length - record.split);
+                    add(")");
+                }
+                add("\n");
+                break;
+            case Kind::error:
+                add("\x1b[31m");
+                add(record.text, record.length);
+                addCopy(record.category->message(static_cast<int>(record.values[0])));
+                add("\x1b[0m\n");
+                break;
+        }
+    }
+
+    void write() {
+        iovec* next = iov.data();
+        std::size_t remaining = iov.size();
+        while (remaining > 0) {
+            ssize_t n = ::writev(STDOUT_FILENO, next, static_cast<int>(std::min(remaining, kMaxIov)));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            // Skip fully written buffers and trim a partially written one
+            std::size_t written = static_cast<std::size_t>(n);
+            while (remaining > 0 && written >= next->iov_len) {
+                written -= next->iov_len;
+                ++next;
+                --remaining;
+            }
+            if (remaining > 0) {
+                next->iov_base = static_cast<char*>(next->iov_base) + written;
+                next->iov_len -= written;
+            }
+        }
+        iov.clear();
+        scratch_used = 0;
+    }
+};
 
 Logger::Logger() : terminate_(false) {
     loggingThread_ = std::thread(&Logger::processMessages, this);
@@ -10,27 +157,231 @@ Logger::Logger() : terminate_(false) {
 
 Logger::~Logger() {
     terminate_ = true;
-    queue_.push(""); // Push an empty message to unblock the thread
     if (loggingThread_.joinable()) {
         loggingThread_.join();
     }
+    for (std::size_t i = 0; i < ring_count_.load(); ++i) {
+        delete rings_[i].load();
+    }
 }
 
 void Logger::processMessages() {
-    while (!terminate_ || !queue_.empty()) {
-        auto message = queue_.pop();
-        if (message) {
-            std::lock_guard<std::mutex> lock(coutMutex_);
-            std::cout << *message << std::endl;
+    Batch batch;
+    auto idle = std::chrono::microseconds(50);
+    for (;;) {
+        bool terminating = terminate_.load(std::memory_order_acquire);
+        if (drainOnce(batch) > 0) {
+            idle = std::chrono::microseconds(50);
+            continue;
         }
+        if (terminating) {
+            return;
+        }
+        // Producers never signal; back off while the rings stay empty
+        std::this_thread::sleep_for(idle);
+        idle = std::min(idle * 2, std::chrono::microseconds(5000));
     }
 }
 
+std::size_t Logger::drainOnce(Batch& batch) {
+    std::size_t count = ring_count_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i) {
+        Ring* ring = rings_[i].load(std::memory_order_acquire);
+        batch.cursor[i] = ring->tail.load(std::memory_order_relaxed);
+        batch.end[i] = ring->head.load(std::memory_order_acquire);
+    }
+
+    // Merge the rings oldest-first; parts of a split message stay together
+    std::size_t consumed = 0;
+    std::size_t continuing = kMaxRings;
+    while (!batch.full()) {
+        std::size_t pick = continuing;
+        if (pick == kMaxRings) {
+            std::uint64_t oldest = UINT64_MAX;
+            for (std::size_t i = 0; i < count; ++i) {
+                if (batch.cursor[i] == batch.end[i]) {
+                    continue;
+                }
+                Ring* ring = rings_[i].load(std::memory_order_relaxed);
+                const Record& record = ring->records[batch.cursor[i] & (kRingCapacity - 1)];
+                if (record.timestamp < oldest) {
+                    oldest = record.timestamp;
+                    pick = i;
+                }
+            }
+            if (pick == kMaxRings) {
+                break;
+            }
+        }
+
+        Ring* ring = rings_[pick].load(std::memory_order_relaxed);
+        const Record& record = ring->records[batch.cursor[pick]++ & (kRingCapacity - 1)];
+        batch.format(record);
+        continuing = record.kind == Kind::text_part ? pick : kMaxRings;
+        ++consumed;
+    }
+
+    if (consumed == 0) {
+        return 0;
+    }
+
+    batch.write();
+
+    // Slots are only handed back once their text has been written out
+    for (std::size_t i = 0; i < count; ++i) {
+        rings_[i].load(std::memory_order_relaxed)->tail.store(batch.cursor[i], std::memory_order_release);
+    }
+    return consumed;
+}
+
+Logger::Ring* Logger::localRing() {
+    thread_local RingLease lease;
+    if (!lease.ring) {
+        lease.ring = acquireRing();
+    }
+    return lease.ring;
+}
+
+Logger::Ring* Logger::acquireRing() {
+    // Reuse the ring of a thread that has exited
+    std::size_t count = ring_count_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i) {
+        Ring* ring = rings_[i].load(std::memory_order_acquire);
+        bool expected = false;
+        if (ring->owned.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+            ring->cached_tail = ring->tail.load(std::memory_order_acquire);
+            return ring;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    count = ring_count_.load(std::memory_order_relaxed);
+    if (count == kMaxRings) {
+        return nullptr;
+    }
+    Ring* ring = new Ring;
+    ring->owned.store(true, std::memory_order_relaxed);
+    rings_[count].store(ring, std::memory_order_release);
+    ring_count_.store(count + 1, std::memory_order_release);
+    return ring;
+}
+
+Logger::Record* Logger::reserve(Ring* ring, std::size_t count) {
+    if (!ring) {
+        dropped_.fetch_add(count, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    std::uint64_t head = ring->head.load(std::memory_order_relaxed);
+    while (head + count - ring->cached_tail > kRingCapacity) {
+        ring->cached_tail = ring->tail.load(std::memory_order_acquire);
+        if (head + count - ring->cached_tail <= kRingCapacity) {
+            break;
+        }
+        if (policy_.load(std::memory_order_relaxed) == OverflowPolicy::drop ||
+            terminate_.load(std::memory_order_relaxed)) {
+            dropped_.fetch_add(count, std::memory_order_relaxed);
+            return nullptr;
+        }
+        std::this_thread::yield();
+    }
+    return &ring->records[head & (kRingCapacity - 1)];
+}
+
+void Logger::commit(Ring* ring, std::size_t count) {
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + count,
+                     std::memory_order_release);
+}
+
 Logger& Logger::getInstance() {
     static Logger instance;
     return instance;
 }
 
 void Logger::log(const std::string& message) {
-    queue_.push(message);
+    // Long messages span several records that are published together
+    constexpr std::size_t capacity = sizeof(Record::text);
+    std::size_t parts = std::max<std::size_t>(1, (message.size() + capacity - 1) / capacity);
+    parts = std::min(parts, kRingCapacity);
+
+    Ring* ring = localRing();
+    if (!reserve(ring, parts)) {
+        return;
+    }
+
+    std::uint64_t head = ring->head.load(std::memory_order_relaxed);
+    std::uint64_t timestamp = now_ns();
+    for (std::size_t i = 0; i < parts; ++i) {
+        Record& record = ring->records[(head + i) & (kRingCapacity - 1)];
+        std::size_t offset = i * capacity;
+        std::size_t size = std::min(capacity, message.size() - std::min(offset, message.size()));
+        record.timestamp = timestamp;
+        record.kind = i + 1 == parts ? Kind::text : Kind::text_part;
+        record.length = static_cast<std::uint16_t>(size);
+        std::memcpy(record.text, message.data() + offset, size);
+    }
+    commit(ring, parts);
+}
+
+void Logger::logRequest(std::string_view method, std::string_view target, std::size_t bytes) {
+    Ring* ring = localRing();
+    Record* record = reserve(ring, 1);
+    if (!record) {
+        return;
+    }
+
+    constexpr std::size_t capacity = sizeof(Record::text);
+    method = method.substr(0, std::min<std::size_t>(32, method.size()));
+    target = target.substr(0, std::min(capacity - method.size(), target.size()));
+    record->timestamp = now_ns();
+    record->kind = Kind::request;
+    record->values[0] = bytes;
+    record->split = static_cast<std::uint8_t>(method.size());
+    record->length = static_cast<std::uint16_t>(method.size() + target.size());
+    std::memcpy(record->text, method.data(), method.size());
+    std::memcpy(record->text + method.size(), target.data(), target.size());
+    commit(ring, 1);
+}
+
+void Logger::logResponse(unsigned status, std::string_view reason, std::size_t bytes,
+                         std::string_view note) {
+    Ring* ring = localRing();
+    Record* record = reserve(ring, 1);
+    if (!record) {
+        return;
+    }
+
+    constexpr std::size_t capacity = sizeof(Record::text);
+    reason = reason.substr(0, std::min<std::size_t>(64, reason.size()));
+    note = note.substr(0, std::min(capacity - reason.size(), note.size()));
+    record->timestamp = now_ns();
+    record->kind = Kind::response;
+    record->values[0] = status;
+    record->values[1] = bytes;
+    record->split = static_cast<std::uint8_t>(reason.size());
+    record->length = static_cast<std::uint16_t>(reason.size() + note.size());
+    std::memcpy(record->text, reason.data(), reason.size());
+    std::memcpy(record->text + reason.size(), note.data(), note.size());
+    commit(ring, 1);
+}
+
+void Logger::logError(std::string_view context, const boost::system::error_code& ec) {
+    Ring* ring = localRing();
+    Record* record = reserve(ring, 1);
+    if (!record) {
+        return;
+    }
+
+    context = context.substr(0, std::min(sizeof(Record::text), context.size()));
+    record->timestamp = now_ns();
+    record->kind = Kind::error;
+    record->values[0] = static_cast<std::uint64_t>(ec.value());
+    record->category = &ec.category();
+    record->length = static_cast<std::uint16_t>(context.size());
+    std::memcpy(record->text, context.data(), context.size());
+    commit(ring, 1);
+}
+
+void Logger::setOverflowPolicy(OverflowPolicy policy) {
+    policy_.store(policy, std::memory_order_relaxed);
 }
@@ -1,25 +1,76 @@
-// ThreadSafeQueue remains unchanged, so it's not repeated here.
-
 #ifndef LOGGER_HPP
 #define LOGGER_HPP
 
-#include "thread_safe_queue.hpp"
-#include <string>
-#include <thread>
+#include <boost/system/error_code.hpp>
+#include <array>
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
 
+// Asynchronous logger. Every producer thread owns a single-producer ring of
+// fixed-size binary records; callers only copy their arguments into a slot.
+// All formatting happens on the logging thread, which merges the rings in
+// timestamp order and writes whole batches with writev(2).
 class Logger {
+public:
+    enum class OverflowPolicy {
+        drop,   // discard the record and count it in dropped()
+        block,  // wait for the logging thread to free a slot
+    };
+
 private:
-    ThreadSafeQueue<std::string> queue_;
+    static constexpr std::size_t kRecordSize = 256;
+    static constexpr std::size_t kRingCapacity = 4096;  // records, power of two
+    static constexpr std::size_t kMaxRings = 1024;
+
+    enum class Kind : std::uint8_t { text, text_part, request, response, error };
+
+    struct Record {
+        std::uint64_t timestamp;
+        std::uint64_t values[2];
+        const boost::system::error_category* category;
+        Kind kind;
+        std::uint8_t split;     // length of the first of two packed strings
+        std::uint16_t length;   // bytes used in text
+        char text[kRecordSize - 40];
+    };
+    static_assert(sizeof(Record) == kRecordSize, "log records must stay fixed size");
+
+    struct Ring {
+        alignas(64) std::atomic<std::uint64_t> head{0};  // next slot to publish
+        alignas(64) std::atomic<std::uint64_t> tail{0};  // next slot to consume
+        alignas(64) std::uint64_t cached_tail = 0;       // producer's view of tail
+        std::atomic<bool> owned{false};
+        Record records[kRingCapacity];
+    };
+
+    struct RingLease;
+    struct Batch;
+
+    std::array<std::atomic<Ring*>, kMaxRings> rings_{};
+    std::atomic<std::size_t> ring_count_{0};
+    std::mutex registry_mutex_;  // only taken when a thread logs for the first time
+
     std::thread loggingThread_;
     std::atomic<bool> terminate_;
-    static std::mutex coutMutex_;
+    std::atomic<OverflowPolicy> policy_{OverflowPolicy::block};
+    std::atomic<std::uint64_t> dropped_{0};
 
     Logger();
     ~Logger();
 
     void processMessages();
+    std::size_t drainOnce(Batch& batch);
+
+    Ring* localRing();
+    Ring* acquireRing();
+    Record* reserve(Ring* ring, std::size_t count);
+    void commit(Ring* ring, std::size_t count);
 
 public:
     Logger(const Logger&) = delete;
@@ -28,6 +79,15 @@ public:
     static Logger& getInstance();
 
     void log(const std::string& message);
+
+    // Hot-path records; arguments are copied raw and formatted later
+    void logRequest(std::string_view method, std::string_view target, std::size_t bytes);
+    void logResponse(unsigned status, std::string_view reason, std::size_t bytes,
+                     std::string_view note = {});
+    void logError(std::string_view context, const boost::system::error_code& ec);
+
+    void setOverflowPolicy(OverflowPolicy policy);
+    std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
 };
 
 #endif // LOGGER_HPP
@@ -1,154 +1,693 @@
-#include <csignal>
-#include <filesystem>
-#include <fstream>
-#include <iostream>
-#include <mutex>
-#include <thread>
-
-#include "globals.hpp"
-#include "http_server.hpp"
-#include "router.hpp"
-#include "logger.hpp"
-
-namespace fs = std::filesystem;
-
-#define SERVER_PORT 8080
-
-std::unique_ptr<http_server> server;
-
-void signal_handler(int signal) {
-
-  switch (signal) {
-    case SIGINT:
-      getGlobalLogger().log("Received SIGINT, shutting down");
-      server->stop();
-      break;
-
-    case SIGTERM:
-      getGlobalLogger().log("Received SIGTERM, shutting down");
-      server->stop();
-      break;
-
-    case SIGKILL:
-      getGlobalLogger().log("Received SIGKILL, shutting down");
-      server->stop();
-      break;
-
-    default:
-      getGlobalLogger().log("Received unknown signal " + std::to_string(signal));
-      break;
-  }
-
-}
-
-std::unordered_map<std::string, std::string> extension_to_mime = {
-    {".html", "text/html"},
-    {".css", "text/css"},
-    {".js", "text/javascript"},
-    {".json", "application/json"},
-    {".png", "image/png"},
-    {".jpg", "image/jpeg"},
-    {".jpeg", "image/jpeg"},
-    {".gif", "image/gif"},
-    {".svg", "image/svg+xml"},
-    {".ico", "image/x-icon"}
-};
-
-std::string determine_content_type(const std::string& extension) {
-  auto it = extension_to_mime.find(extension);
-  if (it != extension_to_mime.end()) {
-    return it->second;
-  }
-
-  return "UNSUPPORTED";
-}
-
-void add_all_files_in_directory() {
-  auto& router = Router::getInstance();
-  const std::string directory_path = "./";
-  for (const auto& entry : fs::recursive_directory_iterator(directory_path)) {
-    if (fs::is_regular_file(entry.status())) {
-      std::string file_path = entry.path().string();
-      std::string route =
-          file_path.substr(directory_path.length());  // Remove directory path
-
-      // do not go into files starting with a dot
-      if (route[0] == '.') {
-        continue;
-      }
-
-      // Determine the MIME type based on the file extension
-      std::string content_type =
-          determine_content_type(entry.path().extension().string());
-
-      if (content_type == "UNSUPPORTED") {
-        getGlobalLogger().log("Skipping file " + file_path + " with unsupported MIME type");
-        continue;
-      }
-
-      // this slash is needed for the route to work
-      route = "/" + route;
-
-      getGlobalLogger().log("Adding route " + route + " for file " + file_path +
-                            " with content type " + content_type);
-
-      // Add the route
-      router.addRoute(route,
-                             [file_path, content_type](
-                                 http_session& session,
-                                 const http::request<http::dynamic_body>& req) {
-                               session.stream_file(file_path, content_type);
-                             });
-    }
-  }
-}
-
-void handle_root(http_session& session,
-                 const http::request<http::dynamic_body>& req) {
-  session.stream_file("index.html", "text/html");
-}
-
-int main() {
-  try {
-    std::signal(SIGINT, signal_handler);
-    getGlobalLogger().log("Starting server on port " + std::to_string(SERVER_PORT));
-    getGlobalLogger().log("Press Ctrl+C to stop");
-
-    getGlobalLogger().log("Using " + std::to_string(MAX_THREADS) + " threads");
-    getGlobalLogger().log("Max Listen Connections: " + std::to_string(net::socket_base::max_listen_connections));
-
-    const std::size_t num_contexts = MAX_THREADS;
-    std::vector<net::io_context> io_contexts(num_contexts);
-    std::vector<net::executor_work_guard<net::io_context::executor_type>> work_guards;
-
-    for (auto& ctx : io_contexts) {
-        work_guards.emplace_back(net::make_work_guard(ctx));
-    }
-
-    std::vector<std::reference_wrapper<net::io_context>> io_context_refs;
-    for (auto& ctx : io_contexts) {
-        io_context_refs.push_back(std::ref(ctx));
-    }
-    server = std::make_unique<http_server>(io_context_refs, tcp::endpoint(tcp::v4(), SERVER_PORT));
-    server->run();
-
-    // add routes
-    auto& router = Router::getInstance();
-    router.addRoute("/", handle_root);
-    add_all_files_in_directory();
-
-    std::vector<std::thread> threads;
-    for (auto& ctx : io_contexts) {
-        threads.emplace_back([&ctx] { ctx.run(); });
-    }
-
-    for (auto& t : threads) {
-        t.join();
-    }
-  } catch (std::exception const& e) {
-    getGlobalLogger().log("Error: " + std::string(e.what()));
-    return EXIT_FAILURE;
-  }
-
-  return EXIT_SUCCESS;
-}
+#include <algorithm>
+#include <charconv>
+#include <csignal>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "alloc_stats.hpp"
+#include "asset_bundle.hpp"
+#include "asset_cache.hpp"
+#include "compression.hpp"
+#include "cpu_affinity.hpp"
+#include "file_watcher.hpp"
+#include "globals.hpp"
+#include "http_server.hpp"
+#include "router.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "mime_types.hpp"
+#include "proxy.hpp"
+#include "rate_limiter.hpp"
+#include "static_asset.hpp"
+#include "tls.hpp"
+#include "tracer.hpp"
+
+namespace fs = std::filesystem;
+
+#define SERVER_PORT 8080
+#define TLS_PORT 8443
+
+std::unique_ptr<http_server> server;
+bool watch_files = false;  // --watch
+bool debug_routes = false;  // --debug-routes; unauthenticated, so off by default
+std::string bundle_path;  // --bundle; replaces the directory walk
+std::shared_ptr<const AssetBundle> bundle;
+// --proxy prefixes and their backends; made into Upstreams once every flag is read
+std::vector<std::pair<std::string, std::vector<std::string>>> proxy_routes;
+ProxyOptions proxy_options;
+// HTTPS is served on --tls-port once a certificate and key are given
+TlsOptions tls_options;
+unsigned short tls_port = TLS_PORT;
+
+// index.html as indexed by add_all_files_in_directory, served for "/"
+std::shared_ptr<const StaticAsset> root_asset;
+
+void signal_handler(int signal) {
+
+  switch (signal) {
+    case SIGINT:
+      getGlobalLogger().log("Received SIGINT, shutting down");
+      server->stop();
+      break;
+
+    case SIGTERM:
+      getGlobalLogger().log("Received SIGTERM, shutting down");
+      server->stop();
+      break;
+
+    case SIGKILL:
+      getGlobalLogger().log("Received SIGKILL, shutting down");
+      server->stop();
+      break;
+
+    default:
+      getGlobalLogger().log("Received unknown signal " + std::to_string(signal));
+      break;
+  }
+
+}
+
+// Files with a route, by path
+std::set<std::string> static_files;
+std::mutex static_files_mutex;  // the startup walk against the file watcher
+
+const std::string static_root = "./";
+
+// Indexes one file and binds its route, replacing any earlier binding.
+// Returns false for files that are not served.
+bool add_static_file(const std::string& file_path) {
+  std::string route =
+      file_path.substr(static_root.length());  // Remove directory path
+
+  // do not go into files starting with a dot
+  if (route.empty() || route[0] == '.') {
+    return false;
+  }
+
+  // Determine the MIME type based on the file extension
+  std::string content_type =
+      determine_content_type(fs::path(file_path).extension().string());
+
+  if (content_type == "UNSUPPORTED") {
+    getGlobalLogger().log("Skipping file " + file_path + " with unsupported MIME type");
+    return false;
+  }
+
+  // this slash is needed for the route to work
+  route = "/" + route;
+
+  // Index the file once: validators and precompressed variants are built here
+  auto asset = index_static_asset(file_path, content_type);
+  if (route == "/index.html") {
+    std::atomic_store(&root_asset, asset);
+  }
+
+  std::string encodings;
+  for (const auto& encoding : asset->encodings) {
+    encodings += " " + encoding;
+  }
+  getGlobalLogger().log("Adding route " + route + " for file " + file_path +
+                        " with content type " + content_type +
+                        (encodings.empty() ? "" : ", encodings:" + encodings));
+
+  // Add the route. Every file shares the "static" metrics id, as a bundle's
+  // files share that of its one wildcard route; one id each would run past
+  // Metrics::kMaxRoutes in any sizeable tree.
+  Router::getInstance().addRoute(route, "static",
+                                 [asset](
+                                     http_session& session,
+                                     const http_request& req) {
+                                   session.serve_asset(asset);
+                                 });
+  static_files.insert(file_path);
+  return true;
+}
+
+void remove_static_file(const std::string& file_path) {
+  if (!static_files.erase(file_path)) {
+    return;
+  }
+  std::string route = "/" + file_path.substr(static_root.length());
+  Router::getInstance().removeRoute(route);
+  AssetCache::getInstance().invalidate(file_path);
+  if (route == "/index.html") {
+    std::atomic_store(&root_asset, std::shared_ptr<const StaticAsset>());
+  }
+  getGlobalLogger().log("Removed route " + route);
+}
+
+void add_all_files_in_directory() {
+  for (const auto& entry : fs::recursive_directory_iterator(static_root)) {
+    if (fs::is_regular_file(entry.status())) {
+      add_static_file(entry.path().string());
+    }
+  }
+}
+
+// Brings the routes in line with a batch of changes from the file watcher,
+// publishing them as one routing table
+void apply_file_changes(const std::vector<FileWatcher::Event>& events) {
+  std::lock_guard<std::mutex> lock(static_files_mutex);
+  Router::getInstance().update([&events] {
+    for (const auto& event : events) {
+      if (event.change == FileWatcher::Change::rescan) {
+        // Events were lost; drop what is gone and index everything again
+        getGlobalLogger().log("File watcher overflowed, rescanning " + static_root);
+        std::vector<std::string> known(static_files.begin(), static_files.end());
+        for (const auto& file_path : known) {
+          if (!fs::is_regular_file(file_path)) {
+            remove_static_file(file_path);
+          }
+        }
+        AssetCache::getInstance().clear();
+        add_all_files_in_directory();
+        continue;
+      }
+
+      if (event.change == FileWatcher::Change::removed) {
+        // A directory takes everything below it along. Names like "dir.txt"
+        // or "dir-old" sort between "dir" and "dir/...", so the files below
+        // it are looked up from the prefix rather than from the path itself.
+        std::string prefix = event.path + "/";
+        std::vector<std::string> gone;
+        if (static_files.count(event.path)) {
+          gone.push_back(event.path);
+        }
+        for (auto it = static_files.lower_bound(prefix);
+             it != static_files.end() && it->compare(0, prefix.size(), prefix) == 0; ++it) {
+          gone.push_back(*it);
+        }
+        for (const auto& file_path : gone) {
+          remove_static_file(file_path);
+        }
+      } else {
+        AssetCache::getInstance().invalidate(event.path);
+        add_static_file(event.path);
+      }
+
+      // A precompressed sibling changes what its original can offer
+      for (const auto& encoding : supported_encodings) {
+        std::string suffix = encoding_suffix(encoding);
+        if (event.path.size() > suffix.size() &&
+            event.path.compare(event.path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+          std::string original = event.path.substr(0, event.path.size() - suffix.size());
+          if (static_files.count(original)) {
+            AssetCache::getInstance().invalidate(original);
+            add_static_file(original);
+          }
+        }
+      }
+    }
+  });
+}
+
+void print_usage(const char* program) {
+  std::cerr << "Usage: " << program << " [options]\n"
+            << "  --accept=single|reuseport           listener topology\n"
+            << "  --dispatch=round-robin|least-loaded  io_context choice for the single acceptor\n"
+            << "  --threading=strand|per-core          strand-wrapped sockets, or one pinned thread per io_context\n"
+            << "  --numa                               per-core: spread threads across NUMA nodes\n"
+            << "  --cache-size=BYTES                   asset cache memory budget\n"
+            << "  --log-overflow=block|drop            what logging does when its ring is full\n"
+            << "  --compress-dynamic[=MIN_BYTES]       gzip dynamic responses at least this large\n"
+            << "  --file-io-threads[=N]                read files on N helper threads, not the io threads\n"
+            << "  --max-connections=N                  answer 503 to new connections past N open\n"
+            << "  --max-connections-per-context=N      the same for each io_context\n"
+            << "  --shed-lag=MS                        answer 503 while an io_context is this far behind (0 never)\n"
+            << "  --rate-limit=RATE[/BURST]            requests per second per client; 429 past it\n"
+            << "  --route-rate-limit=ROUTE=RATE[/BURST]  the same for one route pattern, on top; static\n"
+            << "                                       files share the pattern \"static\"\n"
+            << "  --connection-limit=N                 open connections per client; 429 past it\n"
+            << "  --proxy=PREFIX=HOST:PORT[,HOST:PORT...]  forward everything under PREFIX to these backends\n"
+            << "  --proxy-balance=round-robin|least-outstanding  how a backend is picked\n"
+            << "  --proxy-max-fails=N --proxy-fail-timeout=MS  leave a backend out for MS after N\n"
+            << "                                       failures in a row (0 never)\n"
+            << "  --proxy-timeout=MS                   for each read from or write to a backend\n"
+            << "  --tls-cert=FILE --tls-key=FILE       also serve HTTPS with this PEM certificate chain and key\n"
+            << "  --tls-port=PORT                      where HTTPS listens (8443)\n"
+            << "  --tls-session-cache=N                TLS 1.2 sessions kept for resumption (0 for none)\n"
+            << "  --tls-session-timeout=SECONDS        how long a session or ticket can be resumed\n"
+            << "  --no-tls-tickets                     resume from the session cache only\n"
+            << "  --no-ktls                            keep TLS records in user space\n"
+            << "  --no-http2                           HTTP/1.1 only: no h2c upgrade, prior knowledge or ALPN h2\n"
+            << "  --header-timeout=MS --body-timeout=MS --write-timeout=MS --idle-timeout=MS\n"
+            << "                                       per-phase connection deadlines (0 for none)\n"
+            << "  --bundle=FILE                        serve a bundle made by packer instead of the working directory\n"
+            << "  --watch                              pick up added, changed and removed files while running\n"
+            << "  --trace-sample=N                     trace one request in N (0, the default, is off)\n"
+            << "  --debug-routes                       serve /debug/trace, POST /debug/trace/sample/N and\n"
+            << "                                       POST /debug/upload\n"
+            << "                                       (no authentication: trusted networks only)\n";
+}
+
+// "RATE" or "RATE/BURST", both positive
+bool parse_rate(const std::string& text, RateLimiter::Rate& rate) {
+  char* end = nullptr;
+  rate.per_second = std::strtod(text.c_str(), &end);
+  rate.burst = 0;
+  if (*end == '/') {
+    rate.burst = std::strtod(end + 1, &end);
+    if (rate.burst <= 0) {
+      return false;
+    }
+  }
+  return *end == '\0' && end != text.c_str() && rate.per_second > 0;
+}
+
+// Decimal digits only, and within T's range; value is left alone otherwise.
+// Unlike std::stoul this never throws, so a huge flag cannot end the process.
+template <typename T>
+bool parse_count(std::string_view text, T& value) {
+  if (text.empty() || text.find_first_not_of("0123456789") != std::string_view::npos) {
+    return false;
+  }
+  auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+  return ec == std::errc() && end == text.data() + text.size();
+}
+
+// parse_count for a flag's value, reporting one that does not parse
+template <typename T>
+bool parse_flag_count(const std::string& arg, const std::string& value, T& count) {
+  if (!parse_count(value, count)) {
+    std::cerr << "Bad value: " << arg << "\n";
+    return false;
+  }
+  return true;
+}
+
+// Parses --name=value flags; returns false on anything unrecognised
+bool parse_arguments(int argc, char* argv[], server_options& options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    std::string name = arg.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+    if (name == "--accept" && value == "single") {
+      options.accept = accept_mode::single;
+    } else if (name == "--accept" && value == "reuseport") {
+      options.accept = accept_mode::reuseport;
+    } else if (name == "--dispatch" && value == "round-robin") {
+      options.dispatch = dispatch_policy::round_robin;
+    } else if (name == "--dispatch" && value == "least-loaded") {
+      options.dispatch = dispatch_policy::least_loaded;
+    } else if (name == "--threading" && value == "strand") {
+      options.execution = execution_mode::strand;
+    } else if (name == "--threading" && value == "per-core") {
+      options.execution = execution_mode::per_core;
+    } else if (arg == "--numa") {
+      options.numa_aware = true;
+    } else if (name == "--bundle" && !value.empty()) {
+      bundle_path = value;
+    } else if (arg == "--watch") {
+      watch_files = true;
+    } else if (arg == "--debug-routes") {
+      debug_routes = true;
+    } else if (name == "--log-overflow" && value == "block") {
+      getGlobalLogger().setOverflowPolicy(Logger::OverflowPolicy::block);
+    } else if (name == "--log-overflow" && value == "drop") {
+      getGlobalLogger().setOverflowPolicy(Logger::OverflowPolicy::drop);
+    } else if (name == "--compress-dynamic" && value.empty()) {
+      options.session.compress_dynamic = true;
+    } else if (name == "--compress-dynamic") {
+      if (!parse_flag_count(arg, value, options.session.compress_min_size)) {
+        return false;
+      }
+      options.session.compress_dynamic = true;
+    } else if (name == "--file-io-threads" && value.empty()) {
+      options.file_io_threads = FILE_IO_THREADS;
+    } else if (name == "--file-io-threads") {
+      if (!parse_flag_count(arg, value, options.file_io_threads)) {
+        return false;
+      }
+    } else if (name == "--max-connections") {
+      if (!parse_flag_count(arg, value, options.max_connections)) {
+        return false;
+      }
+    } else if (name == "--max-connections-per-context") {
+      if (!parse_flag_count(arg, value, options.max_connections_per_context)) {
+        return false;
+      }
+    } else if (name == "--shed-lag") {
+      if (!parse_flag_count(arg, value, options.overload_lag_ms)) {
+        return false;
+      }
+    } else if (name == "--rate-limit") {
+      RateLimiter::Rate rate;
+      if (!parse_rate(value, rate)) {
+        std::cerr << "Bad rate: " << value << "\n";
+        return false;
+      }
+      RateLimiter::getInstance().setRequestRate(rate);
+    } else if (name == "--route-rate-limit" && value.rfind('=') != std::string::npos) {
+      // Keyed by the pattern's metrics id, which the router gives the
+      // route when it is added
+      RateLimiter::Rate rate;
+      std::string route = value.substr(0, value.rfind('='));
+      if (!parse_rate(value.substr(value.rfind('=') + 1), rate)) {
+        std::cerr << "Bad rate: " << value << "\n";
+        return false;
+      }
+      RateLimiter::getInstance().setRouteRate(Metrics::getInstance().registerRoute(route), rate);
+    } else if (name == "--connection-limit") {
+      std::uint32_t limit = 0;
+      if (!parse_flag_count(arg, value, limit)) {
+        return false;
+      }
+      RateLimiter::getInstance().setConnectionLimit(limit);
+    } else if (name == "--proxy" && value.find('=') != std::string::npos) {
+      std::string prefix = value.substr(0, value.find('='));
+      std::vector<std::string> backends;
+      std::string list = value.substr(value.find('=') + 1);
+      for (std::size_t begin = 0; begin <= list.size();) {
+        std::size_t end = std::min(list.find(',', begin), list.size());
+        backends.push_back(list.substr(begin, end - begin));
+        begin = end + 1;
+      }
+      proxy_routes.emplace_back(prefix, backends);
+    } else if (name == "--proxy-balance" && value == "round-robin") {
+      proxy_options.balance = balance_policy::round_robin;
+    } else if (name == "--proxy-balance" && value == "least-outstanding") {
+      proxy_options.balance = balance_policy::least_outstanding;
+    } else if (name == "--proxy-max-fails") {
+      if (!parse_flag_count(arg, value, proxy_options.max_fails)) {
+        return false;
+      }
+    } else if (name == "--proxy-fail-timeout") {
+      if (!parse_flag_count(arg, value, proxy_options.fail_timeout)) {
+        return false;
+      }
+    } else if (name == "--proxy-timeout") {
+      if (!parse_flag_count(arg, value, proxy_options.response_timeout)) {
+        return false;
+      }
+    } else if (name == "--tls-cert" && !value.empty()) {
+      tls_options.certificate_file = value;
+    } else if (name == "--tls-key" && !value.empty()) {
+      tls_options.private_key_file = value;
+    } else if (name == "--tls-port") {
+      if (!parse_flag_count(arg, value, tls_port)) {
+        return false;
+      }
+    } else if (name == "--tls-session-cache") {
+      if (!parse_flag_count(arg, value, tls_options.session_cache_size)) {
+        return false;
+      }
+    } else if (name == "--tls-session-timeout") {
+      if (!parse_flag_count(arg, value, tls_options.session_timeout)) {
+        return false;
+      }
+    } else if (arg == "--no-tls-tickets") {
+      tls_options.tickets = false;
+    } else if (arg == "--no-ktls") {
+      tls_options.ktls = false;
+    } else if (arg == "--no-http2") {
+      options.session.http2 = false;
+      tls_options.http2 = false;
+    } else if (name == "--header-timeout") {
+      if (!parse_flag_count(arg, value, options.session.timeouts.header)) {
+        return false;
+      }
+    } else if (name == "--body-timeout") {
+      if (!parse_flag_count(arg, value, options.session.timeouts.body)) {
+        return false;
+      }
+    } else if (name == "--write-timeout") {
+      if (!parse_flag_count(arg, value, options.session.timeouts.write)) {
+        return false;
+      }
+    } else if (name == "--idle-timeout") {
+      if (!parse_flag_count(arg, value, options.session.timeouts.idle)) {
+        return false;
+      }
+    } else if (name == "--trace-sample") {
+      std::uint32_t every = 0;
+      if (!parse_flag_count(arg, value, every)) {
+        return false;
+      }
+      Tracer::getInstance().setSampleEvery(every);
+    } else if (name == "--cache-size") {
+      std::size_t bytes = 0;
+      if (!parse_flag_count(arg, value, bytes)) {
+        return false;
+      }
+      AssetCache::getInstance().setCapacity(bytes);
+    } else {
+      std::cerr << "Unknown option: " << arg << "\n";
+      return false;
+    }
+  }
+  if (tls_options.certificate_file.empty() != tls_options.private_key_file.empty()) {
+    std::cerr << "--tls-cert and --tls-key go together\n";
+    return false;
+  }
+  return true;
+}
+
+void handle_metrics(http_session& session, const http_request& req) {
+  session.send_response(Metrics::getInstance().render(),
+                        "text/plain; version=0.0.4; charset=utf-8");
+}
+
+// Recent spans of sampled requests, for chrome://tracing or Perfetto
+void handle_trace_dump(http_session& session, const http_request& req) {
+  session.send_response(Tracer::getInstance().dump(), "application/json");
+}
+
+// POST /debug/trace/sample/N traces one request in N from now on; 0 stops
+void handle_trace_sample(http_session& session, const http_request& req) {
+  std::string_view every = session.route_params().get("every");
+  std::uint32_t n = 0;
+  if (!parse_count(every, n)) {
+    session.send_bad_request("Sample rate must be a number");
+    return;
+  }
+  Tracer::getInstance().setSampleEvery(n);
+  session.send_response(n == 0 ? "Tracing off\n"
+                               : "Tracing one request in " + std::to_string(n) + "\n",
+                        "text/plain");
+}
+
+// POST /debug/upload spools the body to a temporary file and reports its
+// size; the body is never held in memory
+void handle_upload(http_session& session, const http_request& req, int fd,
+                   std::uint64_t size) {
+  session.send_response("Received " + std::to_string(size) + " bytes\n", "text/plain");
+}
+
+void dump_trace_on_signal(net::signal_set& signals) {
+  signals.async_wait([&signals](const beast::error_code& ec, int) {
+    if (ec) {
+      return;
+    }
+    std::ofstream out(TRACE_DUMP_PATH, std::ios::trunc);
+    out << Tracer::getInstance().dump();
+    getGlobalLogger().log(out ? "Trace written to " TRACE_DUMP_PATH
+                              : "Failed to write " TRACE_DUMP_PATH);
+    dump_trace_on_signal(signals);
+  });
+}
+
+void handle_root(http_session& session,
+                 const http_request& req) {
+  if (bundle) {
+    session.serve_bundled(bundle, "/index.html");
+    return;
+  }
+  if (auto asset = std::atomic_load(&root_asset)) {
+    session.serve_asset(asset);
+    return;
+  }
+  session.stream_file("index.html", "text/html");
+}
+
+int main(int argc, char* argv[]) {
+  server_options options;
+  RateLimiter::getInstance().setCapacity(RATE_LIMIT_CLIENTS, RATE_LIMIT_EXPIRY_MS);
+  if (!parse_arguments(argc, argv, options)) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  try {
+    std::signal(SIGINT, signal_handler);
+    // sendfile(2) to a peer that has gone away raises SIGPIPE; the EPIPE it
+    // also returns is handled, the signal would kill the process
+    std::signal(SIGPIPE, SIG_IGN);
+    getGlobalLogger().log("Starting server on port " + std::to_string(SERVER_PORT));
+    getGlobalLogger().log("Press Ctrl+C to stop");
+
+    getGlobalLogger().log("Using " + std::to_string(MAX_THREADS) + " threads");
+    getGlobalLogger().log("Max Listen Connections: " + std::to_string(net::socket_base::max_listen_connections));
+    getGlobalLogger().log(std::string("Accept mode: ") +
+                          (options.accept == accept_mode::reuseport ? "reuseport" : "single") +
+                          ", dispatch: " +
+                          (options.dispatch == dispatch_policy::least_loaded ? "least-loaded" : "round-robin") +
+                          ", threading: " +
+                          (options.execution == execution_mode::per_core ? "per-core" : "strand") +
+                          ", file I/O threads: " + std::to_string(options.file_io_threads));
+
+    const std::size_t num_contexts = MAX_THREADS;
+    const bool per_core = options.execution == execution_mode::per_core;
+
+    // A concurrency hint of 1 tells asio each io_context has a single thread
+    std::deque<net::io_context> io_contexts;
+    for (std::size_t i = 0; i < num_contexts; ++i) {
+        if (per_core) {
+            io_contexts.emplace_back(1);
+        } else {
+            io_contexts.emplace_back();
+        }
+    }
+    std::vector<net::executor_work_guard<net::io_context::executor_type>> work_guards;
+
+    for (auto& ctx : io_contexts) {
+        work_guards.emplace_back(net::make_work_guard(ctx));
+    }
+
+    std::vector<std::reference_wrapper<net::io_context>> io_context_refs;
+    for (auto& ctx : io_contexts) {
+        io_context_refs.push_back(std::ref(ctx));
+    }
+    // Every route is in place before the listener opens, so no early
+    // connection is answered from a half-built table
+    auto& router = Router::getInstance();
+    router.addRoute("/", handle_root);
+    router.addRoute(http::verb::get, "/metrics", handle_metrics);
+    if (debug_routes) {
+      router.addRoute(http::verb::get, "/debug/trace", handle_trace_dump);
+      router.addRoute(http::verb::post, "/debug/trace/sample/:every", handle_trace_sample);
+      BodyOptions upload_options;
+      upload_options.body_limit = DEBUG_UPLOAD_LIMIT;
+      router.addUploadRoute(http::verb::post, "/debug/upload", upload_options,
+                            spool_to_file(handle_upload));
+    }
+
+    // Backends are resolved here, so a bad address stops startup
+    std::vector<std::shared_ptr<Upstream>> upstreams;
+    BodyOptions proxy_body_options;
+    proxy_body_options.body_limit = PROXY_BODY_LIMIT;
+    for (const auto& [prefix, backends] : proxy_routes) {
+      upstreams.push_back(std::make_shared<Upstream>(prefix, backends, proxy_options));
+      router.addProxyRoute(prefix, upstreams.back(), proxy_body_options);
+      std::string list;
+      for (const auto& backend : backends) {
+        list += " " + backend;
+      }
+      getGlobalLogger().log("Proxying " + prefix + " to" + list);
+    }
+
+    // A bundle is mapped, not scanned: its files are looked up in its own
+    // index behind one wildcard route, whatever their number
+    std::unique_ptr<FileWatcher> watcher;
+    if (!bundle_path.empty()) {
+      bundle = AssetBundle::open(bundle_path);
+      getGlobalLogger().log("Serving " + std::to_string(bundle->entryCount()) + " files from " +
+                            bundle_path);
+      router.addRoute("/*path", [](http_session& session, const http_request& req) {
+        std::string_view target = to_string_view(req.target());
+        session.serve_bundled(bundle, target.substr(0, target.find('?')));
+      });
+    } else {
+      // Watching starts before the walk, so a file written during it may be
+      // indexed twice but is never missed
+      std::lock_guard<std::mutex> lock(static_files_mutex);
+      if (watch_files) {
+        watcher = std::make_unique<FileWatcher>(static_root, apply_file_changes);
+      }
+      add_all_files_in_directory();
+    }
+    router.freeze();
+
+    // The certificate is loaded here, so a bad one stops startup
+    if (!tls_options.certificate_file.empty()) {
+      options.tls = std::make_shared<TlsContext>(tls_options);
+      options.tls_endpoint = tcp::endpoint(tcp::v4(), tls_port);
+      getGlobalLogger().log("Serving HTTPS on port " + std::to_string(tls_port) +
+                            ", kernel TLS " +
+                            (!tls_options.ktls                       ? "off"
+                             : TlsContext::kernelTlsAvailable() ? "where the cipher allows"
+                                                                : "unavailable on this kernel"));
+    }
+
+    server = std::make_unique<http_server>(io_context_refs, tcp::endpoint(tcp::v4(), SERVER_PORT), options);
+    server->run();
+
+    // SIGUSR1 writes the trace buffers to TRACE_DUMP_PATH
+    net::signal_set trace_signals(io_contexts.front(), SIGUSR1);
+    dump_trace_on_signal(trace_signals);
+    Metrics::getInstance().addCollector(
+        [](std::string& out) { server->collect_metrics(out); });
+    Metrics::getInstance().addCollector(
+        [](std::string& out) { RateLimiter::getInstance().collectMetrics(out); });
+    if (options.tls) {
+      Metrics::getInstance().addCollector(
+          [tls = options.tls](std::string& out) { tls->collectMetrics(out); });
+    }
+    if (!upstreams.empty()) {
+      Metrics::getInstance().addCollector(
+          [upstreams](std::string& out) { Upstream::collectMetrics(upstreams, out); });
+    }
+    Metrics::getInstance().addCollector([](std::string& out) {
+      out += "# HELP webserver_router_retired_tables Replaced routing tables not yet freed.\n"
+             "# TYPE webserver_router_retired_tables gauge\n"
+             "webserver_router_retired_tables " +
+             std::to_string(Router::getInstance().retiredTables()) + "\n";
+    });
+
+
+    std::vector<int> cpus;
+    if (per_core) {
+        cpus = plan_cpu_placement(num_contexts, options.numa_aware);
+        if (cpus.empty()) {
+            getGlobalLogger().log("CPU placement unavailable, threads will not be pinned");
+        }
+    }
+
+    // Startup (routes, asset indexing) is done; what is counted from here on
+    // is serving. Only keep-alive requests for cached assets, one at a time,
+    // stay at a handful per connection. Pipelining, and sendfile in strand
+    // mode, also pay for asio's operations past its one-block-per-thread
+    // cache (see memory_pool.hpp).
+    std::uint64_t allocations_at_start = allocation_count();
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < num_contexts; ++i) {
+        int cpu = i < cpus.size() ? cpus[i] : -1;
+        threads.emplace_back([&ctx = io_contexts[i], cpu] {
+            // Pin before running so the thread's allocations land on its node
+            if (cpu >= 0 && !pin_current_thread(cpu)) {
+                getGlobalLogger().log("Failed to pin thread to CPU " + std::to_string(cpu));
+            }
+            ctx.run();
+        });
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    auto& cache = AssetCache::getInstance();
+    getGlobalLogger().log("Asset cache: " + std::to_string(cache.hits()) + " hits, " +
+                          std::to_string(cache.misses()) + " misses, " +
+                          std::to_string(cache.evictions()) + " evictions, " +
+                          std::to_string(cache.size()) + "/" +
+                          std::to_string(cache.capacity()) + " bytes");
+    getGlobalLogger().log("Heap allocations while serving: " +
+                          std::to_string(allocation_count() - allocations_at_start) +
+                          " over " + std::to_string(server->requests_served()) +
+                          " requests");
+    getGlobalLogger().log("Log records dropped: " + std::to_string(getGlobalLogger().dropped()));
+  } catch (std::exception const& e) {
+    getGlobalLogger().log("Error: " + std::string(e.what()));
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
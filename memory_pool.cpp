@@ -0,0 +1,48 @@
+#include "memory_pool.hpp"
+
+#include <new>
+
+memory_pool::~memory_pool() { trim(); }
+
+void memory_pool::trim() noexcept {
+    for (FreeBlock*& head : free_) {
+        while (head) {
+            FreeBlock* next = head->next;
+            ::operator delete(head);
+            head = next;
+        }
+    }
+}
+
+std::size_t memory_pool::size_class(std::size_t size) {
+    std::size_t index = 0;
+    std::size_t block = kMinBlock;
+    while (block < size && index < kClasses) {
+        block <<= 1;
+        ++index;
+    }
+    return index;
+}
+
+void* memory_pool::allocate(std::size_t size) {
+    std::size_t index = size_class(size);
+    if (index == kClasses) {
+        return ::operator new(size);
+    }
+    if (FreeBlock* block = free_[index]) {
+        free_[index] = block->next;
+        return block;
+    }
+    return ::operator new(kMinBlock << index);
+}
+
+void memory_pool::deallocate(void* p, std::size_t size) noexcept {
+    std::size_t index = size_class(size);
+    if (index == kClasses) {
+        ::operator delete(p);
+        return;
+    }
+    auto* block = static_cast<FreeBlock*>(p);
+    block->next = free_[index];
+    free_[index] = block;
+}
@@ -0,0 +1,109 @@
+// memory_pool.hpp
+#ifndef MEMORY_POOL_HPP
+#define MEMORY_POOL_HPP
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+// Recycles memory blocks in power-of-two size classes from 32 bytes to
+// 4 KB. A freed block goes onto its class's free list instead of back to the
+// heap, so an owner that allocates the same shapes on every request (parsed
+// header fields, asio operation state) stops touching the heap once warm.
+// That covers what carries a pooled_handler. Asio's own scheduler and strand
+// operations (strand invokers, the functions any_io_executor type-erases)
+// go through its per-thread recycling cache, which holds one block per
+// purpose. When several operations are live at once, as with pipelined
+// requests or sendfile turns through a strand, the rest come from the heap.
+// Larger blocks are passed straight through to operator new.
+//
+// Not thread-safe: a pool belongs to one session or one io_context and is
+// only used from the thread running it.
+class memory_pool {
+public:
+    memory_pool() = default;
+    memory_pool(const memory_pool&) = delete;
+    memory_pool& operator=(const memory_pool&) = delete;
+    ~memory_pool();
+
+    void* allocate(std::size_t size);
+    void deallocate(void* p, std::size_t size) noexcept;
+    // Returns every free block to the heap
+    void trim() noexcept;
+
+private:
+    static constexpr std::size_t kMinBlock = 32;
+    static constexpr std::size_t kClasses = 8;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    FreeBlock* free_[kClasses] = {};
+
+    static std::size_t size_class(std::size_t size);
+};
+
+// Standard allocator over a memory_pool, for Beast fields and shared_ptr
+// control blocks
+template <class T>
+class pool_allocator {
+public:
+    using value_type = T;
+
+    explicit pool_allocator(memory_pool& pool) noexcept : pool_(&pool) {}
+
+    template <class U>
+    pool_allocator(const pool_allocator<U>& other) noexcept : pool_(other.pool_) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(pool_->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept { pool_->deallocate(p, n * sizeof(T)); }
+
+    template <class U>
+    bool operator==(const pool_allocator<U>& other) const noexcept {
+        return pool_ == other.pool_;
+    }
+
+    template <class U>
+    bool operator!=(const pool_allocator<U>& other) const noexcept {
+        return pool_ != other.pool_;
+    }
+
+private:
+    template <class U>
+    friend class pool_allocator;
+
+    memory_pool* pool_;
+};
+
+// Wraps a completion handler so asio and Beast allocate the operation
+// state for it from a memory_pool instead of the heap
+template <class Handler>
+class pooled_handler {
+public:
+    using allocator_type = pool_allocator<char>;
+
+    pooled_handler(memory_pool& pool, Handler handler)
+        : pool_(&pool), handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept { return allocator_type(*pool_); }
+
+    template <class... Args>
+    void operator()(Args&&... args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    memory_pool* pool_;
+    Handler handler_;
+};
+
+template <class Handler>
+pooled_handler<std::decay_t<Handler>> bind_pool(memory_pool& pool, Handler&& handler) {
+    return pooled_handler<std::decay_t<Handler>>(pool, std::forward<Handler>(handler));
+}
+
+#endif  // MEMORY_POOL_HPP
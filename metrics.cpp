@@ -0,0 +1,243 @@
+#include "metrics.hpp"
+
+#include <charconv>
+
+namespace {
+
+void appendNumber(std::string& out, std::uint64_t value) {
+    char digits[20];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr - digits);
+}
+
+// Nanoseconds as seconds, the unit Prometheus expects
+void appendSeconds(std::string& out, std::uint64_t nanoseconds) {
+    appendNumber(out, nanoseconds / 1'000'000'000);
+    out += '.';
+    char fraction[10];
+    std::uint64_t rest = nanoseconds % 1'000'000'000;
+    for (int i = 8; i >= 0; --i) {
+        fraction[i] = static_cast<char>('0' + rest % 10);
+        rest /= 10;
+    }
+    out.append(fraction, 9);
+}
+
+void appendLabelValue(std::string& out, std::string_view value) {
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+}
+
+void appendHeader(std::string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void appendCounter(std::string& out, const char* name, const char* help, std::uint64_t value) {
+    appendHeader(out, name, "counter", help);
+    out += name;
+    out += ' ';
+    appendNumber(out, value);
+    out += '\n';
+}
+
+}  // namespace
+
+// Gives a thread exclusive use of a shard until the thread exits; the
+// counts stay in the shard for the next thread to add to
+struct Metrics::ShardLease {
+    Shard* shard = nullptr;
+
+    ~ShardLease() {
+        if (shard) {
+            shard->owned.store(false, std::memory_order_release);
+        }
+    }
+};
+
+Metrics::Metrics() : routes_{"unmatched"} {}
+
+Metrics& Metrics::getInstance() {
+    static Metrics instance;
+    return instance;
+}
+
+Metrics::Shard* Metrics::localShard() {
+    thread_local ShardLease lease;
+    if (!lease.shard) {
+        lease.shard = acquireShard();
+        if (!lease.shard) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return lease.shard;
+}
+
+Metrics::Shard* Metrics::acquireShard() {
+    // Reuse the shard of a thread that has exited
+    std::size_t count = shard_count_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i) {
+        Shard* shard = shards_[i].load(std::memory_order_acquire);
+        bool expected = false;
+        if (shard->owned.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+            return shard;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    count = shard_count_.load(std::memory_order_relaxed);
+    if (count == kMaxShards) {
+        return nullptr;
+    }
+    Shard* shard = new Shard;
+    shard->owned.store(true, std::memory_order_relaxed);
+    shards_[count].store(shard, std::memory_order_release);
+    shard_count_.store(count + 1, std::memory_order_release);
+    return shard;
+}
+
+std::uint32_t Metrics::registerRoute(std::string_view pattern) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::size_t i = 1; i < routes_.size(); ++i) {
+        if (routes_[i] == pattern) {
+            return static_cast<std::uint32_t>(i);
+        }
+    }
+    if (routes_.size() == kMaxRoutes - 1) {
+        routes_.emplace_back("other");
+    }
+    if (routes_.size() == kMaxRoutes) {
+        return kMaxRoutes - 1;
+    }
+    routes_.emplace_back(pattern);
+    return static_cast<std::uint32_t>(routes_.size() - 1);
+}
+
+void Metrics::addCollector(Collector collector) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    collectors_.push_back(std::move(collector));
+}
+
+std::string Metrics::render() const {
+    // Sum the shards first; each value is read once, so a scrape is a
+    // consistent-enough snapshot without stopping the writers
+    std::uint64_t accepted = 0, requests = 0, bytes_in = 0, bytes_out = 0, shed = 0, timeouts = 0;
+    std::vector<std::uint64_t> status(kMaxStatus);
+    std::vector<std::uint64_t> buckets(kMaxRoutes * (kBucketBounds.size() + 1));
+    std::vector<std::uint64_t> sums(kMaxRoutes);
+
+    std::size_t count = shard_count_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i) {
+        const Shard* shard = shards_[i].load(std::memory_order_acquire);
+        accepted += shard->accepted.get();
+        requests += shard->requests.get();
+        bytes_in += shard->bytes_in.get();
+        bytes_out += shard->bytes_out.get();
+        shed += shard->shed.get();
+        timeouts += shard->timeouts.get();
+        for (std::size_t s = 0; s < kMaxStatus; ++s) {
+            status[s] += shard->status[s].get();
+        }
+        for (std::size_t r = 0; r < kMaxRoutes; ++r) {
+            const RouteHistogram& histogram = shard->routes[r];
+            for (std::size_t b = 0; b <= kBucketBounds.size(); ++b) {
+                buckets[r * (kBucketBounds.size() + 1) + b] += histogram.buckets[b].get();
+            }
+            sums[r] += histogram.sum.get();
+        }
+    }
+
+    std::string out;
+    out.reserve(16 * 1024);
+    appendCounter(out, "webserver_accepted_connections_total", "Connections accepted.", accepted);
+    appendCounter(out, "webserver_requests_total", "Requests read.", requests);
+    appendCounter(out, "webserver_request_bytes_total", "Bytes of request headers and bodies read.",
+                  bytes_in);
+    appendCounter(out, "webserver_response_bytes_total", "Bytes written to clients.", bytes_out);
+    appendCounter(out, "webserver_shed_connections_total",
+                  "Connections answered 503 at accept because of a connection cap or overload.",
+                  shed);
+    appendCounter(out, "webserver_timeouts_total",
+                  "Connections closed for overrunning a read, write or idle deadline.", timeouts);
+    appendCounter(out, "webserver_metrics_dropped_total",
+                  "Recordings discarded because every metrics shard was taken.",
+                  dropped_.load(std::memory_order_relaxed));
+
+    appendHeader(out, "webserver_responses_total", "counter", "Responses by status code.");
+    for (std::size_t s = 0; s < kMaxStatus; ++s) {
+        if (status[s] == 0) {
+            continue;
+        }
+        out += "webserver_responses_total{code=\"";
+        appendNumber(out, s);
+        out += "\"} ";
+        appendNumber(out, status[s]);
+        out += '\n';
+    }
+
+    std::vector<std::string> routes;
+    std::vector<Collector> collectors;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        routes = routes_;
+        collectors = collectors_;
+    }
+
+    appendHeader(out, "webserver_route_duration_seconds", "histogram",
+                 "Time from reading a request to queueing its response, by route.");
+    for (std::size_t r = 0; r < routes.size(); ++r) {
+        const std::uint64_t* counts = &buckets[r * (kBucketBounds.size() + 1)];
+        std::uint64_t total = 0;
+        for (std::size_t b = 0; b <= kBucketBounds.size(); ++b) {
+            total += counts[b];
+        }
+        if (total == 0) {
+            continue;
+        }
+
+        std::uint64_t cumulative = 0;
+        for (std::size_t b = 0; b <= kBucketBounds.size(); ++b) {
+            cumulative += counts[b];
+            out += "webserver_route_duration_seconds_bucket{route=\"";
+            appendLabelValue(out, routes[r]);
+            out += "\",le=\"";
+            if (b < kBucketBounds.size()) {
+                appendSeconds(out, kBucketBounds[b]);
+            } else {
+                out += "+Inf";
+            }
+            out += "\"} ";
+            appendNumber(out, cumulative);
+            out += '\n';
+        }
+        out += "webserver_route_duration_seconds_sum{route=\"";
+        appendLabelValue(out, routes[r]);
+        out += "\"} ";
+        appendSeconds(out, sums[r]);
+        out += "\nwebserver_route_duration_seconds_count{route=\"";
+        appendLabelValue(out, routes[r]);
+        out += "\"} ";
+        appendNumber(out, total);
+        out += '\n';
+    }
+
+    for (const auto& collector : collectors) {
+        collector(out);
+    }
+    return out;
+}
@@ -0,0 +1,156 @@
+// metrics.hpp
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Server counters and per-route latency histograms, exported in Prometheus
+// text format. Like the logger's rings, every recording thread owns a shard
+// that only it writes, so recording is a few plain loads and stores with no
+// locked instructions; render() sums the shards when the endpoint is
+// scraped.
+class Metrics {
+public:
+    static constexpr std::size_t kMaxRoutes = 256;   // route 0 is "unmatched"
+    static constexpr std::size_t kMaxStatus = 600;
+    static constexpr std::size_t kMaxShards = 1024;
+
+    // Upper bounds of the service time buckets, in nanoseconds; one more
+    // bucket catches everything slower
+    static constexpr std::array<std::uint64_t, 22> kBucketBounds = {
+        1'000,         2'500,         5'000,         10'000,
+        25'000,        50'000,        100'000,       250'000,
+        500'000,       1'000'000,     2'500'000,     5'000'000,
+        10'000'000,    25'000'000,    50'000'000,    100'000'000,
+        250'000'000,   500'000'000,   1'000'000'000, 2'500'000'000,
+        5'000'000'000, 10'000'000'000};
+
+    // Appends extra samples (e.g. gauges owned by the server) to a scrape
+    using Collector = std::function<void(std::string& out)>;
+
+private:
+    // Written by one thread and read by scrapes, so a relaxed load and
+    // store is enough; no read-modify-write is ever contended
+    struct Counter {
+        std::atomic<std::uint64_t> value{0};
+
+        void add(std::uint64_t n) {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        std::uint64_t get() const { return value.load(std::memory_order_relaxed); }
+    };
+
+    struct RouteHistogram {
+        Counter buckets[kBucketBounds.size() + 1];
+        Counter sum;  // nanoseconds
+    };
+
+    struct alignas(64) Shard {
+        std::atomic<bool> owned{false};
+        Counter accepted;
+        Counter requests;
+        Counter bytes_in;
+        Counter bytes_out;
+        Counter shed;
+        Counter timeouts;
+        Counter status[kMaxStatus];
+        RouteHistogram routes[kMaxRoutes];
+    };
+
+    struct ShardLease;
+
+    std::array<std::atomic<Shard*>, kMaxShards> shards_{};
+    std::atomic<std::size_t> shard_count_{0};
+    std::atomic<std::uint64_t> dropped_{0};  // recordings with no shard to go to
+
+    mutable std::mutex mutex_;  // routes_ and collectors_
+    std::vector<std::string> routes_;
+    std::vector<Collector> collectors_;
+
+    Metrics();
+    ~Metrics() = default;
+
+    Shard* localShard();
+    Shard* acquireShard();
+
+public:
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    static Metrics& getInstance();
+
+    // Nanoseconds on the steady clock, for measuring service time
+    static std::uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // Returns the histogram id for a route pattern, the same id for the
+    // same pattern. Past kMaxRoutes patterns share the last id, "other".
+    std::uint32_t registerRoute(std::string_view pattern);
+    void addCollector(Collector collector);
+
+    // Hot path
+    void countAccept() {
+        if (Shard* shard = localShard()) {
+            shard->accepted.add(1);
+        }
+    }
+
+    void countShed() {
+        if (Shard* shard = localShard()) {
+            shard->shed.add(1);
+        }
+    }
+
+    void countTimeout() {
+        if (Shard* shard = localShard()) {
+            shard->timeouts.add(1);
+        }
+    }
+
+    void countRequest(std::size_t bytes) {
+        if (Shard* shard = localShard()) {
+            shard->requests.add(1);
+            shard->bytes_in.add(bytes);
+        }
+    }
+
+    void countBytesOut(std::size_t bytes) {
+        if (Shard* shard = localShard()) {
+            shard->bytes_out.add(bytes);
+        }
+    }
+
+    void recordResponse(std::uint32_t route, unsigned status, std::uint64_t nanoseconds) {
+        Shard* shard = localShard();
+        if (!shard) {
+            return;
+        }
+        if (status < kMaxStatus) {
+            shard->status[status].add(1);
+        }
+        std::size_t bucket = 0;
+        while (bucket < kBucketBounds.size() && nanoseconds > kBucketBounds[bucket]) {
+            ++bucket;
+        }
+        RouteHistogram& histogram = shard->routes[route < kMaxRoutes ? route : kMaxRoutes - 1];
+        histogram.buckets[bucket].add(1);
+        histogram.sum.add(nanoseconds);
+    }
+
+    // Prometheus text exposition of everything recorded so far
+    std::string render() const;
+};
+
+#endif  // METRICS_HPP
@@ -0,0 +1,421 @@
+// microbench: isolated timings of the server's hot paths.
+//
+// Each benchmark runs its operation in batches until it has been measured
+// for long enough, then reports wall time and global operator new calls per
+// operation. Multi-threaded benchmarks count operations across all threads,
+// so ns/op is the inverse of total throughput.
+//
+// Usage: microbench [--filter=SUBSTRING] [--json] [--min-time=SECONDS]
+#include <boost/asio/io_context.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "alloc_stats.hpp"
+#include "globals.hpp"
+#include "http_request.hpp"
+#include "http_session.hpp"
+#include "logger.hpp"
+#include "memory_pool.hpp"
+#include "metrics.hpp"
+#include "mime_types.hpp"
+#include "rate_limiter.hpp"
+#include "router.hpp"
+#include "thread_safe_queue.hpp"
+
+namespace {
+
+using steady = std::chrono::steady_clock;
+
+struct bench_options {
+  std::string filter;
+  bool json = false;
+  double min_time = 0.5;
+};
+
+bench_options options;
+FILE* report_out = stdout;  // the real stdout; fd 1 is /dev/null for the logger
+
+// Keeps the compiler from discarding a result
+template <class T>
+void keep(const T& value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+void report(const std::string& name, std::uint64_t ops, double seconds,
+            std::uint64_t allocations) {
+  double ns = seconds * 1e9 / ops;
+  double allocs = static_cast<double>(allocations) / ops;
+  if (options.json) {
+    std::fprintf(report_out,
+                 "{\"name\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,\"allocs_per_op\":%.3f}\n",
+                 name.c_str(), static_cast<unsigned long long>(ops), ns, allocs);
+  } else {
+    std::fprintf(report_out, "%-44s %12llu ops %12.2f ns/op %10.3f allocs/op\n",
+                 name.c_str(), static_cast<unsigned long long>(ops), ns, allocs);
+  }
+  std::fflush(report_out);
+}
+
+bool selected(const std::string& name) {
+  return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+// Runs batch(n), which must perform n operations, with growing n until
+// min_time has been spent in one measured batch
+void run(const std::string& name, const std::function<void(std::uint64_t)>& batch) {
+  if (!selected(name)) {
+    return;
+  }
+  batch(1);  // warm caches and any lazily built state
+
+  std::uint64_t n = 1;
+  while (true) {
+    std::uint64_t allocations = allocation_count();
+    auto begin = steady::now();
+    batch(n);
+    double seconds = std::chrono::duration<double>(steady::now() - begin).count();
+    allocations = allocation_count() - allocations;
+
+    if (seconds >= options.min_time || n >= (1ull << 40)) {
+      report(name, n, seconds, allocations);
+      return;
+    }
+    // Aim a little past min_time, growing at most 100x per step
+    double scale = seconds > 0 ? options.min_time * 1.2 / seconds : 100;
+    n = static_cast<std::uint64_t>(n * std::min(std::max(scale, 2.0), 100.0));
+  }
+}
+
+// Runs body(thread, n) on threads concurrently, splitting n operations
+// between them
+void run_threads(const std::string& name, unsigned threads,
+                 const std::function<void(unsigned, std::uint64_t)>& body) {
+  run(name, [&](std::uint64_t n) {
+    std::vector<std::thread> workers;
+    std::uint64_t share = (n + threads - 1) / threads;
+    for (unsigned t = 0; t < threads; ++t) {
+      workers.emplace_back(body, t, share);
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+  });
+}
+
+// ---- Router ----------------------------------------------------------------
+
+http_request make_request(memory_pool& pool, http::verb method, const std::string& target) {
+  http_request req{std::piecewise_construct, std::make_tuple(),
+                   std::make_tuple(pool_allocator<char>(pool))};
+  req.method(method);
+  req.target(target);
+  return req;
+}
+
+void bench_router() {
+  auto& router = Router::getInstance();
+  net::io_context ioc;
+  std::atomic<int> load{0};
+  std::atomic<std::uint64_t> requests{0};
+  std::atomic<bool> overloaded{false};
+  upstream_pool upstreams(ioc);
+  session_options session_opts;
+  auto session = std::make_shared<http_session>(ioc, load, requests, overloaded, upstreams,
+                                                session_opts);
+  memory_pool pool;
+
+  auto noop = [](http_session&, const http_request&) {};
+  router.addRoute("/users/:id/posts/:post", noop);
+  router.addRoute(http::verb::get, "/static/*path", noop);
+  router.freeze();
+
+  // The table grows between rounds; every route is "/assets/<i>/file.js"
+  std::size_t routes = 0;
+  for (std::size_t size : {10, 100, 1000}) {
+    for (; routes < size; ++routes) {
+      router.addRoute("/assets/" + std::to_string(routes) + "/file.js", noop);
+    }
+
+    std::vector<http_request> hits;
+    for (std::size_t i = 0; i < 64; ++i) {
+      hits.push_back(make_request(pool, http::verb::get,
+                                  "/assets/" + std::to_string(i * 7919 % size) + "/file.js"));
+    }
+    std::string suffix = "/routes=" + std::to_string(size);
+
+    run("router/static-hit" + suffix, [&](std::uint64_t n) {
+      for (std::uint64_t i = 0; i < n; ++i) {
+        keep(router.routeRequest(*session, hits[i & 63]));
+      }
+    });
+
+    auto param = make_request(pool, http::verb::get, "/users/42/posts/7?full=1");
+    run("router/params" + suffix, [&](std::uint64_t n) {
+      for (std::uint64_t i = 0; i < n; ++i) {
+        keep(router.routeRequest(*session, param));
+      }
+    });
+
+    auto wildcard = make_request(pool, http::verb::get, "/static/css/site/main.css");
+    run("router/wildcard" + suffix, [&](std::uint64_t n) {
+      for (std::uint64_t i = 0; i < n; ++i) {
+        keep(router.routeRequest(*session, wildcard));
+      }
+    });
+
+    auto miss = make_request(pool, http::verb::get, "/assets/missing/file.js");
+    run("router/not-found" + suffix, [&](std::uint64_t n) {
+      for (std::uint64_t i = 0; i < n; ++i) {
+        keep(router.routeRequest(*session, miss));
+      }
+    });
+  }
+}
+
+// ---- Logger ----------------------------------------------------------------
+
+void bench_logger() {
+  auto& logger = getGlobalLogger();
+  const std::string message = "Adding route /assets/app.js for file ./assets/app.js";
+
+  for (unsigned threads : {1u, 2u, 4u, 8u}) {
+    std::string suffix = "/threads=" + std::to_string(threads);
+    run_threads("logger/log" + suffix, threads, [&](unsigned, std::uint64_t n) {
+      for (std::uint64_t i = 0; i < n; ++i) {
+        logger.log(message);
+      }
+    });
+    run_threads("logger/logRequest" + suffix, threads, [&](unsigned, std::uint64_t n) {
+      for (std::uint64_t i = 0; i < n; ++i) {
+        logger.logRequest("GET", "/assets/app.js", 312);
+      }
+    });
+  }
+}
+
+// ---- ThreadSafeQueue -------------------------------------------------------
+
+void bench_queue() {
+  ThreadSafeQueue<std::uint64_t> queue;
+  run("queue/push-pop/uncontended", [&](std::uint64_t n) {
+    for (std::uint64_t i = 0; i < n; ++i) {
+      queue.push(i);
+      keep(queue.pop());
+    }
+  });
+
+  // Half the threads push their share and half pop the same number
+  for (unsigned pairs : {1u, 2u, 4u}) {
+    run_threads("queue/push-pop/pairs=" + std::to_string(pairs), pairs * 2,
+                [&](unsigned t, std::uint64_t n) {
+                  if (t % 2 == 0) {
+                    for (std::uint64_t i = 0; i < n; ++i) {
+                      queue.push(i);
+                    }
+                  } else {
+                    for (std::uint64_t i = 0; i < n; ++i) {
+                      keep(queue.pop());
+                    }
+                  }
+                });
+  }
+}
+
+// ---- MIME lookup -----------------------------------------------------------
+
+void bench_content_type() {
+  const std::string extensions[] = {".html", ".js", ".png", ".ico", ".woff2"};
+  run("content-type/lookup", [&](std::uint64_t n) {
+    for (std::uint64_t i = 0; i < n; ++i) {
+      keep(determine_content_type(extensions[i % 5]));
+    }
+  });
+}
+
+// ---- Metrics ---------------------------------------------------------------
+
+void bench_metrics() {
+  auto& metrics = Metrics::getInstance();
+  std::uint32_t route = metrics.registerRoute("/bench");
+
+  // What a session records for one request and its response
+  for (unsigned threads : {1u, 4u}) {
+    run_threads("metrics/request/threads=" + std::to_string(threads), threads,
+                [&](unsigned, std::uint64_t n) {
+                  for (std::uint64_t i = 0; i < n; ++i) {
+                    metrics.countRequest(420);
+                    metrics.recordResponse(route, 200, 180'000 + (i & 1023));
+                    metrics.countBytesOut(1600);
+                  }
+                });
+  }
+  run("metrics/now", [&](std::uint64_t n) {
+    for (std::uint64_t i = 0; i < n; ++i) {
+      keep(Metrics::now());
+    }
+  });
+  run("metrics/render", [&](std::uint64_t n) {
+    for (std::uint64_t i = 0; i < n; ++i) {
+      keep(metrics.render());
+    }
+  });
+}
+
+// ---- RateLimiter -----------------------------------------------------------
+
+void bench_rate_limiter() {
+  auto& limiter = RateLimiter::getInstance();
+  limiter.setCapacity(RATE_LIMIT_CLIENTS, RATE_LIMIT_EXPIRY_MS);
+  // High enough that every request is admitted, so the full path is timed
+  limiter.setRequestRate({1e12, 1e12});
+
+  std::vector<RateLimiter::ClientKey> clients(10000);
+  for (std::size_t i = 0; i < clients.size(); ++i) {
+    clients[i] = RateLimiter::keyFor(net::ip::make_address_v4(0x0a000000 + i));
+  }
+
+  // One client hammering, and a crowd spread over the shards
+  for (unsigned threads : {1u, 4u}) {
+    std::string suffix = "/threads=" + std::to_string(threads);
+    run_threads("rate-limiter/one-client" + suffix, threads, [&](unsigned t, std::uint64_t n) {
+      for (std::uint64_t i = 0; i < n; ++i) {
+        keep(limiter.admitRequest(clients[t]));
+      }
+    });
+    run_threads("rate-limiter/10k-clients" + suffix, threads, [&](unsigned t, std::uint64_t n) {
+      for (std::uint64_t i = 0; i < n; ++i) {
+        keep(limiter.admitRequest(clients[(i * 7919 + t) % clients.size()]));
+      }
+    });
+  }
+  limiter.setRequestRate({});
+}
+
+// ---- Request parsing -------------------------------------------------------
+
+const std::string browser_get =
+    "GET /assets/app.js?v=3 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: http://localhost:8080/\r\n"
+    "Connection: keep-alive\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-None-Match: \"09ef4145a32f6257\"\r\n"
+    "\r\n";
+
+const std::string json_post =
+    "POST /api/items HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 1024\r\n"
+    "\r\n" +
+    std::string(1024, 'x');
+
+// Parses the request with a fresh parser per operation, as sessions do
+template <class Body, class Allocator = std::allocator<char>>
+void bench_parse(const std::string& name, const std::string& text,
+                 const Allocator& allocator = Allocator()) {
+  run(name, [&](std::uint64_t n) {
+    for (std::uint64_t i = 0; i < n; ++i) {
+      http::request_parser<Body, Allocator> parser(
+          std::piecewise_construct, std::make_tuple(), std::make_tuple(allocator));
+      parser.eager(true);
+      beast::error_code ec;
+      parser.put(net::buffer(text), ec);
+      if (ec || !parser.is_done()) {
+        std::cerr << name << ": parse failed: " << ec.message() << "\n";
+        std::exit(EXIT_FAILURE);
+      }
+      keep(parser.get());
+    }
+  });
+}
+
+void bench_parsing() {
+  memory_pool pool;
+  pool_allocator<char> pooled(pool);
+
+  for (const auto& [label, text] : {std::make_pair("get", &browser_get),
+                                    std::make_pair("post-1k", &json_post)}) {
+    std::string prefix = std::string("parse/") + label;
+    bench_parse<http::dynamic_body>(prefix + "/dynamic_body", *text);
+    bench_parse<http::string_body>(prefix + "/string_body", *text);
+    bench_parse<http::vector_body<char>>(prefix + "/vector_body", *text);
+    if (std::string(label) == "get") {
+      bench_parse<http::empty_body>(prefix + "/empty_body", *text);
+    }
+    bench_parse<http::dynamic_body, pool_allocator<char>>(
+        prefix + "/dynamic_body+pool_fields", *text, pooled);
+    bench_parse<http::string_body, pool_allocator<char>>(
+        prefix + "/string_body+pool_fields", *text, pooled);
+  }
+}
+
+bool parse_arguments(int argc, char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    std::string name = arg.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+    if (name == "--filter") {
+      options.filter = value;
+    } else if (arg == "--json") {
+      options.json = true;
+    } else if (name == "--min-time" && !value.empty()) {
+      options.min_time = std::stod(value);
+    } else {
+      std::cerr << "Unknown option: " << arg << "\n"
+                << "Usage: " << argv[0]
+                << " [--filter=SUBSTRING] [--json] [--min-time=SECONDS]\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (!parse_arguments(argc, argv)) {
+    return EXIT_FAILURE;
+  }
+
+  // The logger writes to fd 1. Point that at /dev/null so its cost is
+  // measured without a terminal in the way, and report on a copy of the
+  // original stdout.
+  int saved = ::dup(STDOUT_FILENO);
+  int null_fd = ::open("/dev/null", O_WRONLY);
+  if (saved < 0 || null_fd < 0 || ::dup2(null_fd, STDOUT_FILENO) < 0) {
+    std::perror("redirecting stdout");
+    return EXIT_FAILURE;
+  }
+  ::close(null_fd);
+  report_out = ::fdopen(saved, "w");
+
+  bench_router();
+  bench_logger();
+  bench_queue();
+  bench_content_type();
+  bench_metrics();
+  bench_rate_limiter();
+  bench_parsing();
+  return EXIT_SUCCESS;
+}
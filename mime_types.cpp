@@ -0,0 +1,29 @@
+#include "mime_types.hpp"
+
+#include <unordered_map>
+
+namespace {
+
+const std::unordered_map<std::string, std::string> extension_to_mime = {
+    {".html", "text/html"},
+    {".css", "text/css"},
+    {".js", "text/javascript"},
+    {".json", "application/json"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".gif", "image/gif"},
+    {".svg", "image/svg+xml"},
+    {".ico", "image/x-icon"}
+};
+
+}  // namespace
+
+std::string determine_content_type(const std::string& extension) {
+  auto it = extension_to_mime.find(extension);
+  if (it != extension_to_mime.end()) {
+    return it->second;
+  }
+
+  return "UNSUPPORTED";
+}
@@ -0,0 +1,11 @@
+// mime_types.hpp
+#ifndef MIME_TYPES_HPP
+#define MIME_TYPES_HPP
+
+#include <string>
+
+// Content type served for a file extension (".html" -> "text/html"), or
+// "UNSUPPORTED" for files the server should not expose
+std::string determine_content_type(const std::string& extension);
+
+#endif  // MIME_TYPES_HPP
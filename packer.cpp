@@ -0,0 +1,211 @@
+// packer: packs a directory of static files into a bundle for
+// webserver --bundle (see asset_bundle.hpp).
+//
+// Files are chosen and indexed exactly as the server does at startup:
+// dotfiles at the top level and unsupported types are skipped, and each
+// file gets its ETag, Last-Modified, precompressed siblings and in-memory
+// compressed variants. All of that, and the serialized response headers,
+// are fixed at pack time, so the server does none of it.
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "asset_bundle.hpp"
+#include "asset_cache.hpp"
+#include "mime_types.hpp"
+#include "static_asset.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct options {
+  std::string root = ".";
+  std::string output;
+};
+
+void print_usage(const char* program) {
+  std::cerr << "Usage: " << program << " --output=FILE [--root=DIR]\n"
+            << "  --root=DIR     directory to pack (default: the current one)\n"
+            << "  --output=FILE  bundle to write\n";
+}
+
+bool parse_arguments(int argc, char* argv[], options& opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    std::string name = arg.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+    if (name == "--root" && !value.empty()) {
+      opts.root = value;
+    } else if (name == "--output" && !value.empty()) {
+      opts.output = value;
+    } else {
+      std::cerr << "Unknown option: " << arg << "\n";
+      return false;
+    }
+  }
+  return !opts.output.empty();
+}
+
+struct packed_file {
+  std::string route;
+  std::shared_ptr<const StaticAsset> asset;
+};
+
+// Appends blobs after the tables, remembering where each one went
+class blob_writer {
+ public:
+  blob_writer(std::ofstream& out, std::uint64_t offset) : out_(out), offset_(offset) {}
+
+  BundleSpan write(std::string_view bytes) {
+    BundleSpan span{offset_, bytes.size()};
+    out_.write(bytes.data(), bytes.size());
+    offset_ += bytes.size();
+    return span;
+  }
+
+  std::uint64_t offset() const { return offset_; }
+
+ private:
+  std::ofstream& out_;
+  std::uint64_t offset_;
+};
+
+bool read_file(const std::string& file_path, std::string& out) {
+  std::ifstream file(file_path, std::ios::binary);
+  if (!file.is_open()) {
+    return false;
+  }
+  out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return true;
+}
+
+bool pack_variant(blob_writer& blobs, const AssetVariant& variant, BundleVariant& packed) {
+  // Small compressible files were compressed while indexing; everything
+  // else is read from disk now
+  std::string body;
+  std::string header;
+  if (variant.response) {
+    body = variant.response->body;
+    header = variant.response->header;
+  } else {
+    if (!read_file(variant.file_path, body)) {
+      std::cerr << "Cannot read " << variant.file_path << "\n";
+      return false;
+    }
+    header = make_asset_header(variant.headers, body.size());
+  }
+
+  packed.encoding = blobs.write(variant.headers.content_encoding);
+  packed.etag = blobs.write(variant.headers.etag);
+  packed.last_modified = blobs.write(variant.headers.last_modified);
+  packed.content_type = blobs.write(variant.headers.content_type);
+  packed.header = blobs.write(header);
+  packed.body = blobs.write(body);
+  packed.not_modified = blobs.write(variant.not_modified ? variant.not_modified->header : "");
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  options opts;
+  if (!parse_arguments(argc, argv, opts)) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Index first: the table sizes have to be known before any blob is written
+  std::vector<packed_file> files;
+  std::error_code ec;
+  for (fs::recursive_directory_iterator it(opts.root, ec), end; !ec && it != end; it.increment(ec)) {
+    if (!it->is_regular_file()) {
+      continue;
+    }
+    std::string relative = fs::relative(it->path(), opts.root).generic_string();
+    if (relative.empty() || relative[0] == '.') {
+      continue;
+    }
+    std::string content_type = determine_content_type(it->path().extension().string());
+    if (content_type == "UNSUPPORTED") {
+      continue;
+    }
+    files.push_back({"/" + relative, index_static_asset(it->path().string(), content_type)});
+  }
+  if (ec) {
+    std::cerr << "Cannot walk " << opts.root << ": " << ec.message() << "\n";
+    return EXIT_FAILURE;
+  }
+  std::sort(files.begin(), files.end(),
+            [](const packed_file& a, const packed_file& b) { return a.route < b.route; });
+
+  std::vector<BundleEntry> entries(files.size());
+  std::size_t variant_count = 0;
+  for (const auto& file : files) {
+    variant_count += 1 + file.asset->variants.size();
+  }
+  std::vector<BundleVariant> variants(variant_count);
+
+  BundleHeader header;
+  std::memcpy(header.magic, kBundleMagic, sizeof(kBundleMagic));
+  header.entry_count = static_cast<std::uint32_t>(entries.size());
+  header.variant_count = static_cast<std::uint32_t>(variants.size());
+  header.entries_offset = sizeof(BundleHeader);
+  header.variants_offset = header.entries_offset + entries.size() * sizeof(BundleEntry);
+
+  std::string temporary = opts.output + ".tmp";
+  std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    std::cerr << "Cannot write " << temporary << "\n";
+    return EXIT_FAILURE;
+  }
+
+  // Tables go in last; leave room for them
+  out.seekp(header.variants_offset + variants.size() * sizeof(BundleVariant));
+  blob_writer blobs(out, header.variants_offset + variants.size() * sizeof(BundleVariant));
+  std::size_t next_variant = 0;
+  for (std::size_t i = 0; i < files.size(); ++i) {
+    const StaticAsset& asset = *files[i].asset;
+    BundleEntry& entry = entries[i];
+    entry.path = blobs.write(files[i].route);
+    entry.first_variant = static_cast<std::uint32_t>(next_variant);
+    entry.variant_count = static_cast<std::uint32_t>(1 + asset.variants.size());
+    entry.last_modified = asset.last_modified;
+
+    bool packed = pack_variant(blobs, asset.identity, variants[next_variant++]);
+    for (const auto& variant : asset.variants) {
+      packed = packed && pack_variant(blobs, variant, variants[next_variant++]);
+    }
+    if (!packed) {
+      std::remove(temporary.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
+  header.size = blobs.offset();
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(BundleEntry));
+  out.write(reinterpret_cast<const char*>(variants.data()), variants.size() * sizeof(BundleVariant));
+  out.close();
+
+  // A running server may have the old bundle mapped; replacing the file
+  // rather than rewriting it leaves that mapping intact
+  if (!out || std::rename(temporary.c_str(), opts.output.c_str()) != 0) {
+    std::cerr << "Cannot write " << opts.output << "\n";
+    std::remove(temporary.c_str());
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "Packed " << files.size() << " files (" << variants.size() << " representations, "
+            << header.size << " bytes) into " << opts.output << "\n";
+  return EXIT_SUCCESS;
+}
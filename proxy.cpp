@@ -0,0 +1,204 @@
+#include "proxy.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+#include <sys/socket.h>
+
+#include "globals.hpp"
+
+Upstream::Upstream(std::string name, const std::vector<std::string>& addresses,
+                   ProxyOptions options)
+    : name_(std::move(name)), options_(options) {
+    if (addresses.empty()) {
+        throw std::runtime_error("Upstream " + name_ + " has no backends");
+    }
+
+    boost::asio::io_context ioc;
+    boost::asio::ip::tcp::resolver resolver(ioc);
+    for (const std::string& address : addresses) {
+        auto colon = address.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+            throw std::runtime_error("Backend must be host:port: " + address);
+        }
+        boost::system::error_code ec;
+        auto results = resolver.resolve(address.substr(0, colon), address.substr(colon + 1), ec);
+        if (ec || results.empty()) {
+            throw std::runtime_error("Cannot resolve backend " + address + ": " + ec.message());
+        }
+        Backend& backend = backends_.emplace_back();
+        backend.address = address;
+        backend.endpoint = results.begin()->endpoint();
+    }
+}
+
+bool Upstream::available(Backend& backend, std::uint64_t now) const {
+    if (!options_.max_fails || backend.fails.load(std::memory_order_relaxed) < options_.max_fails) {
+        return true;
+    }
+    // Out of rotation. Once its time is up one request claims the trial by
+    // pushing the deadline on; the rest wait to see how that goes.
+    std::uint64_t until = backend.down_until.load(std::memory_order_relaxed);
+    return now >= until &&
+           backend.down_until.compare_exchange_strong(until, now + options_.fail_timeout,
+                                                      std::memory_order_relaxed);
+}
+
+Upstream::Backend* Upstream::pick(std::uint64_t now) {
+    std::size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+    Backend* chosen = nullptr;
+    if (options_.balance == balance_policy::round_robin) {
+        for (std::size_t i = 0; i < backends_.size() && !chosen; ++i) {
+            Backend& backend = backends_[(start + i) % backends_.size()];
+            if (available(backend, now)) {
+                chosen = &backend;
+            }
+        }
+    } else {
+        // Scanned from a moving start so ties are spread out. Healthy
+        // backends are compared first; one due a trial is only taken if
+        // none is healthy.
+        std::uint32_t fewest = 0;
+        for (std::size_t i = 0; i < backends_.size(); ++i) {
+            Backend& backend = backends_[(start + i) % backends_.size()];
+            bool healthy = !options_.max_fails ||
+                           backend.fails.load(std::memory_order_relaxed) < options_.max_fails;
+            std::uint32_t outstanding = backend.outstanding.load(std::memory_order_relaxed);
+            if (healthy && (!chosen || outstanding < fewest)) {
+                chosen = &backend;
+                fewest = outstanding;
+            }
+        }
+        for (std::size_t i = 0; i < backends_.size() && !chosen; ++i) {
+            Backend& backend = backends_[(start + i) % backends_.size()];
+            if (available(backend, now)) {
+                chosen = &backend;
+            }
+        }
+    }
+
+    if (chosen) {
+        chosen->outstanding.fetch_add(1, std::memory_order_relaxed);
+        chosen->requests.fetch_add(1, std::memory_order_relaxed);
+    }
+    return chosen;
+}
+
+void Upstream::finished(Backend& backend) {
+    backend.outstanding.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Upstream::succeeded(Backend& backend) {
+    if (backend.fails.exchange(0, std::memory_order_relaxed) >= options_.max_fails &&
+        options_.max_fails) {
+        getGlobalLogger().log("Backend " + backend.address + " of " + name_ + " is back");
+    }
+}
+
+void Upstream::failed(Backend& backend, std::uint64_t now) {
+    backend.failures.fetch_add(1, std::memory_order_relaxed);
+    std::uint32_t fails = backend.fails.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (options_.max_fails && fails >= options_.max_fails) {
+        backend.down_until.store(now + options_.fail_timeout, std::memory_order_relaxed);
+        if (fails == options_.max_fails) {
+            getGlobalLogger().log("Backend " + backend.address + " of " + name_ +
+                                  " failed " + std::to_string(fails) +
+                                  " times, leaving it out");
+        }
+    }
+}
+
+void Upstream::collectMetrics(const std::vector<std::shared_ptr<Upstream>>& upstreams,
+                              std::string& out) {
+    std::uint64_t now = coarse_now();
+    auto each = [&](const char* metric, auto value) {
+        for (const auto& upstream : upstreams) {
+            for (Backend& backend : upstream->backends_) {
+                out += std::string(metric) + "{upstream=\"" + upstream->name_ +
+                       "\",backend=\"" + backend.address + "\"} " +
+                       std::to_string(value(*upstream, backend)) + "\n";
+            }
+        }
+    };
+    out += "# HELP webserver_upstream_requests_total Requests sent to each backend.\n"
+           "# TYPE webserver_upstream_requests_total counter\n";
+    each("webserver_upstream_requests_total", [](const Upstream&, Backend& backend) {
+        return backend.requests.load(std::memory_order_relaxed);
+    });
+    out += "# HELP webserver_upstream_failures_total Requests that failed at a backend.\n"
+           "# TYPE webserver_upstream_failures_total counter\n";
+    each("webserver_upstream_failures_total", [](const Upstream&, Backend& backend) {
+        return backend.failures.load(std::memory_order_relaxed);
+    });
+    out += "# HELP webserver_upstream_outstanding Requests in flight at each backend.\n"
+           "# TYPE webserver_upstream_outstanding gauge\n";
+    each("webserver_upstream_outstanding", [](const Upstream&, Backend& backend) {
+        return backend.outstanding.load(std::memory_order_relaxed);
+    });
+    out += "# HELP webserver_upstream_up 0 while a backend is left out after failures.\n"
+           "# TYPE webserver_upstream_up gauge\n";
+    each("webserver_upstream_up", [now](const Upstream& upstream, Backend& backend) {
+        bool down = upstream.options_.max_fails &&
+                    backend.fails.load(std::memory_order_relaxed) >= upstream.options_.max_fails &&
+                    now < backend.down_until.load(std::memory_order_relaxed);
+        return down ? 0 : 1;
+    });
+}
+
+upstream_connection::upstream_connection(boost::asio::io_context& ioc,
+                                         std::shared_ptr<Upstream> upstream,
+                                         Upstream::Backend& backend)
+    : upstream(std::move(upstream)), backend(&backend), socket(ioc) {}
+
+upstream_pool::upstream_pool(boost::asio::io_context& ioc) : ioc_(ioc) {}
+
+upstream_pool::idle_list& upstream_pool::list_for(const Upstream::Backend& backend) {
+    for (auto& entry : idle_) {
+        if (entry.first == &backend) {
+            return entry.second;
+        }
+    }
+    idle_.emplace_back(&backend, idle_list());
+    return idle_.back().second;
+}
+
+std::unique_ptr<upstream_connection> upstream_pool::acquire(
+    const std::shared_ptr<Upstream>& upstream, Upstream::Backend& backend) {
+    idle_list& idle = list_for(backend);
+    while (!idle.empty()) {
+        auto connection = std::move(idle.back());
+        idle.pop_back();
+        // A backend that closed the connection while it sat here has left
+        // an EOF to read; anything but "nothing yet" means it is unusable
+        char byte;
+        ssize_t n = ::recv(connection->socket.native_handle(), &byte, 1,
+                           MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            connection->reused = true;
+            return connection;
+        }
+    }
+    return std::make_unique<upstream_connection>(ioc_, upstream, backend);
+}
+
+void upstream_pool::release(std::unique_ptr<upstream_connection> connection) {
+    const ProxyOptions& options = connection->upstream->options();
+    idle_list& idle = list_for(*connection->backend);
+    if (idle.size() >= options.max_idle || !options.idle_timeout) {
+        return;
+    }
+    connection->idle_deadline = coarse_now() + options.idle_timeout;
+    idle.push_back(std::move(connection));
+}
+
+void upstream_pool::reap(std::uint64_t now) {
+    // Oldest first, so the expired ones are a prefix
+    for (auto& entry : idle_) {
+        idle_list& idle = entry.second;
+        auto live = std::find_if(idle.begin(), idle.end(), [now](const auto& connection) {
+            return connection->idle_deadline > now;
+        });
+        idle.erase(idle.begin(), live);
+    }
+}
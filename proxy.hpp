@@ -0,0 +1,130 @@
+// proxy.hpp
+#ifndef PROXY_HPP
+#define PROXY_HPP
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// How an Upstream picks the backend for a request
+enum class balance_policy {
+    round_robin,
+    least_outstanding,  // fewest requests in flight, counted over every io_context
+};
+
+struct ProxyOptions {
+    balance_policy balance = balance_policy::round_robin;
+    // Passive health checks: a backend that fails this many requests in a
+    // row (connect or I/O errors, timeouts) is left out for fail_timeout,
+    // then tried with one request. 0 never leaves one out.
+    std::uint32_t max_fails = 3;
+    std::uint32_t fail_timeout = 10000;      // ms
+    std::uint32_t connect_timeout = 5000;    // ms
+    std::uint32_t response_timeout = 60000;  // ms for each read from or write to a backend
+    std::uint32_t idle_timeout = 30000;      // ms a pooled connection is kept unused
+    std::size_t max_idle = 32;               // pooled connections per backend and io_context
+};
+
+// A set of interchangeable backends a proxy route forwards to. Shared by
+// every io_context; all it keeps per backend is atomic counters, so picking
+// one never takes a lock. The connections themselves are in each
+// io_context's upstream_pool.
+class Upstream {
+public:
+    struct Backend {
+        std::string address;  // "host:port" as configured
+        boost::asio::ip::tcp::endpoint endpoint;
+        std::atomic<std::uint32_t> outstanding{0};  // requests in flight
+        std::atomic<std::uint32_t> fails{0};        // consecutive failures
+        std::atomic<std::uint64_t> down_until{0};   // ms; left out until then
+        std::atomic<std::uint64_t> requests{0};
+        std::atomic<std::uint64_t> failures{0};
+    };
+
+    // Resolves every "host:port" now, so a bad address stops startup;
+    // throws std::runtime_error
+    Upstream(std::string name, const std::vector<std::string>& addresses,
+             ProxyOptions options = {});
+    Upstream(const Upstream&) = delete;
+    Upstream& operator=(const Upstream&) = delete;
+
+    const std::string& name() const { return name_; }
+    const ProxyOptions& options() const { return options_; }
+    std::size_t size() const { return backends_.size(); }
+
+    // The backend for the next request, counted as in flight until
+    // finished() is called; nullptr if every backend is left out
+    Backend* pick(std::uint64_t now);
+    void finished(Backend& backend);
+
+    // Passive health check results
+    void succeeded(Backend& backend);
+    void failed(Backend& backend, std::uint64_t now);
+
+    // Per-backend counters of every upstream in Prometheus text format
+    static void collectMetrics(const std::vector<std::shared_ptr<Upstream>>& upstreams,
+                               std::string& out);
+
+private:
+    std::string name_;
+    ProxyOptions options_;
+    std::deque<Backend> backends_;  // atomics pin them in place
+    std::atomic<std::size_t> next_{0};
+
+    bool available(Backend& backend, std::uint64_t now) const;
+};
+
+// A connection to one backend, kept open between requests
+struct upstream_connection {
+    upstream_connection(boost::asio::io_context& ioc, std::shared_ptr<Upstream> upstream,
+                        Upstream::Backend& backend);
+
+    std::shared_ptr<Upstream> upstream;  // kept alive while the connection is pooled
+    Upstream::Backend* backend;
+    boost::asio::ip::tcp::socket socket;
+    boost::beast::flat_buffer buffer;  // response bytes read past the last response
+    bool connected = false;
+    bool reused = false;             // has carried a request before this one
+    std::uint64_t idle_deadline = 0;  // coarse_now() ms, while pooled
+};
+
+// Keeps the idle backend connections of one io_context, so a connection
+// is only ever used by the thread that opened it and a request on this
+// io_context never waits on another one.
+//
+// Not thread-safe: acquire(), release() and reap() run on the io_context's
+// single thread, as session_pool's do.
+class upstream_pool {
+public:
+    explicit upstream_pool(boost::asio::io_context& ioc);
+    upstream_pool(const upstream_pool&) = delete;
+    upstream_pool& operator=(const upstream_pool&) = delete;
+
+    // An idle connection to backend that still looks open, or a new one
+    // that has yet to connect
+    std::unique_ptr<upstream_connection> acquire(const std::shared_ptr<Upstream>& upstream,
+                                                 Upstream::Backend& backend);
+    // Keeps a connection whose last response was read to its end, if the
+    // backend has room; otherwise it is closed
+    void release(std::unique_ptr<upstream_connection> connection);
+    // Closes connections idle past their deadline
+    void reap(std::uint64_t now);
+
+private:
+    using idle_list = std::vector<std::unique_ptr<upstream_connection>>;
+
+    boost::asio::io_context& ioc_;
+    std::vector<std::pair<const Upstream::Backend*, idle_list>> idle_;  // most recent last
+
+    idle_list& list_for(const Upstream::Backend& backend);
+};
+
+#endif  // PROXY_HPP
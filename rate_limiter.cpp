@@ -0,0 +1,202 @@
+#include "rate_limiter.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+
+#include "globals.hpp"
+
+RateLimiter& RateLimiter::getInstance() {
+    static RateLimiter instance;
+    return instance;
+}
+
+RateLimiter::ClientKey RateLimiter::keyFor(const boost::asio::ip::address& address) {
+    if (address.is_v4()) {
+        return boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4())
+            .to_bytes();
+    }
+    return address.to_v6().to_bytes();
+}
+
+std::size_t RateLimiter::KeyHash::operator()(const Key& key) const {
+    std::uint64_t high, low;
+    std::memcpy(&high, key.client.data(), 8);
+    std::memcpy(&low, key.client.data() + 8, 8);
+    std::uint64_t h = (high * 0x9e3779b97f4a7c15ULL) ^ low ^ (std::uint64_t{key.route} << 32);
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return static_cast<std::size_t>(h ^ (h >> 32));
+}
+
+void RateLimiter::setCapacity(std::size_t clients, std::uint64_t expiry_ms) {
+    shard_capacity_ = clients / kShards + 1;
+    expiry_ms_ = expiry_ms;
+    for (Shard& shard : shards_) {
+        shard.index.reserve(shard_capacity_);
+    }
+}
+
+void RateLimiter::setConnectionLimit(std::uint32_t per_client) {
+    connection_limit_ = per_client;
+}
+
+void RateLimiter::setRequestRate(Rate rate) {
+    request_rate_ = rate;
+}
+
+void RateLimiter::setRouteRate(std::uint32_t route_id, Rate rate) {
+    if (route_id == 0 || route_id >= kMaxRoutes) {
+        return;
+    }
+    route_limits_ += (rate.per_second > 0) - (route_rates_[route_id].per_second > 0);
+    route_rates_[route_id] = rate;
+}
+
+RateLimiter::Shard& RateLimiter::shardFor(const Key& key) {
+    // The low bits pick the bucket inside the shard's map, so the shard
+    // comes from the high ones
+    return shards_[(KeyHash{}(key) >> 48) % kShards];
+}
+
+RateLimiter::Entry& RateLimiter::touch(Shard& shard, const Key& key, std::uint64_t now) {
+    // Expire from the cold end; the oldest entry is checked on every use,
+    // so stale ones go at the rate new ones come
+    if (!shard.lru.empty()) {
+        Entry& oldest = shard.lru.back();
+        // last_used may be a tick ahead of now, read by a thread that took
+        // the lock first
+        if (oldest.connections == 0 && now > oldest.last_used &&
+            now - oldest.last_used > expiry_ms_ &&
+            !(oldest.key == key)) {
+            shard.index.erase(oldest.key);
+            shard.lru.pop_back();
+            shard.evictions.store(shard.evictions.load(std::memory_order_relaxed) + 1,
+                                  std::memory_order_relaxed);
+        }
+    }
+
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        it->second->last_used = now;
+        return *it->second;
+    }
+
+    if (shard.lru.size() >= shard_capacity_) {
+        // Full: forget the least recently used client that has no
+        // connections open. Forgetting one that has would reset its count
+        // and let it past the connection limit, so those go back to the
+        // warm end; if every client is connected, the shard grows, by at
+        // most the number of open connections.
+        for (std::size_t i = shard.lru.size(); i > 0 && shard.lru.back().connections > 0; --i) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, std::prev(shard.lru.end()));
+        }
+        if (shard.lru.back().connections == 0) {
+            shard.index.erase(shard.lru.back().key);
+            shard.lru.pop_back();
+            shard.evictions.store(shard.evictions.load(std::memory_order_relaxed) + 1,
+                                  std::memory_order_relaxed);
+        }
+    }
+    shard.lru.push_front(Entry{key});
+    Entry& entry = shard.lru.front();
+    entry.refilled = entry.last_used = now;
+    entry.tokens = -1;  // filled on first use
+    shard.index.emplace(key, shard.lru.begin());
+    return entry;
+}
+
+bool RateLimiter::admitConnection(const ClientKey& client) {
+    if (!connection_limit_) {
+        return true;
+    }
+    Key key{client, 0};
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    Entry& entry = touch(shard, key, coarse_now());
+    if (entry.connections >= connection_limit_) {
+        shard.limited_connections.store(
+            shard.limited_connections.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        return false;
+    }
+    ++entry.connections;
+    return true;
+}
+
+void RateLimiter::releaseConnection(const ClientKey& client) {
+    if (!connection_limit_) {
+        return;
+    }
+    Key key{client, 0};
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end() && it->second->connections > 0) {
+        --it->second->connections;
+    }
+}
+
+std::uint32_t RateLimiter::take(const Key& key, const Rate& rate) {
+    // A bucket that holds less than one token could never admit anything
+    double burst = std::max(1.0, rate.burst > 0 ? rate.burst : rate.per_second);
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // Read under the lock, so the entry's times only move forward
+    std::uint64_t at = coarse_now();
+    Entry& entry = touch(shard, key, at);
+    if (entry.tokens < 0) {
+        entry.tokens = burst;
+    } else {
+        std::uint64_t elapsed = at > entry.refilled ? at - entry.refilled : 0;
+        entry.tokens = std::min(burst, entry.tokens + elapsed * rate.per_second / 1000);
+    }
+    entry.refilled = std::max(entry.refilled, at);
+
+    if (entry.tokens >= 1) {
+        entry.tokens -= 1;
+        return 0;
+    }
+    shard.limited_requests.store(shard.limited_requests.load(std::memory_order_relaxed) + 1,
+                                 std::memory_order_relaxed);
+    return static_cast<std::uint32_t>(std::ceil((1 - entry.tokens) / rate.per_second));
+}
+
+std::uint32_t RateLimiter::admitRequest(const ClientKey& client) {
+    if (request_rate_.per_second <= 0) {
+        return 0;
+    }
+    return take(Key{client, 0}, request_rate_);
+}
+
+std::uint32_t RateLimiter::admitRoute(const ClientKey& client, std::uint32_t route_id) {
+    if (route_id == 0 || route_id >= kMaxRoutes || route_rates_[route_id].per_second <= 0) {
+        return 0;
+    }
+    return take(Key{client, route_id}, route_rates_[route_id]);
+}
+
+void RateLimiter::collectMetrics(std::string& out) const {
+    std::uint64_t limited_requests = 0, limited_connections = 0, evictions = 0, entries = 0;
+    for (const Shard& shard : shards_) {
+        limited_requests += shard.limited_requests.load(std::memory_order_relaxed);
+        limited_connections += shard.limited_connections.load(std::memory_order_relaxed);
+        evictions += shard.evictions.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        entries += shard.lru.size();
+    }
+    out += "# HELP webserver_rate_limited_requests_total Requests answered 429.\n"
+           "# TYPE webserver_rate_limited_requests_total counter\n"
+           "webserver_rate_limited_requests_total " + std::to_string(limited_requests) + "\n";
+    out += "# HELP webserver_rate_limited_connections_total Connections refused at accept for a client's connection limit.\n"
+           "# TYPE webserver_rate_limited_connections_total counter\n"
+           "webserver_rate_limited_connections_total " + std::to_string(limited_connections) + "\n";
+    out += "# HELP webserver_rate_limiter_entries Clients and client-route pairs tracked.\n"
+           "# TYPE webserver_rate_limiter_entries gauge\n"
+           "webserver_rate_limiter_entries " + std::to_string(entries) + "\n";
+    out += "# HELP webserver_rate_limiter_evictions_total Entries dropped as stale or to make room.\n"
+           "# TYPE webserver_rate_limiter_evictions_total counter\n"
+           "webserver_rate_limiter_evictions_total " + std::to_string(evictions) + "\n";
+}
@@ -0,0 +1,117 @@
+// rate_limiter.hpp
+#ifndef RATE_LIMITER_HPP
+#define RATE_LIMITER_HPP
+
+#include <boost/asio/ip/address.hpp>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Per-client limits: open connections, checked at accept, and token-bucket
+// request rates, checked as each request is read, per client and optionally
+// per route. Clients are keyed by address.
+//
+// State lives in a table split into kShards cache-line-aligned shards, each
+// with its own lock, so io_contexts only meet on the rare shard they share
+// a client in. Each shard keeps its entries in LRU order: an entry idle for
+// the expiry time is dropped as the shard is next used, and a full shard
+// drops its least recently used entry. A check is a hash, an uncontended
+// lock, a lookup and a little arithmetic.
+//
+// Limits are set before the server starts; a zero rate or count turns a
+// limit off, and with every limit off nothing is looked up at all.
+class RateLimiter {
+public:
+    static constexpr std::size_t kShards = 64;
+    static constexpr std::size_t kMaxRoutes = 256;  // as Metrics route ids
+
+    // An IPv6 address, or an IPv4 one mapped into IPv6
+    using ClientKey = std::array<unsigned char, 16>;
+
+    struct Rate {
+        double per_second = 0;  // 0: no limit
+        double burst = 0;       // bucket size; per_second if 0, and at least 1
+    };
+
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    static RateLimiter& getInstance();
+    static ClientKey keyFor(const boost::asio::ip::address& address);
+
+    void setCapacity(std::size_t clients, std::uint64_t expiry_ms);
+    void setConnectionLimit(std::uint32_t per_client);
+    void setRequestRate(Rate rate);
+    // The route is a Metrics route id; see Metrics::registerRoute
+    void setRouteRate(std::uint32_t route_id, Rate rate);
+
+    bool enabled() const { return connection_limit_ || request_rate_.per_second || route_limits_; }
+
+    // Counts a new connection against the client's limit; false if it is
+    // over it. Every admitted connection must be released.
+    bool admitConnection(const ClientKey& client);
+    void releaseConnection(const ClientKey& client);
+
+    // 0 if the request may go ahead, otherwise the whole seconds until the
+    // client's bucket has a token again, for Retry-After
+    std::uint32_t admitRequest(const ClientKey& client);
+    std::uint32_t admitRoute(const ClientKey& client, std::uint32_t route_id);
+
+    // Counters and table size in Prometheus text format
+    void collectMetrics(std::string& out) const;
+
+private:
+    struct Key {
+        ClientKey client;
+        std::uint32_t route;  // 0 for the client's own entry
+
+        bool operator==(const Key& other) const {
+            return route == other.route && client == other.client;
+        }
+    };
+
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const;
+    };
+
+    struct Entry {
+        Key key;
+        double tokens = 0;
+        std::uint64_t refilled = 0;   // ms, when tokens was last topped up
+        std::uint64_t last_used = 0;  // ms
+        std::uint32_t connections = 0;
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        std::list<Entry> lru;  // most recently used first
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+        // Written under mutex, read by scrapes
+        std::atomic<std::uint64_t> limited_requests{0};
+        std::atomic<std::uint64_t> limited_connections{0};
+        std::atomic<std::uint64_t> evictions{0};
+    };
+
+    std::array<Shard, kShards> shards_;
+    std::size_t shard_capacity_ = 1024;
+    std::uint64_t expiry_ms_ = 60000;
+    std::uint32_t connection_limit_ = 0;
+    Rate request_rate_;
+    std::array<Rate, kMaxRoutes> route_rates_{};
+    std::size_t route_limits_ = 0;
+
+    RateLimiter() = default;
+
+    Shard& shardFor(const Key& key);
+    // The entry for key, made most recently used; created if missing.
+    // Called with the shard locked.
+    Entry& touch(Shard& shard, const Key& key, std::uint64_t now);
+    std::uint32_t take(const Key& key, const Rate& rate);
+};
+
+#endif  // RATE_LIMITER_HPP
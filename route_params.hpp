@@ -0,0 +1,63 @@
+#ifndef ROUTE_PARAMS_HPP
+#define ROUTE_PARAMS_HPP
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Path parameters captured by the router, e.g. id for "/users/:id". Names
+// point into the route table and values into the request target, so both
+// are only valid while the handler runs; parameters kept past that need
+// copy_names(), since a replaced route table is freed. Fixed capacity keeps
+// lookups free of heap allocation.
+class RouteParams {
+public:
+    static constexpr std::size_t kMaxParams = 8;
+
+    std::string_view get(std::string_view name) const {
+        for (std::size_t i = 0; i < size_; ++i) {
+            if (params_[i].first == name) {
+                return params_[i].second;
+            }
+        }
+        return {};
+    }
+
+    bool push(std::string_view name, std::string_view value) {
+        if (size_ == kMaxParams) {
+            return false;
+        }
+        params_[size_++] = {name, value};
+        return true;
+    }
+
+    // Re-points the names into storage, which must outlive the parameters.
+    // storage keeps its capacity, so a reused one stops allocating.
+    void copy_names(std::string& storage) {
+        storage.clear();
+        for (std::size_t i = 0; i < size_; ++i) {
+            storage += params_[i].first;
+        }
+        std::size_t offset = 0;
+        for (std::size_t i = 0; i < size_; ++i) {
+            std::size_t length = params_[i].first.size();
+            params_[i].first = std::string_view(storage.data() + offset, length);
+            offset += length;
+        }
+    }
+
+    void resize(std::size_t size) { size_ = size; }
+    void clear() { size_ = 0; }
+    std::size_t size() const { return size_; }
+    const std::pair<std::string_view, std::string_view>& operator[](std::size_t i) const {
+        return params_[i];
+    }
+
+private:
+    std::array<std::pair<std::string_view, std::string_view>, kMaxParams> params_;
+    std::size_t size_ = 0;
+};
+
+#endif // ROUTE_PARAMS_HPP
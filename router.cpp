@@ -1,16 +1,538 @@
 #include "router.hpp"
 
+#include <algorithm>
+#include <stdexcept>
+
+#include "globals.hpp"
+#include "metrics.hpp"
+
+struct Router::Node {
+    std::string prefix;                            // static text consumed by this edge
+    std::vector<std::unique_ptr<Node>> children;   // static edges, distinct first bytes
+    std::unique_ptr<Node> param;                   // ":name" segment
+    std::unique_ptr<Node> wildcard;                // "*name" rest of path
+    std::string name;                              // set on param and wildcard nodes
+    std::uint32_t route_id = 0;                    // metrics histogram of the route ending here
+
+    std::shared_ptr<const RequestHandler> any;
+    std::vector<std::pair<http::verb, std::shared_ptr<const RequestHandler>>> methods;
+    std::vector<std::pair<http::verb, std::shared_ptr<const BodyRoute>>> bodies;
+    std::shared_ptr<const BodyRoute> any_body;     // with any; for methods without their own
+
+    std::unique_ptr<Node> clone() const {
+        auto copy = std::make_unique<Node>();
+        copy->prefix = prefix;
+        copy->name = name;
+        copy->route_id = route_id;
+        copy->any = any;
+        copy->methods = methods;
+        copy->bodies = bodies;
+        copy->any_body = any_body;
+        copy->children.reserve(children.size());
+        for (const auto& child : children) {
+            copy->children.push_back(child->clone());
+        }
+        if (param) {
+            copy->param = param->clone();
+        }
+        if (wildcard) {
+            copy->wildcard = wildcard->clone();
+        }
+        return copy;
+    }
+
+    bool hasHandlers() const { return any || !methods.empty(); }
+
+    const std::shared_ptr<const RequestHandler>* find(http::verb method) const {
+        for (const auto& entry : methods) {
+            if (entry.first == method) {
+                return &entry.second;
+            }
+        }
+        if (method == http::verb::head) {
+            for (const auto& entry : methods) {
+                if (entry.first == http::verb::get) {
+                    return &entry.second;
+                }
+            }
+        }
+        return any ? &any : nullptr;
+    }
+
+    std::shared_ptr<const BodyRoute> findBody(http::verb method) const {
+        for (const auto& entry : bodies) {
+            if (entry.first == method) {
+                return entry.second;
+            }
+        }
+        for (const auto& entry : methods) {
+            if (entry.first == method) {
+                return nullptr;
+            }
+        }
+        return any_body;
+    }
+};
+
+struct Router::Table {
+    std::unique_ptr<Node> root = std::make_unique<Node>();
+
+    std::unique_ptr<Table> clone() const {
+        auto copy = std::make_unique<Table>();
+        copy->root = root->clone();
+        return copy;
+    }
+};
+
+namespace {
+
+// Walks static text below node, splitting edges as needed, and returns the
+// node at which the text ends
+template <typename NodeT>
+NodeT* descend(NodeT* node, std::string_view text) {
+    while (!text.empty()) {
+        auto it = std::find_if(node->children.begin(), node->children.end(),
+                               [&](const auto& child) { return child->prefix[0] == text[0]; });
+        if (it == node->children.end()) {
+            node->children.push_back(std::make_unique<NodeT>());
+            node->children.back()->prefix = std::string(text);
+            return node->children.back().get();
+        }
+
+        auto& child = *it;
+        std::size_t common = 0;
+        while (common < child->prefix.size() && common < text.size() &&
+               child->prefix[common] == text[common]) {
+            ++common;
+        }
+
+        if (common < child->prefix.size()) {
+            auto split = std::make_unique<NodeT>();
+            split->prefix = child->prefix.substr(0, common);
+            child->prefix.erase(0, common);
+            split->children.push_back(std::move(child));
+            child = std::move(split);
+        }
+
+        node = child.get();
+        text.remove_prefix(common);
+    }
+    return node;
+}
+
+// Static edges win over parameters, which win over wildcards; on a dead
+// end, including a path that matches but lacks a handler for the method,
+// the search backtracks to the next kind of edge
+template <typename NodeT>
+const NodeT* match(const NodeT* node, std::string_view rest, http::verb method,
+                   RouteParams& params, bool& path_matched) {
+    if (rest.empty()) {
+        if (node->hasHandlers()) {
+            path_matched = true;
+            if (node->find(method)) {
+                return node;
+            }
+        }
+    } else {
+        for (const auto& child : node->children) {
+            if (child->prefix[0] != rest[0]) {
+                continue;
+            }
+            if (rest.compare(0, child->prefix.size(), child->prefix) == 0) {
+                if (auto found = match(child.get(), rest.substr(child->prefix.size()), method, params, path_matched)) {
+                    return found;
+                }
+            }
+            break;
+        }
+
+        if (node->param) {
+            std::string_view segment = rest.substr(0, rest.find('/'));
+            std::size_t mark = params.size();
+            if (!segment.empty() && params.push(node->param->name, segment)) {
+                if (auto found = match(node->param.get(), rest.substr(segment.size()), method, params, path_matched)) {
+                    return found;
+                }
+                params.resize(mark);
+            }
+        }
+    }
+
+    if (node->wildcard && node->wildcard->hasHandlers()) {
+        path_matched = true;
+        if (node->wildcard->find(method) && params.push(node->wildcard->name, rest)) {
+            return node->wildcard.get();
+        }
+    }
+    return nullptr;
+}
+
+}  // namespace
+
+// Gives a thread exclusive use of a reader slot until the thread exits
+struct Router::ReaderLease {
+    ReaderSlot* slot = nullptr;
+
+    ~ReaderLease() {
+        if (slot) {
+            slot->owned.store(false, std::memory_order_release);
+        }
+    }
+};
+
+// Marks the reader idle again when a lookup is done
+struct Router::ReadSection {
+    ReaderSlot* slot;
+
+    ~ReadSection() {
+        if (slot) {
+            slot->epoch.store(0, std::memory_order_release);
+        }
+    }
+};
+
+Router::Router() : draft_(std::make_unique<Table>()) {}
+
+Router::~Router() { delete published_.load(); }
+
 void Router::addRoute(const std::string& route, RequestHandler handler) {
-    routeHandlers[route] = std::move(handler);
+    insert(std::nullopt, route, std::move(handler));
+}
+
+void Router::addRoute(http::verb method, const std::string& route, RequestHandler handler) {
+    insert(method, route, std::move(handler));
+}
+
+void Router::addRoute(const std::string& route, std::string_view metrics_name, RequestHandler handler) {
+    insert(std::nullopt, route, std::move(handler), nullptr, metrics_name);
+}
+
+void Router::addRoute(http::verb method, const std::string& route, const BodyOptions& options,
+                      RequestHandler handler) {
+    insert(method, route, std::move(handler), std::make_shared<const BodyRoute>(BodyRoute{options, {}}));
 }
 
-bool Router::routeRequest(http_session& session, const boost::beast::http::request<boost::beast::http::dynamic_body>& req) {
-    auto it = routeHandlers.find(req.target().to_string());
-    if (it != routeHandlers.end()) {
-        it->second(session, req);
-        return true;
+void Router::addUploadRoute(http::verb method, const std::string& route, const BodyOptions& options,
+                            UploadHandler handler) {
+    auto body = std::make_shared<const BodyRoute>(BodyRoute{options, std::move(handler)});
+    // Requests with a body are streamed by the session; this runs for those
+    // without one, which have nothing to stream
+    RequestHandler empty = [body](http_session& session, const http_request& req) {
+        if (auto sink = body->upload(session, req)) {
+            sink->on_complete(session, req);
+        }
+    };
+    insert(method, route, std::move(empty), std::move(body));
+}
+
+void Router::addProxyRoute(const std::string& prefix, std::shared_ptr<Upstream> upstream,
+                           const BodyOptions& options) {
+    auto body = std::make_shared<const BodyRoute>(BodyRoute{options, {}, upstream});
+    // Requests with a body are forwarded by the session as the body is
+    // read; this forwards those without one
+    RequestHandler forward = [upstream](http_session& session, const http_request&) {
+        session.proxy_request(upstream);
+    };
+    std::string base = prefix;
+    while (base.size() > 1 && base.back() == '/') {
+        base.pop_back();
+    }
+    update([&] {
+        insert(std::nullopt, base, forward, body);
+        insert(std::nullopt, (base == "/" ? "" : base) + "/*", forward, body);
+    });
+}
+
+namespace {
+
+// Async handlers sit in the table like any other; the wrapper hands the
+// request over to a coroutine on the session
+Router::RequestHandler spawning(AsyncRequestHandler handler) {
+    auto shared = std::make_shared<const AsyncRequestHandler>(std::move(handler));
+    return [shared](http_session& session, const http_request&) {
+        session.spawn_handler(shared);
+    };
+}
+
+}  // namespace
+
+void Router::addAsyncRoute(const std::string& route, AsyncRequestHandler handler) {
+    insert(std::nullopt, route, spawning(std::move(handler)));
+}
+
+void Router::addAsyncRoute(http::verb method, const std::string& route, AsyncRequestHandler handler) {
+    insert(method, route, spawning(std::move(handler)));
+}
+
+void Router::insert(std::optional<http::verb> method, const std::string& route,
+                    RequestHandler handler, std::shared_ptr<const BodyRoute> body,
+                    std::string_view metrics_name) {
+    if (route.empty() || route[0] != '/') {
+        throw std::runtime_error("Route must start with '/': " + route);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Node* node = draft_->root.get();
+    std::string_view rest = route;
+    while (!rest.empty()) {
+        // ':' and '*' are only special at the start of a segment
+        std::size_t special = 0;
+        while ((special = rest.find_first_of(":*", special)) != std::string_view::npos &&
+               (special == 0 || rest[special - 1] != '/')) {
+            ++special;
+        }
+        if (special == std::string_view::npos) {
+            node = descend(node, rest);
+            break;
+        }
+
+        node = descend(node, rest.substr(0, special));
+        rest.remove_prefix(special);
+
+        if (rest[0] == '*') {
+            std::string name(rest.substr(1));
+            if (name.find('/') != std::string::npos) {
+                throw std::runtime_error("Wildcard must end the route: " + route);
+            }
+            if (!node->wildcard) {
+                node->wildcard = std::make_unique<Node>();
+                node->wildcard->name = name.empty() ? "*" : name;
+            }
+            node = node->wildcard.get();
+            break;
+        }
+
+        std::string_view name = rest.substr(1, rest.find('/') - 1);
+        if (name.empty()) {
+            throw std::runtime_error("Empty parameter name in route: " + route);
+        }
+        if (!node->param) {
+            node->param = std::make_unique<Node>();
+            node->param->name = std::string(name);
+        } else if (node->param->name != name) {
+            throw std::runtime_error("Conflicting parameter name in route: " + route);
+        }
+        node = node->param.get();
+        rest.remove_prefix(name.size() + 1);
+    }
+
+    node->route_id = Metrics::getInstance().registerRoute(metrics_name.empty() ? route : metrics_name);
+    auto shared = std::make_shared<const RequestHandler>(std::move(handler));
+    if (!method) {
+        node->any = std::move(shared);
+        node->any_body = std::move(body);
     } else {
-        // Route not found
+        auto it = std::find_if(node->methods.begin(), node->methods.end(),
+                               [&](const auto& entry) { return entry.first == *method; });
+        if (it != node->methods.end()) {
+            it->second = std::move(shared);
+        } else {
+            node->methods.emplace_back(*method, std::move(shared));
+        }
+
+        // Re-registering a method replaces its body handling too
+        node->bodies.erase(std::remove_if(node->bodies.begin(), node->bodies.end(),
+                                          [&](const auto& entry) { return entry.first == *method; }),
+                           node->bodies.end());
+        if (body) {
+            node->bodies.emplace_back(*method, std::move(body));
+        }
+    }
+
+    if (frozen_.load(std::memory_order_relaxed) && deferred_ == 0) {
+        publish();
+    }
+}
+
+bool Router::removeRoute(const std::string& route) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Node* node = draft_->root.get();
+    std::string_view rest = route;
+    while (!rest.empty()) {
+        auto it = std::find_if(node->children.begin(), node->children.end(), [&](const auto& child) {
+            return rest.compare(0, child->prefix.size(), child->prefix) == 0;
+        });
+        if (it == node->children.end()) {
+            return false;
+        }
+        node = it->get();
+        rest.remove_prefix(node->prefix.size());
+    }
+    if (!node->hasHandlers()) {
         return false;
     }
+
+    // The node stays as a junction; without handlers it never matches
+    node->any.reset();
+    node->methods.clear();
+    node->bodies.clear();
+    if (frozen_.load(std::memory_order_relaxed) && deferred_ == 0) {
+        publish();
+    }
+    return true;
+}
+
+void Router::update(const std::function<void()>& edits) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++deferred_;
+    }
+    auto finish = [this] {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--deferred_ == 0 && frozen_.load(std::memory_order_relaxed)) {
+            publish();
+        }
+    };
+    try {
+        edits();
+    } catch (...) {
+        finish();
+        throw;
+    }
+    finish();
+}
+
+void Router::publish() {
+    // Readers may still be walking the old table, so it is retired rather
+    // than freed. The epoch moves on after the swap: a reader that entered
+    // in the new epoch can only have loaded the new table.
+    const Table* previous = published_.exchange(draft_->clone().release());
+    if (previous) {
+        retired_.push_back({std::unique_ptr<const Table>(previous), epoch_.fetch_add(1) + 1});
+    }
+    reclaim();
+}
+
+void Router::reclaim() {
+    std::uint64_t oldest = UINT64_MAX;
+    std::size_t count = reader_count_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i) {
+        std::uint64_t epoch = readers_[i].load(std::memory_order_acquire)->epoch.load();
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    retired_.erase(std::remove_if(retired_.begin(), retired_.end(),
+                                  [oldest](const Retired& retired) { return retired.epoch <= oldest; }),
+                   retired_.end());
+}
+
+void Router::freeze() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    publish();
+    frozen_.store(true, std::memory_order_release);
+}
+
+std::size_t Router::retiredTables() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reclaim();
+    return retired_.size();
+}
+
+Router::ReaderSlot* Router::localReader() {
+    thread_local ReaderLease lease;
+    if (!lease.slot) {
+        lease.slot = acquireReader();
+    }
+    return lease.slot;
+}
+
+Router::ReaderSlot* Router::acquireReader() {
+    // Reuse the slot of a thread that has exited
+    std::size_t count = reader_count_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i) {
+        ReaderSlot* slot = readers_[i].load(std::memory_order_acquire);
+        bool expected = false;
+        if (slot->owned.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+            return slot;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    count = reader_count_.load(std::memory_order_relaxed);
+    if (count == kMaxReaders) {
+        return nullptr;
+    }
+    ReaderSlot* slot = new ReaderSlot;
+    slot->owned.store(true, std::memory_order_relaxed);
+    readers_[count].store(slot, std::memory_order_release);
+    reader_count_.store(count + 1, std::memory_order_release);
+    return slot;
+}
+
+RouteResult Router::routeRequest(http_session& session, const http_request& req) {
+    std::string_view target = to_string_view(req.target());
+    std::string_view path = target.substr(0, target.find('?'));
+    RouteParams& params = session.route_params();
+    params.clear();
+
+    const RequestHandler* handler = nullptr;
+    std::shared_ptr<const RequestHandler> draft_handler;
+    std::uint32_t route_id = 0;
+    bool path_matched = false;
+
+    // The table, and the handler called from it, stay alive until the slot
+    // is cleared. The store must be ordered before the load of published_.
+    ReaderSlot* reader = frozen_.load(std::memory_order_acquire) ? localReader() : nullptr;
+    ReadSection section{reader};
+
+    if (reader) {
+        reader->epoch.store(epoch_.load());
+        const Table* table = published_.load();
+        if (const Node* node = match(table->root.get(), path, req.method(), params, path_matched)) {
+            handler = node->find(req.method())->get();
+            route_id = node->route_id;
+        }
+    } else {
+        // Not frozen yet, or out of reader slots; copy the handler out so
+        // it may add routes itself
+        std::lock_guard<std::mutex> lock(mutex_);
+        const Node* root = draft_->root.get();
+        if (const Node* node = match(root, path, req.method(), params, path_matched)) {
+            draft_handler = *node->find(req.method());
+            handler = draft_handler.get();
+            route_id = node->route_id;
+        }
+    }
+
+    session.set_route_id(route_id);
+    if (!handler) {
+        return path_matched ? RouteResult::method_not_allowed : RouteResult::not_found;
+    }
+    if (!session.admit_route(route_id)) {
+        return RouteResult::handled;
+    }
+    (*handler)(session, req);
+    return RouteResult::handled;
+}
+
+std::shared_ptr<const BodyRoute> Router::bodyRoute(http_session& session,
+                                                           const http_request& req) {
+    std::string_view target = to_string_view(req.target());
+    std::string_view path = target.substr(0, target.find('?'));
+    RouteParams& params = session.route_params();
+    params.clear();
+    session.set_route_id(0);
+
+    ReaderSlot* reader = frozen_.load(std::memory_order_acquire) ? localReader() : nullptr;
+    ReadSection section{reader};
+    std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+    const Table* table;
+    if (reader) {
+        reader->epoch.store(epoch_.load());
+        table = published_.load();
+    } else {
+        lock.lock();
+        table = draft_.get();
+    }
+
+    bool path_matched = false;
+    const Node* node = match(table->root.get(), path, req.method(), params, path_matched);
+    if (!node) {
+        return nullptr;
+    }
+    session.set_route_id(node->route_id);
+    return node->findBody(req.method());
 }
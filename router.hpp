@@ -1,19 +1,80 @@
 #ifndef ROUTER_HPP
 #define ROUTER_HPP
 
+#include "async_handler.hpp"
 #include "http_session.hpp"
+#include "http_request.hpp"
+#include "route_params.hpp"
+#include "upload.hpp"
 #include <boost/beast/http.hpp>
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <functional>
-#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
+enum class RouteResult {
+    handled,
+    not_found,
+    method_not_allowed,
+};
+
+// Routes are kept in a compressed radix tree keyed on the request path.
+// Patterns may contain parameters ("/users/:id") and a trailing wildcard
+// ("/static/*path"). Until freeze() is called the table is edited in place
+// under a mutex; afterwards every change builds a new immutable table that
+// is published with an atomic pointer swap, so request threads never lock.
+//
+// Replaced tables are freed once no request thread can still be reading
+// them: each reader announces the epoch it entered routeRequest in, and a
+// table retired in epoch e goes once every reader is past e or idle.
 class Router {
 public:
-    using RequestHandler = std::function<void(http_session&, const boost::beast::http::request<boost::beast::http::dynamic_body>&)>;
+    using RequestHandler = std::function<void(http_session&, const http_request&)>;
+    static constexpr std::size_t kMaxReaders = 256;
 
 private:
-    std::map<std::string, RequestHandler> routeHandlers;
-    Router() {} // Private constructor
+    struct Node;
+    struct Table;
+
+    struct Retired {
+        std::unique_ptr<const Table> table;
+        std::uint64_t epoch;  // first epoch in which no reader can reach it
+    };
+
+    struct alignas(64) ReaderSlot {
+        std::atomic<std::uint64_t> epoch{0};  // 0 while outside routeRequest
+        std::atomic<bool> owned{false};
+    };
+
+    struct ReaderLease;
+    struct ReadSection;
+
+    std::unique_ptr<Table> draft_;
+    std::atomic<const Table*> published_{nullptr};
+    std::vector<Retired> retired_;  // readers may still hold these
+    std::mutex mutex_;
+    std::atomic<bool> frozen_{false};
+    std::size_t deferred_ = 0;      // update() calls in progress; publishing waits for them
+    std::array<std::atomic<ReaderSlot*>, kMaxReaders> readers_{};
+    std::atomic<std::size_t> reader_count_{0};
+    std::atomic<std::uint64_t> epoch_{1};
+
+    Router();
+    ~Router();
+
+    void insert(std::optional<boost::beast::http::verb> method, const std::string& route,
+                RequestHandler handler, std::shared_ptr<const BodyRoute> body = nullptr,
+                std::string_view metrics_name = {});
+    void publish();
+    void reclaim();
+    ReaderSlot* localReader();
+    ReaderSlot* acquireReader();
 
 public:
     Router(const Router&) = delete; // Delete copy constructor
@@ -24,8 +85,56 @@ public:
         return instance;
     }
 
+    // Registers a handler for every method
     void addRoute(const std::string& route, RequestHandler handler);
-    bool routeRequest(http_session& session, const boost::beast::http::request<boost::beast::http::dynamic_body>& req);
+    // Registers a handler for one method; HEAD falls back to GET
+    void addRoute(boost::beast::http::verb method, const std::string& route, RequestHandler handler);
+    // Registers a handler for every method whose requests are counted, and
+    // rate limited, under metrics_name rather than the route's own pattern,
+    // so a family of routes (one per static file) takes one metrics id
+    void addRoute(const std::string& route, std::string_view metrics_name, RequestHandler handler);
+
+    // Registers a handler whose request bodies are read under options
+    void addRoute(boost::beast::http::verb method, const std::string& route,
+                  const BodyOptions& options, RequestHandler handler);
+
+    // Registers a handler that takes the request body as it arrives, in
+    // constant memory; see upload.hpp
+    void addUploadRoute(boost::beast::http::verb method, const std::string& route,
+                        const BodyOptions& options, UploadHandler handler);
+
+    // Forwards every request under prefix, the prefix itself included, to
+    // upstream's backends with its original target. Request bodies are
+    // streamed to the backend under options.
+    void addProxyRoute(const std::string& prefix, std::shared_ptr<Upstream> upstream,
+                       const BodyOptions& options);
+
+    // Registers a coroutine handler; see async_handler.hpp. It runs on the
+    // connection's executor and its response keeps its place among the
+    // connection's pipelined responses.
+    void addAsyncRoute(const std::string& route, AsyncRequestHandler handler);
+    void addAsyncRoute(boost::beast::http::verb method, const std::string& route, AsyncRequestHandler handler);
+
+    // Drops every handler of a route without parameters or wildcards;
+    // returns false if it had none
+    bool removeRoute(const std::string& route);
+
+    // Runs edits (addRoute and removeRoute calls) and publishes the result
+    // as one table, rather than one per call
+    void update(const std::function<void()>& edits);
+
+    // Publishes the table built so far; later additions are swapped in atomically
+    void freeze();
+
+    // Replaced tables still waiting for their readers to move on
+    std::size_t retiredTables();
+
+    RouteResult routeRequest(http_session& session, const http_request& req);
+
+    // For a request whose header has been read: how the route it goes to
+    // takes bodies, or nullptr for the defaults. Sets the session's route
+    // parameters and metrics id as routeRequest does.
+    std::shared_ptr<const BodyRoute> bodyRoute(http_session& session, const http_request& req);
 };
 
 #endif // ROUTER_HPP
@@ -0,0 +1,330 @@
+// selfcheck: assertions over the parsers and matchers the server relies on.
+//
+// Each check prints the failing expression with its line, and any failure
+// makes the exit status nonzero, so `make check` stops on it.
+//
+// Usage: selfcheck
+#include <boost/asio/io_context.hpp>
+#include <boost/beast/http.hpp>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "async_handler.hpp"
+#include "byte_range.hpp"
+#include "hpack.hpp"
+#include "http_request.hpp"
+#include "http_session.hpp"
+#include "memory_pool.hpp"
+#include "router.hpp"
+
+namespace {
+
+namespace http = boost::beast::http;
+namespace net = boost::asio;
+
+int failures = 0;
+
+#define CHECK(expr)                                                         \
+  do {                                                                      \
+    if (!(expr)) {                                                          \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                   #expr);                                                  \
+      ++failures;                                                           \
+    }                                                                       \
+  } while (0)
+
+// ---- Router ----------------------------------------------------------------
+
+struct router_fixture {
+  net::io_context ioc;
+  std::atomic<int> load{0};
+  std::atomic<std::uint64_t> requests{0};
+  std::atomic<bool> overloaded{false};
+  upstream_pool upstreams{ioc};
+  session_options session_opts;
+  std::shared_ptr<http_session> session =
+      std::make_shared<http_session>(ioc, load, requests, overloaded, upstreams, session_opts);
+  memory_pool pool;
+
+  http_request request(http::verb method, const std::string& target) {
+    http_request req{std::piecewise_construct, std::make_tuple(),
+                     std::make_tuple(pool_allocator<char>(pool))};
+    req.method(method);
+    req.target(target);
+    return req;
+  }
+};
+
+// What the last matched handler saw. The session's parameters point into
+// the request, which route() does not keep, so they are copied here.
+std::string matched;
+std::vector<std::pair<std::string, std::string>> captured;
+
+Router::RequestHandler recording(std::string name) {
+  return [name](http_session& session, const http_request&) {
+    matched = name;
+    captured.clear();
+    const RouteParams& params = session.route_params();
+    for (std::size_t i = 0; i < params.size(); ++i) {
+      captured.emplace_back(std::string(params[i].first), std::string(params[i].second));
+    }
+  };
+}
+
+RouteResult route(router_fixture& f, http::verb method, const std::string& target) {
+  matched.clear();
+  captured.clear();
+  http_request req = f.request(method, target);
+  return Router::getInstance().routeRequest(*f.session, req);
+}
+
+void check_router(router_fixture& f) {
+  auto& router = Router::getInstance();
+  router.addRoute("/users/:id", recording("user"));
+  router.addRoute("/users/:id/posts/:post", recording("post"));
+  router.addRoute("/users/me", recording("me"));
+  router.addRoute(http::verb::get, "/static/*path", recording("static"));
+  router.addRoute(http::verb::get, "/files/*", recording("files"));
+  router.addRoute(http::verb::post, "/submit", recording("submit"));
+  router.freeze();
+
+  CHECK(route(f, http::verb::get, "/users/42") == RouteResult::handled);
+  CHECK(matched == "user");
+  CHECK(captured.size() == 1 && captured[0].first == "id" && captured[0].second == "42");
+
+  // Static segments win over parameters
+  CHECK(route(f, http::verb::get, "/users/me") == RouteResult::handled);
+  CHECK(matched == "me" && captured.empty());
+
+  // The query string is not part of the path
+  CHECK(route(f, http::verb::get, "/users/7/posts/99?full=1") == RouteResult::handled);
+  CHECK(matched == "post");
+  CHECK(captured.size() == 2 && captured[0].second == "7" && captured[1].second == "99");
+
+  CHECK(route(f, http::verb::get, "/static/css/site/main.css") == RouteResult::handled);
+  CHECK(matched == "static");
+  CHECK(captured.size() == 1 && captured[0].first == "path" &&
+        captured[0].second == "css/site/main.css");
+
+  CHECK(route(f, http::verb::get, "/files/a/b") == RouteResult::handled);
+  CHECK(matched == "files");
+
+  // HEAD falls back to GET; other methods are refused
+  CHECK(route(f, http::verb::head, "/static/app.js") == RouteResult::handled);
+  CHECK(matched == "static");
+  CHECK(route(f, http::verb::post, "/static/app.js") == RouteResult::method_not_allowed);
+  CHECK(route(f, http::verb::get, "/submit") == RouteResult::method_not_allowed);
+  CHECK(route(f, http::verb::post, "/submit") == RouteResult::handled);
+
+  CHECK(route(f, http::verb::get, "/users") == RouteResult::not_found);
+  CHECK(route(f, http::verb::get, "/users/42/comments") == RouteResult::not_found);
+  CHECK(route(f, http::verb::get, "/nothing") == RouteResult::not_found);
+
+  // Added after freeze(): published by swapping in a new table
+  router.addRoute("/late/:name", recording("late"));
+  CHECK(route(f, http::verb::get, "/late/x") == RouteResult::handled);
+  CHECK(matched == "late" && captured.size() == 1 && captured[0].second == "x");
+  CHECK(router.removeRoute("/users/me"));
+  CHECK(route(f, http::verb::get, "/users/me") == RouteResult::handled);
+  CHECK(matched == "user" && captured.size() == 1 && captured[0].second == "me");
+}
+
+// async_request copies its parameters, names included, so they outlive the
+// table they were matched in
+void check_async_params_across_swap(router_fixture& f) {
+  auto& router = Router::getInstance();
+  router.addRoute("/orders/:order/items/:item", recording("item"));
+
+  http_request req = f.request(http::verb::get, "/orders/17/items/3");
+  CHECK(router.routeRequest(*f.session, req) == RouteResult::handled);
+  const char* table_name = f.session->route_params()[0].first.data();
+  async_request request(req, f.session->route_params(), f.ioc.get_executor());
+
+  // Two swaps with no reader in between free the table matched above
+  router.addRoute("/swap/1", recording("swap"));
+  router.addRoute("/swap/2", recording("swap"));
+  CHECK(router.retiredTables() == 0);
+
+  const RouteParams& params = request.params();
+  CHECK(params.size() == 2);
+  CHECK(params[0].first.data() != table_name);
+  CHECK(params.get("order") == "17");
+  CHECK(params.get("item") == "3");
+
+  // Values point into the request's own copy of the target
+  req.target("/orders/99/items/99");
+  CHECK(params.get("order") == "17");
+}
+
+// ---- Byte ranges -------------------------------------------------------------
+
+bool one_range(std::string_view header, std::uint64_t size, std::uint64_t first,
+               std::uint64_t last) {
+  std::vector<ByteRange> ranges;
+  return parse_range(header, size, ranges) == RangeParse::satisfiable && ranges.size() == 1 &&
+         ranges[0].first == first && ranges[0].last == last;
+}
+
+RangeParse parse_only(std::string_view header, std::uint64_t size) {
+  std::vector<ByteRange> ranges;
+  return parse_range(header, size, ranges);
+}
+
+void check_byte_range() {
+  CHECK(one_range("bytes=0-499", 1000, 0, 499));
+  CHECK(one_range("bytes=500-", 1000, 500, 999));
+  CHECK(one_range("bytes=-200", 1000, 800, 999));
+  CHECK(one_range("bytes=-5000", 1000, 0, 999));
+  CHECK(one_range("bytes=900-5000", 1000, 900, 999));
+  CHECK(one_range("Bytes= 10-19 ", 1000, 10, 19));
+
+  std::vector<ByteRange> ranges;
+  CHECK(parse_range("bytes=0-0, -1", 1000, ranges) == RangeParse::satisfiable);
+  CHECK(ranges.size() == 2 && ranges[0].first == 0 && ranges[0].last == 0 &&
+        ranges[1].first == 999 && ranges[1].last == 999);
+  CHECK(ranges[0].length() == 1);
+
+  // Unsatisfiable ranges are dropped; none left is a 416
+  CHECK(one_range("bytes=2000-3000,5-9", 1000, 5, 9));
+  CHECK(parse_only("bytes=1000-", 1000) == RangeParse::unsatisfiable);
+  CHECK(parse_only("bytes=-0", 1000) == RangeParse::unsatisfiable);
+  CHECK(parse_only("bytes=0-", 0) == RangeParse::unsatisfiable);
+
+  // Anything malformed sends the whole representation
+  CHECK(parse_only("", 1000) == RangeParse::ignore);
+  CHECK(parse_only("bytes=", 1000) == RangeParse::ignore);
+  CHECK(parse_only("items=0-1", 1000) == RangeParse::ignore);
+  CHECK(parse_only("bytes=5", 1000) == RangeParse::ignore);
+  CHECK(parse_only("bytes=9-5", 1000) == RangeParse::ignore);
+  CHECK(parse_only("bytes=a-b", 1000) == RangeParse::ignore);
+  CHECK(parse_only("bytes=0-1,x", 1000) == RangeParse::ignore);
+  CHECK(parse_only("bytes=99999999999999999999-", 1000) == RangeParse::ignore);
+
+  std::string many = "bytes=0-0";
+  for (std::size_t i = 1; i <= kMaxByteRanges; ++i) {
+    many += "," + std::to_string(i) + "-" + std::to_string(i);
+  }
+  CHECK(parse_only(many, 1000) == RangeParse::ignore);
+}
+
+// ---- HPACK -------------------------------------------------------------------
+
+std::string from_hex(std::string_view hex) {
+  std::string out;
+  for (std::size_t i = 0; i + 1 < hex.size(); i += 2) {
+    out += static_cast<char>(std::stoi(std::string(hex.substr(i, 2)), nullptr, 16));
+  }
+  return out;
+}
+
+using field_list = std::vector<std::pair<std::string, std::string>>;
+
+bool decodes_to(hpack_decoder& decoder, const std::string& block, const field_list& expected) {
+  field_list fields;
+  bool ok = decoder.decode(block, [&](std::string_view name, std::string_view value) {
+    fields.emplace_back(std::string(name), std::string(value));
+  });
+  return ok && fields == expected;
+}
+
+void check_hpack() {
+  const field_list first = {{":method", "GET"},
+                            {":scheme", "http"},
+                            {":path", "/"},
+                            {":authority", "www.example.com"}};
+  field_list second = first;
+  second.emplace_back("cache-control", "no-cache");
+  const field_list third = {{":method", "GET"},
+                            {":scheme", "https"},
+                            {":path", "/index.html"},
+                            {":authority", "www.example.com"},
+                            {"custom-key", "custom-value"}};
+
+  // RFC 7541 C.3: requests without Huffman coding, on one connection
+  hpack_decoder plain;
+  CHECK(decodes_to(plain, from_hex("828684410f7777772e6578616d706c652e636f6d"), first));
+  CHECK(decodes_to(plain, from_hex("828684be58086e6f2d6361636865"), second));
+  CHECK(decodes_to(plain,
+                   from_hex("828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565"),
+                   third));
+
+  // RFC 7541 C.4: the same requests with Huffman coding
+  hpack_decoder huffman;
+  CHECK(decodes_to(huffman, from_hex("828684418cf1e3c2e5f23a6ba0ab90f4ff"), first));
+  CHECK(decodes_to(huffman, from_hex("828684be5886a8eb10649cbf"), second));
+  CHECK(decodes_to(huffman,
+                   from_hex("828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"), third));
+
+  // Indexes past the tables and truncated blocks are errors
+  hpack_decoder bad;
+  CHECK(!bad.decode(from_hex("be"), [](std::string_view, std::string_view) {}));
+  bad.reset();
+  CHECK(!bad.decode(from_hex("410f7777"), [](std::string_view, std::string_view) {}));
+
+  // Multi-byte integers decode, but zero-valued continuation bytes cannot
+  // stretch one past 32 bits
+  hpack_decoder integers;
+  CHECK(decodes_to(integers, from_hex("3fe11f"), {}));
+  bad.reset();
+  CHECK(!bad.decode(from_hex("3f" "808080808080808080808080" "00"),
+                    [](std::string_view, std::string_view) {}));
+
+  // Encoder and decoder keep their tables in step across blocks; a repeated
+  // response costs less the second time
+  hpack_encoder encoder;
+  hpack_decoder decoder;
+  const field_list response = {{":status", "200"},
+                               {"content-type", "text/html"},
+                               {"server", "my_server/1.0"},
+                               {"content-length", "1234"}};
+  std::size_t sizes[2];
+  for (std::size_t& size : sizes) {
+    std::string block;
+    encoder.begin_block(block);
+    encoder.encode_status(block, 200);
+    for (std::size_t i = 1; i < response.size(); ++i) {
+      encoder.encode(block, response[i].first, response[i].second);
+    }
+    CHECK(decodes_to(decoder, block, response));
+    size = block.size();
+  }
+  CHECK(sizes[1] < sizes[0]);
+
+  // A smaller table is announced at the start of the next block
+  encoder.set_max_size(0);
+  std::string block;
+  encoder.begin_block(block);
+  encoder.encode_status(block, 404);
+  CHECK(decodes_to(decoder, block, {{":status", "404"}}));
+
+  hpack_table table(100);
+  table.insert("a", "1");
+  table.insert("b", "2");
+  CHECK(table.count() == 2 && table.name(0) == "b" && table.value(1) == "1");
+  table.insert("c", std::string(60, 'x'));  // 32 + 61 bytes: evicts both
+  CHECK(table.count() == 1 && table.name(0) == "c");
+  table.insert("d", std::string(100, 'x'));  // larger than the table
+  CHECK(table.count() == 0);
+}
+
+}  // namespace
+
+int main() {
+  router_fixture fixture;
+  check_router(fixture);
+  check_async_params_across_swap(fixture);
+  check_byte_range();
+  check_hpack();
+
+  if (failures) {
+    std::fprintf(stderr, "%d check(s) failed\n", failures);
+  } else {
+    std::printf("All checks passed\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,76 @@
+#include "session_pool.hpp"
+
+#include "globals.hpp"
+
+session_pool::session_pool(net::io_context& ioc, std::atomic<int>& load,
+                           std::atomic<std::uint64_t>& requests,
+                           std::atomic<bool>& overloaded,
+                           const session_options& options)
+    : ioc_(ioc), load_(load), requests_(requests), overloaded_(overloaded),
+      options_(options), upstreams_(ioc), reaper_(ioc) {}
+
+std::shared_ptr<http_session> session_pool::acquire(tcp::socket socket,
+                                                    const RateLimiter::ClientKey& client,
+                                                    TlsContext* tls) {
+    http_session* session;
+    if (free_.empty()) {
+        sessions_.push_back(
+            std::make_unique<http_session>(ioc_, load_, requests_, overloaded_, upstreams_,
+                                           options_));
+        session = sessions_.back().get();
+        // Room for every session to be idle at once, so release() never
+        // allocates
+        free_.reserve(sessions_.size());
+    } else {
+        session = free_.back();
+        free_.pop_back();
+    }
+
+    session->reset(std::move(socket), client, tls);
+    return std::shared_ptr<http_session>(session, recycler{this},
+                                         pool_allocator<http_session>(control_blocks_));
+}
+
+void session_pool::release(http_session* session) {
+    session->recycle();
+    free_.push_back(session);
+}
+
+void session_pool::start_reaper(std::uint32_t overload_lag_ms) {
+    overload_lag_ms_ = overload_lag_ms;
+    schedule_reap();
+}
+
+void session_pool::schedule_reap() {
+    next_reap_ = coarse_now() + REAP_INTERVAL_MS;
+    reaper_.expires_after(std::chrono::milliseconds(REAP_INTERVAL_MS));
+    reaper_.async_wait([this](const beast::error_code& ec) {
+        if (!ec) {
+            reap();
+        }
+    });
+}
+
+void session_pool::reap() {
+    // Timers run after the handlers queued ahead of them, so the delay is
+    // a measure of the backlog
+    std::uint64_t now = coarse_now();
+    std::uint64_t lag = now > next_reap_ ? now - next_reap_ : 0;
+    bool overloaded = overload_lag_ms_ && lag > overload_lag_ms_;
+    if (overloaded != overloaded_.load(std::memory_order_relaxed)) {
+        overloaded_.store(overloaded, std::memory_order_relaxed);
+        getGlobalLogger().log(overloaded ? "io_context is " + std::to_string(lag) +
+                                               " ms behind, shedding load"
+                                         : std::string("io_context has caught up"));
+    }
+
+    // A session that closes itself here stays in use until its handlers
+    // unwind, so the walk is not disturbed
+    for (const auto& session : sessions_) {
+        if (session->active()) {
+            session->check_timeouts(now);
+        }
+    }
+    upstreams_.reap(now);
+    schedule_reap();
+}
@@ -0,0 +1,70 @@
+// session_pool.hpp
+#ifndef SESSION_POOL_HPP
+#define SESSION_POOL_HPP
+
+#include <boost/asio/steady_timer.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "http_session.hpp"
+#include "memory_pool.hpp"
+
+// Keeps finished http_sessions for reuse on one io_context. A connection
+// takes an idle session, and when the last reference to it drops the
+// session is recycled and handed to the next connection with its buffers,
+// response slots and memory pool still warm. The pool grows to the peak
+// number of concurrent connections and keeps that many sessions.
+//
+// The pool also keeps its sessions to their deadlines: a reaper timer walks
+// the sessions in use, and how late that timer fires tells whether the
+// io_context has more work queued than it can get through. It owns the
+// io_context's idle backend connections too, which the reaper expires.
+//
+// Not thread-safe: acquire(), every release and the reaper run on the
+// io_context's single thread.
+class session_pool {
+public:
+    session_pool(net::io_context& ioc, std::atomic<int>& load,
+                 std::atomic<std::uint64_t>& requests, std::atomic<bool>& overloaded,
+                 const session_options& options);
+    session_pool(const session_pool&) = delete;
+    session_pool& operator=(const session_pool&) = delete;
+
+    // Binds an idle (or new) session to the socket; tls for an HTTPS one
+    std::shared_ptr<http_session> acquire(tcp::socket socket,
+                                          const RateLimiter::ClientKey& client,
+                                          TlsContext* tls);
+
+    std::size_t size() const { return sessions_.size(); }
+
+    // Starts the reaper. The io_context counts as overloaded while the
+    // reaper runs more than overload_lag_ms late; 0 never does.
+    void start_reaper(std::uint32_t overload_lag_ms);
+
+private:
+    struct recycler {
+        session_pool* pool;
+        void operator()(http_session* session) const { pool->release(session); }
+    };
+
+    net::io_context& ioc_;
+    std::atomic<int>& load_;
+    std::atomic<std::uint64_t>& requests_;
+    std::atomic<bool>& overloaded_;
+    const session_options& options_;
+    memory_pool control_blocks_;  // shared_ptr control blocks for handed-out sessions
+    upstream_pool upstreams_;     // outlives the sessions, which hand connections back
+    std::vector<std::unique_ptr<http_session>> sessions_;
+    std::vector<http_session*> free_;
+    net::steady_timer reaper_;
+    std::uint32_t overload_lag_ms_ = 0;
+    std::uint64_t next_reap_ = 0;  // coarse_now() the reaper is due
+
+    void release(http_session* session);
+    void schedule_reap();
+    void reap();
+};
+
+#endif  // SESSION_POOL_HPP
@@ -0,0 +1,242 @@
+#include "static_asset.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <optional>
+
+#include <sys/stat.h>
+
+#include "compression.hpp"
+#include "globals.hpp"
+
+namespace {
+
+constexpr const char* kDays[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+constexpr const char* kMonths[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+// 64-bit FNV-1a, streamed over the file
+class ContentHash {
+public:
+    void update(const char* data, std::size_t size) {
+        for (std::size_t i = 0; i < size; ++i) {
+            hash_ ^= static_cast<unsigned char>(data[i]);
+            hash_ *= 0x100000001b3ULL;
+        }
+    }
+
+    std::string hex() const {
+        char out[17];
+        std::snprintf(out, sizeof(out), "%016llx", static_cast<unsigned long long>(hash_));
+        return out;
+    }
+
+private:
+    std::uint64_t hash_ = 0xcbf29ce484222325ULL;
+};
+
+bool hash_file(const std::string& file_path, ContentHash& hash) {
+    std::ifstream file(file_path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::vector<char> buffer(64 * 1024);
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+        hash.update(buffer.data(), file.gcount());
+    }
+    return true;
+}
+
+std::optional<std::string> read_file(const std::string& file_path) {
+    std::ifstream file(file_path, std::ios::binary);
+    if (!file.is_open()) {
+        return std::nullopt;
+    }
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Days since 1970-01-01 for a proleptic Gregorian date
+std::int64_t days_from_civil(std::int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const std::int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<std::int64_t>(doe) - 719468;
+}
+
+bool parse_number(std::string_view text, std::size_t pos, std::size_t len, int& out) {
+    out = 0;
+    for (std::size_t i = pos; i < pos + len; ++i) {
+        if (text[i] < '0' || text[i] > '9') {
+            return false;
+        }
+        out = out * 10 + (text[i] - '0');
+    }
+    return true;
+}
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+std::string_view strip_weak(std::string_view tag) {
+    if (tag.size() >= 2 && tag[0] == 'W' && tag[1] == '/') {
+        tag.remove_prefix(2);
+    }
+    return tag;
+}
+
+AssetVariant make_variant(std::string file_path, AssetHeaders headers) {
+    AssetVariant variant;
+    variant.file_path = std::move(file_path);
+    variant.headers = std::move(headers);
+    variant.not_modified = make_not_modified(variant.headers);
+    return variant;
+}
+
+}  // namespace
+
+std::string format_http_date(std::time_t time) {
+    std::tm tm{};
+    gmtime_r(&time, &tm);
+    char out[32];
+    std::snprintf(out, sizeof(out), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                  kDays[tm.tm_wday], tm.tm_mday, kMonths[tm.tm_mon], tm.tm_year + 1900,
+                  tm.tm_hour, tm.tm_min, tm.tm_sec);
+    return out;
+}
+
+bool parse_http_date(std::string_view text, std::time_t& time) {
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    if (text.size() != 29 || text.compare(3, 2, ", ") != 0 || text.compare(25, 4, " GMT") != 0) {
+        return false;
+    }
+
+    int day, year, hour, minute, second;
+    if (!parse_number(text, 5, 2, day) || !parse_number(text, 12, 4, year) ||
+        !parse_number(text, 17, 2, hour) || !parse_number(text, 20, 2, minute) ||
+        !parse_number(text, 23, 2, second)) {
+        return false;
+    }
+
+    unsigned month = 0;
+    while (month < 12 && text.compare(8, 3, kMonths[month]) != 0) {
+        ++month;
+    }
+    if (month == 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+        return false;
+    }
+
+    time = static_cast<std::time_t>(days_from_civil(year, month + 1, day) * 86400 +
+                                    hour * 3600 + minute * 60 + second);
+    return true;
+}
+
+bool etag_matches(std::string_view if_none_match, std::string_view etag) {
+    etag = strip_weak(etag);
+    while (!if_none_match.empty()) {
+        std::size_t comma = if_none_match.find(',');
+        std::string_view tag = trim(if_none_match.substr(0, comma));
+        if (tag == "*" || strip_weak(tag) == etag) {
+            return true;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        if_none_match.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+std::shared_ptr<const StaticAsset> index_static_asset(const std::string& file_path,
+                                                      const std::string& content_type) {
+    auto asset = std::make_shared<StaticAsset>();
+    asset->file_path = file_path;
+    asset->content_type = content_type;
+
+    struct stat st;
+    bool exists = ::stat(file_path.c_str(), &st) == 0;
+    if (exists) {
+        asset->last_modified = st.st_mtime;
+    }
+
+    bool compress_in_memory = exists && is_compressible(content_type) &&
+                              static_cast<std::uintmax_t>(st.st_size) <= ASSET_CACHE_MAX_ENTRY_SIZE;
+    std::optional<std::string> contents;
+    if (compress_in_memory) {
+        contents = read_file(file_path);
+        compress_in_memory = contents.has_value();
+    }
+
+    // Strong validator: a hash of the identity bytes. Forms compressed in
+    // memory get their coding appended so every representation has a
+    // distinct tag.
+    ContentHash hash;
+    if (contents) {
+        hash.update(contents->data(), contents->size());
+    } else {
+        exists = exists && hash_file(file_path, hash);
+    }
+
+    AssetHeaders identity;
+    identity.content_type = content_type;
+    if (exists) {
+        identity.etag = "\"" + hash.hex() + "\"";
+        identity.last_modified = format_http_date(asset->last_modified);
+    }
+
+    for (const auto& encoding : supported_encodings) {
+        AssetHeaders headers = identity;
+        headers.content_encoding = encoding;
+        headers.vary = true;
+        if (exists) {
+            headers.etag = "\"" + hash.hex() + "-" + encoding + "\"";
+        }
+
+        std::string sibling = file_path + encoding_suffix(encoding);
+        struct stat sibling_st;
+        AssetVariant variant;
+        if (::stat(sibling.c_str(), &sibling_st) == 0 && S_ISREG(sibling_st.st_mode)) {
+            // A precompressed sibling is validated by its own bytes and time:
+            // it can be rebuilt without the original changing
+            ContentHash sibling_hash;
+            if (hash_file(sibling, sibling_hash)) {
+                headers.etag = "\"" + sibling_hash.hex() + "\"";
+                headers.last_modified = format_http_date(sibling_st.st_mtime);
+            } else {
+                headers.etag.clear();
+                headers.last_modified.clear();
+            }
+            variant = make_variant(sibling, headers);
+        } else if (compress_in_memory) {
+            // Only keep codings that actually save bytes
+            std::string compressed;
+            if (!compress(encoding, *contents, compressed) ||
+                compressed.size() >= contents->size()) {
+                continue;
+            }
+            variant = make_variant("", headers);
+            variant.response = make_cached_asset(std::move(compressed), headers);
+        } else {
+            continue;
+        }
+
+        asset->encodings.push_back(encoding);
+        asset->variants.push_back(std::move(variant));
+    }
+
+    // The identity response (and its 304) depends on Accept-Encoding as soon
+    // as any other coding could have been chosen instead
+    identity.vary = !asset->variants.empty();
+    asset->identity = make_variant(file_path, identity);
+
+    return asset;
+}
@@ -0,0 +1,48 @@
+// static_asset.hpp
+#ifndef STATIC_ASSET_HPP
+#define STATIC_ASSET_HPP
+
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "asset_cache.hpp"
+
+// One representation of a static file: the file itself or a compressed form
+struct AssetVariant {
+    std::string file_path;                             // file holding this representation
+    AssetHeaders headers;                              // coding, ETag and Last-Modified
+    std::shared_ptr<const CachedAsset> response;       // set if compressed at index time
+    std::shared_ptr<const CachedAsset> not_modified;   // pre-serialized 304
+};
+
+// Everything the server knows about a servable file, gathered once when the
+// file is indexed so request handling never has to look at the file system
+// to decide what to send.
+struct StaticAsset {
+    std::string file_path;
+    std::string content_type;
+    std::time_t last_modified = 0;
+    AssetVariant identity;
+    std::vector<std::string> encodings;  // encodings[i] == variants[i].headers.content_encoding
+    std::vector<AssetVariant> variants;
+};
+
+// Indexes file_path: hashes its contents for a strong ETag, records its
+// modification time, picks up .br/.zst/.gz siblings and, for compressible
+// types small enough to cache, compresses the missing codings in memory.
+std::shared_ptr<const StaticAsset> index_static_asset(const std::string& file_path,
+                                                      const std::string& content_type);
+
+// Formats a time as an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+std::string format_http_date(std::time_t time);
+
+// Parses an IMF-fixdate; returns false for anything else
+bool parse_http_date(std::string_view text, std::time_t& time);
+
+// True if an If-None-Match header lists etag (weak comparison) or is "*"
+bool etag_matches(std::string_view if_none_match, std::string_view etag);
+
+#endif  // STATIC_ASSET_HPP
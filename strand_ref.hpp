@@ -0,0 +1,68 @@
+// strand_ref.hpp
+#ifndef STRAND_REF_HPP
+#define STRAND_REF_HPP
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/strand.hpp>
+#include <utility>
+
+// An executor that refers to a strand owned elsewhere. A socket's
+// any_io_executor keeps executors of up to two pointers inline and copies
+// larger ones to the heap each time asio copies or rebinds it, which is on
+// every async operation; net::strand<> is three pointers wide. Binding the
+// socket to a strand_ref instead keeps strand-mode I/O off the heap. The
+// strand must outlive every socket and handler that uses the reference.
+class strand_ref {
+public:
+    using strand_type = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+    explicit strand_ref(strand_type& strand) noexcept : strand_(&strand) {}
+
+    boost::asio::execution::blocking_t query(boost::asio::execution::blocking_t) const noexcept {
+        if (never_) {
+            return boost::asio::execution::blocking.never;
+        }
+        return boost::asio::execution::blocking.possibly;
+    }
+
+    // Every other query (the execution context in particular) is the strand's
+    template <class Property>
+    auto query(const Property& property) const
+        -> decltype(boost::asio::query(std::declval<const strand_type&>(), property)) {
+        return boost::asio::query(*strand_, property);
+    }
+
+    strand_ref require(boost::asio::execution::blocking_t::never_t) const noexcept {
+        return strand_ref(strand_, true);
+    }
+
+    strand_ref require(boost::asio::execution::blocking_t::possibly_t) const noexcept {
+        return strand_ref(strand_, false);
+    }
+
+    template <class Function>
+    void execute(Function&& f) const {
+        if (never_) {
+            boost::asio::require(*strand_, boost::asio::execution::blocking.never)
+                .execute(std::forward<Function>(f));
+        } else {
+            strand_->execute(std::forward<Function>(f));
+        }
+    }
+
+    friend bool operator==(const strand_ref& a, const strand_ref& b) noexcept {
+        return a.strand_ == b.strand_ && a.never_ == b.never_;
+    }
+
+    friend bool operator!=(const strand_ref& a, const strand_ref& b) noexcept {
+        return !(a == b);
+    }
+
+private:
+    strand_type* strand_;
+    bool never_ = false;
+
+    strand_ref(strand_type* strand, bool never) noexcept : strand_(strand), never_(never) {}
+};
+
+#endif  // STRAND_REF_HPP
@@ -0,0 +1,281 @@
+#include "tls.hpp"
+
+#include <cerrno>
+#include <stdexcept>
+
+#include <boost/asio/ssl/error.hpp>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace net = boost::asio;
+namespace beast = boost::beast;
+
+TlsContext::TlsContext(const TlsOptions& options)
+    : options_(options), context_(net::ssl::context::tls_server) {
+    SSL_CTX* ctx = context_.native_handle();
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // A peer that hangs up without close_notify reads as a plain EOF, as it
+    // would on a plaintext connection. No renegotiation: it is a way to make
+    // the server redo its most expensive step on request.
+    std::uint64_t flags = SSL_OP_NO_COMPRESSION | SSL_OP_NO_RENEGOTIATION |
+                          SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF;
+    if (!options_.tickets) {
+        flags |= SSL_OP_NO_TICKET;
+    }
+    if (options_.ktls) {
+        flags |= SSL_OP_ENABLE_KTLS;
+    }
+    SSL_CTX_set_options(ctx, flags);
+    // Writes may stop after a record, and be retried from a different
+    // address with the same bytes. Idle connections give their record
+    // buffers back, as parked sessions give back theirs.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+
+    boost::system::error_code ec;
+    context_.use_certificate_chain_file(options_.certificate_file, ec);
+    if (ec) {
+        throw std::runtime_error("Cannot load TLS certificate " + options_.certificate_file +
+                                 ": " + ec.message());
+    }
+    context_.use_private_key_file(options_.private_key_file, net::ssl::context::pem, ec);
+    if (ec) {
+        throw std::runtime_error("Cannot load TLS key " + options_.private_key_file + ": " +
+                                 ec.message());
+    }
+    if (SSL_CTX_check_private_key(ctx) != 1) {
+        throw std::runtime_error("TLS key " + options_.private_key_file +
+                                 " does not match the certificate");
+    }
+
+    // The cache is shared by every io_context behind one lock; tickets need
+    // no lookup at all, so a single one is issued per handshake
+    static const unsigned char session_context[] = "webserver";
+    SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, options_.session_cache_size ? SSL_SESS_CACHE_SERVER
+                                                                    : SSL_SESS_CACHE_OFF);
+    SSL_CTX_sess_set_cache_size(ctx, options_.session_cache_size);
+    SSL_CTX_set_timeout(ctx, options_.session_timeout);
+    SSL_CTX_set_num_tickets(ctx, options_.tickets ? 1 : 0);
+
+    // HTTP/2 first, where it is on, then HTTP/1.1; a client asking for
+    // anything else goes on without ALPN
+    auto offer = [this](std::string_view protocol) {
+        alpn_.push_back(static_cast<unsigned char>(protocol.size()));
+        alpn_.insert(alpn_.end(), protocol.begin(), protocol.end());
+    };
+    if (options_.http2) {
+        offer("h2");
+    }
+    offer("http/1.1");
+    SSL_CTX_set_alpn_select_cb(ctx, &TlsContext::selectProtocol, this);
+}
+
+int TlsContext::selectProtocol(SSL* ssl, const unsigned char** out, unsigned char* out_length,
+                               const unsigned char* in, unsigned int in_length, void* arg) {
+    auto* self = static_cast<TlsContext*>(arg);
+    unsigned char* selected = nullptr;
+    if (SSL_select_next_proto(&selected, out_length, self->alpn_.data(), self->alpn_.size(),
+                              in, in_length) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+SSL* TlsContext::newConnection(int fd) {
+    SSL* ssl = SSL_new(context_.native_handle());
+    if (!ssl) {
+        return nullptr;
+    }
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return nullptr;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+void TlsContext::countHandshake(SSL* ssl) {
+    (SSL_session_reused(ssl) ? resumed_ : full_).fetch_add(1, std::memory_order_relaxed);
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        ktls_send_.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+        ktls_receive_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void TlsContext::countFailure() {
+    failed_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool TlsContext::kernelTlsAvailable() {
+#ifdef TCP_ULP
+    // The ULP is looked up before the socket's state is checked, so an
+    // unconnected socket tells "no such ULP" (ENOENT) from "not connected"
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    int result = ::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+    int error = errno;
+    ::close(fd);
+    return result == 0 || error != ENOENT;
+#else
+    return false;
+#endif
+}
+
+void TlsContext::collectMetrics(std::string& out) const {
+    out += "# HELP webserver_tls_handshakes_total TLS handshakes by outcome.\n"
+           "# TYPE webserver_tls_handshakes_total counter\n"
+           "webserver_tls_handshakes_total{result=\"full\"} " +
+           std::to_string(full_.load(std::memory_order_relaxed)) +
+           "\nwebserver_tls_handshakes_total{result=\"resumed\"} " +
+           std::to_string(resumed_.load(std::memory_order_relaxed)) +
+           "\nwebserver_tls_handshakes_total{result=\"failed\"} " +
+           std::to_string(failed_.load(std::memory_order_relaxed)) + "\n";
+    out += "# HELP webserver_tls_ktls_connections_total Connections whose records the kernel "
+           "encrypts or decrypts.\n"
+           "# TYPE webserver_tls_ktls_connections_total counter\n"
+           "webserver_tls_ktls_connections_total{direction=\"send\"} " +
+           std::to_string(ktls_send_.load(std::memory_order_relaxed)) +
+           "\nwebserver_tls_ktls_connections_total{direction=\"receive\"} " +
+           std::to_string(ktls_receive_.load(std::memory_order_relaxed)) + "\n";
+}
+
+void session_stream::bind(net::ip::tcp::socket& socket, TlsContext* tls) {
+    reset();
+    socket_ = &socket;
+    tls_ = tls;
+    if (!tls_) {
+        return;
+    }
+    // OpenSSL's own reads and writes must return rather than block
+    beast::error_code ec;
+    socket.native_non_blocking(true, ec);
+    ssl_ = tls_->newConnection(socket.native_handle());
+}
+
+void session_stream::reset() {
+    if (ssl_) {
+        // OpenSSL drops the session from the cache if the connection ends
+        // without close_notify, which most clients never wait for. Fatal
+        // errors have already dropped it.
+        if (SSL_is_init_finished(ssl_)) {
+            SSL_set_shutdown(ssl_, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        }
+        SSL_free(ssl_);  // the descriptor is the socket's to close
+        ssl_ = nullptr;
+    }
+    tls_ = nullptr;
+}
+
+std::string_view session_stream::protocol() const {
+    if (!ssl_) {
+        return {};
+    }
+    const unsigned char* data = nullptr;
+    unsigned int size = 0;
+    SSL_get0_alpn_selected(ssl_, &data, &size);
+    return {reinterpret_cast<const char*>(data), size};
+}
+
+bool session_stream::zero_copy() const {
+    return !tls_ || (ssl_ && BIO_get_ktls_send(SSL_get_wbio(ssl_)));
+}
+
+void session_stream::shutdown() {
+    if (ssl_ && SSL_is_init_finished(ssl_)) {
+        ERR_clear_error();
+        SSL_shutdown(ssl_);
+    }
+}
+
+bool session_stream::should_wait(int result, beast::error_code& ec, wait_type& wait) const {
+    switch (SSL_get_error(ssl_, result)) {
+        case SSL_ERROR_WANT_READ:
+            wait = net::ip::tcp::socket::wait_read;
+            return true;
+        case SSL_ERROR_WANT_WRITE:
+            wait = net::ip::tcp::socket::wait_write;
+            return true;
+        case SSL_ERROR_ZERO_RETURN:
+            ec = net::error::eof;
+            return false;
+        case SSL_ERROR_SYSCALL:
+            if (unsigned long error = ERR_get_error()) {
+                ec.assign(static_cast<int>(error), net::error::get_ssl_category());
+            } else if (errno) {
+                ec.assign(errno, beast::system_category());
+            } else {
+                ec = net::error::eof;
+            }
+            return false;
+        default:
+            ec.assign(static_cast<int>(ERR_get_error()), net::error::get_ssl_category());
+            return false;
+    }
+}
+
+bool session_stream::handshake_step(beast::error_code& ec, wait_type& wait) {
+    if (!ssl_) {
+        ec = net::error::no_memory;
+        tls_->countFailure();
+        return true;
+    }
+    ERR_clear_error();
+    errno = 0;
+    int result = SSL_do_handshake(ssl_);
+    if (result == 1) {
+        tls_->countHandshake(ssl_);
+        return true;
+    }
+    if (should_wait(result, ec, wait)) {
+        return false;
+    }
+    tls_->countFailure();
+    return true;
+}
+
+bool session_stream::read_step(void* data, std::size_t size, beast::error_code& ec,
+                               std::size_t& bytes, wait_type& wait) {
+    if (size == 0) {
+        return true;
+    }
+    ERR_clear_error();
+    errno = 0;
+    if (SSL_read_ex(ssl_, data, size, &bytes) == 1) {
+        return true;
+    }
+    return !should_wait(0, ec, wait);
+}
+
+bool session_stream::write_step(const void* data, std::size_t size, beast::error_code& ec,
+                                std::size_t& bytes, wait_type& wait) {
+    // Records go out one at a time; keep going while the socket takes them,
+    // and report what went if it fills up part way
+    const char* next = static_cast<const char*>(data);
+    while (bytes < size) {
+        std::size_t written = 0;
+        ERR_clear_error();
+        errno = 0;
+        if (SSL_write_ex(ssl_, next + bytes, size - bytes, &written) == 1) {
+            bytes += written;
+            continue;
+        }
+        if (should_wait(0, ec, wait)) {
+            if (bytes == 0) {
+                return false;
+            }
+            ec = {};
+        }
+        return true;
+    }
+    return true;
+}
@@ -0,0 +1,264 @@
+// tls.hpp
+#ifndef TLS_HPP
+#define TLS_HPP
+
+#include <boost/asio/compose.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/beast/core/error.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <openssl/ssl.h>
+
+struct TlsOptions {
+    std::string certificate_file;  // PEM, leaf first, then any intermediates
+    std::string private_key_file;  // PEM
+    // Resumption: a server-side cache for TLS 1.2 session ids, and
+    // stateless tickets for both versions
+    std::size_t session_cache_size = 20480;
+    std::uint32_t session_timeout = 300;  // seconds a session can be resumed for
+    bool tickets = true;
+    // Let OpenSSL hand the record layer to the kernel after the handshake,
+    // where the kernel and cipher allow it, so sendfile stays zero-copy
+    bool ktls = true;
+    // Offer HTTP/2 by ALPN, ahead of HTTP/1.1
+    bool http2 = true;
+};
+
+// The certificate and settings every HTTPS connection shares, across all
+// io_contexts. Connections are driven by session_stream; all kept here
+// per connection is counters.
+class TlsContext {
+public:
+    // Loads the certificate and key now, so a bad file stops startup;
+    // throws std::runtime_error
+    explicit TlsContext(const TlsOptions& options);
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    const TlsOptions& options() const { return options_; }
+
+    // A server-side SSL for an accepted socket, reading and writing the
+    // descriptor itself; nullptr if OpenSSL cannot make one
+    SSL* newConnection(int fd);
+
+    void countHandshake(SSL* ssl);
+    void countFailure();
+
+    // Whether this kernel has the "tls" upper layer kTLS needs. Checked
+    // once at startup for the log; OpenSSL tries it per connection anyway.
+    static bool kernelTlsAvailable();
+
+    // Handshake and offload counters in Prometheus text format
+    void collectMetrics(std::string& out) const;
+
+private:
+    TlsOptions options_;
+    boost::asio::ssl::context context_;
+    std::vector<unsigned char> alpn_;  // protocols we speak, in wire format
+
+    std::atomic<std::uint64_t> full_{0};
+    std::atomic<std::uint64_t> resumed_{0};
+    std::atomic<std::uint64_t> failed_{0};
+    std::atomic<std::uint64_t> ktls_send_{0};
+    std::atomic<std::uint64_t> ktls_receive_{0};
+
+    static int selectProtocol(SSL* ssl, const unsigned char** out, unsigned char* out_length,
+                              const unsigned char* in, unsigned int in_length, void* arg);
+};
+
+// The byte stream an http_session reads and writes: the socket itself, or
+// TLS over it. Meets Asio's AsyncReadStream and AsyncWriteStream, so Beast
+// reads and writes it like a socket.
+//
+// OpenSSL reads and writes the descriptor directly rather than through
+// Asio's memory BIOs; that is what lets it switch the connection to kTLS.
+// When it would block, the operation waits for the socket to become ready
+// and tries again. A read and a write may be pending at once, as on a
+// socket, but not two of either.
+class session_stream {
+public:
+    using executor_type = boost::asio::ip::tcp::socket::executor_type;
+
+    session_stream() = default;
+    session_stream(const session_stream&) = delete;
+    session_stream& operator=(const session_stream&) = delete;
+    ~session_stream() { reset(); }
+
+    // Plaintext if tls is null. The socket is made non-blocking.
+    void bind(boost::asio::ip::tcp::socket& socket, TlsContext* tls);
+    // Frees the connection's TLS state; the socket is left alone
+    void reset();
+
+    executor_type get_executor() { return socket_->get_executor(); }
+
+    bool secure() const { return tls_ != nullptr; }
+    // Writes may go to the socket around the stream (sendfile): it is
+    // plaintext, or the kernel is encrypting for us
+    bool zero_copy() const;
+    // Data already read off the socket that the next read will return
+    bool pending() const { return ssl_ && SSL_has_pending(ssl_); }
+    // The protocol agreed by ALPN in the handshake; empty if none
+    std::string_view protocol() const;
+
+    // Completes with (error_code, std::size_t); a no-op when plaintext
+    template <class Handler>
+    auto async_handshake(Handler&& handler);
+
+    template <class MutableBufferSequence, class ReadHandler>
+    auto async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler);
+
+    template <class ConstBufferSequence, class WriteHandler>
+    auto async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler);
+
+    // Sends close_notify if the socket takes it right away; the caller
+    // then shuts the socket down as it would a plaintext one
+    void shutdown();
+
+private:
+    using wait_type = boost::asio::ip::tcp::socket::wait_type;
+    using signature = void(boost::beast::error_code, std::size_t);
+
+    // Runs step until it finishes, waiting for the socket in between.
+    // step(ec, bytes, wait) returns false, having set wait, to be run
+    // again once the socket is ready.
+    template <class Step>
+    struct tls_op {
+        session_stream& stream;
+        Step step;
+        boost::beast::error_code result{};
+        std::size_t bytes = 0;
+        bool started = false;
+        bool done = false;
+
+        template <class Self>
+        void operator()(Self& self, boost::beast::error_code ec = {}) {
+            if (done) {
+                self.complete(result, bytes);
+                return;
+            }
+            if (ec) {
+                self.complete(ec, 0);
+                return;
+            }
+            bool first = !started;
+            started = true;
+            wait_type wait;
+            if (!step(result, bytes, wait)) {
+                stream.socket_->async_wait(wait, std::move(self));
+                return;
+            }
+            if (first) {
+                // Finished without waiting; never call the handler from
+                // inside the initiating function
+                done = true;
+                boost::asio::post(std::move(self));
+                return;
+            }
+            self.complete(result, bytes);
+        }
+    };
+
+    boost::asio::ip::tcp::socket* socket_ = nullptr;
+    TlsContext* tls_ = nullptr;
+    SSL* ssl_ = nullptr;
+    std::unique_ptr<char[]> staging_;  // small writes gathered into one record
+
+    // Maps a failed OpenSSL call to a wait, returning true, or an error
+    bool should_wait(int result, boost::beast::error_code& ec, wait_type& wait) const;
+    bool handshake_step(boost::beast::error_code& ec, wait_type& wait);
+    bool read_step(void* data, std::size_t size, boost::beast::error_code& ec,
+                   std::size_t& bytes, wait_type& wait);
+    bool write_step(const void* data, std::size_t size, boost::beast::error_code& ec,
+                    std::size_t& bytes, wait_type& wait);
+    // Up to one record's worth of the buffers, copied together if they
+    // start with a small one
+    template <class ConstBufferSequence>
+    boost::asio::const_buffer gather(const ConstBufferSequence& buffers);
+};
+
+// Largest TLS record payload
+constexpr std::size_t TLS_RECORD_SIZE = 16 * 1024;
+
+template <class Handler>
+auto session_stream::async_handshake(Handler&& handler) {
+    auto step = [this](boost::beast::error_code& ec, std::size_t&, wait_type& wait) {
+        return !tls_ || handshake_step(ec, wait);
+    };
+    return boost::asio::async_compose<Handler, signature>(
+        tls_op<decltype(step)>{*this, step}, handler, *socket_);
+}
+
+template <class MutableBufferSequence, class ReadHandler>
+auto session_stream::async_read_some(const MutableBufferSequence& buffers,
+                                     ReadHandler&& handler) {
+    if (!ssl_) {
+        return socket_->async_read_some(buffers, std::forward<ReadHandler>(handler));
+    }
+    boost::asio::mutable_buffer buffer;
+    for (auto it = boost::asio::buffer_sequence_begin(buffers);
+         it != boost::asio::buffer_sequence_end(buffers); ++it) {
+        if (boost::asio::mutable_buffer(*it).size() > 0) {
+            buffer = *it;
+            break;
+        }
+    }
+    auto step = [this, buffer](boost::beast::error_code& ec, std::size_t& bytes,
+                               wait_type& wait) {
+        return read_step(buffer.data(), buffer.size(), ec, bytes, wait);
+    };
+    return boost::asio::async_compose<ReadHandler, signature>(
+        tls_op<decltype(step)>{*this, step}, handler, *socket_);
+}
+
+template <class ConstBufferSequence, class WriteHandler>
+auto session_stream::async_write_some(const ConstBufferSequence& buffers,
+                                      WriteHandler&& handler) {
+    if (!ssl_) {
+        return socket_->async_write_some(buffers, std::forward<WriteHandler>(handler));
+    }
+    // Gathered once: a write that has to wait is retried with the same bytes
+    boost::asio::const_buffer buffer = gather(buffers);
+    auto step = [this, buffer](boost::beast::error_code& ec, std::size_t& bytes,
+                               wait_type& wait) {
+        return write_step(buffer.data(), buffer.size(), ec, bytes, wait);
+    };
+    return boost::asio::async_compose<WriteHandler, signature>(
+        tls_op<decltype(step)>{*this, step}, handler, *socket_);
+}
+
+template <class ConstBufferSequence>
+boost::asio::const_buffer session_stream::gather(const ConstBufferSequence& buffers) {
+    auto it = boost::asio::buffer_sequence_begin(buffers);
+    auto end = boost::asio::buffer_sequence_end(buffers);
+    while (it != end && boost::asio::const_buffer(*it).size() == 0) {
+        ++it;
+    }
+    if (it == end) {
+        return {};
+    }
+    boost::asio::const_buffer first = *it;
+    if (first.size() >= TLS_RECORD_SIZE || std::next(it) == end) {
+        return first;
+    }
+    if (!staging_) {
+        staging_.reset(new char[TLS_RECORD_SIZE]);
+    }
+    std::size_t size = 0;
+    for (; it != end && size < TLS_RECORD_SIZE; ++it) {
+        size += boost::asio::buffer_copy(
+            boost::asio::buffer(staging_.get() + size, TLS_RECORD_SIZE - size),
+            boost::asio::const_buffer(*it));
+    }
+    return boost::asio::const_buffer(staging_.get(), size);
+}
+
+#endif  // TLS_HPP
@@ -0,0 +1,117 @@
+#include "tracer.hpp"
+
+#include <cstdio>
+#include <unistd.h>
+
+// Gives a thread exclusive use of a ring until the thread exits
+struct Tracer::RingLease {
+    Ring* ring = nullptr;
+
+    ~RingLease() {
+        if (ring) {
+            ring->owned.store(false, std::memory_order_release);
+        }
+    }
+};
+
+Tracer::Tracer() : epoch_(now()) {}
+
+Tracer& Tracer::getInstance() {
+    static Tracer instance;
+    return instance;
+}
+
+Tracer::Ring* Tracer::localRing() {
+    thread_local RingLease lease;
+    if (!lease.ring) {
+        lease.ring = acquireRing();
+    }
+    return lease.ring;
+}
+
+Tracer::Ring* Tracer::acquireRing() {
+    // Reuse the ring of a thread that has exited
+    std::size_t count = ring_count_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < count; ++i) {
+        Ring* ring = rings_[i].load(std::memory_order_acquire);
+        bool expected = false;
+        if (ring->owned.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+            return ring;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    count = ring_count_.load(std::memory_order_relaxed);
+    if (count == kMaxRings) {
+        return nullptr;
+    }
+    // Rings are only allocated once a thread traces something
+    Ring* ring = new Ring;
+    ring->index = count;
+    ring->owned.store(true, std::memory_order_relaxed);
+    rings_[count].store(ring, std::memory_order_release);
+    ring_count_.store(count + 1, std::memory_order_release);
+    return ring;
+}
+
+void Tracer::span(const char* name, std::uint64_t trace_id, std::uint64_t begin,
+                  std::uint64_t end) {
+    Ring* ring = localRing();
+    if (!ring) {
+        return;
+    }
+    std::uint64_t head = ring->head.load(std::memory_order_relaxed);
+    Span& span = ring->spans[head & (kRingCapacity - 1)];
+    span.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    span.name.store(name, std::memory_order_relaxed);
+    span.trace_id.store(trace_id, std::memory_order_relaxed);
+    span.begin.store(begin, std::memory_order_relaxed);
+    span.end.store(end, std::memory_order_relaxed);
+    span.sequence.store(head + 1, std::memory_order_release);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::string Tracer::dump() const {
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    char event[256];
+    int pid = static_cast<int>(::getpid());
+
+    std::size_t count = ring_count_.load(std::memory_order_acquire);
+    for (std::size_t r = 0; r < count; ++r) {
+        const Ring* ring = rings_[r].load(std::memory_order_acquire);
+        std::snprintf(event, sizeof(event),
+                      "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%zu,"
+                      "\"args\":{\"name\":\"worker %zu\"}}",
+                      first ? "" : ",", pid, ring->index, ring->index);
+        out += event;
+        first = false;
+
+        std::uint64_t head = ring->head.load(std::memory_order_acquire);
+        std::uint64_t begin = head > kRingCapacity ? head - kRingCapacity : 0;
+        for (std::uint64_t i = begin; i < head; ++i) {
+            const Span& span = ring->spans[i & (kRingCapacity - 1)];
+            std::uint64_t sequence = span.sequence.load(std::memory_order_acquire);
+            const char* name = span.name.load(std::memory_order_relaxed);
+            std::uint64_t id = span.trace_id.load(std::memory_order_relaxed);
+            std::uint64_t start = span.begin.load(std::memory_order_relaxed);
+            std::uint64_t end = span.end.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // Overwritten, or being overwritten, by a newer span
+            if (sequence != i + 1 || span.sequence.load(std::memory_order_relaxed) != sequence ||
+                start < epoch_) {
+                continue;
+            }
+
+            std::snprintf(event, sizeof(event),
+                          ",{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":%d,"
+                          "\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":%llu}}",
+                          name, pid, ring->index, (start - epoch_) / 1000.0,
+                          (end - start) / 1000.0, static_cast<unsigned long long>(id));
+            out += event;
+        }
+    }
+    out += "]}";
+    return out;
+}
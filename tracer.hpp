@@ -0,0 +1,120 @@
+// tracer.hpp
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Sampled request tracing. One request in every sampleEvery() gets a trace
+// id, and the session records the time each phase of that request took
+// (reading, routing, queueing, file reads, writes) as spans. Every thread
+// writes spans into its own ring, oldest overwritten first, so the rings
+// always hold the most recent activity; dump() renders them in Chrome's
+// trace_event JSON for chrome://tracing or Perfetto.
+//
+// With sampling off (the default) the only cost is one relaxed load per
+// request to find that out.
+class Tracer {
+public:
+    static constexpr std::size_t kRingCapacity = 16384;  // spans per thread, power of two
+    static constexpr std::size_t kMaxRings = 256;
+
+private:
+    // A per-slot seqlock: dump() may read a ring while its thread
+    // overwrites it, and skips any span whose sequence changed mid-read
+    struct Span {
+        std::atomic<std::uint64_t> sequence{0};  // position + 1 once written, 0 while writing
+        std::atomic<const char*> name{nullptr};  // string literal
+        std::atomic<std::uint64_t> trace_id{0};
+        std::atomic<std::uint64_t> begin{0};
+        std::atomic<std::uint64_t> end{0};
+    };
+
+    struct Ring {
+        std::atomic<std::uint64_t> head{0};  // spans ever written
+        std::atomic<bool> owned{false};
+        std::size_t index = 0;               // Chrome tid
+        Span spans[kRingCapacity];
+    };
+
+    struct RingLease;
+
+    std::array<std::atomic<Ring*>, kMaxRings> rings_{};
+    std::atomic<std::size_t> ring_count_{0};
+    std::mutex registry_mutex_;
+    std::atomic<std::uint32_t> sample_every_{0};
+    std::atomic<std::uint64_t> next_id_{1};
+    const std::uint64_t epoch_;  // now() at startup; trace timestamps count from here
+
+    Tracer();
+    ~Tracer() = default;
+
+    Ring* localRing();
+    Ring* acquireRing();
+
+public:
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    static Tracer& getInstance();
+
+    static std::uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // 0 turns tracing off; otherwise one request in every n is traced
+    void setSampleEvery(std::uint32_t n) { sample_every_.store(n, std::memory_order_relaxed); }
+    std::uint32_t sampleEvery() const { return sample_every_.load(std::memory_order_relaxed); }
+    bool enabled() const { return sampleEvery() != 0; }
+
+    // A trace id for a new request, or 0 if it is not sampled
+    std::uint64_t sample() {
+        std::uint32_t every = sampleEvery();
+        if (every == 0) {
+            return 0;
+        }
+        thread_local std::uint32_t countdown = 0;
+        if (countdown == 0) {
+            countdown = every;
+        }
+        if (--countdown != 0) {
+            return 0;
+        }
+        return next_id_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Records [begin, end) as phase name of trace_id; name must be a literal
+    void span(const char* name, std::uint64_t trace_id, std::uint64_t begin, std::uint64_t end);
+
+    // Every span still held, as a Chrome trace_event JSON document
+    std::string dump() const;
+};
+
+// Records the enclosing scope as a span of trace_id, if it is not 0
+class TraceScope {
+public:
+    TraceScope(const char* name, std::uint64_t trace_id)
+        : name_(name), trace_id_(trace_id), begin_(trace_id ? Tracer::now() : 0) {}
+    ~TraceScope() {
+        if (trace_id_) {
+            Tracer::getInstance().span(name_, trace_id_, begin_, Tracer::now());
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name_;
+    std::uint64_t trace_id_;
+    std::uint64_t begin_;
+};
+
+#endif  // TRACER_HPP
@@ -0,0 +1,89 @@
+#include "upload.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "globals.hpp"
+#include "http_session.hpp"
+
+namespace {
+
+// An unlinked file in UPLOAD_SPOOL_DIR; it disappears with its descriptor
+int open_spool_file() {
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = ::open(UPLOAD_SPOOL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+        return fd;
+    }
+#endif
+    // File systems without O_TMPFILE
+    std::string path = UPLOAD_SPOOL_DIR "/upload-XXXXXX";
+    fd = ::mkstemp(path.data());
+    if (fd >= 0) {
+        ::unlink(path.c_str());
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+}
+
+class SpoolSink : public UploadSink {
+public:
+    SpoolSink(int fd, std::shared_ptr<const SpooledUploadHandler> done)
+        : fd_(fd), done_(std::move(done)) {}
+
+    ~SpoolSink() override { ::close(fd_); }
+
+    bool on_data(std::string_view chunk) override {
+        while (!chunk.empty()) {
+            ssize_t n = ::write(fd_, chunk.data(), chunk.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                error_ = errno;
+                return false;
+            }
+            chunk.remove_prefix(n);
+            size_ += n;
+        }
+        return true;
+    }
+
+    void on_complete(http_session& session, const http_request& req) override {
+        if (error_ != 0 || ::lseek(fd_, 0, SEEK_SET) != 0) {
+            getGlobalLogger().logError("Error spooling upload: ",
+                                       beast::error_code(error_ ? error_ : errno,
+                                                         beast::system_category()));
+            session.send_error(http::status::insufficient_storage, "Upload could not be stored");
+            return;
+        }
+        (*done_)(session, req, fd_, size_);
+    }
+
+private:
+    int fd_;
+    std::shared_ptr<const SpooledUploadHandler> done_;
+    std::uint64_t size_ = 0;
+    int error_ = 0;
+};
+
+}  // namespace
+
+UploadHandler spool_to_file(SpooledUploadHandler done) {
+    auto shared = std::make_shared<const SpooledUploadHandler>(std::move(done));
+    return [shared](http_session& session, const http_request&) -> std::unique_ptr<UploadSink> {
+        int fd = open_spool_file();
+        if (fd < 0) {
+            getGlobalLogger().logError("Error creating upload spool file: ",
+                                       beast::error_code(errno, beast::system_category()));
+            session.send_error(http::status::insufficient_storage, "Upload could not be stored");
+            return nullptr;
+        }
+        return std::make_unique<SpoolSink>(fd, shared);
+    };
+}
@@ -0,0 +1,71 @@
+// upload.hpp
+#ifndef UPLOAD_HPP
+#define UPLOAD_HPP
+
+#include <boost/beast/core/error.hpp>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+
+#include "http_request.hpp"
+
+class http_session;
+class Upstream;
+
+// How a route reads request bodies. The session parses the header first,
+// finds the route, and only then decides whether and how much body to read.
+// These apply to requests that carry a body; zero limits mean the
+// server-wide ones in globals.hpp.
+struct BodyOptions {
+    std::uint64_t body_limit = 0;    // larger bodies get 413; REQUEST_BODY_LIMIT if 0
+    std::uint32_t header_limit = 0;  // larger headers get 431. The parser enforces
+                                     // REQUEST_HEADER_LIMIT before routing, so this
+                                     // can only be stricter.
+    bool expect_continue = true;     // answer "Expect: 100-continue"; if false, 417
+};
+
+// Receives a request body piece by piece as it comes off the socket, so an
+// upload of any size is held in memory one read at a time. A sink lives
+// for one request and runs on the session's executor.
+class UploadSink {
+public:
+    virtual ~UploadSink() = default;
+
+    // The next piece, in order. Returning false stops reading the body;
+    // on_complete still runs, and the connection is closed after the
+    // response since the rest of the body is never read.
+    virtual bool on_data(std::string_view chunk) = 0;
+
+    // Runs once the body is complete, or once on_data has returned false,
+    // and must send the response through the session
+    virtual void on_complete(http_session& session, const http_request& req) = 0;
+
+    // Runs instead of on_complete if the body cannot be read: it is over
+    // the route's limit (the session answers 413) or the connection failed
+    virtual void on_error(const boost::beast::error_code& ec) {}
+};
+
+// Called once the request header is in, with the route's parameters set.
+// Returning nullptr refuses the body: the handler must have responded, and
+// the body is read and dropped, still under the route's limit.
+using UploadHandler = std::function<std::unique_ptr<UploadSink>(http_session&, const http_request&)>;
+
+// Handed a spooled body: fd is an unlinked temporary file positioned at its
+// start, closed once the handler returns
+using SpooledUploadHandler =
+    std::function<void(http_session&, const http_request&, int fd, std::uint64_t size)>;
+
+// How one method of a route takes its request bodies; see
+// Router::addUploadRoute
+struct BodyRoute {
+    BodyOptions options;
+    UploadHandler upload;  // empty: the body is buffered for the route's handler
+    std::shared_ptr<Upstream> proxy;  // set: the request and its body go to a backend
+};
+
+// An upload handler that spills the body to a temporary file in
+// UPLOAD_SPOOL_DIR and hands the file to done once the body is complete
+UploadHandler spool_to_file(SpooledUploadHandler done);
+
+#endif  // UPLOAD_HPP